@@ -155,7 +155,8 @@ int append_setup(struct appendstate *as, const char *name,
     int r;
     struct mailbox *mailbox = NULL;
 
-    r = mailbox_open_iwl(name, &mailbox);
+    /* only appending, so flag changes can carry on meanwhile */
+    r = mailbox_open_ial(name, &mailbox);
     if (r) return r;
 
     return append_setup_mbox(as, mailbox, userid, auth_state,
@@ -919,6 +919,13 @@ error:
     return NULL;
 }
 
+int backend_compress(struct backend *s)
+{
+    if (!CAPA(s, CAPA_COMPRESS) || !s->prot->compress_cmd.cmd) return -1;
+
+    return do_compress(s, &s->prot->compress_cmd);
+}
+
 int backend_ping(struct backend *s)
 {
     char buf[1024];
@@ -95,6 +95,8 @@ struct backend {
 struct backend *backend_connect(struct backend *cache, const char *server,
 				struct protocol_t *prot, const char *userid,
 				sasl_callback_t *cb, const char **auth_status);
+/* start compression on a connection which doesn't already use it */
+int backend_compress(struct backend *s);
 int backend_ping(struct backend *s);
 void backend_disconnect(struct backend *s);
 char *backend_get_cap_params(const struct backend *, unsigned long capa);
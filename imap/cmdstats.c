@@ -0,0 +1,312 @@
+/* cmdstats.c -- per command timing and resource statistics
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "bsearch.h"
+#include "cmdstats.h"
+#include "cyr_lock.h"
+#include "global.h"
+#include "hash.h"
+#include "histogram.h"
+#include "mailbox.h"
+#include "map.h"
+#include "retry.h"
+#include "strarray.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define CMDSTATS_TABLE_SIZE	64
+
+static int interval = 0;		/* seconds between exports, 0 if off */
+static char *fname = NULL;
+static hash_table stats;		/* since the last export */
+static time_t last_export;
+
+/* where we were when the current command started */
+static struct {
+    struct protstream *in, *out;
+    struct timeval wall;
+    double cpu;
+    double lockwait;
+    int bytes_in, bytes_out;
+    unsigned long mapped;
+} mark;
+
+static double cpu_time(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+	return 0.0;
+
+    return timeval_get_double(&ru.ru_utime) +
+	   timeval_get_double(&ru.ru_stime);
+}
+
+static bit64 usec(double t)
+{
+    return t > 0.0 ? (bit64) (t * 1000000.0 + 0.5) : 0;
+}
+
+static struct cmdstat *cmdstat_get(hash_table *table, const char *cmd)
+{
+    struct cmdstat *cs = hash_lookup(cmd, table);
+
+    if (!cs) {
+	cs = xzmalloc(sizeof(struct cmdstat));
+	hash_insert(cmd, cs, table);
+    }
+    return cs;
+}
+
+static void cmdstat_merge(struct cmdstat *cs, const struct cmdstat *from)
+{
+    histogram_merge(&cs->wall, &from->wall);
+    histogram_merge(&cs->cpu, &from->cpu);
+    histogram_merge(&cs->lockwait, &from->lockwait);
+    cs->bytes_in += from->bytes_in;
+    cs->bytes_out += from->bytes_out;
+    cs->mapped += from->mapped;
+}
+
+int cmdstats_read(const char *fname, hash_table *table)
+{
+    FILE *f;
+    char line[8192];
+    int r = 0;
+
+    f = fopen(fname, "r");
+    if (!f)
+	return errno == ENOENT ? 0 : -1;
+
+    while (fgets(line, sizeof(line), f)) {
+	char *cmd = line, *metric, *p;
+	struct cmdstat *cs;
+
+	if (!(metric = strchr(cmd, ' ')) || !(p = strchr(metric + 1, ' '))) {
+	    r = -1;
+	    continue;
+	}
+	*metric++ = '\0';
+	*p++ = '\0';
+	cs = cmdstat_get(table, cmd);
+
+	if (!strcmp(metric, "wall_us"))
+	    r |= histogram_parse(&cs->wall, p);
+	else if (!strcmp(metric, "cpu_us"))
+	    r |= histogram_parse(&cs->cpu, p);
+	else if (!strcmp(metric, "lockwait_us"))
+	    r |= histogram_parse(&cs->lockwait, p);
+	else if (!strcmp(metric, "bytes_in"))
+	    cs->bytes_in += strtoull(p, NULL, 10);
+	else if (!strcmp(metric, "bytes_out"))
+	    cs->bytes_out += strtoull(p, NULL, 10);
+	else if (!strcmp(metric, "mapped"))
+	    cs->mapped += strtoull(p, NULL, 10);
+	/* else something newer than us, ignore it */
+    }
+    fclose(f);
+
+    return r;
+}
+
+static void cmdstat_write(const char *cmd, struct cmdstat *cs, struct buf *buf)
+{
+    buf_printf(buf, "%s wall_us ", cmd);
+    histogram_format(&cs->wall, buf);
+    buf_printf(buf, "\n%s cpu_us ", cmd);
+    histogram_format(&cs->cpu, buf);
+    buf_printf(buf, "\n%s lockwait_us ", cmd);
+    histogram_format(&cs->lockwait, buf);
+    buf_printf(buf, "\n%s bytes_in %llu\n", cmd, cs->bytes_in);
+    buf_printf(buf, "%s bytes_out %llu\n", cmd, cs->bytes_out);
+    buf_printf(buf, "%s mapped %llu\n", cmd, cs->mapped);
+}
+
+static void collect_key(const char *key, void *data __attribute__((unused)),
+			void *rock)
+{
+    strarray_append((strarray_t *) rock, key);
+}
+
+static void merge_cb(const char *key, void *data, void *rock)
+{
+    cmdstat_merge(cmdstat_get((hash_table *) rock, key),
+		  (struct cmdstat *) data);
+}
+
+/*
+ * Add what we have counted to the file, under a lock so that other
+ * processes doing the same don't lose any of it, and start again.
+ */
+static void export(void)
+{
+    hash_table total;
+    strarray_t cmds = STRARRAY_INITIALIZER;
+    struct buf buf = BUF_INITIALIZER;
+    char *newfname = NULL;
+    const char *failaction;
+    int fd, newfd = -1, i;
+
+    last_export = time(NULL);
+
+    fd = open(fname, O_RDWR|O_CREAT, 0644);
+    if (fd == -1 && errno == ENOENT) {
+	cyrus_mkdir(fname, 0755);
+	fd = open(fname, O_RDWR|O_CREAT, 0644);
+    }
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	return;
+    }
+    if (lock_reopen(fd, fname, NULL, &failaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", failaction, fname);
+	close(fd);
+	return;
+    }
+
+    construct_hash_table(&total, CMDSTATS_TABLE_SIZE, 0);
+    if (cmdstats_read(fname, &total))
+	syslog(LOG_WARNING, "cmdstats: ignoring damaged lines in %s", fname);
+    hash_enumerate(&stats, merge_cb, &total);
+
+    hash_enumerate(&total, collect_key, &cmds);
+    strarray_sort(&cmds, cmpstringp_raw);
+    for (i = 0; i < cmds.count; i++)
+	cmdstat_write(cmds.data[i], hash_lookup(cmds.data[i], &total), &buf);
+
+    /* replace the file, so that readers never see half of it */
+    newfname = strconcat(fname, ".NEW", (char *)NULL);
+    newfd = open(newfname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (newfd == -1 ||
+	retry_write(newfd, buf.s, buf.len) != (ssize_t) buf.len ||
+	fsync(newfd) < 0 || rename(newfname, fname) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+	unlink(newfname);
+    }
+    else {
+	/* counted now, start afresh */
+	free_hash_table(&stats, free);
+	construct_hash_table(&stats, CMDSTATS_TABLE_SIZE, 0);
+    }
+
+    if (newfd != -1) close(newfd);
+    close(fd);
+    free(newfname);
+    buf_free(&buf);
+    strarray_fini(&cmds);
+    free_hash_table(&total, free);
+}
+
+void cmdstats_init(const char *service)
+{
+    interval = config_getint(IMAPOPT_COMMANDSTATS_INTERVAL);
+    if (interval <= 0) {
+	interval = 0;
+	return;
+    }
+
+    fname = strconcat(config_dir, "/stats/", service, (char *)NULL);
+    construct_hash_table(&stats, CMDSTATS_TABLE_SIZE, 0);
+    last_export = time(NULL);
+}
+
+void cmdstats_start(struct protstream *in, struct protstream *out)
+{
+    if (!interval)
+	return;
+
+    mark.in = in;
+    mark.out = out;
+    gettimeofday(&mark.wall, 0);
+    mark.cpu = cpu_time();
+    mark.lockwait = lock_wait_time;
+    mark.bytes_in = in ? prot_bytes_in(in) : 0;
+    mark.bytes_out = out ? prot_bytes_out(out) : 0;
+    mark.mapped = mailbox_messages_mapped;
+}
+
+void cmdstats_end(const char *cmd)
+{
+    struct cmdstat *cs;
+    struct timeval now;
+
+    if (!interval || !mark.wall.tv_sec)
+	return;
+
+    gettimeofday(&now, 0);
+    cs = cmdstat_get(&stats, cmd);
+    histogram_add(&cs->wall, usec(timesub(&mark.wall, &now)));
+    histogram_add(&cs->cpu, usec(cpu_time() - mark.cpu));
+    histogram_add(&cs->lockwait, usec(lock_wait_time - mark.lockwait));
+    if (mark.in) cs->bytes_in += prot_bytes_in(mark.in) - mark.bytes_in;
+    if (mark.out) cs->bytes_out += prot_bytes_out(mark.out) - mark.bytes_out;
+    cs->mapped += mailbox_messages_mapped - mark.mapped;
+    mark.wall.tv_sec = 0;
+
+    if (now.tv_sec >= last_export + interval)
+	export();
+}
+
+void cmdstats_done(void)
+{
+    if (!interval)
+	return;
+
+    export();
+    free_hash_table(&stats, free);
+    free(fname);
+    fname = NULL;
+    interval = 0;
+}
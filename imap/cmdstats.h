@@ -0,0 +1,90 @@
+/* cmdstats.h -- per command timing and resource statistics
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef INCLUDED_CMDSTATS_H
+#define INCLUDED_CMDSTATS_H
+
+#include "hash.h"
+#include "histogram.h"
+#include "prot.h"
+
+/* what we know about one command, summed over every time it ran */
+struct cmdstat {
+    struct histogram wall;	/* elapsed, in microseconds */
+    struct histogram cpu;	/* user + system CPU, in microseconds */
+    struct histogram lockwait;	/* waiting for file locks, in microseconds */
+    bit64 bytes_in;		/* read from the client */
+    bit64 bytes_out;		/* written to the client */
+    bit64 mapped;		/* message files mapped */
+};
+
+/*
+ * Start keeping statistics for the commands of 'service', if the
+ * commandstats_interval option is set.  They are added to the file
+ * {configdirectory}/stats/<service> every so often, which holds the
+ * totals for all processes of the service as lines of
+ *
+ *	<command> wall_us|cpu_us|lockwait_us <histogram>
+ *	<command> bytes_in|bytes_out|mapped <total>
+ *
+ * where <histogram> is as written by histogram_format().
+ */
+extern void cmdstats_init(const char *service);
+
+/* a command is starting, on a connection using 'in' and 'out' */
+extern void cmdstats_start(struct protstream *in, struct protstream *out);
+
+/* the name to use for commands the service didn't recognise */
+#define CMDSTATS_UNKNOWN "unknown"
+
+/* the command started last was 'cmd', and has finished; only pass
+ * names of commands the service knows, or CMDSTATS_UNKNOWN */
+extern void cmdstats_end(const char *cmd);
+
+/* write out anything not yet in the file, and stop */
+extern void cmdstats_done(void);
+
+/* add the statistics in the file 'fname' to 'table' (of struct cmdstat) */
+extern int cmdstats_read(const char *fname, struct hash_table *table);
+
+#endif /* INCLUDED_CMDSTATS_H */
@@ -301,6 +301,14 @@ int main(int argc, char *argv[])
 	if (dblist[i].doarchive)
 	    strarray_add(&files, fname);
 
+	/* and the other shards of a sharded mailbox list */
+	if (dblist[i].doarchive && !strcmp(dblist[i].name, FNAME_MBOXLIST)) {
+	    int shard, nshards = config_getint(IMAPOPT_MBOXLIST_SHARDS);
+
+	    for (shard = 1; shard < nshards; shard++)
+		strarray_appendm(&files, mboxlist_shardfname(fname, shard));
+	}
+
 	/* deal with each dbenv once */
 	if (dblist[i+1].archiver == dblist[i].archiver)
 	    continue;
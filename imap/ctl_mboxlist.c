@@ -216,7 +216,7 @@ static int dump_cb(void *rockp,
 	if(!d->partition || !strcmp(d->partition, part)) {
 	    printf("%s\t%d %s %s\n", name, mbtype, part, acl);
 	    if(d->purge) {
-		cyrusdb_delete(mbdb, key, keylen, &(d->tid), 0);
+		mboxlist_rawdelete(name, &(d->tid));
 	    }
 	}
 	break;
@@ -478,10 +478,10 @@ void do_dump(enum mboxop op, const char *part, int purge)
     }
 
     /* Dump Database */
-    cyrusdb_foreach(mbdb, "", 0, NULL, &dump_cb, &d, NULL);
+    mboxlist_allmbox("", &dump_cb, &d);
 
     if (d.tid) {
-	cyrusdb_commit(mbdb, d.tid);
+	mboxlist_commit(d.tid);
 	d.tid = NULL;
     }
 
@@ -572,7 +572,7 @@ void do_undump(void)
     int line = 0;
     char last_commit[MAX_MAILBOX_BUFFER];
     char *key=NULL, *data=NULL;
-    int keylen, datalen;
+    int datalen;
     int untilCommit = PER_COMMIT;
     struct txn *tid = NULL;
     
@@ -621,7 +621,6 @@ void do_undump(void)
 	}
 
 	key = name;
-	keylen = strlen(key);
 
 	/* generate a new entry */
 	newmbentry = mboxlist_entry_create();
@@ -636,7 +635,7 @@ void do_undump(void)
 
 	tries = 0;
     retry:
-	r = cyrusdb_store(mbdb, key, keylen, data, datalen, &tid);
+	r = mboxlist_rawstore(key, data, datalen, &tid);
 	switch (r) {
 	case 0:
 	    break;
@@ -656,7 +655,7 @@ void do_undump(void)
 
 	if(--untilCommit == 0) {
 	    /* commit */
-	    r = cyrusdb_commit(mbdb, tid);
+	    r = mboxlist_commit(tid);
 	    if(r) break;
 	    tid = NULL;
 	    untilCommit = PER_COMMIT;
@@ -668,11 +667,11 @@ void do_undump(void)
 
     if(!r && tid) {
 	/* commit the last transaction */
-	r=cyrusdb_commit(mbdb, tid);
+	r=mboxlist_commit(tid);
     }
 
     if (r) {
-	if(tid) cyrusdb_abort(mbdb, tid);
+	if(tid) mboxlist_abort(tid);
 	fprintf(stderr, "db error: %s\n", cyrusdb_strerror(r));
 	if(key) fprintf(stderr, "was processing mailbox: %s\n", key);
 	if(last_commit[0]) fprintf(stderr, "last commit was at: %s\n",
@@ -937,7 +936,7 @@ void do_verify(void)
 
     qsort(found.data, found.size, sizeof(struct found_data), compar_mbox);
 
-    cyrusdb_foreach(mbdb, "", 0, NULL, &verify_cb, &found, NULL);
+    mboxlist_allmbox("", &verify_cb, &found);
 }
 
 void usage(void)
@@ -57,6 +57,7 @@
 #include <errno.h>
 
 #include "global.h"
+#include "cyr_lock.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
 #include "proc.h"
@@ -84,6 +85,7 @@ static void usage(void)
     fprintf(stderr, "Where command is one of:\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "  * proc       - listing of all open processes\n");
+    fprintf(stderr, "  * locks      - listing of locks held, if lock_registry is set\n");
     fprintf(stderr, "  * allconf    - listing of all config values\n");
     fprintf(stderr, "  * conf       - listing of non-default config values\n");
     fprintf(stderr, "  * lint       - unknown config keys\n");
@@ -107,6 +109,22 @@ static void do_proc(void)
     proc_foreach(print_procinfo, NULL);
 }
 
+static int print_lockinfo(const struct lock_holder *holder,
+			  void *rock __attribute__((unused)))
+{
+    printf("%d %s %s %lus %s %s\n", holder->pid, holder->kind, holder->name,
+	   (unsigned long) (time(NULL) - holder->since),
+	   holder->ident, holder->command);
+    return 0;
+}
+
+static void do_locks(void)
+{
+    if (!config_getswitch(IMAPOPT_LOCK_REGISTRY))
+	fprintf(stderr, "lock_registry is not set, nothing is recorded\n");
+    lock_foreach(print_lockinfo, NULL);
+}
+
 static void print_overflow(const char *key, const char *val,
 			  void *rock __attribute__((unused)))
 {
@@ -314,6 +332,8 @@ int main(int argc, char *argv[])
 
     if (!strcmp(argv[optind], "proc"))
 	do_proc();
+    else if (!strcmp(argv[optind], "locks"))
+	do_locks();
     else if (!strcmp(argv[optind], "allconf"))
 	do_conf(0);
     else if (!strcmp(argv[optind], "conf"))
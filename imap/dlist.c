@@ -48,6 +48,7 @@
 #include <unistd.h>
 #endif
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -82,14 +83,65 @@
 #include "retry.h"
 #include "cyr_lock.h"
 #include "prot.h"
+#include "mpool.h"
 
 #include "dlist.h"
 
 /* Parse routines */
 
+#define DLIST_POOL_SIZE 4096
+
 const char *lastkey = NULL;
 
-static void printfile(struct protstream *out, const struct dlist *dl)
+/* Binary encoding: a DLIST_BINARY byte, then the item.  Each item is
+ * its key as a counted string (if the list it's in has keys), then a
+ * type byte and the value.  Numbers and counts are unsigned LEB128
+ * varints, GUIDs are raw, and lists end with a B_END byte. */
+
+#define DLIST_BINARY 0x00
+
+/* real ones nest a few deep at most; deeper is junk or an attack */
+#define DLIST_BINARY_DEPTH 16
+
+enum {
+    B_END = 0,
+    B_NIL,
+    B_ATOM,
+    B_FLAG,
+    B_NUM,
+    B_DATE,
+    B_HEX,
+    B_BUF,
+    B_GUID,
+    B_FILE,
+    B_KVLIST,
+    B_LIST,
+    B_PKLIST
+};
+
+static void printvarint(struct protstream *out, bit64 val)
+{
+    unsigned char buf[10];
+    int n = 0;
+
+    do {
+	buf[n] = val & 0x7f;
+	val >>= 7;
+	if (val) buf[n] |= 0x80;
+	n++;
+    } while (val);
+
+    prot_write(out, (char *)buf, n);
+}
+
+static void printcounted(struct protstream *out, const char *s, size_t len)
+{
+    printvarint(out, len);
+    prot_write(out, s, len);
+}
+
+static void printfile(struct protstream *out, const struct dlist *dl,
+		      int binary)
 {
     struct stat sbuf;
     FILE *f;
@@ -103,22 +155,19 @@ static void printfile(struct protstream *out, const struct dlist *dl)
     f = fopen(dl->sval, "r");
     if (!f) {
 	syslog(LOG_ERR, "IOERROR: Failed to read file %s", dl->sval);
-	prot_printf(out, "NIL");
-	return;
+	goto nil;
     }
     if (fstat(fileno(f), &sbuf) == -1) {
 	syslog(LOG_ERR, "IOERROR: Failed to stat file %s", dl->sval);
-	prot_printf(out, "NIL");
 	fclose(f);
-	return;
+	goto nil;
     }
     size = sbuf.st_size;
     if (size != dl->nval) {
 	syslog(LOG_ERR, "IOERROR: Size mismatch %s (%lu != " MODSEQ_FMT ")",
 	       dl->sval, size, dl->nval);
-	prot_printf(out, "NIL");
 	fclose(f);
-	return;
+	goto nil;
     }
 
     map_refresh(fileno(f), 1, &msg_base, &msg_len, sbuf.st_size,
@@ -129,29 +178,56 @@ static void printfile(struct protstream *out, const struct dlist *dl)
     if (!message_guid_equal(&guid2, dl->gval)) {
 	syslog(LOG_ERR, "IOERROR: GUID mismatch %s",
 	       dl->sval);
-	prot_printf(out, "NIL");
 	fclose(f);
 	map_free(&msg_base, &msg_len);
-	return;
+	goto nil;
     }
 
-    prot_printf(out, "%%{");
-    prot_printastring(out, dl->part);
-    prot_printf(out, " ");
-    prot_printastring(out, message_guid_encode(dl->gval));
-    prot_printf(out, " %lu}\r\n", size);
+    if (binary) {
+	unsigned char guidbuf[MESSAGE_GUID_SIZE];
+
+	prot_putc(B_FILE, out);
+	printcounted(out, dl->part, strlen(dl->part));
+	message_guid_export(dl->gval, guidbuf);
+	prot_write(out, (char *)guidbuf, MESSAGE_GUID_SIZE);
+	printvarint(out, size);
+    }
+    else {
+	prot_printf(out, "%%{");
+	prot_printastring(out, dl->part);
+	prot_printf(out, " ");
+	prot_printastring(out, message_guid_encode(dl->gval));
+	prot_printf(out, " %lu}\r\n", size);
+    }
     prot_write(out, msg_base, msg_len);
     fclose(f);
     map_free(&msg_base, &msg_len);
+    return;
+
+nil:
+    if (binary)
+	prot_putc(B_NIL, out);
+    else
+	prot_printf(out, "NIL");
 }
 
 /* XXX - these two functions should be out in append.c or reserve.c
  * or something more general */
+static pid_t reserve_owner = 0;
+
+/* a helper process forked to use files staged by its parent */
+void dlist_reserve_setowner(pid_t pid)
+{
+    reserve_owner = pid;
+}
+
 const char *dlist_reserve_path(const char *part, struct message_guid *guid)
 {
     static char buf[MAX_MAILBOX_PATH];
+    pid_t pid = reserve_owner ? reserve_owner : getpid();
+
     snprintf(buf, MAX_MAILBOX_PATH, "%s/sync./%lu/%s",
-		  config_partitiondir(part), (unsigned long)getpid(),
+		  config_partitiondir(part), (unsigned long)pid,
 		  message_guid_encode(guid));
     /* gotta make sure we can create files */
     cyrus_mkdir(buf, 0755);
@@ -267,6 +343,30 @@ static struct dlist *dlist_child(struct dlist *dl, const char *name)
     return i;
 }
 
+/* parsed trees are allocated from a pool owned by the root, so a big
+ * APPLY costs a few large allocations rather than several per item */
+static struct dlist *dlist_pooled_child(struct mpool *pool, const char *name)
+{
+    struct dlist *i = mpool_malloc(pool, sizeof(struct dlist));
+    memset(i, 0, sizeof(struct dlist));
+    if (name) i->name = mpool_strdup(pool, name);
+    i->type = DL_NIL;
+    i->flags = DLIST_POOLED;
+    return i;
+}
+
+static void dlist_pooled_value(struct dlist *dl, struct mpool *pool,
+			       int type, const char *val, size_t len)
+{
+    if (!val) return; /* NIL */
+    dl->type = type;
+    dl->sval = mpool_malloc(pool, len+1);
+    memcpy(dl->sval, val, len);
+    dl->sval[len] = '\0'; /* make it string safe too */
+    dl->nval = len;
+    dl->flags |= DLIST_POOLEDVAL;
+}
+
 static void _dlist_free_children(struct dlist *dl)
 {
     struct dlist *next;
@@ -294,8 +394,10 @@ static void _dlist_clean(struct dlist *dl)
     /* clean out values */
     free(dl->part);
     dl->part = NULL;
-    free(dl->sval);
+    if (!(dl->flags & DLIST_POOLEDVAL))
+	free(dl->sval);
     dl->sval = NULL;
+    dl->flags &= ~DLIST_POOLEDVAL;
     free(dl->gval);
     dl->gval = NULL;
     dl->nval = 0;
@@ -424,6 +526,17 @@ struct dlist *dlist_newlist(struct dlist *parent, const char *name)
     return dl;
 }
 
+struct dlist *dlist_newrawlist(struct dlist *parent, const char *name,
+			       struct buf *items, int binary)
+{
+    struct dlist *dl = dlist_child(parent, name);
+    dl->type = DL_RAWLIST;
+    if (binary) dl->flags |= DLIST_RAWBINARY;
+    dl->nval = items->len;
+    dl->sval = buf_release(items);
+    return dl;
+}
+
 struct dlist *dlist_newpklist(struct dlist *parent, const char *name)
 {
     struct dlist *dl = dlist_child(parent, name);
@@ -573,6 +686,32 @@ struct dlist *dlist_updatefile(struct dlist *parent, const char *name,
     return dl;
 }
 
+/* a raw list is printed as is in the encoding it was streamed in, and
+ * has to be parsed back into a tree to print it in the other one */
+static struct dlist *rawlist_parse(const struct dlist *dl)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct dlist *kl = NULL;
+
+    if (dl->flags & DLIST_RAWBINARY) {
+	buf_putc(&buf, DLIST_BINARY);
+	buf_putc(&buf, B_LIST);
+	buf_appendmap(&buf, dl->sval, dl->nval);
+	buf_putc(&buf, B_END);
+    }
+    else {
+	buf_putc(&buf, '(');
+	buf_appendmap(&buf, dl->sval, dl->nval);
+	buf_putc(&buf, ')');
+    }
+
+    if (dlist_parsemap(&kl, 0, buf.s, buf.len))
+	syslog(LOG_ERR, "IOERROR: failed to reparse raw list %s", dl->name);
+    buf_free(&buf);
+
+    return kl;
+}
+
 void dlist_print(const struct dlist *dl, int printkeys,
 		 struct protstream *out)
 {
@@ -596,7 +735,7 @@ void dlist_print(const struct dlist *dl, int printkeys,
 	prot_printf(out, "%llu", dl->nval);
 	break;
     case DL_FILE:
-	printfile(out, dl);
+	printfile(out, dl, 0);
 	break;
     case DL_BUF:
 	prot_printliteral(out, dl->sval, dl->nval);
@@ -630,9 +769,105 @@ void dlist_print(const struct dlist *dl, int printkeys,
 	}
 	prot_printf(out, ")");
 	break;
+    case DL_RAWLIST:
+	prot_printf(out, "(");
+	if (dl->flags & DLIST_RAWBINARY) {
+	    struct dlist *kl = rawlist_parse(dl);
+	    for (di = kl ? kl->head : NULL; di; di = di->next) {
+		dlist_print(di, 0, out);
+		if (di->next)
+		    prot_printf(out, " ");
+	    }
+	    dlist_free(&kl);
+	}
+	else
+	    prot_write(out, dl->sval, dl->nval);
+	prot_printf(out, ")");
+	break;
     }
 }
 
+static void printbinary(const struct dlist *dl, int printkeys,
+			struct protstream *out)
+{
+    struct dlist *di;
+    unsigned char guidbuf[MESSAGE_GUID_SIZE];
+
+    if (printkeys) {
+	const char *name = dl->name ? dl->name : "";
+	printcounted(out, name, strlen(name));
+    }
+
+    switch (dl->type) {
+    case DL_NIL:
+	prot_putc(B_NIL, out);
+	break;
+    case DL_ATOM:
+	prot_putc(B_ATOM, out);
+	printcounted(out, dl->sval, strlen(dl->sval));
+	break;
+    case DL_FLAG:
+	prot_putc(B_FLAG, out);
+	printcounted(out, dl->sval, strlen(dl->sval));
+	break;
+    case DL_NUM:
+	prot_putc(B_NUM, out);
+	printvarint(out, dl->nval);
+	break;
+    case DL_DATE:
+	prot_putc(B_DATE, out);
+	printvarint(out, dl->nval);
+	break;
+    case DL_HEX:
+	prot_putc(B_HEX, out);
+	printvarint(out, dl->nval);
+	break;
+    case DL_FILE:
+	printfile(out, dl, 1);
+	break;
+    case DL_BUF:
+	prot_putc(B_BUF, out);
+	printcounted(out, dl->sval, dl->nval);
+	break;
+    case DL_GUID:
+	prot_putc(B_GUID, out);
+	message_guid_export(dl->gval, guidbuf);
+	prot_write(out, (char *)guidbuf, MESSAGE_GUID_SIZE);
+	break;
+    case DL_KVLIST:
+	prot_putc(B_KVLIST, out);
+	for (di = dl->head; di; di = di->next)
+	    printbinary(di, 1, out);
+	prot_putc(B_END, out);
+	break;
+    case DL_ATOMLIST:
+	prot_putc(dl->nval ? B_PKLIST : B_LIST, out);
+	for (di = dl->head; di; di = di->next)
+	    printbinary(di, dl->nval, out);
+	prot_putc(B_END, out);
+	break;
+    case DL_RAWLIST:
+	prot_putc(B_LIST, out);
+	if (dl->flags & DLIST_RAWBINARY)
+	    prot_write(out, dl->sval, dl->nval);
+	else {
+	    struct dlist *kl = rawlist_parse(dl);
+	    for (di = kl ? kl->head : NULL; di; di = di->next)
+		printbinary(di, 0, out);
+	    dlist_free(&kl);
+	}
+	prot_putc(B_END, out);
+	break;
+    }
+}
+
+void dlist_printbinary(const struct dlist *dl, int printkeys,
+		       struct protstream *out)
+{
+    prot_putc(DLIST_BINARY, out);
+    printbinary(dl, printkeys, out);
+}
+
 void dlist_printbuf(const struct dlist *dl, int printkeys, struct buf *outbuf)
 {
     struct protstream *outstream;
@@ -645,10 +880,18 @@ void dlist_printbuf(const struct dlist *dl, int printkeys, struct buf *outbuf)
 
 void dlist_free(struct dlist **dlp)
 {
-    if (!*dlp) return;
-    _dlist_clean(*dlp);
-    free((*dlp)->name);
-    free(*dlp);
+    struct dlist *dl = *dlp;
+    struct mpool *pool;
+
+    if (!dl) return;
+    pool = dl->pool;
+    _dlist_clean(dl);
+    if (!(dl->flags & DLIST_POOLED)) {
+	free(dl->name);
+	free(dl);
+    }
+    /* last, it may hold the node itself */
+    free_mpool(pool);
     *dlp = NULL;
 }
 
@@ -658,7 +901,8 @@ static char next_nonspace(struct protstream *in, char c)
     return c;
 }
 
-char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
+static char _dlist_parse(struct dlist **dlp, int parsekey,
+			 struct protstream *in, struct mpool *pool)
 {
     struct dlist *dl = NULL;
     static struct buf kbuf;
@@ -680,12 +924,13 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 
     /* check what sort of value we have */
     if (c == '(') {
-	dl = dlist_newlist(NULL, kbuf.s);
+	dl = dlist_pooled_child(pool, kbuf.s);
+	dl->type = DL_ATOMLIST;
 	c = next_nonspace(in, ' ');
 	while (c != ')') {
 	    struct dlist *di = NULL;
 	    prot_ungetc(c, in);
-	    c = dlist_parse(&di, 0, in);
+	    c = _dlist_parse(&di, 0, in, pool);
 	    if (di) dlist_stitch(dl, di);
 	    c = next_nonspace(in, c);
 	    if (c == EOF) goto fail;
@@ -696,12 +941,13 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 	/* no whitespace allowed here */
 	c = prot_getc(in);
 	if (c == '(') {
-	    dl = dlist_newkvlist(NULL, kbuf.s);
+	    dl = dlist_pooled_child(pool, kbuf.s);
+	    dl->type = DL_KVLIST;
 	    c = next_nonspace(in, ' ');
 	    while (c != ')') {
 		struct dlist *di = NULL;
 		prot_ungetc(c, in);
-		c = dlist_parse(&di, 1, in);
+		c = _dlist_parse(&di, 1, in, pool);
 		if (di) dlist_stitch(dl, di);
 		c = next_nonspace(in, c);
 		if (c == EOF) goto fail;
@@ -723,7 +969,8 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 	    if (c != '\n') goto fail;
 	    if (!message_guid_decode(&tmp_guid, gbuf.s)) goto fail;
 	    if (reservefile(in, pbuf.s, &tmp_guid, size, &fname)) goto fail;
-	    dl = dlist_setfile(NULL, kbuf.s, pbuf.s, &tmp_guid, size, fname);
+	    dl = dlist_pooled_child(pool, kbuf.s);
+	    dlist_makefile(dl, pbuf.s, &tmp_guid, size, fname);
 	    /* file literal */
 	}
 	else {
@@ -736,17 +983,20 @@ char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
 	prot_ungetc(c, in);
 	/* could be binary in a literal */
 	c = getbastring(in, NULL, &vbuf);
-	dl = dlist_setmap(NULL, kbuf.s, vbuf.s, vbuf.len);
+	dl = dlist_pooled_child(pool, kbuf.s);
+	dlist_pooled_value(dl, pool, DL_BUF, vbuf.s, vbuf.len);
     }
     else if (c == '\\') { /* special case for flags */
 	prot_ungetc(c, in);
 	c = getastring(in, NULL, &vbuf);
-	dl = dlist_setflag(NULL, kbuf.s, vbuf.s);
+	dl = dlist_pooled_child(pool, kbuf.s);
+	dlist_pooled_value(dl, pool, DL_FLAG, vbuf.s, vbuf.len);
     }
     else {
 	prot_ungetc(c, in);
 	c = getnastring(in, NULL, &vbuf);
-	dl = dlist_setatom(NULL, kbuf.s, vbuf.s);
+	dl = dlist_pooled_child(pool, kbuf.s);
+	dlist_pooled_value(dl, pool, DL_ATOM, vbuf.s, vbuf.len);
     }
 
     /* success */
@@ -758,6 +1008,169 @@ fail:
     return EOF;
 }
 
+static int readvarint(struct protstream *in, bit64 *valp)
+{
+    bit64 val = 0;
+    int shift = 0;
+    int c;
+
+    do {
+	c = prot_getc(in);
+	if (c == EOF || shift > 63) return -1;
+	val |= (bit64)(c & 0x7f) << shift;
+	shift += 7;
+    } while (c & 0x80);
+
+    *valp = val;
+    return 0;
+}
+
+static int readbytes(struct protstream *in, char *base, size_t len)
+{
+    while (len) {
+	int n = prot_read(in, base, len > INT_MAX ? INT_MAX : len);
+	if (n <= 0) return -1;
+	base += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static char *readcounted(struct protstream *in, struct mpool *pool,
+			 size_t *lenp)
+{
+    bit64 len;
+    char *val;
+
+    if (readvarint(in, &len) || len > INT_MAX) return NULL;
+    val = mpool_malloc(pool, len+1);
+    if (readbytes(in, val, len)) return NULL;
+    val[len] = '\0';
+    if (lenp) *lenp = len;
+
+    return val;
+}
+
+static int _dlist_parsebinary(struct dlist **dlp, int parsekey, int depth,
+			      struct protstream *in, struct mpool *pool)
+{
+    struct dlist *dl = NULL;
+    unsigned char guidbuf[MESSAGE_GUID_SIZE];
+    struct message_guid tmp_guid;
+    char *name = NULL;
+    size_t len;
+    int c;
+
+    if (parsekey) {
+	name = readcounted(in, pool, NULL);
+	if (!name) return -1;
+    }
+
+    c = prot_getc(in);
+    if (c == EOF) return -1;
+
+    dl = dlist_pooled_child(pool, NULL);
+    dl->name = name ? name : mpool_strdup(pool, "");
+
+    switch (c) {
+    case B_NIL:
+	break;
+    case B_ATOM:
+    case B_FLAG:
+    case B_BUF:
+	dl->sval = readcounted(in, pool, &len);
+	if (!dl->sval) goto fail;
+	dl->type = c == B_ATOM ? DL_ATOM : c == B_FLAG ? DL_FLAG : DL_BUF;
+	dl->nval = len;
+	dl->flags |= DLIST_POOLEDVAL;
+	break;
+    case B_NUM:
+    case B_DATE:
+    case B_HEX:
+	if (readvarint(in, &dl->nval)) goto fail;
+	dl->type = c == B_NUM ? DL_NUM : c == B_DATE ? DL_DATE : DL_HEX;
+	break;
+    case B_GUID:
+	if (readbytes(in, (char *)guidbuf, MESSAGE_GUID_SIZE)) goto fail;
+	message_guid_import(&tmp_guid, guidbuf);
+	dlist_makeguid(dl, &tmp_guid);
+	break;
+    case B_FILE:
+	{
+	    char *part;
+	    bit64 size;
+	    const char *fname;
+
+	    part = readcounted(in, pool, NULL);
+	    if (!part) goto fail;
+	    if (readbytes(in, (char *)guidbuf, MESSAGE_GUID_SIZE)) goto fail;
+	    message_guid_import(&tmp_guid, guidbuf);
+	    if (readvarint(in, &size) || size > UINT_MAX) goto fail;
+	    if (reservefile(in, part, &tmp_guid, size, &fname)) goto fail;
+	    dlist_makefile(dl, part, &tmp_guid, size, fname);
+	}
+	break;
+    case B_KVLIST:
+    case B_LIST:
+    case B_PKLIST:
+	if (depth >= DLIST_BINARY_DEPTH) {
+	    syslog(LOG_ERR, "IOERROR: binary dlist nested too deeply");
+	    goto fail;
+	}
+	dl->type = c == B_KVLIST ? DL_KVLIST : DL_ATOMLIST;
+	dl->nval = (c == B_PKLIST);
+	while ((c = prot_getc(in)) != B_END) {
+	    struct dlist *di = NULL;
+	    if (c == EOF) goto fail;
+	    prot_ungetc(c, in);
+	    if (_dlist_parsebinary(&di, dl->type == DL_KVLIST || dl->nval,
+				   depth + 1, in, pool))
+		goto fail;
+	    dlist_stitch(dl, di);
+	}
+	break;
+    default:
+	goto fail;
+    }
+
+    *dlp = dl;
+    return 0;
+
+fail:
+    dlist_free(&dl);
+    return -1;
+}
+
+/* reads either encoding - a binary dlist starts with a byte which
+ * can't start a text one */
+char dlist_parse(struct dlist **dlp, int parsekey, struct protstream *in)
+{
+    struct mpool *pool = new_mpool(DLIST_POOL_SIZE);
+    struct dlist *dl = NULL;
+    int c;
+
+    c = prot_getc(in);
+    if (c == DLIST_BINARY) {
+	if (_dlist_parsebinary(&dl, parsekey, 0, in, pool))
+	    c = EOF;
+	else
+	    c = prot_getc(in);
+    }
+    else {
+	if (c != EOF) prot_ungetc(c, in);
+	c = _dlist_parse(&dl, parsekey, in, pool);
+    }
+
+    if (dl) {
+	dl->pool = pool;
+	*dlp = dl;
+    }
+    else
+	free_mpool(pool);
+
+    return c;
+}
+
 char dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
 			    struct protstream *in)
 {
@@ -1175,3 +1588,196 @@ const char *dlist_lastkey(void)
 {
     return lastkey;
 }
+
+/* STREAMING OUTPUT */
+
+void dlist_stream_init(struct dlist_stream *ds, int printkeys, int binary,
+		       struct protstream *out)
+{
+    memset(ds, 0, sizeof(struct dlist_stream));
+    ds->out = out;
+    ds->binary = binary;
+    ds->printkeys[0] = printkeys;
+}
+
+void dlist_stream_init_buf(struct dlist_stream *ds, int printkeys,
+			   int binary, struct buf *buf)
+{
+    dlist_stream_init(ds, printkeys, binary, prot_writebuf(buf));
+    ds->ownout = ds->out;
+    prot_setisclient(ds->out, 1);
+}
+
+void dlist_stream_done(struct dlist_stream *ds)
+{
+    assert(!ds->depth);
+
+    if (ds->ownout) {
+	prot_flush(ds->ownout);
+	prot_free(ds->ownout);
+	ds->ownout = NULL;
+    }
+    ds->out = NULL;
+}
+
+/* separator and key for the next item at this level.  A binary stream
+ * into a buf is raw list items, so it gets no DLIST_BINARY byte */
+static void stream_item(struct dlist_stream *ds, const char *name)
+{
+    if (ds->binary) {
+	if (!ds->depth && !ds->ownout)
+	    prot_putc(DLIST_BINARY, ds->out);
+	if (ds->printkeys[ds->depth])
+	    printcounted(ds->out, name, strlen(name));
+	return;
+    }
+
+    if (ds->count[ds->depth]++)
+	prot_printf(ds->out, " ");
+    if (ds->printkeys[ds->depth])
+	prot_printf(ds->out, "%s ", name);
+}
+
+static void stream_open(struct dlist_stream *ds, const char *name,
+			const char *open, int type, int printkeys)
+{
+    stream_item(ds, name);
+    if (ds->binary)
+	prot_putc(type, ds->out);
+    else
+	prot_printf(ds->out, "%s", open);
+
+    ds->depth++;
+    assert(ds->depth < DLIST_STREAM_DEPTH);
+    ds->printkeys[ds->depth] = printkeys;
+    ds->count[ds->depth] = 0;
+}
+
+void dlist_stream_kvlist(struct dlist_stream *ds, const char *name)
+{
+    stream_open(ds, name, "%(", B_KVLIST, 1);
+}
+
+void dlist_stream_list(struct dlist_stream *ds, const char *name)
+{
+    stream_open(ds, name, "(", B_LIST, 0);
+}
+
+void dlist_stream_end(struct dlist_stream *ds)
+{
+    assert(ds->depth > 0);
+    ds->depth--;
+    if (ds->binary)
+	prot_putc(B_END, ds->out);
+    else
+	prot_printf(ds->out, ")");
+}
+
+void dlist_stream_atom(struct dlist_stream *ds, const char *name,
+		       const char *val)
+{
+    stream_item(ds, name);
+    if (ds->binary) {
+	if (val) {
+	    prot_putc(B_ATOM, ds->out);
+	    printcounted(ds->out, val, strlen(val));
+	}
+	else
+	    prot_putc(B_NIL, ds->out);
+    }
+    else if (val)
+	prot_printastring(ds->out, val);
+    else
+	prot_printf(ds->out, "NIL");
+}
+
+void dlist_stream_flag(struct dlist_stream *ds, const char *name,
+		       const char *val)
+{
+    stream_item(ds, name);
+    if (ds->binary) {
+	prot_putc(B_FLAG, ds->out);
+	printcounted(ds->out, val, strlen(val));
+    }
+    else
+	prot_printf(ds->out, "%s", val);
+}
+
+static void stream_number(struct dlist_stream *ds, const char *name,
+			  int type, bit64 val)
+{
+    char buf[21];
+
+    stream_item(ds, name);
+    if (ds->binary) {
+	prot_putc(type, ds->out);
+	printvarint(ds->out, val);
+	return;
+    }
+
+    if (type == B_HEX)
+	snprintf(buf, sizeof(buf), "%016llx", val);
+    else
+	snprintf(buf, sizeof(buf), "%llu", val);
+    prot_printf(ds->out, "%s", buf);
+}
+
+void dlist_stream_num32(struct dlist_stream *ds, const char *name,
+			uint32_t val)
+{
+    stream_number(ds, name, B_NUM, val);
+}
+
+void dlist_stream_num64(struct dlist_stream *ds, const char *name,
+			bit64 val)
+{
+    stream_number(ds, name, B_NUM, val);
+}
+
+void dlist_stream_date(struct dlist_stream *ds, const char *name,
+		       time_t val)
+{
+    stream_number(ds, name, B_DATE, (bit64)val);
+}
+
+void dlist_stream_hex64(struct dlist_stream *ds, const char *name,
+			bit64 val)
+{
+    stream_number(ds, name, B_HEX, val);
+}
+
+void dlist_stream_map(struct dlist_stream *ds, const char *name,
+		      const char *val, size_t len)
+{
+    stream_item(ds, name);
+    if (ds->binary) {
+	prot_putc(B_BUF, ds->out);
+	printcounted(ds->out, val, len);
+    }
+    else
+	prot_printliteral(ds->out, val, len);
+}
+
+void dlist_stream_guid(struct dlist_stream *ds, const char *name,
+		       struct message_guid *guid)
+{
+    unsigned char guidbuf[MESSAGE_GUID_SIZE];
+
+    stream_item(ds, name);
+    if (ds->binary) {
+	prot_putc(B_GUID, ds->out);
+	message_guid_export(guid, guidbuf);
+	prot_write(ds->out, (char *)guidbuf, MESSAGE_GUID_SIZE);
+    }
+    else
+	prot_printf(ds->out, "%s", message_guid_encode(guid));
+}
+
+void dlist_stream_dlist(struct dlist_stream *ds, const struct dlist *dl)
+{
+    stream_item(ds, dl->name);
+    if (ds->binary)
+	printbinary(dl, 0, ds->out);
+    else
+	dlist_print(dl, 0, ds->out);
+}
@@ -64,9 +64,17 @@ enum dlist_t {
     DL_GUID,
     DL_FILE,
     DL_KVLIST,
-    DL_ATOMLIST
+    DL_ATOMLIST,
+    DL_RAWLIST	/* items already written by a dlist_stream */
 };
 
+/* flags */
+#define DLIST_POOLED	(1<<0)	/* node and name are in the root's pool */
+#define DLIST_POOLEDVAL	(1<<1)	/* so is sval */
+#define DLIST_RAWBINARY	(1<<2)	/* DL_RAWLIST items are binary encoded */
+
+struct mpool;
+
 struct dlist {
     char *name;
     struct dlist *head;
@@ -77,9 +85,12 @@ struct dlist {
     bit64 nval;
     struct message_guid *gval; /* guid if any */
     char *part; /* so what if we're big! */
+    int flags;
+    struct mpool *pool; /* parsed trees: everything pooled, freed with root */
 };
 
 const char *dlist_reserve_path(const char *part, struct message_guid *guid);
+void dlist_reserve_setowner(pid_t pid);
 
 /* set fields */
 void dlist_makeatom(struct dlist *dl, const char *val);
@@ -127,6 +138,10 @@ const char *dlist_cstring(struct dlist *dl);
 struct dlist *dlist_newlist(struct dlist *parent, const char *name);
 struct dlist *dlist_newpklist(struct dlist *parent, const char *name);
 struct dlist *dlist_newkvlist(struct dlist *parent, const char *name);
+/* takes over the contents of 'items', which must have been written by
+ * a dlist_stream_init_buf() stream with the same 'binary' */
+struct dlist *dlist_newrawlist(struct dlist *parent, const char *name,
+			       struct buf *items, int binary);
 
 struct dlist *dlist_setatom(struct dlist *parent, const char *name,
 			    const char *val);
@@ -202,6 +217,10 @@ void dlist_print(const struct dlist *dl, int printkeys,
 		 struct protstream *out);
 void dlist_printbuf(const struct dlist *dl, int printkeys,
 		    struct buf *outbuf);
+/* the compact encoding negotiated for replication.  dlist_parse()
+ * reads either */
+void dlist_printbinary(const struct dlist *dl, int printkeys,
+		       struct protstream *out);
 char dlist_parse(struct dlist **dlp, int parsekeys,
 		 struct protstream *in);
 char dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
@@ -220,4 +239,52 @@ struct dlist *dlist_getkvchild_bykey(struct dlist *dl,
 
 const char *dlist_lastkey(void);
 
+/* Streaming output: writes the same syntax as dlist_print() (or
+ * dlist_printbinary(), if binary is set) as it goes, for lists too big
+ * to want to build as a tree first.  Each item is preceded by its key
+ * if the list it's in is a kvlist (or, at the top level, if printkeys
+ * was set). */
+
+#define DLIST_STREAM_DEPTH 8
+
+struct dlist_stream {
+    struct protstream *out;
+    struct protstream *ownout;	/* a dlist_stream_init_buf() stream */
+    int binary;
+    int depth;
+    char printkeys[DLIST_STREAM_DEPTH];
+    int count[DLIST_STREAM_DEPTH];
+};
+
+void dlist_stream_init(struct dlist_stream *ds, int printkeys, int binary,
+		       struct protstream *out);
+/* write into 'buf', for dlist_newrawlist().  Literals are written
+ * non-synchronising, which either end of a sync connection accepts */
+void dlist_stream_init_buf(struct dlist_stream *ds, int printkeys,
+			   int binary, struct buf *buf);
+void dlist_stream_done(struct dlist_stream *ds);
+
+void dlist_stream_kvlist(struct dlist_stream *ds, const char *name);
+void dlist_stream_list(struct dlist_stream *ds, const char *name);
+void dlist_stream_end(struct dlist_stream *ds);
+
+void dlist_stream_atom(struct dlist_stream *ds, const char *name,
+		       const char *val);
+void dlist_stream_flag(struct dlist_stream *ds, const char *name,
+		       const char *val);
+void dlist_stream_num32(struct dlist_stream *ds, const char *name,
+			uint32_t val);
+void dlist_stream_num64(struct dlist_stream *ds, const char *name,
+			bit64 val);
+void dlist_stream_date(struct dlist_stream *ds, const char *name,
+		       time_t val);
+void dlist_stream_hex64(struct dlist_stream *ds, const char *name,
+			bit64 val);
+void dlist_stream_map(struct dlist_stream *ds, const char *name,
+		      const char *val, size_t len);
+void dlist_stream_guid(struct dlist_stream *ds, const char *name,
+		       struct message_guid *guid);
+/* a whole tree, under its own name */
+void dlist_stream_dlist(struct dlist_stream *ds, const struct dlist *dl);
+
 #endif /* INCLUDED_DLIST_H */
@@ -61,6 +61,7 @@
 
 #include "acl.h"
 #include "charset.h"
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
 #include "gmtoff.h"
@@ -191,6 +192,11 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 
     config_fulldirhash = config_getswitch(IMAPOPT_FULLDIRHASH);
 
+    /* find out who's holding us up */
+    lock_profile_init(config_ident, config_dir,
+		      config_getint(IMAPOPT_LOCKWAIT_WARNING),
+		      config_getswitch(IMAPOPT_LOCK_REGISTRY));
+
     /* look up and canonify the implicit rights of mailbox owners */
     config_implicitrights =
 	cyrus_acl_strtomask(config_getstring(IMAPOPT_IMPLICIT_OWNER_RIGHTS));
@@ -685,6 +691,8 @@ void cyrus_done(void)
 	return;
     cyrus_init_run = DONE;
 
+    lock_profile_done();
+
     if (!cyrus_init_nodb)
 	libcyrus_done();
 }
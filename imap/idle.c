@@ -41,6 +41,9 @@
  * $Id: idle.c,v 1.7 2010/01/06 17:01:32 murch Exp $
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* for struct ucred */
+#endif
 #include <config.h>
 
 #include <sys/types.h>
@@ -59,6 +62,7 @@
 
 #include "idle.h"
 #include "idlemsg.h"
+#include "xstrlcpy.h"
 #include "global.h"
 
 const char *idle_method_desc = "no";
@@ -66,6 +70,7 @@ const char *idle_method_desc = "no";
 /* how often to poll the mailbox */
 static time_t idle_period = -1;
 static int idle_started = 0;
+static char idle_mboxname[MAX_MAILBOX_BUFFER];
 
 /* UNIX socket variables */
 static struct sockaddr_un idle_remote;
@@ -157,7 +162,14 @@ int idle_enabled(void)
 
 void idle_start(const char *mboxname)
 {
+    struct sockaddr_un from;
+    idle_message_t msg;
+
     idle_started = 1;
+    strlcpy(idle_mboxname, mboxname ? mboxname : ".", sizeof(idle_mboxname));
+
+    /* forget anything that arrived since we last IDLEd */
+    while (idle_recv(&from, &msg));
 
     /* Tell idled that we're idling.  It doesn't
      * matter if it fails, we'll still poll */
@@ -165,6 +177,11 @@ void idle_start(const char *mboxname)
 }
 
 int idle_wait(int otherfd)
+{
+    return idle_wait_until(otherfd, 0);
+}
+
+int idle_wait_until(int otherfd, time_t deadline)
 {
     int s = idle_get_sock();
     fd_set rfds;
@@ -196,6 +213,15 @@ int idle_wait(int otherfd)
 	/* TODO: this is wrong, we actually want a rolling period */
 	timeout.tv_sec = idle_period;
 	timeout.tv_usec = 0;
+	if (deadline) {
+	    time_t now = time(NULL);
+	    if (now >= deadline) {
+		flags |= IDLE_DEADLINE;
+		break;
+	    }
+	    if (deadline - now < timeout.tv_sec)
+		timeout.tv_sec = deadline - now;
+	}
 
 	r = select(maxfd+1, &rfds, NULL, NULL, &timeout);
 	if (r < 0) {
@@ -206,7 +232,12 @@ int idle_wait(int otherfd)
 	}
 	if (r == 0) {
 	    /* timeout */
-	    flags |= IDLE_MAILBOX|IDLE_ALERT;
+	    if (deadline && time(NULL) >= deadline)
+		flags |= IDLE_DEADLINE;
+	    else if (s >= 0 && idle_send_msg(IDLE_MSG_INIT, idle_mboxname))
+		; /* idled tells us about changes, we just stay on its list */
+	    else
+		flags |= IDLE_MAILBOX|IDLE_ALERT;
 	}
 	if (r > 0 && s >= 0 && FD_ISSET(s, &rfds)) {
 	    struct sockaddr_un from;
@@ -232,11 +263,94 @@ int idle_wait(int otherfd)
 
 void idle_done(const char *mboxname)
 {
-    /* Tell idled that we're done idling */
+    /* Tell idled that we're done idling.  The socket stays open
+     * so that we can still notify idled of our own changes, and
+     * IDLE again later in the same process */
     idle_send_msg(IDLE_MSG_DONE, mboxname);
 
-    /* close the AF_UNIX socket */
-    idle_done_sock();
-
     idle_started = 0;
 }
+
+/* how long to wait for idled to take or give a connection */
+#define IDLE_HANDOFF_TIMEOUT 5
+
+int idle_offload(int fd, const struct buf *state)
+{
+    struct sockaddr_un mux;
+    struct timeval tv;
+    char ack;
+    int s, r = -1;
+
+    if (!idle_make_mux_address(&mux))
+	return -1;
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	syslog(LOG_ERR, "idle_offload: socket: %m");
+	return -1;
+    }
+
+    tv.tv_sec = IDLE_HANDOFF_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(s, (struct sockaddr *)&mux, sizeof(mux)) == -1) {
+	/* idled isn't multiplexing, which is not worth complaining about */
+	if (errno != ENOENT && errno != ECONNREFUSED)
+	    syslog(LOG_ERR, "idle_offload: connect(%s): %m", mux.sun_path);
+	goto done;
+    }
+
+    if (idle_sendfd(s, fd, state))
+	goto done;
+
+    /* idled confirms once the connection is being watched */
+    if (read(s, &ack, 1) == 1 && ack == '+')
+	r = 0;
+    else
+	syslog(LOG_ERR, "idle_offload: idled did not take the connection");
+
+ done:
+    close(s);
+    return r;
+}
+
+int idle_takeover(int sock, struct buf *state)
+{
+    uid_t uid;
+    int fd;
+
+    /* only idled, running as us, may hand us connections */
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+
+    uid = getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ?
+	(uid_t) -1 : cred.uid;
+#elif defined(HAVE_GETPEEREID)
+    gid_t gid;
+
+    if (getpeereid(sock, &uid, &gid)) uid = (uid_t) -1;
+#else
+    /* no way to tell who it is */
+    uid = (uid_t) -1;
+#endif
+    if (uid != geteuid()) {
+	syslog(LOG_ERR, "idle_takeover: connection not from idled");
+	return -1;
+    }
+
+    if (idle_recvfd(sock, &fd, state))
+	return -1;
+
+    /* all of stdio, as master would give it, so nothing is left on
+     * the connection from idled */
+    if (dup2(fd, 0) == -1 || dup2(fd, 1) == -1 || dup2(fd, 2) == -1) {
+	syslog(LOG_ERR, "idle_takeover: dup2: %m");
+	close(fd);
+	return -1;
+    }
+    if (fd > 2) close(fd);
+
+    return 0;
+}
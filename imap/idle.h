@@ -45,6 +45,7 @@
 #define IDLE_H
 
 #include "mailbox.h"
+#include "util.h"
 
 extern const char *idle_method_desc;
 
@@ -57,7 +58,9 @@ typedef enum {
     IDLE_ALERT =	0x2,
     /* input was detected on the @otherfd, probably because the IMAP
      * client cancelled the IDLE */
-    IDLE_INPUT =	0x4
+    IDLE_INPUT =	0x4,
+    /* the deadline given to idle_wait_until() passed */
+    IDLE_DEADLINE =	0x8
 } idle_flags_t;
 
 typedef void idle_updateproc_t(idle_flags_t flags);
@@ -66,6 +69,9 @@ typedef void idle_updateproc_t(idle_flags_t flags);
 /* Is IDLE enabled?  Can also do initial setup, if necessary */
 int idle_enabled(void);
 
+/* Tell idled that 'mboxname' has changed. */
+void idle_notify(const char *mboxname);
+
 /* Start IDLEing on 'mailbox'. */
 void idle_start(const char *mboxname);
 
@@ -79,6 +85,26 @@ void idle_start(const char *mboxname);
  */
 int idle_wait(int otherfd);
 
+/* Like idle_wait(), but also returns IDLE_DEADLINE once the time
+ * @deadline has passed.  A @deadline of 0 means wait forever.
+ */
+int idle_wait_until(int otherfd, time_t deadline);
+
+/* Hand the client connection @fd over to idled, along with @state
+ * which will be passed back untouched when the connection needs
+ * attention.  Returns 0 once idled has taken charge of it, after
+ * which the caller should close its copy of @fd without writing to
+ * it.
+ */
+int idle_offload(int fd, const struct buf *state);
+
+/* Take over a connection handed back by idled on the socket @sock.
+ * The client connection replaces stdin and stdout, and @state is
+ * filled in with what was given to idle_offload().  Returns 0 on
+ * success.
+ */
+int idle_takeover(int sock, struct buf *state);
+
 /* Cleanup when IDLE is completed. */
 void idle_done(const char *mboxname);
 
@@ -47,6 +47,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <syslog.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -56,13 +57,18 @@
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "idlemsg.h"
 #include "global.h"
+#include "dlist.h"
 #include "mboxlist.h"
 #include "xmalloc.h"
 #include "hash.h"
 #include "exitcodes.h"
+#include "xstrlcpy.h"
 
 /* global state */
 const int config_need_data = 0;
@@ -75,12 +81,54 @@ static int debugmode = 0;
 static time_t idle_timeout;
 static volatile sig_atomic_t sigquit = 0;
 
+/* how often to log notification counts, if they changed */
+#define STATS_INTERVAL 300
+
+/* everyone IDLEing on a mailbox */
+struct isub {
+    char *mboxname;
+    struct ientry *idlers;
+    int pending;		/* a notification is waiting to go out... */
+    struct timeval due;		/* ...at this time */
+    struct isub *nextpending;
+};
+
+/* an imapd IDLEing on a mailbox */
 struct ientry {
     struct sockaddr_un remote;
     time_t itime;
-    struct ientry *next;
+    struct isub *sub;
+    struct ientry *prev, *next;
+};
+
+static struct hash_table itable;	/* mailbox name -> struct isub */
+static struct hash_table ctable;	/* imapd address -> struct ientry */
+static struct isub *pending_head = NULL, *pending_tail = NULL;
+static struct timeval notify_delay;
+
+static struct idled_stats {
+    unsigned long received;	/* mailbox changes we heard about */
+    unsigned long coalesced;	/* ...which were already waiting to go */
+    unsigned long sent;		/* notifications sent to imapd */
+} stats, laststats;
+
+#ifdef HAVE_SYS_EPOLL_H
+/* an IMAP connection handed to us by an imapd while IDLEing, which
+ * goes back to a fresh imapd as soon as it needs attention */
+struct parked {
+    int fd;
+    char *mboxname;
+    struct buf state;
+    time_t ptime;
+    struct parked *next;
 };
-static struct hash_table itable;
+static struct hash_table ptable;
+static int muxsock = -1;
+static int epfd = -1;
+static unsigned long nparked = 0;
+
+static void resume_parked(const char *mboxname);
+#endif
 
 void fatal(const char *msg, int err)
 {
@@ -105,41 +153,167 @@ static int mbox_count_cb(void *rockp,
     return 0;
 }
 
-/* remove an ientry from list of those idling on mboxname */
-static void remove_ientry(const char *mboxname,
-			  const struct sockaddr_un *remote)
+static struct isub *get_isub(const char *mboxname)
 {
-    struct ientry *t, *p = NULL;
+    struct isub *sub = (struct isub *) hash_lookup(mboxname, &itable);
 
-    t = (struct ientry *) hash_lookup(mboxname, &itable);
-    while (t && memcmp(&t->remote, remote, sizeof(*remote))) {
-	p = t;
-	t = t->next;
+    if (!sub) {
+	sub = (struct isub *) xzmalloc(sizeof(struct isub));
+	sub->mboxname = xstrdup(mboxname);
+	hash_insert(mboxname, sub, &itable);
+    }
+
+    return sub;
+}
+
+/* forget about a mailbox once nobody is interested in it */
+static void put_isub(struct isub *sub)
+{
+    if (sub->idlers || sub->pending) return;
+
+    hash_del(sub->mboxname, &itable);
+    free(sub->mboxname);
+    free(sub);
+}
+
+/* remove an ientry from list of those idling on its mailbox */
+static void remove_ientry(struct ientry *t)
+{
+    struct isub *sub = t->sub;
+
+    if (t->prev) t->prev->next = t->next;
+    else sub->idlers = t->next;
+    if (t->next) t->next->prev = t->prev;
+
+    hash_del(t->remote.sun_path, &ctable);
+    free(t);
+
+    put_isub(sub);
+}
+
+/* add an imapd to the list of those idling on mboxname */
+static void add_ientry(const struct sockaddr_un *remote, const char *mboxname)
+{
+    struct ientry *t;
+    struct isub *sub;
+
+    t = (struct ientry *) hash_lookup(remote->sun_path, &ctable);
+    if (t && !strcmp(t->sub->mboxname, mboxname)) {
+	/* just letting us know it's still there */
+	t->itime = time(NULL);
+	return;
     }
-    if (t) {
-	if (!p) {
-	    /* first ientry in the linked list */
+    if (t) remove_ientry(t);
+
+    sub = get_isub(mboxname);
+    t = (struct ientry *) xzmalloc(sizeof(struct ientry));
+    t->remote = *remote;
+    t->itime = time(NULL);
+    t->sub = sub;
+    t->next = sub->idlers;
+    if (t->next) t->next->prev = t;
+    sub->idlers = t;
+    hash_insert(remote->sun_path, t, &ctable);
+}
+
+/* tell everyone idling on a mailbox that it changed */
+static void notify_isub(struct isub *sub)
+{
+    struct ientry *t, *n;
+    idle_message_t msg;
+    time_t now = time(NULL);
+
+    msg.which = IDLE_MSG_NOTIFY;
+    strlcpy(msg.mboxname, sub->mboxname, sizeof(msg.mboxname));
 
-	    p = t->next; /* remove node */
+    /* still pending, so removing idlers won't free it under us */
+    for (t = sub->idlers; t; t = n) {
+	n = t->next;
+	if ((t->itime + idle_timeout) < now) {
+	    /* This process hasn't been heard from for longer than the
+	     * timeout period, so it probably died.  Remove it from the list.
+	     */
+	    if (verbose || debugmode)
+		syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
 
-	    /* we just removed the data that the hash entry
-	       was pointing to, so insert the new data */
-	    hash_insert(mboxname, p, &itable);
+	    remove_ientry(t);
 	}
-	else {
-	    /* not the first ientry in the linked list */
+	else { /* signal process to update */
+	    if (verbose || debugmode)
+		syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
 
-	    p->next = t->next; /* remove node */
+	    if (idle_send(&t->remote, &msg)) {
+		stats.sent++;
+	    }
+	    else {
+		if (verbose || debugmode)
+		    syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
+		remove_ientry(t);
+	    }
 	}
-	free(t);
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    /* connections we're holding need an imapd to report the change */
+    if (epfd >= 0) resume_parked(sub->mboxname);
+#endif
+
+    sub->pending = 0;
+    put_isub(sub);
+}
+
+/* send out notifications whose time has come */
+static void flush_pending(void)
+{
+    struct isub *sub;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    while ((sub = pending_head) && !timercmp(&now, &sub->due, <)) {
+	pending_head = sub->nextpending;
+	if (!pending_head) pending_tail = NULL;
+	sub->nextpending = NULL;
+	notify_isub(sub);
     }
 }
 
+/* a mailbox changed; let its idlers know once things settle down */
+static void schedule_notify(const char *mboxname)
+{
+    struct isub *sub;
+
+    stats.received++;
+
+    sub = (struct isub *) hash_lookup(mboxname, &itable);
+#ifdef HAVE_SYS_EPOLL_H
+    if (!sub && epfd >= 0 && hash_lookup(mboxname, &ptable))
+	sub = get_isub(mboxname);
+#endif
+    if (!sub) return; /* nobody cares */
+
+    if (sub->pending) {
+	/* they'll hear about this one along with the last one */
+	stats.coalesced++;
+	return;
+    }
 
+    sub->pending = 1;
+    if (!timerisset(&notify_delay)) {
+	notify_isub(sub);
+	return;
+    }
+
+    gettimeofday(&sub->due, NULL);
+    timeradd(&sub->due, &notify_delay, &sub->due);
+    if (pending_tail) pending_tail->nextpending = sub;
+    else pending_head = sub;
+    pending_tail = sub;
+}
 
 static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 {
-    struct ientry *t, *n;
+    struct ientry *t;
 
     switch (msg->which) {
     case IDLE_MSG_INIT:
@@ -148,43 +322,14 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 		   idle_id_from_addr(remote), msg->mboxname);
 
 	/* add an ientry to list of those idling on mboxname */
-	t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-	n = (struct ientry *) xzmalloc(sizeof(struct ientry));
-	n->remote = *remote;
-	n->itime = time(NULL);
-	n->next = t;
-	hash_insert(msg->mboxname, n, &itable);
+	add_ientry(remote, msg->mboxname);
 	break;
 
     case IDLE_MSG_NOTIFY:
 	if (verbose || debugmode)
 	    syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", msg->mboxname);
 
-	/* send a message to all clients idling on mboxname */
-	t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-	for ( ; t ; t = n) {
-	    n = t->next;
-	    if ((t->itime + idle_timeout) < time(NULL)) {
-		/* This process has been idling for longer than the timeout
-		 * period, so it probably died.  Remove it from the list.
-		 */
-		if (verbose || debugmode)
-		    syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
-
-		remove_ientry(msg->mboxname, &t->remote);
-	    }
-	    else { /* signal process to update */
-		if (verbose || debugmode)
-		    syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
-
-		/* forward the received msg onto our clients */
-		if (!idle_send(&t->remote, msg)) {
-		    if (verbose || debugmode)
-			syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-		    remove_ientry(msg->mboxname, &t->remote);
-		}
-	    }
-	}
+	schedule_notify(msg->mboxname);
 	break;
 
     case IDLE_MSG_DONE:
@@ -193,7 +338,8 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 		   idle_id_from_addr(remote), msg->mboxname);
 
 	/* remove client from list of those idling on mboxname */
-	remove_ientry(msg->mboxname, remote);
+	t = (struct ientry *) hash_lookup(remote->sun_path, &ctable);
+	if (t) remove_ientry(t);
 	break;
 
     case IDLE_MSG_NOOP:
@@ -206,32 +352,287 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 }
 
 
-static void send_alert(const char *key,
+static void send_alert(const char *key __attribute__((unused)),
 		       void *data,
 		       void *rock __attribute__((unused)))
 {
     struct ientry *t = (struct ientry *) data;
-    struct ientry *n;
     idle_message_t msg;
 
     msg.which = IDLE_MSG_ALERT;
     strncpy(msg.mboxname, ".", sizeof(msg.mboxname));
 
+    /* signal process to check ALERTs */
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "    ALERT %s\n", idle_id_from_addr(&t->remote));
 
-    for ( ; t ; t = n) {
-	n = t->next;
+    /* we're on our way out, so there's no need to forget failures */
+    idle_send(&t->remote, &msg);
+}
 
-	/* signal process to check ALERTs */
-	if (verbose || debugmode)
-	    syslog(LOG_DEBUG, "    ALERT %s\n", idle_id_from_addr(&t->remote));
+static void log_stats(void)
+{
+    if (!memcmp(&stats, &laststats, sizeof(stats)))
+	return;
 
-	if (!idle_send(&t->remote, &msg)) {
-	    if (verbose || debugmode)
-		syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-	    remove_ientry(key, &t->remote);
+    syslog(LOG_INFO, "notifications: %lu received, %lu coalesced, %lu sent",
+	   stats.received, stats.coalesced, stats.sent);
+    laststats = stats;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void free_parked(struct parked *p)
+{
+    if (p->fd >= 0) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+	close(p->fd);
+    }
+    free(p->mboxname);
+    buf_free(&p->state);
+    free(p);
+    nparked--;
+}
+
+/* remove a connection from the list of those parked on its mailbox */
+static void unpark(struct parked *p)
+{
+    struct parked *t, *prev = NULL;
+
+    t = (struct parked *) hash_lookup(p->mboxname, &ptable);
+    while (t && t != p) {
+	prev = t;
+	t = t->next;
+    }
+    if (!t) return;
+
+    if (prev) prev->next = t->next;
+    else if (t->next) hash_insert(p->mboxname, t->next, &ptable);
+    else hash_del(p->mboxname, &ptable);
+}
+
+/* hand a connection back to a fresh imapd, then forget about it */
+static void resume_connection(struct parked *p, const char *why)
+{
+    static const char bye[] = "* BYE Unable to resume session\r\n";
+    struct sockaddr_un remote;
+    struct timeval tv;
+    int s;
+
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "resuming connection on '%s' (%s)", p->mboxname, why);
+
+    idle_make_resume_address(&remote);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s >= 0) {
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    if (s == -1 ||
+	connect(s, (struct sockaddr *) &remote, sizeof(remote)) == -1 ||
+	idle_sendfd(s, p->fd, &p->state)) {
+	syslog(LOG_ERR, "unable to hand connection back to imapd via %s: %m",
+	       remote.sun_path);
+	if (write(p->fd, bye, sizeof(bye)-1) < 0) {
+	    /* we tried */
 	}
     }
+
+    if (s >= 0) close(s);
+    free_parked(p);
+}
+
+static void resume_parked(const char *mboxname)
+{
+    struct parked *p, *n;
+
+    p = (struct parked *) hash_del(mboxname, &ptable);
+    for ( ; p ; p = n) {
+	n = p->next;
+	resume_connection(p, "mailbox changed");
+    }
+}
+
+static void resume_all(const char *key __attribute__((unused)),
+		       void *data,
+		       void *rock __attribute__((unused)))
+{
+    struct parked *p = (struct parked *) data;
+    struct parked *n;
+
+    for ( ; p ; p = n) {
+	n = p->next;
+	resume_connection(p, "shutting down");
+    }
+}
+
+/* take a connection from an imapd on the multiplexer socket */
+static void park_connection(void)
+{
+    struct parked *p, *t;
+    struct dlist *kl = NULL;
+    struct epoll_event ev;
+    struct timeval tv;
+    const char *mboxname = NULL;
+    int s, fd = -1;
+
+    s = accept(muxsock, NULL, NULL);
+    if (s == -1) {
+	if (errno != EAGAIN && errno != EINTR)
+	    syslog(LOG_ERR, "accept(): %m");
+	return;
+    }
+
+    /* don't let a wedged imapd hold us up */
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    p = (struct parked *) xzmalloc(sizeof(struct parked));
+    p->fd = -1;
+    nparked++;
+
+    if (idle_recvfd(s, &fd, &p->state))
+	goto err;
+    p->fd = fd;
+
+    if (dlist_parsemap(&kl, 0, p->state.s, p->state.len)) {
+	syslog(LOG_ERR, "unable to parse state of handed over connection");
+	goto err;
+    }
+    dlist_getatom(kl, "MBOXNAME", &mboxname);
+    p->mboxname = xstrdup(mboxname ? mboxname : ".");
+    p->ptime = time(NULL);
+    dlist_free(&kl);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev) == -1) {
+	syslog(LOG_ERR, "epoll_ctl(): %m");
+	goto err;
+    }
+
+    /* let imapd know it can go */
+    if (write(s, "+", 1) != 1) {
+	/* it'll notice soon enough and carry on with the connection */
+	syslog(LOG_ERR, "unable to confirm handed over connection");
+	goto err;
+    }
+    close(s);
+
+    t = (struct parked *) hash_lookup(p->mboxname, &ptable);
+    p->next = t;
+    hash_insert(p->mboxname, p, &ptable);
+
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "parked connection on '%s' (%lu parked)",
+	       p->mboxname, nparked);
+    return;
+
+ err:
+    /* imapd keeps the connection if we don't confirm */
+    close(s);
+    dlist_free(&kl);
+    free_parked(p);
+}
+
+/* something happened on a parked connection */
+static void parked_event(struct parked *p)
+{
+    char c;
+    int n;
+
+    unpark(p);
+
+    n = recv(p->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n > 0) {
+	/* probably DONE, which a real imapd can deal with */
+	resume_connection(p, "client input");
+    }
+    else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+	/* spurious, keep waiting */
+	p->next = (struct parked *) hash_lookup(p->mboxname, &ptable);
+	hash_insert(p->mboxname, p, &ptable);
+    }
+    else {
+	/* the client went away */
+	if (verbose || debugmode)
+	    syslog(LOG_DEBUG, "parked connection on '%s' closed",
+		   p->mboxname);
+	free_parked(p);
+    }
+}
+
+static void process_events(void)
+{
+    struct epoll_event events[64];
+    int i, n;
+
+    n = epoll_wait(epfd, events, 64, 0);
+    if (n < 0 && errno != EINTR)
+	syslog(LOG_ERR, "epoll_wait(): %m");
+
+    for (i = 0; i < n; i++) {
+	if (events[i].data.ptr)
+	    parked_event((struct parked *) events[i].data.ptr);
+	else
+	    park_connection();
+    }
+}
+
+/* start accepting connections from imapd, if configured to */
+static void init_mux(int nmbox)
+{
+    struct sockaddr_un local;
+    struct epoll_event ev;
+    mode_t oldumask;
+    int fdflags;
+
+    if (config_getint(IMAPOPT_IMAPIDLEOFFLOAD) <= 0)
+	return;
+
+    construct_hash_table(&ptable, nmbox + 1, 1);
+
+    idle_make_mux_address(&local);
+    unlink(local.sun_path);
+
+    if ((muxsock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	syslog(LOG_ERR, "socket(): %m");
+	return;
+    }
+
+    oldumask = umask((mode_t) 0077);
+    if (bind(muxsock, (struct sockaddr *) &local, sizeof(local)) == -1 ||
+	listen(muxsock, 128) == -1) {
+	syslog(LOG_ERR, "unable to listen on %s: %m", local.sun_path);
+	umask(oldumask);
+	close(muxsock);
+	muxsock = -1;
+	return;
+    }
+    umask(oldumask);
+
+    fdflags = fcntl(muxsock, F_GETFL, 0);
+    if (fdflags != -1) fcntl(muxsock, F_SETFL, O_NONBLOCK | fdflags);
+
+    if ((epfd = epoll_create(1024)) == -1) {
+	syslog(LOG_ERR, "epoll_create(): %m");
+	close(muxsock);
+	muxsock = -1;
+	return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, muxsock, &ev);
+
+    syslog(LOG_INFO, "accepting IDLE connections on %s", local.sun_path);
 }
+#endif /* HAVE_SYS_EPOLL_H */
 
 static void sighandler(int sig __attribute__((unused)))
 {
@@ -244,7 +645,8 @@ int main(int argc, char **argv)
     char *p = NULL;
     int opt;
     int nmbox = 0;
-    int s;
+    int n, s;
+    time_t next_stats = 0;
     struct sockaddr_un local;
     fd_set read_set, rset;
     int nfds;
@@ -297,8 +699,7 @@ int main(int argc, char **argv)
     /* count the number of mailboxes */
     mboxlist_init(0);
     mboxlist_open(NULL);
-    cyrusdb_foreach(mbdb, "", 0, NULL, &mbox_count_cb,
-				&nmbox, NULL);
+    mboxlist_allmbox("", &mbox_count_cb, &nmbox);
     mboxlist_close();
     mboxlist_done();
 
@@ -313,8 +714,15 @@ int main(int argc, char **argv)
     if (sigaction(SIGTERM, &action, NULL) < 0)
 	fatal("unable to install signal handler for SIGTERM", 1);
 
-    /* create idle table -- +1 to avoid a zero value */
-    construct_hash_table(&itable, nmbox + 1, 1);
+    /* create idle tables -- +1 to avoid a zero value */
+    construct_hash_table(&itable, nmbox + 1, 0);
+    construct_hash_table(&ctable, nmbox + 1, 0);
+
+    /* how long to let changes to a mailbox pile up */
+    n = config_getint(IMAPOPT_IDLENOTIFYDELAY);
+    if (n < 0) n = 0;
+    notify_delay.tv_sec = n / 1000;
+    notify_delay.tv_usec = (n % 1000) * 1000;
 
     if (!idle_make_server_address(&local) ||
 	!idle_init_sock(&local)) {
@@ -328,26 +736,49 @@ int main(int argc, char **argv)
     FD_SET(s, &read_set);
     nfds = s + 1;
 
-    for (;;) {
-	int n;
+#ifdef HAVE_SYS_EPOLL_H
+    /* parked connections are watched via epoll, which is itself
+     * just another descriptor to select() on */
+    init_mux(nmbox);
+    if (epfd >= 0) {
+	FD_SET(epfd, &read_set);
+	if (epfd >= nfds) nfds = epfd + 1;
+    }
+#endif
 
+    for (;;) {
 	/* check for shutdown file */
 	if (shutdown_file(NULL, 0)) {
 	    /* signal all processes to shutdown */
 	    if (verbose || debugmode)
 		syslog(LOG_DEBUG, "IDLE_ALERT\n");
 
-	    hash_enumerate(&itable, send_alert, NULL);
+	    hash_enumerate(&ctable, send_alert, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+	    if (epfd >= 0) hash_enumerate(&ptable, resume_all, NULL);
+#endif
 	    break;
 	}
 	if (sigquit) {
-	    hash_enumerate(&itable, send_alert, NULL);
+	    hash_enumerate(&ctable, send_alert, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+	    if (epfd >= 0) hash_enumerate(&ptable, resume_all, NULL);
+#endif
 	    break;
 	}
 
-	/* timeout for select is 1 second */
+	/* timeout for select is 1 second, or until the next notification */
 	timeout.tv_sec = 1;
 	timeout.tv_usec = 0;
+	if (pending_head) {
+	    struct timeval now;
+
+	    gettimeofday(&now, NULL);
+	    if (timercmp(&pending_head->due, &now, <))
+		timerclear(&timeout);
+	    else
+		timersub(&pending_head->due, &now, &timeout);
+	}
 
 	/* check for the next input */
 	rset = read_set;
@@ -370,8 +801,22 @@ int main(int argc, char **argv)
 		process_message(&from, &msg);
 	}
 
+#ifdef HAVE_SYS_EPOLL_H
+	if (epfd >= 0 && FD_ISSET(epfd, &rset))
+	    process_events();
+#endif
+
+	flush_pending();
+
+	if (time(NULL) >= next_stats) {
+	    log_stats();
+	    next_stats = time(NULL) + STATS_INTERVAL;
+	}
+
     }
 
+    log_stats();
+
     idle_done_sock();
     cyrus_done();
 
@@ -55,8 +55,11 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
 
 #include "assert.h"
+#include "retry.h"
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
 #include "idlemsg.h"
@@ -200,3 +203,132 @@ int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
     return 1;
 }
 
+/* longest state we're prepared to accept with a handed over connection */
+#define IDLE_MAX_STATE	(1024*1024)
+
+static void make_address(struct sockaddr_un *mysun, int opt,
+			 const char *fname)
+{
+    const char *path = config_getstring(opt);
+
+    memset(mysun, 0, sizeof(*mysun));
+    mysun->sun_family = AF_UNIX;
+    if (path) {
+	strlcpy(mysun->sun_path, path, sizeof(mysun->sun_path));
+    }
+    else {
+	strlcpy(mysun->sun_path, config_dir, sizeof(mysun->sun_path));
+	strlcat(mysun->sun_path, fname, sizeof(mysun->sun_path));
+    }
+}
+
+int idle_make_mux_address(struct sockaddr_un *mysun)
+{
+    make_address(mysun, IMAPOPT_IDLEMUXSOCKET, FNAME_IDLE_MUX_SOCK);
+    return 1;
+}
+
+int idle_make_resume_address(struct sockaddr_un *mysun)
+{
+    make_address(mysun, IMAPOPT_IDLERESUMESOCKET, FNAME_IDLE_RESUME_SOCK);
+    return 1;
+}
+
+/*
+ * The descriptor travels as SCM_RIGHTS ancillary data along with the
+ * length of the state, in network byte order; the state follows.
+ */
+int idle_sendfd(int sock, int fd, const struct buf *state)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    uint32_t len = htonl(state->len);
+
+    memset(&mh, 0, sizeof(mh));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = (char *)&len;
+    iov.iov_len = sizeof(len);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &mh, 0) != sizeof(len)) {
+	syslog(LOG_ERR, "idle_sendfd: sendmsg: %m");
+	return -1;
+    }
+
+    if (state->len && retry_write(sock, state->s, state->len) < 0) {
+	syslog(LOG_ERR, "idle_sendfd: write: %m");
+	return -1;
+    }
+
+    return 0;
+}
+
+int idle_recvfd(int sock, int *fdp, struct buf *state)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    uint32_t len;
+    int fd = -1;
+    ssize_t n;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (char *)&len;
+    iov.iov_len = sizeof(len);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    do {
+	n = recvmsg(sock, &mh, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(len)) {
+	if (n < 0) syslog(LOG_ERR, "idle_recvfd: recvmsg: %m");
+	else syslog(LOG_ERR, "idle_recvfd: short read");
+	goto err;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+	    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (fd < 0) {
+	syslog(LOG_ERR, "idle_recvfd: no descriptor passed");
+	goto err;
+    }
+
+    len = ntohl(len);
+    if (len > IDLE_MAX_STATE) {
+	syslog(LOG_ERR, "idle_recvfd: state too long (%u)", len);
+	goto err;
+    }
+
+    buf_reset(state);
+    buf_ensure(state, len+1);
+    if (len && retry_read(sock, state->s, len) != (int)len) {
+	syslog(LOG_ERR, "idle_recvfd: short read of state");
+	goto err;
+    }
+    state->len = len;
+
+    *fdp = fd;
+    return 0;
+
+ err:
+    if (fd >= 0) close(fd);
+    return -1;
+}
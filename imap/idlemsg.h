@@ -48,10 +48,14 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "mailbox.h"
+#include "util.h"
 
 /* socket to communicate with the idled */
 #define FNAME_IDLE_SOCK_DIR "/socket"
 #define FNAME_IDLE_SOCK FNAME_IDLE_SOCK_DIR"/idle"
+/* connections handed to idled, and handed back to imapd */
+#define FNAME_IDLE_MUX_SOCK FNAME_IDLE_SOCK_DIR"/idlemux"
+#define FNAME_IDLE_RESUME_SOCK FNAME_IDLE_SOCK_DIR"/imapresume"
 
 typedef struct idle_message_s idle_message_t;
 
@@ -83,5 +87,12 @@ int idle_send(const struct sockaddr_un *remote,
 	      const idle_message_t *msg);
 int idle_recv(struct sockaddr_un *remote, idle_message_t *msg);
 
+int idle_make_mux_address(struct sockaddr_un *);
+int idle_make_resume_address(struct sockaddr_un *);
+/* pass the file descriptor 'fd' and the opaque 'state' over the
+ * connected stream socket 'sock', and pick them up at the other end */
+int idle_sendfd(int sock, int fd, const struct buf *state);
+int idle_recvfd(int sock, int *fdp, struct buf *state);
+
 
 #endif
@@ -94,6 +94,7 @@ struct protocol_t imap_protocol =
       { "RIGHTS=kxte", CAPA_ACLRIGHTS },
       { "LIST-EXTENDED", CAPA_LISTEXTENDED },
       { "SASL-IR", CAPA_SASL_IR },
+      { "X-UNDUMPUSER", CAPA_UNDUMPUSER },
       { NULL, 0 } } },
   { "S01 STARTTLS", "S01 OK", "S01 NO", 0 },
   { "A01 AUTHENTICATE", 0, 0, "A01 OK", "A01 NO", "+ ", "*",
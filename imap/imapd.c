@@ -76,9 +76,12 @@
 #include "backend.h"
 #include "bsearch.h"
 #include "charset.h"
+#include "cmdstats.h"
+#include "cyr_lock.h"
 #include "dlist.h"
 #include "exitcodes.h"
 #include "idle.h"
+#include "idlemsg.h"
 #include "global.h"
 #include "times.h"
 #include "hash.h"
@@ -104,6 +107,7 @@
 #include "telemetry.h"
 #include "tls.h"
 #include "user.h"
+#include "usercache.h"
 #include "userdeny.h"
 #include "util.h"
 #include "version.h"
@@ -172,6 +176,9 @@ static sasl_conn_t *imapd_saslconn; /* the sasl connection context */
 static int imapd_starttls_done = 0; /* have we done a successful starttls? */
 static void *imapd_tls_comp = NULL; /* TLS compression method, if any */
 static int imapd_compress_done = 0; /* have we done a successful compress? */
+static int imapd_resume = 0; /* do we take IDLEs back from idled? */
+static struct dlist *imapd_resumestate = NULL; /* the IDLE we took back */
+static int imapd_handedoff = 0; /* has idled taken the client off us? */
 const char *plaintextloginalert = NULL;
 
 #ifdef HAVE_SSL
@@ -363,6 +370,7 @@ void cmd_create(char *tag, char *name, struct dlist *extargs, int localonly);
 void cmd_delete(char *tag, char *name, int localonly, int force);
 void cmd_dump(char *tag, char *name, int uid_start);
 void cmd_undump(char *tag, char *name);
+void cmd_undumpuser(char *tag, char *partition);
 void cmd_xfer(const char *tag, const char *name, 
 	      const char *toserver, const char *topart);
 void cmd_rename(char *tag, char *oldname, char *newname, char *partition);
@@ -386,6 +394,7 @@ extern void id_getcmdline(int argc, char **argv);
 extern void id_response(struct protstream *pout);
 
 void cmd_idle(char* tag);
+static void cmd_resumeidle(void);
 
 void cmd_starttls(char *tag, int imaps);
 
@@ -687,9 +696,11 @@ static void imapd_reset(void)
     if (imapd_index) index_close(&imapd_index);
 
     if (imapd_in) {
-	/* Flush the incoming buffer */
-	prot_NONBLOCK(imapd_in);
-	prot_fill(imapd_in);
+	/* Flush the incoming buffer, unless it belongs to idled now */
+	if (!imapd_handedoff) {
+	    prot_NONBLOCK(imapd_in);
+	    prot_fill(imapd_in);
+	}
 	bytes_in = prot_bytes_in(imapd_in);
 	prot_free(imapd_in);
     }
@@ -718,7 +729,11 @@ static void imapd_reset(void)
     }
 #endif
 
-    cyrus_reset_stdio();
+    /* the client's socket is idled's now, so just let go of it */
+    if (imapd_handedoff)
+	cyrus_release_stdio();
+    else
+	cyrus_reset_stdio();
 
     imapd_clienthost = "[local]";
     if (imapd_logfd != -1) {
@@ -752,6 +767,8 @@ static void imapd_reset(void)
     imapd_compress_done = 0;
     imapd_tls_comp = NULL;
     imapd_starttls_done = 0;
+    imapd_handedoff = 0;
+    dlist_free(&imapd_resumestate);
     plaintextloginalert = NULL;
 
     if(saslprops.iplocalport) {
@@ -802,11 +819,14 @@ int service_init(int argc, char **argv, char **envp)
     /* setup for sending IMAP IDLE notifications */
     idle_enabled();
 
+    /* per command statistics, if wanted */
+    cmdstats_init("imapd");
+
     /* create connection to the SNMP listener, if available. */
     snmp_connect(); /* ignore return code */
     snmp_set_str(SERVER_NAME_VERSION,cyrus_version());
 
-    while ((opt = getopt(argc, argv, "sp:N")) != EOF) {
+    while ((opt = getopt(argc, argv, "sp:NR")) != EOF) {
 	switch (opt) {
 	case 's': /* imaps (do starttls right away) */
 	    imaps = 1;
@@ -823,6 +843,9 @@ int service_init(int argc, char **argv, char **envp)
 		   * you know what you're doing! */
 	    nosaslpasswdcheck = 1;
 	    break;
+	case 'R': /* take IDLE connections back from idled */
+	    imapd_resume = 1;
+	    break;
 	default:
 	    break;
 	}
@@ -862,6 +885,20 @@ int service_main(int argc __attribute__((unused)),
     struct io_count *io_count_start;
     struct io_count *io_count_stop;
 
+    if (imapd_resume) {
+	/* we're given the client by idled, rather than by master */
+	struct buf state = BUF_INITIALIZER;
+	int r = idle_takeover(0, &state);
+
+	if (!r) r = dlist_parsemap(&imapd_resumestate, 0, state.s, state.len);
+	buf_free(&state);
+	if (r) {
+	    syslog(LOG_ERR, "unable to take IDLE connection back from idled");
+	    cyrus_reset_stdio();
+	    return 0;
+	}
+    }
+
     if (config_iolog) { 
         io_count_start = malloc (sizeof (struct io_count));
         io_count_stop = malloc (sizeof (struct io_count));
@@ -878,6 +915,7 @@ int service_main(int argc __attribute__((unused)),
 #endif
 
     sync_log_init();
+    sync_log_defer();
 
     imapd_in = prot_new(0, 0);
     imapd_out = prot_new(1, 1);
@@ -1010,10 +1048,13 @@ void shut_down(int code)
 
     if (idling)
 	idle_done(imapd_index ? imapd_index->mailbox->name : NULL);
+    idle_done_sock();
 
     if (imapd_index) index_close(&imapd_index);
 
     sync_log_done();
+    cmdstats_done();
+    usercache_drop(NULL);
     seen_done();
     mboxkey_done();
     mboxlist_close();
@@ -1129,21 +1170,23 @@ void cmdloop(void)
     int usinguid, havepartition, havenamespace, recursive;
     static struct buf tag, cmd, arg1, arg2, arg3;
     char *p, shut[MAX_MAILBOX_PATH+1], cmdname[100];
-    const char *err;
+    const char *err, *statname;
     const char * commandmintimer;
     double commandmintimerd = 0.0;
 
-    prot_printf(imapd_out, "* OK [CAPABILITY ");
-    capa_response(CAPA_PREAUTH);
-    prot_printf(imapd_out, "]");
-    if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
-    if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
-	prot_printf(imapd_out, " Cyrus IMAP%s %s",
-		    config_mupdate_server ? " Murder" : "", cyrus_version());
-    }
-    prot_printf(imapd_out, " server ready\r\n");
+    if (!imapd_resumestate) {
+	prot_printf(imapd_out, "* OK [CAPABILITY ");
+	capa_response(CAPA_PREAUTH);
+	prot_printf(imapd_out, "]");
+	if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
+	if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
+	    prot_printf(imapd_out, " Cyrus IMAP%s %s",
+			config_mupdate_server ? " Murder" : "", cyrus_version());
+	}
+	prot_printf(imapd_out, " server ready\r\n");
 
-    motd_file();
+	motd_file();
+    }
 
     /* Get command timer logging paramater. This string
      * is a time in seconds. Any command that takes >=
@@ -1154,10 +1197,17 @@ void cmdloop(void)
       commandmintimerd = atof(commandmintimer);
     }
 
+    /* carry on with an IDLE given back to us by idled */
+    if (imapd_resumestate) {
+	cmd_resumeidle();
+	if (imapd_handedoff) return;
+    }
+
     for (;;) {
 	/* Flush any buffered output */
 	prot_flush(imapd_out);
 	if (backend_current) prot_flush(backend_current->out);
+	sync_log_checkpoint();
 
 	/* Check for shutdown file */
 	if ( !imapd_userisadmin && imapd_userid &&
@@ -1205,6 +1255,8 @@ void cmdloop(void)
 	}
 	lcase(cmd.s);
 	strncpy(cmdname, cmd.s, 99);
+	statname = cmdname;
+	lock_setcommand(cmdname);
 	cmd.s[0] = toupper((unsigned char) cmd.s[0]);
 
 	/* if we need to force a kick, do so */
@@ -1225,6 +1277,7 @@ void cmdloop(void)
 
 	/* Start command timer */
 	cmdtime_starttimer();
+	cmdstats_start(imapd_in, imapd_out);
     
 	/* note that about half the commands (the common ones that don't
 	   hit the mailboxes file) now close the mailboxes file just in
@@ -1508,6 +1561,9 @@ void cmdloop(void)
 		cmd_idle(tag.s);
 
 		snmp_increment(IDLE_COUNT, 1);
+
+		/* the client is idled's problem now */
+		if (imapd_handedoff) return;
 	    }
 	    else goto badcmd;
 	    break;
@@ -2045,6 +2101,15 @@ void cmdloop(void)
 		cmd_undump(tag.s, arg1.s);
 	    /*	snmp_increment(UNDUMP_COUNT, 1);*/
 	    }
+	    else if (!strcmp(cmd.s, "Undumpuser")) {
+		if(c != ' ') goto missingargs;
+		c = getword(imapd_in, &arg1);
+
+		/* we want to get a list of mailboxes at this point */
+		if(c != ' ') goto missingargs;
+
+		cmd_undumpuser(tag.s, arg1.s);
+	    }
 #ifdef HAVE_SSL
 	    else if (!strcmp(cmd.s, "Urlfetch")) {
 		if (c != ' ') goto missingargs;
@@ -2127,10 +2192,14 @@ void cmdloop(void)
 
 	default:
 	badcmd:
+	    /* the client chose this name, don't keep stats under it */
+	    statname = CMDSTATS_UNKNOWN;
 	    prot_printf(imapd_out, "%s BAD Unrecognized command\r\n", tag.s);
 	    eatline(imapd_in, c);
 	}
 
+	cmdstats_end(statname);
+
 	/* End command timer - don't log "idle" commands */
 	if (commandmintimer && strcmp("idle", cmdname)) {
 	    double cmdtime, nettime;
@@ -2205,6 +2274,9 @@ static void authentication_success(void)
     mboxname_hiersep_tointernal(&imapd_namespace, imapd_userid,
 				config_virtdomains ?
 				strcspn(imapd_userid, "@") : 0);
+
+    /* keep this user's databases open for next time */
+    usercache_hold(imapd_userid, config_getint(IMAPOPT_IMAPWARMUSERS));
 }
 
 static int checklimits(const char *tag)
@@ -2746,6 +2818,127 @@ void cmd_id(char *tag)
     did_id = 1;
 }
 
+/*
+ * Can idled look after the client while it IDLEs?  It only watches
+ * the socket, so the connection can't have any state of its own (TLS,
+ * COMPRESS, a SASL security layer) or input we've already read.
+ */
+static int idle_offloadable(void)
+{
+    if (config_getint(IMAPOPT_IMAPIDLEOFFLOAD) <= 0 ||
+	idle_get_sock() < 0)
+	return 0;
+
+    return (!imapd_starttls_done && !imapd_compress_done &&
+	    !imapd_in->saslssf && !imapd_in->cnt &&
+	    imapd_logfd == -1 && !imapd_userisproxyadmin &&
+	    !imapd_magicplus);
+}
+
+/*
+ * Hand the client to idled until there is something to tell it.
+ * Returns 0 if idled took it, after which we must not talk to
+ * the client again.
+ */
+static int idle_handoff(const char *tag)
+{
+    struct dlist *kl;
+    struct buf state = BUF_INITIALIZER;
+    int r;
+
+    if (!idle_offloadable())
+	return -1;
+
+    prot_flush(imapd_out);
+
+    kl = dlist_newkvlist(NULL, "IDLE");
+    dlist_setatom(kl, "TAG", tag);
+    dlist_setatom(kl, "USERID", proxy_userid);
+    dlist_setatom(kl, "CLIENTHOST", imapd_clienthost);
+    dlist_setnum32(kl, "CAPA", imapd_client_capa);
+    if (imapd_index) index_savestate(imapd_index, kl);
+    dlist_printbuf(kl, 0, &state);
+    dlist_free(&kl);
+
+    r = idle_offload(imapd_in->fd, &state);
+    buf_free(&state);
+    if (r) return r;
+
+    imapd_handedoff = 1;
+
+    /* idled can't know about changes made before it took over */
+    if (imapd_index && index_haschanged(imapd_index))
+	idle_notify(imapd_index->mailbox->name);
+
+    syslog(LOG_DEBUG, "idle: handed %s to idled", imapd_userid);
+
+    return 0;
+}
+
+/*
+ * Pick up where another imapd left off with idle_handoff()
+ */
+static void cmd_resumeidle(void)
+{
+    static struct buf clienthost = BUF_INITIALIZER;
+    struct dlist *kl = imapd_resumestate;
+    const char *host = NULL;
+    const char *userid = NULL;
+    const char *mboxname = NULL;
+    const char *tag = NULL;
+    uint32_t capa = 0;
+    uint32_t examine = 0;
+    char *mytag;
+    int r;
+
+    if (!dlist_getatom(kl, "TAG", &tag) ||
+	!dlist_getatom(kl, "USERID", &userid))
+	fatal("invalid IDLE state from idled", EC_SOFTWARE);
+
+    /* still the same client, whatever the socket says now */
+    if (dlist_getatom(kl, "CLIENTHOST", &host)) {
+	buf_setcstr(&clienthost, host);
+	imapd_clienthost = buf_cstring(&clienthost);
+    }
+
+    imapd_userid = xstrdup(userid);
+    imapd_authstate = auth_newstate(imapd_userid);
+    authentication_success();
+
+    dlist_getnum32(kl, "CAPA", &capa);
+    imapd_client_capa = capa;
+
+    if (dlist_getatom(kl, "MBOXNAME", &mboxname)) {
+	struct index_init init;
+
+	memset(&init, 0, sizeof(struct index_init));
+	dlist_getnum32(kl, "EXAMINE", &examine);
+	init.qresync = imapd_client_capa & CAPA_QRESYNC;
+	init.userid = imapd_userid;
+	init.authstate = imapd_authstate;
+	init.out = imapd_out;
+	init.examine_mode = examine;
+	init.select = 1;
+
+	r = index_open(mboxname, &init, &imapd_index);
+	if (!r) r = index_restorestate(imapd_index, kl);
+	if (r) {
+	    prot_printf(imapd_out, "* BYE %s\r\n", error_message(r));
+	    shut_down(0);
+	}
+
+	proc_register("imapd", imapd_clienthost, imapd_userid, mboxname);
+    }
+
+    syslog(LOG_DEBUG, "idle: took %s back from idled", imapd_userid);
+
+    mytag = xstrdup(tag);
+    cmd_idle(mytag);
+    free(mytag);
+
+    dlist_free(&imapd_resumestate);
+}
+
 /*
  * Perform an IDLE command
  */
@@ -2757,19 +2950,34 @@ void cmd_idle(char *tag)
     static int idle_period = -1;
 
     if (!backend_current) {  /* Local mailbox */
+	time_t offload = 0;
 
-	/* Tell client we are idling and waiting for end of command */
-	prot_printf(imapd_out, "+ idling\r\n");
-	prot_flush(imapd_out);
+	/* a resumed IDLE has already been started and brought up to date */
+	if (!imapd_resumestate) {
+	    /* Tell client we are idling and waiting for end of command */
+	    prot_printf(imapd_out, "+ idling\r\n");
+	    prot_flush(imapd_out);
 
-	/* Start doing mailbox updates */
-	if (imapd_index) index_check(imapd_index, 1, 0);
+	    /* Start doing mailbox updates */
+	    if (imapd_index) index_check(imapd_index, 1, 0);
+	}
+	prot_flush(imapd_out);
 	idle_start(imapd_index ? imapd_index->mailbox->name : NULL);
 	/* use this flag so if getc causes a shutdown due to
 	 * connection abort we tell idled about it */
 	idling = 1;
 
-	while ((flags = idle_wait(imapd_in->fd))) {
+	if (idle_offloadable())
+	    offload = time(NULL) + config_getint(IMAPOPT_IMAPIDLEOFFLOAD);
+
+	while ((flags = idle_wait_until(imapd_in->fd, offload))) {
+	    if (flags & IDLE_DEADLINE) {
+		/* nothing is happening, let idled watch the client */
+		if (!idle_handoff(tag)) break;
+		offload = 0;
+		continue;
+	    }
+
 	    if (flags & IDLE_INPUT) {
 		/* Get continuation data */
 		c = getword(imapd_in, &arg);
@@ -2799,6 +3007,9 @@ void cmd_idle(char *tag)
 	/* Stop updates and do any necessary cleanup */
 	idling = 0;
 	idle_done(imapd_index ? imapd_index->mailbox->name : NULL);
+
+	/* nothing more to say, a fresh imapd will finish the command */
+	if (imapd_handedoff) return;
     }
     else {  /* Remote mailbox */
 	int done = 0, shutdown = 0;
@@ -2950,6 +3161,8 @@ void capa_response(int flags)
     for (i = 0 ; i < QUOTA_NUMRESOURCES ; i++)
 	prot_printf(imapd_out, " X-QUOTA=%s", quota_names[i]);
 
+    prot_printf(imapd_out, " X-UNDUMPUSER");
+
     if (idle_enabled()) {
 	prot_printf(imapd_out, " IDLE");
     }
@@ -9219,6 +9432,113 @@ void cmd_undump(char *tag, char *name)
     }
 }
 
+/*
+ * Perform an UNDUMPUSER command: create each of the mailboxes in the
+ * list with the ACL given and fill it in from its dump, as sent by
+ * XFER when moving a whole user here.  Either every mailbox is
+ * created or none is.
+ */
+void cmd_undumpuser(char *tag, char *partition)
+{
+    static struct buf name, acl;
+    char mailboxname[MAX_MAILBOX_BUFFER];
+    char buf[MAX_PARTITION_LEN + HOSTNAME_SIZE + 2];
+    strarray_t created = STRARRAY_INITIALIZER;
+    mupdate_handle *mupdate_h = NULL;
+    int options = config_getint(IMAPOPT_MAILBOX_DEFAULT_OPTIONS)
+		  | OPT_POP3_NEW_UIDL;
+    int c, i;
+    int eaten = 0;
+    int r = 0;
+
+    /* administrators only please */
+    if (!imapd_userisadmin)
+	r = IMAP_PERMISSION_DENIED;
+
+    c = prot_getc(imapd_in);
+    if (!r && c != '(')
+	r = IMAP_PROTOCOL_BAD_PARAMETERS;
+
+    if (!r && config_mupdate_server)
+	r = mupdate_connect(config_mupdate_server, NULL, &mupdate_h, NULL);
+
+    while (!r) {
+	c = getastring(imapd_in, imapd_out, &name);
+	if (c != ' ') {
+	    r = IMAP_PROTOCOL_BAD_PARAMETERS;
+	    break;
+	}
+	c = getastring(imapd_in, imapd_out, &acl);
+	if (c != ' ') {
+	    r = IMAP_PROTOCOL_BAD_PARAMETERS;
+	    break;
+	}
+
+	r = (*imapd_namespace.mboxname_tointernal)(&imapd_namespace, name.s,
+						   imapd_userid, mailboxname);
+
+	/* giving the ACL skips the usual checks, so never replace
+	 * a mailbox which is already here */
+	if (!r) {
+	    r = mboxlist_lookup(mailboxname, NULL, NULL);
+	    if (!r) r = IMAP_MAILBOX_EXISTS;
+	    else if (r == IMAP_MAILBOX_NONEXISTENT) r = 0;
+	}
+	if (!r) r = mboxlist_createmailbox_full(mailboxname, 0, partition,
+						1, imapd_userid,
+						imapd_authstate, options, 0,
+						acl.s, NULL, 1, 1, 0,
+						NULL, NULL);
+	if (r) break;
+	strarray_append(&created, mailboxname);
+
+	r = undump_mailbox_stream(mailboxname, imapd_in, imapd_out);
+	if (r) {
+	    eaten = 1;
+	    break;
+	}
+
+	/* Push mailbox to mupdate server */
+	if (mupdate_h) {
+	    snprintf(buf, sizeof(buf), "%s!%s", config_servername, partition);
+	    r = mupdate_activate(mupdate_h, mailboxname, buf, acl.s);
+	    if (r) break;
+	}
+
+	c = prot_getc(imapd_in);
+	if (c == ')') break;
+	if (c != ' ') r = IMAP_PROTOCOL_BAD_PARAMETERS;
+    }
+
+    if (!r) {
+	c = prot_getc(imapd_in);
+	if (c == '\r') c = prot_getc(imapd_in);
+	if (c != '\n') r = IMAP_PROTOCOL_BAD_PARAMETERS;
+    }
+    if (!eaten) eatline(imapd_in, c);
+
+    if (mupdate_h) mupdate_disconnect(&mupdate_h);
+
+    if (r) {
+	/* remove what we did create, newest first */
+	for (i = created.count - 1; i >= 0; i--) {
+	    int r2 = mboxlist_deletemailbox(created.data[i], 1,
+					    imapd_userid, imapd_authstate,
+					    0, 1, 1);
+	    if (r2) {
+		syslog(LOG_ERR, "UNDUMPUSER: could not back out %s: %s",
+		       created.data[i], error_message(r2));
+	    }
+	}
+	prot_printf(imapd_out, "%s NO %s\r\n", tag, error_message(r));
+    } else {
+	prot_printf(imapd_out, "%s OK %s\r\n", tag,
+		    error_message(IMAP_OK_COMPLETED));
+    }
+
+    strarray_fini(&created);
+}
+
 static int getresult(struct protstream *p, const char *tag)
 {
     char buf[4096];
@@ -9609,6 +9929,14 @@ static int xfer_init(const char *toserver, const char *topart,
 
     xfer->remoteversion = backend_version(xfer->be);
 
+    /* compress the connection if asked to and it isn't already */
+    if (config_getswitch(IMAPOPT_XFER_COMPRESS) &&
+	!config_getswitch(IMAPOPT_PROXY_COMPRESS) &&
+	backend_compress(xfer->be)) {
+	syslog(LOG_NOTICE, "couldn't enable compression for XFER to %s",
+	       toserver);
+    }
+
     xfer->toserver = xstrdup(toserver);
     xfer->topart = xstrdup(topart);
 
@@ -9823,6 +10151,67 @@ static int xfer_undump(struct xfer_header *xfer)
     return 0;
 }
 
+/* Steps 4 and 5 in one go: create, fill in and set the ACL on every
+ * remote mailbox with a single UNDUMPUSER command */
+static int xfer_undumpuser(struct xfer_header *xfer)
+{
+    struct xfer_item *item;
+    struct mailbox *mailbox = NULL;
+    char extname[MAX_MAILBOX_NAME];
+    const char *acl;
+    int sent = 0;
+    int r = 0, r2;
+
+    prot_printf(xfer->be->out, "DU1 UNDUMPUSER %s (", xfer->topart);
+
+    for (item = xfer->items; item; item = item->next) {
+	(*imapd_namespace.mboxname_toexternal)(&imapd_namespace, item->mbentry->name,
+					       imapd_userid, extname);
+	r2 = mailbox_open_irl(item->mbentry->name, &mailbox);
+	if (r2) {
+	    syslog(LOG_ERR,
+		   "Failed to open mailbox %s for dump_mailbox() %s",
+		   item->mbentry->name, error_message(r2));
+	    if (!r) r = r2;
+	    continue;
+	}
+
+	acl = item->mbentry->acl ? item->mbentry->acl : "";
+	prot_printf(xfer->be->out, "%s{" SIZE_T_FMT "+}\r\n%s {" SIZE_T_FMT "+}\r\n%s ",
+		    sent++ ? " " : "", strlen(extname), extname,
+		    strlen(acl), acl);
+
+	r2 = dump_mailbox_stream(mailbox, xfer->be->out);
+
+	mailbox_close(&mailbox);
+
+	/* the remote side doesn't know about any failure here, so
+	 * carry on and back the whole lot out afterwards */
+	if (r2) {
+	    syslog(LOG_ERR,
+		   "Could not move mailbox: %s, dump_mailbox() failed %s",
+		   item->mbentry->name, error_message(r2));
+	    if (!r) r = r2;
+	}
+	item->remote_created = 1;
+    }
+
+    prot_printf(xfer->be->out, ")\r\n");
+
+    r2 = getresult(xfer->be->in, "DU1");
+    if (r2) {
+	/* the remote server removed anything it created */
+	for (item = xfer->items; item; item = item->next) {
+	    syslog(LOG_ERR, "Could not move mailbox: %s, UNDUMPUSER failed %s",
+		   item->mbentry->name, error_message(r2));
+	    item->remote_created = 0;
+	}
+	return r2;
+    }
+
+    return r;
+}
+
 static int xfer_delete(struct xfer_header *xfer)
 {
     struct xfer_item *item;
@@ -9897,8 +10286,14 @@ static int do_xfer(struct xfer_header *xfer)
     int r;
 
     r = xfer_deactivate(xfer);
-    if (!r) r = xfer_localcreate(xfer);
-    if (!r) r = xfer_undump(xfer);
+    if (r) return r;
+
+    if (CAPA(xfer->be, CAPA_UNDUMPUSER)) {
+	r = xfer_undumpuser(xfer);
+    } else {
+	r = xfer_localcreate(xfer);
+	if (!r) r = xfer_undump(xfer);
+    }
     /* note - we don't report errors if this one
      * fails! */
     if (!r) xfer_delete(xfer);
@@ -60,6 +60,7 @@
 #include "append.h"
 #include "assert.h"
 #include "charset.h"
+#include "dlist.h"
 #include "exitcodes.h"
 #include "hash.h"
 #include "imap/imap_err.h"
@@ -89,6 +90,7 @@
 static void index_refresh(struct index_state *state);
 static void index_tellexists(struct index_state *state);
 static int index_lock(struct index_state *state);
+static int index_lock_type(struct index_state *state, int locktype);
 static void index_unlock(struct index_state *state);
 // extern struct namespace imapd_namespace;
 
@@ -654,6 +656,131 @@ void index_select(struct index_state *state, struct index_init *init)
     }
 }
 
+/*
+ * Record what the client has been told about the mailbox, so that
+ * another process can carry on from here with index_restorestate().
+ */
+void index_savestate(struct index_state *state, struct dlist *kl)
+{
+    struct seqset *uids = seqset_init(0, SEQ_SPARSE);
+    modseq_t modseq = state->highestmodseq;
+    struct index_map *im;
+    uint32_t msgno;
+    char *s;
+
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	im = &state->map[msgno-1];
+	seqset_add(uids, im->record.uid, 1);
+	/* changes we haven't reported yet must be reported later */
+	if (im->told_modseq < im->record.modseq && im->told_modseq < modseq)
+	    modseq = im->told_modseq;
+    }
+
+    dlist_setatom(kl, "MBOXNAME", state->mailbox->name);
+    dlist_setnum32(kl, "UIDVALIDITY", state->mailbox->i.uidvalidity);
+    dlist_setnum64(kl, "MODSEQ", modseq);
+    dlist_setnum32(kl, "EXAMINE", state->examining);
+    s = seqset_cstring(uids);
+    if (s) dlist_setatom(kl, "UIDS", s);
+
+    free(s);
+    seqset_free(uids);
+}
+
+/*
+ * Bring the client saved by index_savestate() up to date with a freshly
+ * opened mailbox, reporting everything that changed in between.
+ */
+int index_restorestate(struct index_state *state, struct dlist *kl)
+{
+    struct seqset *uids = NULL;
+    struct seqset *vanishedlist;
+    struct index_map *im;
+    const char *s = NULL;
+    uint32_t uidvalidity = 0;
+    modseq_t modseq = 0;
+    uint32_t msgno = 1;
+    uint32_t known = 0;
+    unsigned uid;
+    int r;
+
+    if (!dlist_getnum32(kl, "UIDVALIDITY", &uidvalidity) ||
+	!dlist_getnum64(kl, "MODSEQ", &modseq))
+	return IMAP_PROTOCOL_ERROR;
+
+    /* it's not the mailbox they were looking at */
+    if (uidvalidity != state->mailbox->i.uidvalidity)
+	return IMAP_MAILBOX_NONEXISTENT;
+
+    r = index_lock(state);
+    if (r) return r;
+
+    if (dlist_getatom(kl, "UIDS", &s))
+	uids = seqset_parse(s, NULL, 0);
+    vanishedlist = seqset_init(0, SEQ_SPARSE);
+
+    /* walk the client's view alongside what is there now */
+    while ((uid = seqset_getnext(uids))) {
+	im = known < state->exists ? &state->map[known] : NULL;
+
+	if (im && im->record.uid == uid) {
+	    /* report anything that changed since */
+	    if (im->told_modseq > modseq)
+		im->told_modseq = modseq;
+	    known++;
+	    msgno++;
+	    continue;
+	}
+
+	if (im && im->record.uid < uid) {
+	    /* a message they never saw in the middle of ones they did */
+	    syslog(LOG_ERR, "IOERROR: %s: uid %u out of order",
+		   state->mailbox->name, im->record.uid);
+	    r = IMAP_IOERROR;
+	    goto done;
+	}
+
+	/* gone while nobody was looking */
+	if (state->qresync)
+	    seqset_add(vanishedlist, uid, 1);
+	else
+	    prot_printf(state->out, "* %u EXPUNGE\r\n", msgno);
+    }
+
+    if (vanishedlist->len) {
+	char *vanished = seqset_cstring(vanishedlist);
+	prot_printf(state->out, "* VANISHED %s\r\n", vanished);
+	free(vanished);
+    }
+
+    /* anything after the ones they knew about is new */
+    state->oldexists = known;
+    index_tellchanges(state, 1, 0, 0);
+
+ done:
+    seqset_free(vanishedlist);
+    seqset_free(uids);
+    index_unlock(state);
+
+    return r;
+}
+
+/*
+ * Has the mailbox changed since we last reported on it?
+ */
+int index_haschanged(struct index_state *state)
+{
+    int changed;
+
+    if (mailbox_lock_index(state->mailbox, LOCK_SHARED))
+	return 1;
+
+    changed = (state->highestmodseq != state->mailbox->i.highestmodseq);
+    mailbox_unlock_index(state->mailbox, NULL);
+
+    return changed;
+}
+
 /*
  * Check for and report updates
  */
@@ -985,6 +1112,7 @@ int index_store(struct index_state *state, char *sequence,
     uint32_t msgno;
     unsigned checkval;
     int userflag;
+    int locktype = LOCK_EXCLUSIVE;
     struct seqset *seq;
     struct index_map *im;
     const strarray_t *flags = &storeargs->flags;
@@ -998,17 +1126,39 @@ int index_store(struct index_state *state, char *sequence,
 	return IMAP_PERMISSION_DENIED;
     }
 
-    r = index_lock(state);
-    if (r) return r;
+    /* changing flags can go on alongside deliveries, unless it needs
+     * a new flag name, which takes the whole index */
+    if (storeargs->operation != STORE_ANNOTATION) {
+	locktype = LOCK_FLAGS;
+	for (i = 0; i < flags->count ; i++) {
+	    if (mailbox_user_flag(mailbox, flags->data[i], NULL, 0)) {
+		locktype = LOCK_EXCLUSIVE;
+		break;
+	    }
+	}
+    }
 
-    seq = _parse_sequence(state, sequence, storeargs->usinguid);
+retry:
+    r = index_lock_type(state, locktype);
+    if (r) return r;
 
     for (i = 0; i < flags->count ; i++) {
 	r = mailbox_user_flag(mailbox, flags->data[i], &userflag, 1);
-	if (r) goto out;
+	if (r == IMAP_MAILBOX_LOCKED && locktype == LOCK_FLAGS) {
+	    /* it went away before we locked */
+	    index_unlock(state);
+	    locktype = LOCK_EXCLUSIVE;
+	    goto retry;
+	}
+	if (r) {
+	    index_unlock(state);
+	    return r;
+	}
 	storeargs->user_flags[userflag/32] |= 1<<(userflag&31);
     }
 
+    seq = _parse_sequence(state, sequence, storeargs->usinguid);
+
     storeargs->update_time = time((time_t *)0);
 
     if (storeargs->operation == STORE_ANNOTATION) {
@@ -1386,7 +1536,12 @@ int index_getuidsequence(struct index_state *state,
 
 static int index_lock(struct index_state *state)
 {
-    int r = mailbox_lock_index(state->mailbox, LOCK_EXCLUSIVE);
+    return index_lock_type(state, LOCK_EXCLUSIVE);
+}
+
+static int index_lock_type(struct index_state *state, int locktype)
+{
+    int r = mailbox_lock_index(state->mailbox, locktype);
     if (r) return r;
 
     /* if highestmodseq has changed, read updates */
@@ -1411,8 +1566,10 @@ static void index_unlock(struct index_state *state)
 
     index_writeseen(state);
 
-    /* grab the latest modseq */
-    state->highestmodseq = state->mailbox->i.highestmodseq;
+    /* grab the latest modseq, unless someone may have appended
+     * alongside us, in which case we want to see it next time */
+    if (state->mailbox->index_locktype != LOCK_FLAGS)
+	state->highestmodseq = state->mailbox->i.highestmodseq;
 
     if (config_getswitch(IMAPOPT_STATUSCACHE)) {
 	struct statusdata sdata;
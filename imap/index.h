@@ -61,6 +61,7 @@
 #include <ctype.h>
 
 #include "annotate.h" /* for strlist functionality */
+#include "dlist.h"
 #include "message_guid.h"
 #include "sequence.h"
 #include "strarray.h"
@@ -236,6 +237,9 @@ extern void index_tellchanges(struct index_state *state, int canexpunge,
 extern unsigned index_getuid(struct index_state *state, uint32_t msgno);
 extern modseq_t index_highestmodseq(struct index_state *state);
 extern int index_check(struct index_state *state, int usinguid, int printuid);
+extern void index_savestate(struct index_state *state, struct dlist *kl);
+extern int index_restorestate(struct index_state *state, struct dlist *kl);
+extern int index_haschanged(struct index_state *state);
 extern int index_urlfetch(struct index_state *state, uint32_t msgno,
 			  unsigned params, const char *section,
 			  unsigned long start_octet, unsigned long octet_count,
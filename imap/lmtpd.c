@@ -281,6 +281,7 @@ int service_main(int argc, char **argv,
     }
 
     sync_log_init();
+    sync_log_defer();
 
     deliver_in = prot_new(0, 0);
     deliver_out = prot_new(1, 1);
@@ -328,6 +329,9 @@ int service_main(int argc, char **argv,
 	prot_printf(deliver_out, " %s\r\n", error_message(r));
     }
 
+    /* nothing from this session waits for the next one */
+    sync_log_checkpoint();
+
     /* free session state */
     if (deliver_in) prot_free(deliver_in);
     if (deliver_out) prot_free(deliver_out);
@@ -929,6 +933,8 @@ int deliver(message_data_t *msgdata, char *authuser,
     stage = NULL;
     if (notifyheader) free(notifyheader);
 
+    sync_log_checkpoint();
+
     return 0;
 }
 
@@ -122,6 +122,7 @@ static struct mailboxlist *open_mailboxes = NULL;
 static int mailbox_index_unlink(struct mailbox *mailbox);
 static int mailbox_index_repack(struct mailbox *mailbox);
 static int mailbox_read_index_header(struct mailbox *mailbox);
+bit32 mailbox_index_header_to_buf(struct index_header *i, unsigned char *buf);
 
 static struct mailboxlist *create_listitem(const char *name)
 {
@@ -576,10 +577,98 @@ fail:
 int mailbox_index_islocked(struct mailbox *mailbox, int write)
 {
     if (mailbox->index_locktype == LOCK_EXCLUSIVE) return 1;
+    if (mailbox->index_locktype == LOCK_FLAGS) return 1;
+    if (mailbox->index_locktype == LOCK_APPEND) return 1;
     if (mailbox->index_locktype == LOCK_SHARED && !write) return 1;
     return 0;
 }
 
+/*
+ * LOCK_FLAGS and LOCK_APPEND each lock a single byte of the index file
+ * rather than all of it, so a delivery can append new records while
+ * someone else changes flags on the existing ones.  Both take the
+ * header byte as well while they read or write the header, and a lock
+ * on the whole file, shared or exclusive, excludes all three.
+ */
+#define LOCKBYTE_HEADER 0
+#define LOCKBYTE_FLAGS 1
+#define LOCKBYTE_APPEND 2
+
+static int mailbox_index_issplit(struct mailbox *mailbox)
+{
+    return (mailbox->index_locktype == LOCK_FLAGS ||
+	    mailbox->index_locktype == LOCK_APPEND);
+}
+
+/* read the index header as it is on disk, not as we have it mapped */
+static int mailbox_read_disk_header(struct mailbox *mailbox,
+				    struct index_header *i)
+{
+    char buf[INDEX_HEADER_SIZE];
+    int n;
+
+    n = pread(mailbox->index_fd, buf, INDEX_HEADER_SIZE, 0);
+    if (n != INDEX_HEADER_SIZE) {
+	syslog(LOG_ERR, "IOERROR: reading index header for %s: %m",
+	       mailbox->name);
+	return IMAP_IOERROR;
+    }
+
+    return mailbox_buf_to_index_header(buf, i);
+}
+
+/*
+ * Merge the changes we've made to the header since 'base' into 'disk',
+ * which may include changes made meanwhile under the other split lock.
+ * Counts move by our difference, things which only grow take the
+ * larger, and anything else we changed is ours.
+ */
+#define MERGE_DELTA(f) disk->f += ours->f - base->f
+#define MERGE_MAX(f) if (ours->f > disk->f) disk->f = ours->f
+#define MERGE_OURS(f) if (ours->f != base->f) disk->f = ours->f
+
+static void mailbox_merge_header(struct index_header *disk,
+				 const struct index_header *base,
+				 const struct index_header *ours)
+{
+    bit32 changed;
+
+    MERGE_DELTA(quota_mailbox_used);
+    MERGE_DELTA(quota_annot_used);
+    MERGE_DELTA(deleted);
+    MERGE_DELTA(answered);
+    MERGE_DELTA(flagged);
+    MERGE_DELTA(exists);
+    MERGE_DELTA(leaked_cache_records);
+
+    MERGE_MAX(num_records);
+    MERGE_MAX(last_uid);
+    MERGE_MAX(highestmodseq);
+    MERGE_MAX(deletedmodseq);
+
+    if (ours->first_expunged != base->first_expunged &&
+	(!disk->first_expunged || ours->first_expunged < disk->first_expunged))
+	disk->first_expunged = ours->first_expunged;
+
+    /* just the option bits we changed */
+    changed = ours->options ^ base->options;
+    disk->options = (disk->options & ~changed) | (ours->options & changed);
+
+    MERGE_OURS(generation_no);
+    MERGE_OURS(last_appenddate);
+    MERGE_OURS(pop3_last_login);
+    MERGE_OURS(uidvalidity);
+    MERGE_OURS(last_repack_time);
+    MERGE_OURS(header_file_crc);
+    MERGE_OURS(recentuid);
+    MERGE_OURS(recenttime);
+    MERGE_OURS(pop3_show_after);
+}
+
+#undef MERGE_DELTA
+#undef MERGE_MAX
+#undef MERGE_OURS
+
 /* return the offset for the start of the record! */
 int mailbox_append_cache(struct mailbox *mailbox,
 			 struct index_record *record)
@@ -596,6 +685,9 @@ int mailbox_append_cache(struct mailbox *mailbox,
     if (record->cache_offset)
 	return 0;
 
+    /* only appenders may extend the cache */
+    assert(mailbox->index_locktype != LOCK_FLAGS);
+
     /* ensure we have a cache fd */
     r = mailbox_ensure_cache(mailbox, 0);
     if (r) {
@@ -775,6 +867,8 @@ static void mailbox_make_uniqueid(struct mailbox *mailbox)
  * Maps in the content for the message with UID 'uid' in 'mailbox'.
  * Returns map in 'basep' and 'lenp'
  */
+unsigned long mailbox_messages_mapped = 0;
+
 int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
 			const char **basep, size_t *lenp)
 {
@@ -795,6 +889,7 @@ int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
     *lenp = 0;
     map_refresh(msgfd, 1, basep, lenp, sbuf.st_size, fname, mailbox->name);
     close(msgfd);
+    mailbox_messages_mapped++;
 
     return 0;
 }
@@ -984,6 +1079,20 @@ int mailbox_open_iwl(const char *name, struct mailbox **mailboxptr)
 				 mailboxptr);
 }
 
+/* just to change flags on existing messages, alongside appends */
+int mailbox_open_ifl(const char *name, struct mailbox **mailboxptr)
+{
+    return mailbox_open_advanced(name, LOCK_SHARED, LOCK_FLAGS,
+				 mailboxptr);
+}
+
+/* just to append new messages, alongside flag changes */
+int mailbox_open_ial(const char *name, struct mailbox **mailboxptr)
+{
+    return mailbox_open_advanced(name, LOCK_SHARED, LOCK_APPEND,
+				 mailboxptr);
+}
+
 int mailbox_open_exclusive(const char *name, struct mailbox **mailboxptr)
 {
     return mailbox_open_advanced(name, LOCK_EXCLUSIVE, LOCK_EXCLUSIVE,
@@ -996,6 +1105,47 @@ void mailbox_index_dirty(struct mailbox *mailbox)
     mailbox->i.dirty = 1;
 }
 
+/*
+ * Under LOCK_FLAGS or LOCK_APPEND the other lock's holder may also be
+ * handing out modseqs, so take ours from the header on disk and write
+ * it straight back, so no two changes get the same one.
+ */
+static void mailbox_reserve_modseq(struct mailbox *mailbox)
+{
+    unsigned char buf[INDEX_HEADER_SIZE];
+    struct index_header disk;
+    modseq_t modseq = mailbox->i.highestmodseq;
+    int r;
+
+    r = lock_range(mailbox->index_fd, LOCKBYTE_HEADER, 1, 1);
+    if (r) {
+	syslog(LOG_ERR, "IOERROR: locking index header for %s: %m",
+	       mailbox->name);
+	r = IMAP_IOERROR;
+    }
+    else {
+	r = mailbox_read_disk_header(mailbox, &disk);
+	if (!r) {
+	    if (disk.highestmodseq > modseq)
+		modseq = disk.highestmodseq;
+	    disk.highestmodseq = modseq + 1;
+	    mailbox_index_header_to_buf(&disk, buf);
+	    if (pwrite(mailbox->index_fd, buf, INDEX_HEADER_SIZE, 0) !=
+		INDEX_HEADER_SIZE) {
+		syslog(LOG_ERR, "IOERROR: writing index header for %s: %m",
+		       mailbox->name);
+		r = IMAP_IOERROR;
+	    }
+	}
+	lock_range_unlock(mailbox->index_fd, LOCKBYTE_HEADER, 1);
+    }
+
+    /* the commit will still merge, so just carry on from ours */
+    if (r) modseq = mailbox->i.highestmodseq;
+
+    mailbox->i.highestmodseq = modseq + 1;
+}
+
 void mailbox_modseq_dirty(struct mailbox *mailbox)
 {
     assert(mailbox_index_islocked(mailbox, 1));
@@ -1003,7 +1153,10 @@ void mailbox_modseq_dirty(struct mailbox *mailbox)
     if (mailbox->modseq_dirty)
 	return;
 
-    mailbox->i.highestmodseq++;
+    if (mailbox_index_issplit(mailbox))
+	mailbox_reserve_modseq(mailbox);
+    else
+	mailbox->i.highestmodseq++;
     mailbox->last_updated = time(0);
     mailbox->modseq_dirty = 1;
     mailbox_index_dirty(mailbox);
@@ -1331,8 +1484,10 @@ int mailbox_user_flag(struct mailbox *mailbox, const char *flag,
 	if (emptyflag == -1) 
 	    return IMAP_USERFLAG_EXHAUSTED;
 
-	/* need to be index locked to make flag changes */
-	if (!mailbox_index_islocked(mailbox, 1))
+	/* need to be index locked to make flag changes, and not
+	 * just for changing flags on the records */
+	if (!mailbox_index_islocked(mailbox, 1) ||
+	    mailbox->index_locktype == LOCK_FLAGS)
 	    return IMAP_MAILBOX_LOCKED;
 
 	/* set the flag and mark the header dirty */
@@ -1611,6 +1766,11 @@ int mailbox_lock_index(struct mailbox *mailbox, int locktype)
     assert(mailbox->index_fd != -1);
     assert(!mailbox->index_locktype);
 
+    /* flock() can't lock part of a file, so they get all of it */
+    if ((locktype == LOCK_FLAGS || locktype == LOCK_APPEND) &&
+	!lock_can_range)
+	locktype = LOCK_EXCLUSIVE;
+
 restart:
 
     if (locktype == LOCK_EXCLUSIVE) {
@@ -1624,6 +1784,17 @@ restart:
     else if (locktype == LOCK_SHARED) {
 	r = lock_shared(mailbox->index_fd);
     }
+    else if (locktype == LOCK_FLAGS || locktype == LOCK_APPEND) {
+	if (mailbox->is_readonly) {
+	    mailbox->is_readonly = 0;
+	    r = mailbox_open_index(mailbox);
+	}
+	if (!r) r = lock_range(mailbox->index_fd,
+			       locktype == LOCK_FLAGS ?
+			       LOCKBYTE_FLAGS : LOCKBYTE_APPEND, 1, 1);
+	/* and the header, while we read it */
+	if (!r) r = lock_range(mailbox->index_fd, LOCKBYTE_HEADER, 1, 0);
+    }
     else {
 	fatal("invalid locktype for index", EC_SOFTWARE);
     }
@@ -1647,6 +1818,7 @@ restart:
 
     mailbox->index_locktype = locktype;
     gettimeofday(&mailbox->starttime, 0);
+    lock_held("index", mailbox->name);
 
     fname = mailbox_meta_fname(mailbox, META_HEADER);
     r = stat(fname, &sbuf);
@@ -1753,6 +1925,12 @@ restart:
 	}
     }
 
+    /* remember where we started, for merging at commit */
+    if (mailbox_index_issplit(mailbox)) {
+	mailbox->locked_i = mailbox->i;
+	lock_range_unlock(mailbox->index_fd, LOCKBYTE_HEADER, 1);
+    }
+
     return 0;
 }
 
@@ -1765,6 +1943,11 @@ void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *sdata)
     double timediff;
     int r;
 
+    /* under a split lock our counts may not include the other's
+     * changes, so don't cache them */
+    if (mailbox_index_issplit(mailbox))
+	sdata = NULL;
+
     /* naughty - you can't unlock a dirty mailbox! */
     r = mailbox_commit(mailbox);
     if (r) {
@@ -1790,6 +1973,7 @@ void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *sdata)
 	    syslog(LOG_ERR, "IOERROR: unlocking index of %s: %m", 
 		mailbox->name);
 	mailbox->index_locktype = 0;
+	lock_released("index", mailbox->name);
     }
     gettimeofday(&endtime, 0);
     timediff = timesub(&mailbox->starttime, &endtime);
@@ -1979,36 +2163,61 @@ int mailbox_commit(struct mailbox *mailbox)
 {
     /* XXX - ibuf for alignment? */
     static unsigned char buf[INDEX_HEADER_SIZE];
+    struct index_header disk;
+    int split = 0;
     int n, r;
 
+    /* under a split lock, hold the header while both it and
+     * cyrus.header change, so nobody sees one without the other */
+    if (mailbox_index_issplit(mailbox) &&
+	(mailbox->i.dirty || mailbox->header_dirty)) {
+	/* only appenders add flag names */
+	assert(!mailbox->header_dirty ||
+	       mailbox->index_locktype == LOCK_APPEND);
+	if (lock_range(mailbox->index_fd, LOCKBYTE_HEADER, 1, 1)) {
+	    syslog(LOG_ERR, "IOERROR: locking index header for %s: %m",
+		   mailbox->name);
+	    return IMAP_IOERROR;
+	}
+	split = 1;
+    }
+
     /* try to commit sub parts first */
     r = mailbox_commit_cache(mailbox);
-    if (r) return r;
-
-    r = mailbox_commit_quota(mailbox);
-    if (r) return r;
-
-    r = mailbox_commit_header(mailbox);
-    if (r) return r;
-
-    if (!mailbox->i.dirty)
-	return 0;
+    if (!r) r = mailbox_commit_quota(mailbox);
+    if (!r) r = mailbox_commit_header(mailbox);
+    if (r || !mailbox->i.dirty)
+	goto done;
 
     assert(mailbox_index_islocked(mailbox, 1));
 
     if (mailbox->i.start_offset < INDEX_HEADER_SIZE)
 	fatal("Mailbox offset bug", EC_SOFTWARE);
 
-    mailbox_index_header_to_buf(&mailbox->i, buf);
+    if (split) {
+	/* fold our changes into what's there now */
+	r = mailbox_read_disk_header(mailbox, &disk);
+	if (r) goto done;
+	mailbox_merge_header(&disk, &mailbox->locked_i, &mailbox->i);
+	mailbox_index_header_to_buf(&disk, buf);
+    }
+    else
+	mailbox_index_header_to_buf(&mailbox->i, buf);
 
     lseek(mailbox->index_fd, 0, SEEK_SET);
     n = retry_write(mailbox->index_fd, buf, INDEX_HEADER_SIZE);
     if ((unsigned long)n != INDEX_HEADER_SIZE || fsync(mailbox->index_fd)) {
 	syslog(LOG_ERR, "IOERROR: writing index header for %s: %m",
 	       mailbox->name);
-	return IMAP_IOERROR;
+	r = IMAP_IOERROR;
+	goto done;
     }
 
+    /* we keep our own view until we next lock; the records the
+     * other added aren't mapped, so we mustn't claim them */
+    if (split)
+	mailbox->locked_i = mailbox->i;
+
     /* remove all dirty flags! */
     mailbox->i.dirty = 0;
     mailbox->modseq_dirty = 0;
@@ -2017,7 +2226,11 @@ int mailbox_commit(struct mailbox *mailbox)
     /* label changes for later logging */
     mailbox->has_changed = 1;
 
-    return 0;
+done:
+    if (split)
+	lock_range_unlock(mailbox->index_fd, LOCKBYTE_HEADER, 1);
+
+    return r;
 }
 
 /*
@@ -2871,6 +3084,7 @@ int mailbox_create(const char *name,
 	goto done;
     }
     mailbox->index_locktype = LOCK_EXCLUSIVE;
+    lock_held("index", mailbox->name);
 
     fname = mailbox_meta_fname(mailbox, META_CACHE);
     if (!fname) {
@@ -93,6 +93,10 @@ enum meta_filename {
 #define LOCK_SHARED 1
 #define LOCK_EXCLUSIVE 2
 #define LOCK_NONBLOCKING 3
+/* index only: write locks for changing the flags of existing records,
+ * and for appending new ones, which don't exclude each other */
+#define LOCK_FLAGS 4
+#define LOCK_APPEND 5
 
 #define NUM_CACHE_FIELDS 10
 
@@ -195,7 +199,7 @@ struct mailbox {
     struct buf cache_buf;
     size_t cache_len;	/* mapped size */
 
-    int index_locktype; /* 0 = none, 1 = shared, 2 = exclusive */
+    int index_locktype; /* 0 = none, or one of the LOCK_* values */
     int is_readonly; /* true = open index and cache files readonly */
 
     ino_t header_file_ino;
@@ -212,6 +216,8 @@ struct mailbox {
     char *acl;
 
     struct index_header i;
+    struct index_header locked_i; /* as of the last commit, under a
+				   * LOCK_FLAGS or LOCK_APPEND lock */
 
     /* Information in header */
     char *uniqueid;
@@ -416,6 +422,7 @@ extern char *mailbox_message_fname(struct mailbox *mailbox,
 extern char *mailbox_datapath(struct mailbox *mailbox);
 
 /* map individual messages in */
+extern unsigned long mailbox_messages_mapped;	/* by this process, ever */
 extern int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
 				  const char **basep, size_t *lenp);
 extern void mailbox_unmap_message(struct mailbox *mailbox,
@@ -442,6 +449,10 @@ extern int mailbox_open_iwl(const char *name,
 			    struct mailbox **mailboxptr);
 extern int mailbox_open_irl(const char *name,
 			    struct mailbox **mailboxptr);
+extern int mailbox_open_ifl(const char *name,
+			    struct mailbox **mailboxptr);
+extern int mailbox_open_ial(const char *name,
+			    struct mailbox **mailboxptr);
 extern int mailbox_open_exclusive(const char *name,
 			          struct mailbox **mailboxptr);
 extern void mailbox_ref(struct mailbox *mailbox);
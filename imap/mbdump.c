@@ -471,17 +471,21 @@ static struct data_file data_files[] = {
 enum { SEEN_DB = 0, SUBS_DB = 1, MBOXKEY_DB = 2 };
 static int NUM_USER_DATA_FILES = 3;
 
-int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid_start,
-		 int oldversion,
-		 struct protstream *pin, struct protstream *pout,
-		 struct auth_state *auth_state __attribute((unused)))
+/* send the parenthesised list making up the dump of a mailbox.  If
+ * it's one of many in an UNDUMPUSER stream, every literal is
+ * non-synchronizing, nothing is read from pin, there's no line ending,
+ * and the list is sent even if the mailbox can't be read so that the
+ * rest of the stream stays parseable */
+static int dump_list(const char *tag, struct mailbox *mailbox,
+		     uint32_t uid_start, int oldversion, int stream,
+		     struct protstream *pin, struct protstream *pout)
 {
     DIR *mbdir = NULL;
     int r = 0;
     struct dirent *next = NULL;
     char filename[MAX_MAILBOX_PATH + 1024];
     const char *fname;
-    int first = 1;
+    int first = !stream;
     int i;
     struct quota q;
     struct data_file *df;
@@ -491,10 +495,12 @@ int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid_start,
     if (!mbdir && errno == EACCES) {
 	syslog(LOG_ERR,
 	       "could not dump mailbox %s (permission denied)", mailbox->name);
+	if (stream) prot_printf(pout, "(NIL)");
 	return IMAP_PERMISSION_DENIED;
     } else if (!mbdir) {
 	syslog(LOG_ERR,
 	       "could not dump mailbox %s (unknown error)", mailbox->name);
+	if (stream) prot_printf(pout, "(NIL)");
 	return IMAP_SYS_ERROR;
     }
 
@@ -721,9 +727,13 @@ int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid_start,
 
  done:
 
-    prot_printf(pout,")\r\n");
-
-    prot_flush(pout);
+    if (stream) {
+	prot_putc(')', pout);
+    }
+    else {
+	prot_printf(pout,")\r\n");
+	prot_flush(pout);
+    }
 
     if (mbdir) closedir(mbdir);
     seqset_free(expunged_seq);
@@ -731,6 +741,19 @@ int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid_start,
     return r;
 }
 
+int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid_start,
+		 int oldversion,
+		 struct protstream *pin, struct protstream *pout,
+		 struct auth_state *auth_state __attribute((unused)))
+{
+    return dump_list(tag, mailbox, uid_start, oldversion, 0, pin, pout);
+}
+
+int dump_mailbox_stream(struct mailbox *mailbox, struct protstream *pout)
+{
+    return dump_list(NULL, mailbox, 0, MAILBOX_MINOR_VERSION, 1, NULL, pout);
+}
+
 static int cleanup_seen_cb(char *name,
 			   int matchlen __attribute__((unused)),
 			   int maycreate __attribute__((unused)),
@@ -802,9 +825,42 @@ static int cleanup_seen_subfolders(const char *mbname)
     return 0;
 }
 
-int undump_mailbox(const char *mbname, 
-		   struct protstream *pin, struct protstream *pout,
-		   struct auth_state *auth_state __attribute((unused)))
+/* copy size bytes of a literal from pin to fd, in large writes */
+static int undump_data(struct protstream *pin, int fd, const char *fname,
+		       unsigned long size)
+{
+    static char buf[65536];
+
+    while (size) {
+	size_t len = 0;
+
+	/* fill the buffer before writing it out */
+	while (len < sizeof(buf) && size) {
+	    int n = prot_read(pin, buf + len,
+			      size > sizeof(buf) - len ? sizeof(buf) - len : size);
+	    if (!n) {
+		syslog(LOG_ERR,
+		       "IOERROR: reading message: unexpected end of file");
+		return IMAP_IOERROR;
+	    }
+	    len += n;
+	    size -= n;
+	}
+
+	if (retry_write(fd, buf, len) != (int)len) {
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+	    return IMAP_IOERROR;
+	}
+    }
+
+    return 0;
+}
+
+/* read the parenthesised list making up the dump of a mailbox into
+ * mbname, leaving the last character read in *cp */
+static int undump_list(const char *mbname,
+		       struct protstream *pin, struct protstream *pout,
+		       int *cp)
 {
     struct buf file, data;
     char c;
@@ -839,7 +895,7 @@ int undump_mailbox(const char *mbname,
     /* we better be in a list now */
     if (c != '(' || data.s[0]) {
 	buf_free(&data);
-	eatline(pin, c);
+	*cp = c;
 	return IMAP_PROTOCOL_BAD_PARAMETERS;
     }
     
@@ -858,13 +914,13 @@ int undump_mailbox(const char *mbname,
     } else {
 	/* Huh? */
 	buf_free(&data);
-	eatline(pin, c);
+	*cp = c;
 	return IMAP_PROTOCOL_BAD_PARAMETERS;
     }
 
     if(c != ' ' && c != ')') {
 	buf_free(&data);
-	eatline(pin, c);
+	*cp = c;
 	return IMAP_PROTOCOL_BAD_PARAMETERS;
     } else if(c == ')') {
 	goto done;
@@ -1147,26 +1203,11 @@ int undump_mailbox(const char *mbname,
 	}
 
 	/* write data to file */
-	while (size) {
-	    char buf[4096+1];
-	    int n = prot_read(pin, buf, size > 4096 ? 4096 : size);
-	    if (!n) {
-		syslog(LOG_ERR,
-		       "IOERROR: reading message: unexpected end of file");
-		r = IMAP_IOERROR;
-		goto done;
-	    }
-
-	    size -= n;
-
-	    if (write(curfile, buf, n) != n) {
-		syslog(LOG_ERR, "IOERROR: writing %s: %m", fnamebuf);
-		r = IMAP_IOERROR;
-		goto done;
-	    }
-	}
+	r = undump_data(pin, curfile, fnamebuf, size);
+	if (r) goto done;
 
 	close(curfile);
+	curfile = -1;
 
 	/* we were operating on the seen state, so merge it and cleanup */
 	if (seen_file) {
@@ -1205,8 +1246,7 @@ int undump_mailbox(const char *mbname,
     }
 
  done:
-    /* eat the rest of the line, we have atleast a \r\n coming */
-    eatline(pin, c);
+    *cp = c;
     buf_free(&file);
     buf_free(&data);
 
@@ -1289,3 +1329,28 @@ int undump_mailbox(const char *mbname,
 
     return r;
 }
+
+int undump_mailbox(const char *mbname, 
+		   struct protstream *pin, struct protstream *pout,
+		   struct auth_state *auth_state __attribute((unused)))
+{
+    int c;
+    int r = undump_list(mbname, pin, pout, &c);
+
+    /* eat the rest of the line, we have atleast a \r\n coming */
+    eatline(pin, c);
+
+    return r;
+}
+
+int undump_mailbox_stream(const char *mbname,
+			  struct protstream *pin, struct protstream *pout)
+{
+    int c;
+    int r = undump_list(mbname, pin, pout, &c);
+
+    /* nothing more of the stream is any use */
+    if (r) eatline(pin, c);
+
+    return r;
+}
@@ -67,4 +67,14 @@ extern int undump_mailbox(const char *mbname,
 			  struct protstream *pin, struct protstream *pout,
 			  struct auth_state *auth_state);
 
+/* the same for one of the mailboxes in an UNDUMPUSER stream, where
+ * every literal is non-synchronizing and the dumps follow each other on
+ * one line.  undump_mailbox_stream() only consumes the rest of the line
+ * if it fails */
+extern int dump_mailbox_stream(struct mailbox *mailbox,
+			       struct protstream *pout);
+extern int undump_mailbox_stream(const char *mbname,
+				 struct protstream *pin,
+				 struct protstream *pout);
+
 #endif
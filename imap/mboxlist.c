@@ -68,6 +68,7 @@
 #include "assert.h"
 #include "global.h"
 #include "cyrusdb.h"
+#include "hash.h"
 #include "util.h"
 #include "mailbox.h"
 #include "exitcodes.h"
@@ -93,8 +94,43 @@ struct db *mbdb;
 
 static int mboxlist_dbopen = 0;
 
-static int mboxlist_opensubs(const char *userid, struct db **ret);
-static void mboxlist_closesubs(struct db *sub);
+/* The mailbox list may be split over several databases (see the
+ * mboxlist_shards option).  mbdb is always shard 0. */
+static struct db **mbdb_shards = &mbdb;
+static int mbdb_nshards = 1;
+static int mbdb_shard_by = IMAP_ENUM_MBOXLIST_SHARD_BY_DOMAIN;
+
+/* A transaction only ever covers one shard, so remember which one
+ * each open transaction belongs to */
+struct mbdb_txn {
+    struct txn *tid;
+    struct db *db;
+    struct mbdb_txn *next;
+};
+static struct mbdb_txn *mbdb_txns = NULL;
+
+/* Recently looked up entries, most recent first (see the
+ * mboxlist_cachesize option).  Each one remembers the generation of
+ * its shard when it was read, and is only used while that hasn't
+ * changed, so the cache never hands out anything stale. */
+struct mbcache_entry {
+    char *name;
+    struct mboxlist_entry *mbentry;	/* NULL if it doesn't exist */
+    size_t alloclen;			/* size of mbentry->_alloc */
+    uint64_t gen;
+    struct mbcache_entry *prev;
+    struct mbcache_entry *next;
+};
+
+static struct {
+    hash_table table;
+    struct mbcache_entry *head;
+    struct mbcache_entry *tail;
+    int count;
+    int max;
+    struct mboxlist_cache_stats stats;
+} mbcache;
+
 
 static int mboxlist_rmquota(const char *name, int matchlen, int maycreate,
 			    void *rock);
@@ -169,6 +205,427 @@ char *mboxlist_entry_cstring(struct mboxlist_entry *mbentry)
     return ret;
 }
 
+/*
+ * Return the length of the leading part of 'name' which decides its
+ * shard: the domain, or for "mboxlist_shard_by: user" the domain and
+ * the top level of the hierarchy ("user.fred", "shared").  If 'name'
+ * is only a prefix, returns -1 when the prefix could still match
+ * mailboxes in more than one shard.
+ */
+static int mbdb_shard_keylen(const char *name, size_t len, int isprefix)
+{
+    const char *end = name + len;
+    const char *dom = memchr(name, '!', len);
+    const char *top, *p;
+
+    /* without a domain, a prefix could also be the start of one */
+    if (isprefix && !dom && config_virtdomains) return -1;
+
+    if (mbdb_shard_by == IMAP_ENUM_MBOXLIST_SHARD_BY_DOMAIN)
+	return dom ? dom - name : 0;
+
+    top = dom ? dom + 1 : name;
+    if (end - top >= 5 && !strncmp(top, "user.", 5)) top += 5;
+
+    p = memchr(top, '.', end - top);
+    if (p) return p - name;
+
+    return isprefix ? -1 : (int) len;
+}
+
+/* index of the shard holding 'name', or -1 if 'name' is a prefix
+ * which spans shards */
+static int mbdb_shard(const char *name, size_t len, int isprefix)
+{
+    unsigned hash = 2166136261U;
+    int i, keylen;
+
+    if (mbdb_nshards <= 1) return 0;
+
+    keylen = mbdb_shard_keylen(name, len, isprefix);
+    if (keylen < 0) return -1;
+
+    /* FNV-1a.  Never change this, it decides which file each
+     * existing mailbox lives in */
+    for (i = 0; i < keylen; i++) {
+	hash ^= (unsigned char) name[i];
+	hash *= 16777619U;
+    }
+
+    return hash % mbdb_nshards;
+}
+
+static struct db *mbdb_for(const char *name)
+{
+    return mbdb_shards[mbdb_shard(name, strlen(name), 0)];
+}
+
+static struct mbdb_txn **mbdb_txn_find(struct txn *tid)
+{
+    struct mbdb_txn **tp;
+
+    for (tp = &mbdb_txns; *tp; tp = &(*tp)->next) {
+	if ((*tp)->tid == tid) break;
+    }
+
+    return tp;
+}
+
+static void mbdb_txn_forget(struct txn *tid)
+{
+    struct mbdb_txn **tp = mbdb_txn_find(tid);
+    struct mbdb_txn *t = *tp;
+
+    if (t) {
+	*tp = t->next;
+	free(t);
+    }
+}
+
+/* the database 'tid' was started on */
+static struct db *mbdb_txn_db(struct txn *tid)
+{
+    struct mbdb_txn *t;
+
+    if (mbdb_nshards <= 1) return mbdb;
+
+    t = *mbdb_txn_find(tid);
+
+    return t ? t->db : mbdb;
+}
+
+/*
+ * Pick the database for an operation on 'name' within '*tid'.  If the
+ * transaction is open on a different shard, the work done so far is
+ * committed and a new transaction is started on the right one, so
+ * callers touching several mailboxes should order their writes so
+ * that stopping between shards leaves nothing lost.
+ */
+static int mbdb_begin(const char *name, struct txn **tid, struct db **dbp)
+{
+    struct db *owner;
+    int r = 0;
+
+    *dbp = mbdb_for(name);
+
+    if (mbdb_nshards <= 1 || !tid || !*tid) return 0;
+
+    owner = mbdb_txn_db(*tid);
+    if (owner == *dbp) return 0;
+
+    r = cyrusdb_commit(owner, *tid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: committing mailboxes shard before %s: %s",
+	       name, cyrusdb_strerror(r));
+    }
+    mbdb_txn_forget(*tid);
+    *tid = NULL;
+
+    return r;
+}
+
+static void mbdb_end(struct db *db, struct txn **tid)
+{
+    struct mbdb_txn *t;
+
+    if (mbdb_nshards <= 1 || !tid || !*tid) return;
+
+    t = *mbdb_txn_find(*tid);
+    if (!t) {
+	t = xzmalloc(sizeof(struct mbdb_txn));
+	t->tid = *tid;
+	t->next = mbdb_txns;
+	mbdb_txns = t;
+    }
+    t->db = db;
+}
+
+static void mbcache_unlink(struct mbcache_entry *ce)
+{
+    if (ce->prev) ce->prev->next = ce->next;
+    else mbcache.head = ce->next;
+    if (ce->next) ce->next->prev = ce->prev;
+    else mbcache.tail = ce->prev;
+    ce->prev = ce->next = NULL;
+}
+
+static void mbcache_push(struct mbcache_entry *ce)
+{
+    ce->next = mbcache.head;
+    if (mbcache.head) mbcache.head->prev = ce;
+    else mbcache.tail = ce;
+    mbcache.head = ce;
+}
+
+static void mbcache_free(struct mbcache_entry *ce)
+{
+    mboxlist_entry_free(&ce->mbentry);
+    free(ce->name);
+    free(ce);
+}
+
+static void mbcache_forget(const char *name)
+{
+    struct mbcache_entry *ce;
+
+    if (!mbcache.max) return;
+
+    ce = hash_del(name, &mbcache.table);
+    if (!ce) return;
+
+    mbcache_unlink(ce);
+    mbcache_free(ce);
+    mbcache.count--;
+}
+
+static void mbcache_flush(void)
+{
+    struct mbcache_entry *ce;
+
+    if (!mbcache.max) return;
+
+    while ((ce = mbcache.head)) {
+	mbcache_unlink(ce);
+	mbcache_free(ce);
+    }
+    free_hash_table(&mbcache.table, NULL);
+    mbcache.count = 0;
+    mbcache.max = 0;
+}
+
+/* a private copy of a cached entry for the caller to free */
+static struct mboxlist_entry *mbcache_copy(const struct mbcache_entry *ce)
+{
+    const struct mboxlist_entry *src = ce->mbentry;
+    struct mboxlist_entry *mbentry = mboxlist_entry_create();
+    char *p;
+
+    /* everything points into _alloc, so move it over wholesale */
+    mbentry->_alloc = p = xmalloc(ce->alloclen);
+    memcpy(p, src->_alloc, ce->alloclen);
+
+#define MBCACHE_REBASE(f) \
+    mbentry->f = src->f ? p + (src->f - src->_alloc) : NULL
+    MBCACHE_REBASE(name);
+    MBCACHE_REBASE(partition);
+    MBCACHE_REBASE(server);
+    MBCACHE_REBASE(acl);
+    MBCACHE_REBASE(specialuse);
+    MBCACHE_REBASE(uniqueid);
+#undef MBCACHE_REBASE
+
+    mbentry->mbtype = src->mbtype;
+
+    return mbentry;
+}
+
+/* the cached entry for 'name' if it is still good for 'gen' */
+static struct mbcache_entry *mbcache_find(const char *name, uint64_t gen)
+{
+    struct mbcache_entry *ce = hash_lookup(name, &mbcache.table);
+
+    if (!ce) {
+	mbcache.stats.misses++;
+	return NULL;
+    }
+
+    if (ce->gen != gen) {
+	mbcache.stats.stale++;
+	mbcache_forget(name);
+	return NULL;
+    }
+
+    mbcache.stats.hits++;
+    mbcache_unlink(ce);
+    mbcache_push(ce);
+
+    return ce;
+}
+
+/* takes over 'mbentry', whose _alloc is 'alloclen' bytes */
+static struct mbcache_entry *mbcache_insert(const char *name, uint64_t gen,
+					    struct mboxlist_entry *mbentry,
+					    size_t alloclen)
+{
+    struct mbcache_entry *ce;
+
+    mbcache_forget(name);
+
+    if (mbcache.count >= mbcache.max) {
+	mbcache.stats.evictions++;
+	mbcache_forget(mbcache.tail->name);
+    }
+
+    ce = xzmalloc(sizeof(struct mbcache_entry));
+    ce->name = xstrdup(name);
+    ce->mbentry = mbentry;
+    ce->alloclen = alloclen;
+    ce->gen = gen;
+
+    hash_insert(name, ce, &mbcache.table);
+    mbcache_push(ce);
+    mbcache.count++;
+
+    return ce;
+}
+
+void mboxlist_cache_stats(struct mboxlist_cache_stats *stats)
+{
+    *stats = mbcache.stats;
+}
+
+static int mbdb_fetch(const char *name, size_t namelen,
+		      const char **data, size_t *datalen,
+		      struct txn **tid, int wrlock)
+{
+    struct db *db;
+    int r;
+
+    r = mbdb_begin(name, tid, &db);
+    if (r) return r;
+
+    if (wrlock)
+	r = cyrusdb_fetchlock(db, name, namelen, data, datalen, tid);
+    else
+	r = cyrusdb_fetch(db, name, namelen, data, datalen, tid);
+
+    mbdb_end(db, tid);
+
+    return r;
+}
+
+static int mbdb_store(const char *name, const char *data, size_t datalen,
+		      struct txn **tid)
+{
+    struct db *db;
+    int r;
+
+    r = mbdb_begin(name, tid, &db);
+    if (r) return r;
+
+    r = cyrusdb_store(db, name, strlen(name), data, datalen, tid);
+
+    mbdb_end(db, tid);
+    mbcache_forget(name);
+
+    return r;
+}
+
+static int mbdb_delete(const char *name, struct txn **tid, int force)
+{
+    struct db *db;
+    int r;
+
+    r = mbdb_begin(name, tid, &db);
+    if (r) return r;
+
+    r = cyrusdb_delete(db, name, strlen(name), tid, force);
+
+    mbdb_end(db, tid);
+    mbcache_forget(name);
+
+    return r;
+}
+
+static int mbdb_commit(struct txn *tid)
+{
+    struct db *db = mbdb_txn_db(tid);
+
+    mbdb_txn_forget(tid);
+
+    return cyrusdb_commit(db, tid);
+}
+
+static int mbdb_abort(struct txn *tid)
+{
+    struct db *db = mbdb_txn_db(tid);
+
+    mbdb_txn_forget(tid);
+
+    return cyrusdb_abort(db, tid);
+}
+
+/*
+ * Walk every record starting with 'prefix' in key order.  When the
+ * prefix spans shards, snapshots of each shard are merged, otherwise
+ * this is a plain foreach (or snapshot walk) of the one shard.
+ */
+static int mbdb_foreach(const char *prefix, size_t prefixlen,
+			foreach_p *p, foreach_cb *cb, void *rock,
+			int snapshot)
+{
+    struct dbsnapshot **snaps;
+    const char **key, **data;
+    size_t *keylen, *datalen;
+    int i, best, r = 0, cb_r = 0;
+    int shard = mbdb_shard(prefix, prefixlen, 1);
+
+    if (shard >= 0) {
+	struct db *db = mbdb_shards[shard];
+
+	if (snapshot)
+	    return cyrusdb_snapshot_foreach(db, prefix, prefixlen,
+					    p, cb, rock);
+
+	return cyrusdb_foreach(db, prefix, prefixlen, p, cb, rock, NULL);
+    }
+
+    snaps = xzmalloc(mbdb_nshards * sizeof(struct dbsnapshot *));
+    key = xzmalloc(mbdb_nshards * sizeof(const char *));
+    data = xzmalloc(mbdb_nshards * sizeof(const char *));
+    keylen = xzmalloc(mbdb_nshards * sizeof(size_t));
+    datalen = xzmalloc(mbdb_nshards * sizeof(size_t));
+
+    /* prime each shard with its first record; key[i] == NULL once a
+     * shard is used up */
+    for (i = 0; i < mbdb_nshards; i++) {
+	r = cyrusdb_snapshot(mbdb_shards[i], prefix, prefixlen, &snaps[i]);
+	if (r) goto done;
+
+	r = cyrusdb_snapshot_next(snaps[i], &key[i], &keylen[i],
+				  &data[i], &datalen[i]);
+	if (r == CYRUSDB_DONE) key[i] = NULL;
+	else if (r) goto done;
+	r = 0;
+    }
+
+    for (;;) {
+	best = -1;
+	for (i = 0; i < mbdb_nshards; i++) {
+	    if (!key[i]) continue;
+	    if (best < 0 ||
+		cyrusdb_compar(mbdb, key[i], keylen[i],
+			       key[best], keylen[best]) < 0)
+		best = i;
+	}
+	if (best < 0) break;
+
+	if (!p || p(rock, key[best], keylen[best],
+		    data[best], datalen[best])) {
+	    cb_r = cb(rock, key[best], keylen[best],
+		      data[best], datalen[best]);
+	    if (cb_r) break;
+	}
+
+	r = cyrusdb_snapshot_next(snaps[best], &key[best], &keylen[best],
+				  &data[best], &datalen[best]);
+	if (r == CYRUSDB_DONE) key[best] = NULL;
+	else if (r) break;
+	r = 0;
+    }
+
+ done:
+    for (i = 0; i < mbdb_nshards; i++)
+	cyrusdb_snapshot_free(&snaps[i]);
+    free(snaps);
+    free(key);
+    free(data);
+    free(keylen);
+    free(datalen);
+
+    return r ? r : cb_r;
+}
+
 /*
  * Lookup 'name' in the mailbox list.
  * The capitalization of 'name' is canonicalized to the way it appears
@@ -186,11 +643,7 @@ static int mboxlist_read(const char *name, const char **dataptr, size_t *datalen
     if (namelen == 0) {
 	return IMAP_MAILBOX_NONEXISTENT;
     }
-    if (wrlock) {
-	r = cyrusdb_fetchlock(mbdb, name, namelen, dataptr, datalenptr, tid);
-    } else {
-	r = cyrusdb_fetch(mbdb, name, namelen, dataptr, datalenptr, tid);
-    }
+    r = mbdb_fetch(name, namelen, dataptr, datalenptr, tid, wrlock);
 
     switch (r) {
     case CYRUSDB_OK:
@@ -287,14 +740,45 @@ static int mboxlist_mylookup(const char *name,
 			     struct mboxlist_entry **mbentryptr,
 			     struct txn **tid, int wrlock)
 {
+    struct mbcache_entry *ce;
+    struct mboxlist_entry *mbentry = NULL;
+    uint64_t gen;
     int r;
     const char *data;
     size_t datalen;
 
-    r = mboxlist_read(name, &data, &datalen, tid, wrlock);
-    if (r) return r;
+    /* only plain reads go through the cache.  The generation is
+     * read before the entry, so if anything changes in between
+     * we just miss again next time */
+    if (tid || wrlock || !mbcache.max || !*name ||
+	cyrusdb_generation(mbdb_for(name), &gen)) {
+	r = mboxlist_read(name, &data, &datalen, tid, wrlock);
+	if (r) return r;
+
+	return mboxlist_parse_entry(mbentryptr, name, data, datalen);
+    }
+
+    ce = mbcache_find(name, gen);
+    if (!ce) {
+	r = mboxlist_read(name, &data, &datalen, NULL, 0);
+	if (r == IMAP_MAILBOX_NONEXISTENT) {
+	    mbcache_insert(name, gen, NULL, 0);
+	    return r;
+	}
+	if (r) return r;
+
+	r = mboxlist_parse_entry(&mbentry, name, data, datalen);
+	if (r) return r;
+
+	ce = mbcache_insert(name, gen, mbentry,
+			    strlen(name) + datalen + 2);
+    }
+
+    if (!ce->mbentry) return IMAP_MAILBOX_NONEXISTENT;
 
-    return mboxlist_parse_entry(mbentryptr, name, data, datalen);
+    if (mbentryptr) *mbentryptr = mbcache_copy(ce);
+
+    return 0;
 }
 
 /*
@@ -325,6 +809,79 @@ int mboxlist_lookup(const char *name, struct mboxlist_entry **entryptr,
     return 0;
 }
 
+struct lookup_multi_rock {
+    const int *idx;
+    int pos;
+    int *results;
+};
+
+static int lookup_multi_cb(void *rock,
+			   const char *key __attribute__((unused)),
+			   size_t keylen __attribute__((unused)),
+			   const char *data, size_t datalen)
+{
+    struct lookup_multi_rock *lrock = (struct lookup_multi_rock *) rock;
+    struct mboxlist_entry *entry = NULL;
+    int *res = &lrock->results[lrock->idx[lrock->pos++]];
+
+    if (!data) {
+	*res = IMAP_MAILBOX_NONEXISTENT;
+	return 0;
+    }
+
+    *res = mboxlist_parse_entry(&entry, "", data, datalen);
+    if (!*res && (entry->mbtype & MBTYPE_RESERVE))
+	*res = IMAP_MAILBOX_RESERVED;
+    mboxlist_entry_free(&entry);
+
+    return 0;
+}
+
+/*
+ * Like mboxlist_lookup() on each of 'names', but with one pass over
+ * each shard of the mailbox list.  'names' should be sorted.
+ * results[i] is set to what mboxlist_lookup() would have returned.
+ */
+static int mboxlist_lookup_multi(const strarray_t *names, int *results)
+{
+    struct lookup_multi_rock lrock;
+    const char **keys;
+    int *idx;
+    int i, n, shard, r = 0;
+
+    keys = xmalloc(names->count * sizeof(const char *));
+    idx = xmalloc(names->count * sizeof(int));
+
+    for (shard = 0; shard < mbdb_nshards; shard++) {
+	n = 0;
+	for (i = 0; i < names->count; i++) {
+	    const char *name = names->data[i];
+
+	    if (mbdb_shard(name, strlen(name), 0) != shard) continue;
+	    keys[n] = name;
+	    idx[n++] = i;
+	}
+	if (!n) continue;
+
+	lrock.idx = idx;
+	lrock.pos = 0;
+	lrock.results = results;
+	r = cyrusdb_fetchmulti(mbdb_shards[shard], keys, NULL, n,
+			       &lookup_multi_cb, &lrock, NULL);
+	if (r) {
+	    syslog(LOG_ERR, "DBERROR: error fetching mboxlist entries: %s",
+		   cyrusdb_strerror(r));
+	    r = IMAP_IOERROR;
+	    break;
+	}
+    }
+
+    free(keys);
+    free(idx);
+
+    return r;
+}
+
 int mboxlist_lookup_allow_reserved(const char *name,
 				   struct mboxlist_entry **entryptr,
 				   struct txn **tid)
@@ -361,8 +918,7 @@ int mboxlist_update(struct mboxlist_entry *mbentry, int localonly)
     struct txn *tid = NULL;
 
     mboxent = mboxlist_entry_cstring(mbentry);
-    r = cyrusdb_store(mbdb, mbentry->name, strlen(mbentry->name),
-		      mboxent, strlen(mboxent), &tid);
+    r = mbdb_store(mbentry->name, mboxent, strlen(mboxent), &tid);
     free(mboxent);
     mboxent = NULL;
 
@@ -391,9 +947,9 @@ int mboxlist_update(struct mboxlist_entry *mbentry, int localonly)
 
     if (tid) {
 	if (r) {
-	    r2 = cyrusdb_abort(mbdb, tid);
+	    r2 = mbdb_abort(tid);
 	} else {
-	    r2 = cyrusdb_commit(mbdb, tid);
+	    r2 = mbdb_commit(tid);
 	}
     }
 
@@ -722,7 +1278,7 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
     newmbentry->uniqueid = newmailbox ? newmailbox->uniqueid : uniqueid;
     newmbentry->specialuse = useptr;
     mboxent = mboxlist_entry_cstring(newmbentry);
-    r = cyrusdb_store(mbdb, name, strlen(name), mboxent, strlen(mboxent), NULL);
+    r = mbdb_store(name, mboxent, strlen(mboxent), NULL);
 
     if (r) {
 	syslog(LOG_ERR, "DBERROR: failed to insert to mailboxes list %s: %s", 
@@ -741,7 +1297,7 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
 	if (r) {
 	    syslog(LOG_ERR,
 		   "MUPDATE: can't commit mailbox entry for '%s'", name);
-	    cyrusdb_delete(mbdb, name, strlen(name), NULL, 0);
+	    mbdb_delete(name, NULL, 0);
 	}
 	if (mupdate_h) mupdate_disconnect(&mupdate_h);
     }
@@ -809,8 +1365,7 @@ int mboxlist_insertremote(struct mboxlist_entry *mbentry,
     mboxent = mboxlist_entry_cstring(mbentry);
 
     /* database put */
-    r = cyrusdb_store(mbdb, mbentry->name, strlen(mbentry->name),
-		      mboxent, strlen(mboxent), tid);
+    r = mbdb_store(mbentry->name, mboxent, strlen(mboxent), tid);
     switch (r) {
     case CYRUSDB_OK:
 	break;
@@ -868,7 +1423,7 @@ int mboxlist_deleteremote(const char *name, struct txn **in_tid)
 
  retry_del:
     /* delete entry */
-    r = cyrusdb_delete(mbdb, name, strlen(name), tid, 0);
+    r = mbdb_delete(name, tid, 0);
     switch (r) {
     case CYRUSDB_OK: /* success */
 	break;
@@ -882,7 +1437,7 @@ int mboxlist_deleteremote(const char *name, struct txn **in_tid)
 
     /* commit db operations, but only if we weren't passed a transaction */
     if (!in_tid) {
-	r = cyrusdb_commit(mbdb, *tid);
+	r = mbdb_commit(*tid);
 	if (r) {
 	    syslog(LOG_ERR, "DBERROR: failed on commit: %s",
 		   cyrusdb_strerror(r));
@@ -894,7 +1449,7 @@ int mboxlist_deleteremote(const char *name, struct txn **in_tid)
  done:
     if (r && !in_tid && tid) {
 	/* Abort the transaction if it is still in progress */
-	cyrusdb_abort(mbdb, *tid);
+	mbdb_abort(*tid);
     }
 
     return r;
@@ -1064,7 +1619,7 @@ int mboxlist_deletemailbox(const char *name, int isadmin,
     if (r && !force) goto done;
 
     /* delete entry */
-    r = cyrusdb_delete(mbdb, name, strlen(name), NULL, 0);
+    r = mbdb_delete(name, NULL, 0);
     if (r) {
 	syslog(LOG_ERR, "DBERROR: error deleting %s: %s",
 	       name, cyrusdb_strerror(r));
@@ -1085,6 +1640,24 @@ int mboxlist_deletemailbox(const char *name, int isadmin,
     return r;
 }
 
+/*
+ * A rename across shards commits the new entry before the old one is
+ * deleted.  If the rename fails after that, take the new entry out
+ * again so that only the old one is left.
+ */
+static void mboxlist_rename_undo(const char *oldname, const char *newname)
+{
+    int r;
+
+    if (mbdb_for(oldname) == mbdb_for(newname)) return;
+
+    r = mbdb_delete(newname, NULL, 1);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: error removing %s after failed rename "
+	       "from %s: %s", newname, oldname, cyrusdb_strerror(r));
+    }
+}
+
 /*
  * Rename/move a single mailbox (recursive renames are handled at a
  * higher level).  This only supports local mailboxes.  Remote
@@ -1172,8 +1745,7 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
 	newmbentry->partition = newpartition;
 	newmbentry->acl = oldmailbox->acl;
 	mboxent = mboxlist_entry_cstring(newmbentry);
-	r = cyrusdb_store(mbdb, newname, strlen(newname), 
-		          mboxent, strlen(mboxent), &tid);
+	r = mbdb_store(newname, mboxent, strlen(mboxent), &tid);
 	mboxlist_entry_free(&newmbentry);
 	if (r) goto done;
 
@@ -1228,16 +1800,15 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
     mboxent = mboxlist_entry_cstring(newmbentry);
 
     do {
-	r = 0;
-
-	/* delete the old entry */
-	if (!isusermbox)
-	    r = cyrusdb_delete(mbdb, oldname, strlen(oldname), &tid, 0);
-
 	/* create a new entry */
-	if (!r)
-	    r = cyrusdb_store(mbdb, newname, strlen(newname), 
-			      mboxent, strlen(mboxent), &tid);
+	r = mbdb_store(newname, mboxent, strlen(mboxent), &tid);
+
+	/* delete the old entry.  This comes second so that if the
+	 * names live in different shards, the new entry is committed
+	 * before the old one goes away, and is taken out again by
+	 * mboxlist_rename_undo() if the rename fails after all */
+	if (!r && !isusermbox)
+	    r = mbdb_delete(oldname, &tid, 0);
 
 	switch (r) {
 	case 0: /* success */
@@ -1248,6 +1819,9 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
 	default:
 	    syslog(LOG_ERR, "DBERROR: error renaming %s %s: %s",
 		   oldname, newname, cyrusdb_strerror(r));
+	    if (tid) mbdb_abort(tid);
+	    tid = NULL;
+	    mboxlist_rename_undo(oldname, newname);
 	    r = IMAP_IOERROR;
 	    goto done;
 	    break;
@@ -1257,11 +1831,12 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
  dbdone:
 
     /* 3. Commit transaction */
-    r = cyrusdb_commit(mbdb, tid);
+    r = mbdb_commit(tid);
     tid = NULL;
     if (r) {
 	syslog(LOG_ERR, "DBERROR: failed on commit %s %s: %s",
 	       oldname, newname, cyrusdb_strerror(r));
+	mboxlist_rename_undo(oldname, newname);
 	r = IMAP_IOERROR;
 	goto done;
     }
@@ -1488,7 +2063,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
      * lock the mailbox, and re-lock the mailboxes list */
     /* we must do this to obey our locking rules */
     if (!r && !(mbentry->mbtype & MBTYPE_REMOTE)) {
-	cyrusdb_abort(mbdb, tid);
+	mbdb_abort(tid);
 	tid = NULL;
 	mboxlist_entry_free(&mbentry);
 
@@ -1576,8 +2151,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
 	mboxent = mboxlist_entry_cstring(mbentry);
 
 	do {
-	    r = cyrusdb_store(mbdb, name, strlen(name),
-			      mboxent, strlen(mboxent), &tid);
+	    r = mbdb_store(name, mboxent, strlen(mboxent), &tid);
 	} while(r == CYRUSDB_AGAIN);
     
 	if(r) {
@@ -1597,7 +2171,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
 
     /* 5. Commit transaction */
     if (!r) {
-	if((r = cyrusdb_commit(mbdb, tid)) != 0) {
+	if((r = mbdb_commit(tid)) != 0) {
 	    syslog(LOG_ERR, "DBERROR: failed on commit: %s",
 		   cyrusdb_strerror(r));
 	    r = IMAP_IOERROR;
@@ -1632,7 +2206,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
   done:
     if (r && tid) {
 	/* if we are mid-transaction, abort it! */
-	int r2 = cyrusdb_abort(mbdb, tid);
+	int r2 = mbdb_abort(tid);
 	if (r2) {
 	    syslog(LOG_ERR,
 		   "DBERROR: error aborting txn in mboxlist_setacl: %s",
@@ -1683,8 +2257,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 	char *mboxent = mboxlist_entry_cstring(mbentry);
 
 	do {
-	    r = cyrusdb_store(mbdb, name, strlen(name),
-			      mboxent, strlen(mboxent), &tid);
+	    r = mbdb_store(name, mboxent, strlen(mboxent), &tid);
 	} while (r == CYRUSDB_AGAIN);
     
 	if (r) {
@@ -1698,7 +2271,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 
     /* 3. Commit transaction */
     if (!r) {
-	r = cyrusdb_commit(mbdb, tid);
+	r = mbdb_commit(tid);
 	if (r) {
 	    syslog(LOG_ERR, "DBERROR: failed on commit %s: %s",
 		   name, cyrusdb_strerror(r));
@@ -1732,7 +2305,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 
     if (r && tid) {
 	/* if we are mid-transaction, abort it! */
-	int r2 = cyrusdb_abort(mbdb, tid);
+	int r2 = mbdb_abort(tid);
 	if (r2) {
 	    syslog(LOG_ERR,
 		   "DBERROR: error aborting txn in sync_setacls %s: %s",
@@ -1782,8 +2355,7 @@ int mboxlist_setspecialuse(struct mailbox *mailbox, const char *specialuse)
     mbentry->specialuse = specialuse;
     mboxent = mboxlist_entry_cstring(mbentry);
     do {
-	r = cyrusdb_store(mbdb, name, strlen(name),
-		          mboxent, strlen(mboxent), &tid);
+	r = mbdb_store(name, mboxent, strlen(mboxent), &tid);
     } while (r == CYRUSDB_AGAIN);
 
     if (r) {
@@ -1801,7 +2373,7 @@ int mboxlist_setspecialuse(struct mailbox *mailbox, const char *specialuse)
     if (r) goto done;
 
     /* 3. Commit transaction */
-    r = cyrusdb_commit(mbdb, tid);
+    r = mbdb_commit(tid);
     if (r) {
 	syslog(LOG_ERR, "DBERROR: failed on commit, header inconsistent %s: %s",
 	       name, cyrusdb_strerror(r));
@@ -1813,7 +2385,7 @@ int mboxlist_setspecialuse(struct mailbox *mailbox, const char *specialuse)
 
  done:
     if (tid) {
-	int r2 = cyrusdb_abort(mbdb, tid);
+	int r2 = mbdb_abort(tid);
 	if (r2) {
 	    syslog(LOG_ERR, "DBERROR: failed on abort %s: %s",
 		   name, cyrusdb_strerror(r2));
@@ -1835,6 +2407,7 @@ struct find_rock {
     const char *usermboxname;
     size_t usermboxnamelen;
     int checkmboxlist;
+    const int *lookup_r;	/* mboxlist_lookup() result, if known */
     int checkshared;
     struct db *db;
     int isadmin;
@@ -1986,7 +2559,8 @@ static int find_cb(void *rockp,
 
 	/* make sure it's in the mailboxes db */
 	if (rock->checkmboxlist) {
-	    r = mboxlist_lookup(namebuf, NULL, NULL);
+	    r = rock->lookup_r ? *rock->lookup_r :
+		mboxlist_lookup(namebuf, NULL, NULL);
 	} else {
 	    r = 0;		/* don't bother checking */
 	}
@@ -2047,12 +2621,22 @@ static int find_cb(void *rockp,
     return r;
 }
 
+/* Admin walks can cover the whole of mailboxes.db and make slow
+ * callbacks, so they iterate over a snapshot rather than keeping
+ * writers waiting behind them (walks spanning shards always do) */
+static int find_foreach(struct find_rock *rock,
+			const char *prefix, size_t prefixlen)
+{
+    return mbdb_foreach(prefix, prefixlen, &find_p, &find_cb, rock,
+			rock->isadmin);
+}
+
 int mboxlist_allmbox(const char *prefix, foreach_cb *proc, void *rock)
 {
     int r;
     char *search = prefix ? (char *)prefix : "";
 
-    r = cyrusdb_foreach(mbdb, search, strlen(search), NULL, proc, rock, 0);
+    r = mbdb_foreach(search, strlen(search), NULL, proc, rock, 1);
 
     return r;
 }
@@ -2131,6 +2715,7 @@ int mboxlist_findall(struct namespace *namespace,
     cbrock.isadmin = isadmin;
     cbrock.auth_state = auth_state;
     cbrock.checkmboxlist = 0;	/* don't duplicate work */
+    cbrock.lookup_r = NULL;
     cbrock.checkshared = 0;
     cbrock.proc = proc;
     cbrock.procrock = rock;
@@ -2155,8 +2740,8 @@ int mboxlist_findall(struct namespace *namespace,
     /* Check for INBOX first of all */
     if (userid) {
 	if (GLOB_TEST(cbrock.g, "INBOX") != -1) {
-	    r = cyrusdb_fetch(mbdb, usermboxname, usermboxnamelen,
-			      &data, &datalen, NULL);
+	    r = mbdb_fetch(usermboxname, usermboxnamelen,
+			   &data, &datalen, NULL, 0);
 	    if (r == CYRUSDB_NOTFOUND) r = 0;
 	    else if (!r)
 		r = (*proc)(cbrock.inboxcase, 5, 1, rock);
@@ -2164,8 +2749,8 @@ int mboxlist_findall(struct namespace *namespace,
 	else if (!strncmp(pattern,
 			  usermboxname+domainlen, usermboxnamelen-domainlen) &&
 		 GLOB_TEST(cbrock.g, usermboxname+domainlen) != -1) {
-	    r = cyrusdb_fetch(mbdb, usermboxname, usermboxnamelen,
-			      &data, &datalen, NULL);
+	    r = mbdb_fetch(usermboxname, usermboxnamelen,
+			   &data, &datalen, NULL, 0);
 	    if (r == CYRUSDB_NOTFOUND) r = 0;
 	    else if (!r)
 		r = (*proc)(usermboxname, usermboxnamelen, 1, rock);
@@ -2212,10 +2797,7 @@ int mboxlist_findall(struct namespace *namespace,
 
 	cbrock.find_namespace = NAMESPACE_INBOX;
 	/* iterate through prefixes matching usermboxname */
-	r = cyrusdb_foreach(mbdb,
-			    usermboxname, usermboxnamelen,
-			    &find_p, &find_cb, &cbrock,
-			    NULL);
+	r = find_foreach(&cbrock, usermboxname, usermboxnamelen);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2236,10 +2818,7 @@ int mboxlist_findall(struct namespace *namespace,
 	/* search for all remaining mailboxes.
 	   just bother looking at the ones that have the same pattern
 	   prefix. */
-	r = cyrusdb_foreach(mbdb,
-			    domainpat, domainlen + prefixlen,
-			    &find_p, &find_cb, &cbrock,
-			    NULL);
+	r = find_foreach(&cbrock, domainpat, domainlen + prefixlen);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2287,6 +2866,7 @@ int mboxlist_findall_alt(struct namespace *namespace,
     cbrock.isadmin = isadmin;
     cbrock.auth_state = auth_state;
     cbrock.checkmboxlist = 0;	/* don't duplicate work */
+    cbrock.lookup_r = NULL;
     cbrock.checkshared = 0;
     cbrock.proc = proc;
     cbrock.procrock = rock;
@@ -2311,8 +2891,8 @@ int mboxlist_findall_alt(struct namespace *namespace,
     /* Check for INBOX first of all */
     if (userid) {
 	if (GLOB_TEST(cbrock.g, "INBOX") != -1) {
-	    r = cyrusdb_fetch(mbdb, usermboxname, usermboxnamelen,
-			      &data, &datalen, NULL);
+	    r = mbdb_fetch(usermboxname, usermboxnamelen,
+			   &data, &datalen, NULL, 0);
 	    if (r == CYRUSDB_NOTFOUND) r = 0;
 	    else if (!r)
 		r = (*proc)(cbrock.inboxcase, 5, 0, rock);
@@ -2354,10 +2934,7 @@ int mboxlist_findall_alt(struct namespace *namespace,
 	cbrock.find_namespace = NAMESPACE_INBOX;
 
 	/* iterate through prefixes matching usermboxname */
-	cyrusdb_foreach(mbdb,
-			usermboxname, usermboxnamelen,
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	find_foreach(&cbrock, usermboxname, usermboxnamelen);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2398,10 +2975,7 @@ int mboxlist_findall_alt(struct namespace *namespace,
 
 	    /* iterate through prefixes matching usermboxname */
 	    strlcpy(domainpat+domainlen, "user", sizeof(domainpat)-domainlen);
-	    cyrusdb_foreach(mbdb,
-			    domainpat, strlen(domainpat),
-			    &find_p, &find_cb, &cbrock,
-			    NULL);
+	    find_foreach(&cbrock, domainpat, strlen(domainpat));
 
 	    glob_free(&cbrock.g);
 	    free(cbrock.prev);
@@ -2451,20 +3025,14 @@ int mboxlist_findall_alt(struct namespace *namespace,
 		}
 
 		domainpat[domainlen] = '\0';
-		cyrusdb_foreach(mbdb,
-				domainpat, domainlen,
-				&find_p, &find_cb, &cbrock,
-				NULL);
+		find_foreach(&cbrock, domainpat, domainlen);
 	    }
 	    else if (pattern[len] == '.') {
 		strlcpy(domainpat+domainlen, pattern+len+1,
 			sizeof(domainpat)-domainlen);
 		cbrock.g = glob_init(domainpat, GLOB_HIERARCHY);
 
-		cyrusdb_foreach(mbdb,
-				domainpat, domainlen+prefixlen-(len+1),
-				&find_p, &find_cb, &cbrock,
-				NULL);
+		find_foreach(&cbrock, domainpat, domainlen+prefixlen-(len+1));
 	    }
 	    free(cbrock.prev);
 	    cbrock.prev = NULL;
@@ -2747,10 +3315,23 @@ void mboxlist_init(int myflags)
     }
 }
 
+/* name of the file holding shard 'shard' of the mailbox list 'fname' */
+char *mboxlist_shardfname(const char *fname, int shard)
+{
+    char num[20];
+
+    if (!shard) return xstrdup(fname);
+
+    snprintf(num, sizeof(num), "%d", shard);
+
+    return strconcat(fname, ".", num, (char *)NULL);
+}
+
 void mboxlist_open(const char *fname)
 {
-    int ret, flags;
+    int ret, flags, i;
     char *tofree = NULL;
+    char *shardfname;
 
     if (!fname)
 	fname = config_getstring(IMAPOPT_MBOXLIST_DB_PATH);
@@ -2766,30 +3347,60 @@ void mboxlist_open(const char *fname)
 	flags |= CYRUSDB_MBOXSORT;
     }
 
-    ret = cyrusdb_open(DB, fname, flags, &mbdb);
-    if (ret != 0) {
-	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
-	       cyrusdb_strerror(ret));
-	    /* Exiting TEMPFAIL because Sendmail thinks this
-	       EC_OSFILE == permanent failure. */
-	fatal("can't read mailboxes file", EC_TEMPFAIL);
-    }    
+    mbdb_nshards = config_getint(IMAPOPT_MBOXLIST_SHARDS);
+    if (mbdb_nshards < 1) mbdb_nshards = 1;
+    mbdb_shard_by = config_getenum(IMAPOPT_MBOXLIST_SHARD_BY);
+    if (mbdb_nshards > 1)
+	mbdb_shards = xzmalloc(mbdb_nshards * sizeof(struct db *));
+
+    for (i = 0; i < mbdb_nshards; i++) {
+	shardfname = mboxlist_shardfname(fname, i);
+	ret = cyrusdb_open(DB, shardfname, flags, &mbdb_shards[i]);
+	if (ret != 0) {
+	    syslog(LOG_ERR, "DBERROR: opening %s: %s", shardfname,
+		   cyrusdb_strerror(ret));
+		/* Exiting TEMPFAIL because Sendmail thinks this
+		   EC_OSFILE == permanent failure. */
+	    fatal("can't read mailboxes file", EC_TEMPFAIL);
+	}
+	free(shardfname);
+    }
+    mbdb = mbdb_shards[0];
 
     free(tofree);
 
+    mbcache.max = config_getint(IMAPOPT_MBOXLIST_CACHESIZE);
+    if (mbcache.max < 0) mbcache.max = 0;
+    if (mbcache.max)
+	construct_hash_table(&mbcache.table, mbcache.max, 0);
+
     mboxlist_dbopen = 1;
 }
 
 void mboxlist_close(void)
 {
-    int r;
+    int r, i;
 
     if (mboxlist_dbopen) {
-	r = cyrusdb_close(mbdb);
-	if (r) {
-	    syslog(LOG_ERR, "DBERROR: error closing mailboxes: %s",
-		   cyrusdb_strerror(r));
+	if (mbcache.stats.hits + mbcache.stats.misses + mbcache.stats.stale) {
+	    syslog(LOG_DEBUG, "mboxlist cache: %lu hits, %lu misses, "
+		   "%lu stale, %lu evictions",
+		   mbcache.stats.hits, mbcache.stats.misses,
+		   mbcache.stats.stale, mbcache.stats.evictions);
+	}
+	mbcache_flush();
+
+	for (i = 0; i < mbdb_nshards; i++) {
+	    r = cyrusdb_close(mbdb_shards[i]);
+	    if (r) {
+		syslog(LOG_ERR, "DBERROR: error closing mailboxes: %s",
+		       cyrusdb_strerror(r));
+	    }
 	}
+	if (mbdb_shards != &mbdb) free(mbdb_shards);
+	mbdb_shards = &mbdb;
+	mbdb_nshards = 1;
+	mbdb = NULL;
 	mboxlist_dbopen = 0;
     }
 }
@@ -2799,29 +3410,23 @@ void mboxlist_done(void)
     /* DB->done() handled by cyrus_done() */
 }
 
-/*
- * Open the subscription list for 'userid'.
- * 
- * On success, returns zero.
- * On failure, returns an error code.
- */
-static int
-mboxlist_opensubs(const char *userid,
-		  struct db **ret)
+static int opensubs(const char *userid, int flags, struct db **ret)
 {
-    int r = 0, flags;
+    int r = 0;
     char *subsfname;
 
     /* Build subscription list filename */
     subsfname = user_hash_subs(userid);
 
-    flags = CYRUSDB_CREATE;
     if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT)) {
 	flags |= CYRUSDB_MBOXSORT;
     }
 
     r = cyrusdb_open(SUBDB, subsfname, flags, ret);
-    if (r != CYRUSDB_OK) {
+    if (r == CYRUSDB_NOTFOUND) {
+	r = IMAP_NOTFOUND;
+    }
+    else if (r != CYRUSDB_OK) {
 	r = IMAP_IOERROR;
     }
     free(subsfname);
@@ -2829,10 +3434,33 @@ mboxlist_opensubs(const char *userid,
     return r;
 }
 
+/*
+ * Open the subscription list for 'userid'.
+ * 
+ * On success, returns zero.
+ * On failure, returns an error code.
+ */
+int
+mboxlist_opensubs(const char *userid,
+		  struct db **ret)
+{
+    return opensubs(userid, CYRUSDB_CREATE, ret);
+}
+
+/*
+ * Open the subscription list for 'userid' if there is one already.
+ *
+ * Returns IMAP_NOTFOUND if the user has never subscribed to anything.
+ */
+int mboxlist_opensubs_existing(const char *userid, struct db **ret)
+{
+    return opensubs(userid, 0, ret);
+}
+
 /*
  * Close a subscription file
  */
-static void mboxlist_closesubs(struct db *sub)
+void mboxlist_closesubs(struct db *sub)
 {
     cyrusdb_close(sub);
 }
@@ -2843,6 +3471,63 @@ static void mboxlist_closesubs(struct db *sub)
  * is the user's login id.  For each matching mailbox, calls
  * 'proc' with the name of the mailbox.
  */
+struct findsub_rock {
+    struct find_rock *rock;
+    strarray_t names;
+};
+
+static int findsub_collect(void *rockp,
+			   const char *key, size_t keylen,
+			   const char *data, size_t datalen)
+{
+    struct findsub_rock *frock = (struct findsub_rock *) rockp;
+
+    if (find_p(frock->rock, key, keylen, data, datalen))
+	strarray_appendm(&frock->names, xstrndup(key, keylen));
+
+    return 0;
+}
+
+/* Walk the subscriptions starting with 'prefix'.  Rather than have
+ * find_cb() look up every subscribed name in the mailbox list on its
+ * own, check them all in one pass first */
+static int findsub_foreach(struct db *subs,
+			   const char *prefix, size_t prefixlen,
+			   struct find_rock *rock)
+{
+    struct findsub_rock frock;
+    int *results = NULL;
+    int i, r;
+
+    memset(&frock, 0, sizeof(frock));
+    frock.rock = rock;
+
+    r = cyrusdb_foreach(subs, prefix, prefixlen,
+			NULL, &findsub_collect, &frock, NULL);
+    if (r) goto done;
+
+    if (rock->checkmboxlist && frock.names.count) {
+	results = xmalloc(frock.names.count * sizeof(int));
+	r = mboxlist_lookup_multi(&frock.names, results);
+	if (r) goto done;
+    }
+
+    for (i = 0; i < frock.names.count; i++) {
+	const char *name = frock.names.data[i];
+
+	rock->lookup_r = results ? &results[i] : NULL;
+	r = find_cb(rock, name, strlen(name), "", 0);
+	if (r) break;
+    }
+    rock->lookup_r = NULL;
+
+ done:
+    strarray_fini(&frock.names);
+    free(results);
+
+    return r;
+}
+
 int mboxlist_findsub(struct namespace *namespace,
 		     const char *pattern, int isadmin __attribute__((unused)),
 		     const char *userid, struct auth_state *auth_state, 
@@ -2878,6 +3563,7 @@ int mboxlist_findsub(struct namespace *namespace,
     cbrock.isadmin = 1;		/* user can always see their subs */
     cbrock.auth_state = auth_state;
     cbrock.checkmboxlist = !force;
+    cbrock.lookup_r = NULL;
     cbrock.checkshared = 0;
     cbrock.proc = proc;
     cbrock.procrock = rock;
@@ -2963,10 +3649,7 @@ int mboxlist_findsub(struct namespace *namespace,
 
 	cbrock.find_namespace = NAMESPACE_INBOX;
 	/* iterate through prefixes matching usermboxname */
-	cyrusdb_foreach(subs,
-			usermboxname, usermboxnamelen,
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	findsub_foreach(subs, usermboxname, usermboxnamelen, &cbrock);
 	free(cbrock.prev);
 	cbrock.prev = NULL;
 	cbrock.prevlen = 0;
@@ -2991,8 +3674,7 @@ int mboxlist_findsub(struct namespace *namespace,
 	}
 	/* search for all remaining mailboxes.
 	   just bother looking at the ones that have the same pattern prefix. */
-	cyrusdb_foreach(subs, domainpat, domainlen + prefixlen,
-			&find_p, &find_cb, &cbrock, NULL);
+	findsub_foreach(subs, domainpat, domainlen + prefixlen, &cbrock);
 	free(cbrock.prev);
 	cbrock.prev = NULL;
 	cbrock.prevlen = 0;
@@ -3057,6 +3739,7 @@ int mboxlist_findsub_alt(struct namespace *namespace,
     cbrock.isadmin = 1;		/* user can always see their subs */
     cbrock.auth_state = auth_state;
     cbrock.checkmboxlist = !force;
+    cbrock.lookup_r = NULL;
     cbrock.checkshared = 0;
     cbrock.proc = proc;
     cbrock.procrock = rock;
@@ -3127,10 +3810,7 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 	cbrock.find_namespace = NAMESPACE_INBOX;
 
 	/* iterate through prefixes matching usermboxname */
-	cyrusdb_foreach(subs,
-			usermboxname, usermboxnamelen,
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	findsub_foreach(subs, usermboxname, usermboxnamelen, &cbrock);
 	free(cbrock.prev);
 	cbrock.prev = NULL;
 	cbrock.prevlen = 0;
@@ -3178,10 +3858,7 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 	
 	    /* iterate through prefixes matching usermboxname */
 	    strlcpy(domainpat+domainlen, "user", sizeof(domainpat)-domainlen);
-	    cyrusdb_foreach(subs,
-			    domainpat, strlen(domainpat),
-			    &find_p, &find_cb, &cbrock,
-			    NULL);
+	    findsub_foreach(subs, domainpat, strlen(domainpat), &cbrock);
 	    free(cbrock.prev);
 	    cbrock.prev = NULL;
 	    cbrock.prevlen = 0;
@@ -3232,10 +3909,7 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 		}
 
 		domainpat[domainlen] = '\0';
-		cyrusdb_foreach(subs,
-				domainpat, domainlen,
-				&find_p, &find_cb, &cbrock,
-				NULL);
+		findsub_foreach(subs, domainpat, domainlen, &cbrock);
 		free(cbrock.prev);
 		cbrock.prev = NULL;
 		cbrock.prevlen = 0;
@@ -3245,10 +3919,7 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 		        sizeof(domainpat)-domainlen);
 		cbrock.g = glob_init(domainpat, GLOB_HIERARCHY);
 
-		cyrusdb_foreach(subs,
-				domainpat, domainlen+prefixlen-(len+1),
-				&find_p, &find_cb, &cbrock,
-				NULL);
+		findsub_foreach(subs, domainpat, domainlen+prefixlen-(len+1), &cbrock);
 		free(cbrock.prev);
 		cbrock.prev = NULL;
 		cbrock.prevlen = 0;
@@ -3340,14 +4011,25 @@ int mboxlist_commit(struct txn *tid)
 {
     assert(tid);
     
-    return cyrusdb_commit(mbdb, tid);
+    return mbdb_commit(tid);
 }
 
 int mboxlist_abort(struct txn *tid) 
 {
     assert(tid);
 
-    return cyrusdb_abort(mbdb, tid);
+    return mbdb_abort(tid);
+}
+
+int mboxlist_rawstore(const char *name, const char *data, size_t datalen,
+		      struct txn **tid)
+{
+    return mbdb_store(name, data, datalen, tid);
+}
+
+int mboxlist_rawdelete(const char *name, struct txn **tid)
+{
+    return mbdb_delete(name, tid, 0);
 }
 
 int mboxlist_delayed_delete_isenabled(void)
@@ -129,6 +129,16 @@ int mboxlist_createmailbox(const char *name, int mbtype,
 			   int localonly, int forceuser, int dbonly,
 			   struct dlist *extargs);
 
+/* create mailbox with every attribute given */
+int mboxlist_createmailbox_full(const char *name, int mbtype,
+				const char *partition,
+				int isadmin, const char *userid,
+				struct auth_state *auth_state,
+				int options, unsigned uidvalidity,
+				const char *copyacl, const char *uniqueid,
+				int localonly, int forceuser, int dbonly,
+				struct mailbox **mboxptr, struct dlist *extargs);
+
 /* create mailbox from sync */
 int mboxlist_createsync(const char *name, int mbtype,
 			const char *partition, 
@@ -181,6 +191,9 @@ int mboxlist_findall_alt(struct namespace *namespace,
 			 void *rock);
 
 /* direct access to subs DB */
+int mboxlist_opensubs(const char *userid, struct db **ret);
+int mboxlist_opensubs_existing(const char *userid, struct db **ret);
+void mboxlist_closesubs(struct db *sub);
 int mboxlist_allsubs(const char *userid, foreach_cb *proc, void *rock);
 int mboxlist_allmbox(const char *prefix, foreach_cb *proc, void *rock);
 
@@ -227,6 +240,24 @@ void mboxlist_done(void);
 int mboxlist_commit(struct txn *tid);
 int mboxlist_abort(struct txn *tid);
 
+/* direct access to the records, for tools that bypass mboxlist_entry.
+ * These route to the right shard and return cyrusdb error codes */
+int mboxlist_rawstore(const char *name, const char *data, size_t datalen,
+		      struct txn **tid);
+int mboxlist_rawdelete(const char *name, struct txn **tid);
+
+/* file name of one shard of the mailbox list */
+char *mboxlist_shardfname(const char *fname, int shard);
+
+/* how well the entry cache is doing, see mboxlist_cachesize */
+struct mboxlist_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;	/* cached, but the database had changed */
+    unsigned long evictions;
+};
+void mboxlist_cache_stats(struct mboxlist_cache_stats *stats);
+
 int mboxlist_delayed_delete_isenabled(void);
 
 /* Small utility routine for limit_user_folders */
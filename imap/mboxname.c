@@ -156,6 +156,8 @@ void remove_lockitem(struct mboxlocklist *remitem)
 		previtem->next = item->next;
 	    else
 		open_mboxlocks = item->next;
+	    if (item->l.locktype)
+		lock_released("mailbox", item->l.name);
 	    if (item->l.lock_fd != -1)
 		close(item->l.lock_fd);
 	    free(item->l.name);
@@ -234,6 +236,8 @@ int mboxname_lock(const char *mboxname, struct mboxlock **mboxlockptr,
 done:
     if (r) remove_lockitem(lockitem);
     else *mboxlockptr = &lockitem->l;
+    if (!r && lockitem->nopen == 1)
+	lock_held("mailbox", mboxname);
 
     return r;
 }
@@ -536,6 +536,7 @@ int service_main(int argc __attribute__((unused)),
     signals_poll();
 
     sync_log_init();
+    sync_log_defer();
 
     nntp_in = prot_new(0, 0);
     nntp_out = prot_new(1, 1);
@@ -800,6 +801,7 @@ static void cmdloop(void)
 	/* Flush any buffered output */
 	prot_flush(nntp_out);
 	if (backend_current) prot_flush(backend_current->out);
+	sync_log_checkpoint();
 
 	/* Check for shutdown file */
 	if (shutdown_file(buf, sizeof(buf)) ||
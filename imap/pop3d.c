@@ -510,6 +510,7 @@ int service_main(int argc __attribute__((unused)),
     signals_poll();
 
     sync_log_init();
+    sync_log_defer();
 
     popd_in = prot_new(0, 0);
     popd_out = prot_new(1, 1);
@@ -866,6 +867,7 @@ static void cmdloop(void)
 
     for (;;) {
 	signals_poll();
+	sync_log_checkpoint();
 
 	if (backend) {
 	    /* create a pipe from client to backend */
@@ -49,7 +49,7 @@
 
 struct backend;
 
-#define MAX_CAPA 9
+#define MAX_CAPA 10
 
 enum {
     /* generic capabilities */
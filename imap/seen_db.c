@@ -78,6 +78,7 @@
 
 enum {
     SEEN_VERSION = 1,
+    SEEN_VERSION_BINARY = 2,
     SEEN_DEBUG = 0
 };
 
@@ -167,7 +168,120 @@ void seen_freedata(struct seendata *sd)
     free (sd->seenuids);
 }
 
-static void parse_data(const char *data, int datalen, struct seendata *sd)
+/*
+ * Binary records (see the seenstate_format option) start with a
+ * SEEN_VERSION_BINARY byte, which can never begin a text record,
+ * followed by lastread, lastuid and lastchange and then one pair of
+ * numbers per range of seen UIDs: the gap since the end of the
+ * previous range and the length of this one less one.  All numbers
+ * are stored 7 bits per byte, least significant first, with the top
+ * bit set on all but the last byte.  So a run of seen messages costs
+ * two bytes or so however long it is, and even the worst case of
+ * every other message seen is two bytes per message.
+ */
+static void put_num(struct buf *buf, uint64_t num)
+{
+    while (num >= 0x80) {
+	buf_putc(buf, (char)((num & 0x7f) | 0x80));
+	num >>= 7;
+    }
+    buf_putc(buf, (char)num);
+}
+
+static int get_num(const char **pp, const char *end, uint64_t *nump)
+{
+    const unsigned char *p = (const unsigned char *)*pp;
+    uint64_t num = 0;
+    int shift = 0;
+
+    for (;;) {
+	if (p >= (const unsigned char *)end || shift > 63) return -1;
+	num |= (uint64_t)(*p & 0x7f) << shift;
+	if (!(*p++ & 0x80)) break;
+	shift += 7;
+    }
+
+    *pp = (const char *)p;
+    *nump = num;
+    return 0;
+}
+
+/* returns non-zero if 'seenuids' isn't a plain ascending list of
+ * UIDs and ranges, in which case it has to be stored as text */
+static int encode_seenuids(const char *seenuids, struct buf *buf)
+{
+    const char *p = seenuids;
+    char *q;
+    unsigned long start, end, prev = 0;
+
+    while (*p) {
+	if (!cyrus_isdigit(*p)) return -1;
+	start = end = strtoul(p, &q, 10);
+	if (*q == ':') {
+	    p = q + 1;
+	    if (!cyrus_isdigit(*p)) return -1;
+	    end = strtoul(p, &q, 10);
+	}
+	if (!start || end < start || start <= prev ||
+	    end > UINT32_MAX) return -1;
+
+	put_num(buf, start - prev - 1);
+	put_num(buf, end - start);
+	prev = end;
+
+	if (*q == ',' && q[1]) q++;
+	else if (*q) return -1;
+	p = q;
+    }
+
+    return 0;
+}
+
+static int decode_seenuids(const char *data, const char *dend,
+			   struct buf *buf)
+{
+    uint64_t gap, len, prev = 0;
+
+    while (data < dend) {
+	if (get_num(&data, dend, &gap) ||
+	    get_num(&data, dend, &len)) return -1;
+	if (prev + gap + len >= UINT32_MAX) return -1;
+
+	if (buf->len) buf_putc(buf, ',');
+	if (len)
+	    buf_printf(buf, "%llu:%llu",
+		       (unsigned long long)(prev + gap + 1),
+		       (unsigned long long)(prev + gap + len + 1));
+	else
+	    buf_printf(buf, "%llu", (unsigned long long)(prev + gap + 1));
+	prev += gap + len + 1;
+    }
+
+    return 0;
+}
+
+static void format_data(struct seendata *sd, struct buf *data)
+{
+    if (config_getenum(IMAPOPT_SEENSTATE_FORMAT) ==
+	IMAP_ENUM_SEENSTATE_FORMAT_BINARY) {
+	buf_putc(data, SEEN_VERSION_BINARY);
+	put_num(data, sd->lastread);
+	put_num(data, sd->lastuid);
+	put_num(data, sd->lastchange);
+	if (!encode_seenuids(sd->seenuids, data)) return;
+
+	/* not something we can encode, fall back to text */
+	buf_reset(data);
+    }
+
+    buf_printf(data, "%d %lu %u %lu %s", SEEN_VERSION,
+	       sd->lastread, sd->lastuid,
+	       sd->lastchange, sd->seenuids);
+}
+
+/* returns non-zero if a binary record is damaged, in which case
+ * 'sd' has no seen UIDs */
+static int parse_data(const char *data, int datalen, struct seendata *sd)
 {
     /* remember that 'data' may not be null terminated ! */
     const char *dend = data + datalen;
@@ -177,6 +291,27 @@ static void parse_data(const char *data, int datalen, struct seendata *sd)
 
     memset(sd, 0, sizeof(struct seendata));
 
+    if (datalen && *data == SEEN_VERSION_BINARY) {
+	struct buf uids = BUF_INITIALIZER;
+	uint64_t num[3];
+	int r;
+
+	data++;
+	r = get_num(&data, dend, &num[0]);
+	if (!r) r = get_num(&data, dend, &num[1]);
+	if (!r) r = get_num(&data, dend, &num[2]);
+	if (!r) {
+	    sd->lastread = num[0];
+	    sd->lastuid = num[1];
+	    sd->lastchange = num[2];
+	    r = decode_seenuids(data, dend, &uids);
+	}
+	if (r) buf_reset(&uids);
+
+	sd->seenuids = buf_release(&uids);
+	return r;
+    }
+
     version = strtol(data, &p, 10); data = p;
     assert(version == SEEN_VERSION);
 
@@ -188,6 +323,8 @@ static void parse_data(const char *data, int datalen, struct seendata *sd)
     sd->seenuids = xmalloc(uidlen + 1);
     memcpy(sd->seenuids, data, uidlen);
     sd->seenuids[uidlen] = '\0';
+
+    return 0;
 }
 
 int foreach_proc(void *rock,
@@ -254,8 +391,11 @@ static int seen_readit(struct seen *seendb, const char *uniqueid,
 	break;
     }
 
-    parse_data(data, datalen, sd);
-    if (sd->seenuids[0] && !imparse_issequence(sd->seenuids)) {
+    if (parse_data(data, datalen, sd)) {
+	syslog(LOG_ERR, "DBERROR: damaged seen record for %s %s - nuking",
+	       seendb->user, uniqueid);
+    }
+    else if (sd->seenuids[0] && !imparse_issequence(sd->seenuids)) {
 	syslog(LOG_ERR, "DBERROR: invalid sequence <%s> for %s %s - nuking",
 	       sd->seenuids, seendb->user, uniqueid);
 	free(sd->seenuids);
@@ -287,9 +427,7 @@ int seen_lockread(struct seen *seendb, const char *uniqueid, struct seendata *sd
 
 int seen_write(struct seen *seendb, const char *uniqueid, struct seendata *sd)
 {
-    int sz = strlen(sd->seenuids) + 50;
-    char *data = xmalloc(sz);
-    int datalen;
+    struct buf data = BUF_INITIALIZER;
     int r;
 
     assert(seendb && uniqueid);
@@ -299,13 +437,10 @@ int seen_write(struct seen *seendb, const char *uniqueid, struct seendata *sd)
 	       seendb->user, uniqueid);
     }
 
-    snprintf(data, sz, "%d %lu %u %lu %s", SEEN_VERSION, 
-	    sd->lastread, sd->lastuid, 
-	    sd->lastchange, sd->seenuids);
-    datalen = strlen(data);
+    format_data(sd, &data);
 
     r = cyrusdb_store(seendb->db, uniqueid, strlen(uniqueid),
-		  data, datalen, &seendb->tid);
+		  data.s, data.len, &seendb->tid);
     switch (r) {
     case CYRUSDB_OK:
 	break;
@@ -319,7 +454,7 @@ int seen_write(struct seen *seendb, const char *uniqueid, struct seendata *sd)
 	break;
     }
 
-    free(data);
+    buf_free(&data);
 
     sync_log_seen(seendb->user, uniqueid);
 
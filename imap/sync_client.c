@@ -116,8 +116,17 @@ static int connect_once    = 0;
 static int background      = 0;
 static int do_compress     = 0;
 
+static const char *sync_channel = NULL;
+static int sync_workers    = 0;
+static int sync_pipeline   = 0;
+static int sync_log_batch  = 0;
+
 #define CAPA_SYNC_CRC_ALGORITHM	    (CAPA_COMPRESS<<1)
 #define CAPA_SYNC_CRC_COVERS	    (CAPA_COMPRESS<<2)
+#define CAPA_SYNC_BINARY	    (CAPA_COMPRESS<<3)
+#define CAPA_SYNC_RESERVE_PREFIX    (CAPA_COMPRESS<<4)
+#define CAPA_SYNC_FULLMAILBOX_SINCE (CAPA_COMPRESS<<5)
+#define CAPA_SYNC_CACHE		    (CAPA_COMPRESS<<6)
 
 static struct protocol_t csync_protocol =
 { "csync", "csync",
@@ -129,6 +138,10 @@ static struct protocol_t csync_protocol =
       { "COMPRESS=DEFLATE", CAPA_COMPRESS },
       { "SYNC_CRC_ALGORITHM", CAPA_SYNC_CRC_ALGORITHM },
       { "SYNC_CRC_COVERS", CAPA_SYNC_CRC_COVERS },
+      { "SYNC_BINARY", CAPA_SYNC_BINARY },
+      { "SYNC_RESERVE_PREFIX", CAPA_SYNC_RESERVE_PREFIX },
+      { "SYNC_FULLMAILBOX_SINCE", CAPA_SYNC_FULLMAILBOX_SINCE },
+      { "SYNC_CACHE", CAPA_SYNC_CACHE },
       { NULL, 0 } } },
   { "STARTTLS", "OK", "NO", 1 },
   { "AUTHENTICATE", USHRT_MAX, 0, "OK", "NO", "+ ", "*", NULL, 0 },
@@ -138,12 +151,17 @@ static struct protocol_t csync_protocol =
 };
 
 static int do_meta(char *user);
+void replica_connect(const char *channel);
+static void replica_disconnect(void);
+static void sync_stop_workers(void);
 
 static void shut_down(int code) __attribute__((noreturn));
 static void shut_down(int code)
 {
     in_shutdown = 1;
 
+    sync_stop_workers();
+
     seen_done();
     annotatemore_close();
     annotatemore_done();
@@ -266,7 +284,7 @@ static int mark_missing (struct dlist *kin,
 {
     struct dlist *kl = kin->head;
     struct dlist *ki;
-    struct message_guid tmp_guid;
+    struct message_guid *tmp_guid;
     struct sync_msgid *msgid;
 
     /* no missing at all, good */
@@ -280,14 +298,14 @@ static int mark_missing (struct dlist *kin,
 
     /* unmark each missing item */
     for (ki = kl->head; ki; ki = ki->next) {
-	if (!message_guid_decode(&tmp_guid, ki->sval)) {
+	if (!dlist_toguid(ki, &tmp_guid)) {
 	    syslog(LOG_ERR, "SYNCERROR: reserve: failed to parse GUID %s",
-		   ki->sval);
+		   dlist_cstring(ki));
 	    return IMAP_PROTOCOL_BAD_PARAMETERS;
         }
 
 	/* afraid we will need this after all */
-	msgid = sync_msgid_lookup(part_list, &tmp_guid);
+	msgid = sync_msgid_lookup(part_list, tmp_guid);
 	if (msgid && !msgid->need_upload) {
 	    msgid->need_upload = 1;
 	    part_list->toupload++;
@@ -297,6 +315,120 @@ static int mark_missing (struct dlist *kin,
     return 0;
 }
 
+static int guid_compare(const void *a, const void *b)
+{
+    struct sync_msgid *ma = *(struct sync_msgid * const *)a;
+    struct sync_msgid *mb = *(struct sync_msgid * const *)b;
+
+    return message_guid_cmp(&ma->guid, &mb->guid);
+}
+
+/* unmark each message the replica found, unless the digest for its
+ * bucket says one of them was the wrong message */
+static int mark_found(struct dlist *kin, struct sync_msgid **msgids, int n,
+		      struct sync_msgid_list *part_list)
+{
+    struct dlist *kl = kin->head;
+    struct message_guid **found;
+    struct buf digest = BUF_INITIALIZER;
+    const char *bitmap, *rdigest;
+    size_t bitmaplen, rdigestlen;
+    int i, j;
+
+    if (!kl || strcmp(kl->name, "FOUND") ||
+	!dlist_getmap(kl, "BITMAP", &bitmap, &bitmaplen) ||
+	!dlist_getmap(kl, "DIGEST", &rdigest, &rdigestlen)) {
+	syslog(LOG_ERR, "SYNCERROR: Illegal response to RESERVE: %s",
+	       kl ? kl->name : "(none)");
+	return IMAP_PROTOCOL_BAD_PARAMETERS;
+    }
+
+    found = xzmalloc(n * sizeof(struct message_guid *));
+    for (i = 0; i < n; i++) {
+	if ((size_t)i / 8 < bitmaplen && (bitmap[i / 8] & (1 << (i % 8))))
+	    found[i] = &msgids[i]->guid;
+    }
+    sync_reserve_digest(found, n, &digest);
+
+    for (i = 0; i < n; i += SYNC_RESERVE_BUCKET) {
+	size_t off = (i / SYNC_RESERVE_BUCKET) * SYNC_GUID_PREFIX;
+	int match = (off + SYNC_GUID_PREFIX <= rdigestlen &&
+		     !memcmp(digest.s + off, rdigest + off, SYNC_GUID_PREFIX));
+
+	for (j = i; j < n && j < i + SYNC_RESERVE_BUCKET; j++) {
+	    if (found[j] && match)
+		continue;
+	    /* afraid we will need this after all */
+	    msgids[j]->need_upload = 1;
+	    part_list->toupload++;
+	}
+    }
+
+    free(found);
+    buf_free(&digest);
+
+    return 0;
+}
+
+/* RESERVE by GUID prefix, in sorted batches, for replicas which can */
+static int reserve_prefixes(char *partition,
+			    struct sync_folder_list *replica_folders,
+			    struct sync_msgid_list *part_list)
+{
+    const char *cmd = "RESERVE";
+    struct sync_msgid **msgids;
+    struct sync_msgid *msgid;
+    struct sync_folder *folder;
+    struct buf prefixes = BUF_INITIALIZER;
+    unsigned char guidbuf[MESSAGE_GUID_SIZE];
+    struct dlist *kl;
+    struct dlist *kin = NULL;
+    struct dlist *ki;
+    int n = 0;
+    int i, batch;
+    int r = 0;
+
+    msgids = xmalloc(part_list->toupload * sizeof(struct sync_msgid *));
+    for (msgid = part_list->head; msgid; msgid = msgid->next) {
+	if (!msgid->need_upload) continue;
+	msgids[n++] = msgid;
+	/* we will re-add the "need upload" if it's not found */
+	msgid->need_upload = 0;
+	part_list->toupload--;
+    }
+    qsort(msgids, n, sizeof(struct sync_msgid *), guid_compare);
+
+    for (batch = 0; !r && batch < n; batch += SYNC_RESERVE_BATCH) {
+	int count = n - batch;
+	if (count > SYNC_RESERVE_BATCH) count = SYNC_RESERVE_BATCH;
+
+	buf_reset(&prefixes);
+	for (i = 0; i < count; i++) {
+	    message_guid_export(&msgids[batch+i]->guid, guidbuf);
+	    buf_appendmap(&prefixes, (char *)guidbuf, SYNC_GUID_PREFIX);
+	}
+
+	kl = dlist_newkvlist(NULL, cmd);
+	dlist_setatom(kl, "PARTITION", partition);
+	ki = dlist_newlist(kl, "MBOXNAME");
+	for (folder = replica_folders->head; folder; folder = folder->next)
+	    dlist_setatom(ki, "MBOXNAME", folder->name);
+	dlist_setmap(kl, "PREFIX", prefixes.s, prefixes.len);
+
+	sync_send_apply(kl, sync_out);
+	dlist_free(&kl);
+
+	r = sync_parse_response(cmd, sync_in, &kin);
+	if (!r) r = mark_found(kin, msgids + batch, count, part_list);
+	dlist_free(&kin);
+    }
+
+    free(msgids);
+    buf_free(&prefixes);
+
+    return r;
+}
+
 static int reserve_partition(char *partition,
 			     struct sync_folder_list *replica_folders,
 			     struct sync_msgid_list *part_list)
@@ -312,8 +444,11 @@ static int reserve_partition(char *partition,
     if (!part_list->toupload)
 	return 0; /* nothing to reserve */
 
-    if (!replica_folders->head)
-	return 0; /* nowhere to reserve */
+    /* even with no mailboxes of this user's to search, the replica
+     * may have them from earlier users on this connection */
+
+    if (CAPA(sync_backend, CAPA_SYNC_RESERVE_PREFIX))
+	return reserve_prefixes(partition, replica_folders, part_list);
 
     kl = dlist_newkvlist(NULL, cmd);
     dlist_setatom(kl, "PARTITION", partition);
@@ -325,7 +460,7 @@ static int reserve_partition(char *partition,
     ki = dlist_newlist(kl, "GUID");
     for (msgid = part_list->head; msgid; msgid = msgid->next) {
 	if (!msgid->need_upload) continue;
-	dlist_setatom(ki, "GUID", message_guid_encode(&msgid->guid));
+	dlist_setguid(ki, "GUID", &msgid->guid);
 	/* we will re-add the "need upload" if we get a MISSING response */
 	msgid->need_upload = 0;
 	part_list->toupload--;
@@ -363,6 +498,115 @@ static int reserve_messages(struct sync_name_list *mboxname_list,
     return 0;
 }
 
+/* The messages the replica still needs after the reserve are sent
+ * before any mailbox is updated, as few APPLY MESSAGEs as will carry
+ * them rather than one per mailbox.  Each batch's mailboxes are kept
+ * open (but unlocked) until it's been sent, so that the files can't
+ * be cleaned up underneath us. */
+
+#define UPLOAD_BATCH_SIZE	(16*1024*1024)
+#define UPLOAD_BATCH_MAILBOXES	32
+
+static int upload_batch(struct dlist **kuploadp,
+			struct mailbox **batch, int *nbatch)
+{
+    int r = 0;
+
+    if ((*kuploadp)->head) {
+	sync_send_apply(*kuploadp, sync_out);
+	r = sync_parse_response("MESSAGE", sync_in, NULL);
+	dlist_free(kuploadp);
+	*kuploadp = dlist_newlist(NULL, "MESSAGE");
+    }
+
+    while (*nbatch)
+	mailbox_close(&batch[--*nbatch]);
+
+    return r;
+}
+
+static int upload_messages(struct sync_name_list *mboxname_list,
+			   struct sync_reserve_list *reserve_guids)
+{
+    struct mailbox *batch[UPLOAD_BATCH_MAILBOXES];
+    struct dlist *kupload = dlist_newlist(NULL, "MESSAGE");
+    struct sync_msgid_list *part_list;
+    struct sync_msgid *msgid;
+    struct sync_name *mbox;
+    struct mailbox *mailbox = NULL;
+    struct index_record record;
+    unsigned long size = 0;
+    uint32_t recno;
+    int nbatch = 0;
+    int r = 0;
+
+    for (mbox = mboxname_list->head; mbox; mbox = mbox->next) {
+	r = mailbox_open_irl(mbox->name, &mailbox);
+	if (r == IMAP_MAILBOX_NONEXISTENT) {
+	    r = 0;
+	    continue;
+	}
+	if (r) goto bail;
+
+	part_list = sync_reserve_partlist(reserve_guids, mailbox->part);
+	if (!part_list->toupload) {
+	    mailbox_close(&mailbox);
+	    continue;
+	}
+
+	for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	    r = mailbox_read_index_record(mailbox, recno, &record);
+	    if (r) {
+		syslog(LOG_ERR,
+		       "IOERROR: reading index entry for recno %u of %s: %m",
+		       recno, mailbox->name);
+		goto bail;
+	    }
+
+	    if (record.system_flags & FLAG_UNLINKED)
+		continue;
+
+	    msgid = sync_msgid_lookup(part_list, &record.guid);
+	    if (!msgid || !msgid->need_upload)
+		continue;
+
+	    r = sync_send_file(mailbox, &record, part_list, kupload);
+	    if (r) goto bail;
+	    size += record.size;
+
+	    /* one big mailbox mustn't make a batch without limit, so send
+	     * what we have, keeping this mailbox open for the rest */
+	    if (size >= UPLOAD_BATCH_SIZE) {
+		mailbox_unlock_index(mailbox, NULL);
+		r = upload_batch(&kupload, batch, &nbatch);
+		if (!r) r = mailbox_lock_index(mailbox, LOCK_SHARED);
+		if (r) goto bail;
+		size = 0;
+	    }
+	}
+
+	mailbox_unlock_index(mailbox, NULL);
+	batch[nbatch++] = mailbox;
+	mailbox = NULL;
+
+	if (nbatch == UPLOAD_BATCH_MAILBOXES) {
+	    r = upload_batch(&kupload, batch, &nbatch);
+	    if (r) goto bail;
+	    size = 0;
+	}
+    }
+
+    r = upload_batch(&kupload, batch, &nbatch);
+
+ bail:
+    mailbox_close(&mailbox);
+    while (nbatch)
+	mailbox_close(&batch[--nbatch]);
+    dlist_free(&kupload);
+
+    return r;
+}
+
 /* ====================================================================== */
 
 static int response_parse(const char *cmd,
@@ -832,6 +1076,8 @@ static int copy_remote(struct mailbox *mailbox, uint32_t uid,
     struct sync_annot_list *annots = NULL;
 
     for (ki = kr->head; ki; ki = ki->next) {
+	/* just a UID: not one we'd ever copy back */
+	if (ki->type != DL_KVLIST) continue;
 	r = parse_upload(ki, mailbox, &record, &annots);
 	if (r) return r;
 	if (record.uid == uid) {
@@ -1084,6 +1330,34 @@ static int compare_one_record(struct mailbox *mailbox,
 }
 
 
+static int parse_stub_or_upload(struct dlist *ki, struct mailbox *mailbox,
+				struct index_record *record,
+				struct sync_annot_list **salp)
+{
+    if (ki->type == DL_KVLIST)
+	return parse_upload(ki, mailbox, record, salp);
+
+    memset(record, 0, sizeof(struct index_record));
+    record->uid = dlist_num(ki);
+
+    return 0;
+}
+
+/* a record the replica still has unchanged, but which has been
+ * cleaned out here since - so it goes on the replica too */
+static int expunge_stub(struct mailbox *mailbox, uint32_t uid,
+			struct dlist *kaction)
+{
+    /* the replica sends anything we've never seen in full */
+    if (uid > mailbox->i.last_uid)
+	return IMAP_PROTOCOL_BAD_PARAMETERS;
+
+    if (kaction)
+	dlist_setnum32(kaction, "EXPUNGE", uid);
+
+    return 0;
+}
+
 static int mailbox_update_loop(struct mailbox *mailbox,
 			       struct dlist *ki,
 			       uint32_t last_uid,
@@ -1096,6 +1370,7 @@ static int mailbox_update_loop(struct mailbox *mailbox,
     uint32_t old_num_records = mailbox->i.num_records;
     struct sync_annot_list *mannots = NULL;
     struct sync_annot_list *rannots = NULL;
+    int stub;
     int r;
 
     /* while there are more records on either master OR replica,
@@ -1105,21 +1380,27 @@ static int mailbox_update_loop(struct mailbox *mailbox,
 	sync_annot_list_free(&mannots);
 	sync_annot_list_free(&rannots);
 
+	/* a delta FULLMAILBOX gives just the UID of any record which
+	 * hasn't changed on the replica since we last agreed on it */
+	stub = (ki && ki->type != DL_KVLIST);
+
 	/* most common case - both a master AND a replica record exist */
 	if (ki && recno <= old_num_records) {
 	    r = mailbox_read_index_record(mailbox, recno, &mrecord);
 	    if (r) goto out;
 	    r = read_annotations(mailbox, &mrecord, &mannots);
 	    if (r) goto out;
-	    r = parse_upload(ki, mailbox, &rrecord, &rannots);
+	    r = parse_stub_or_upload(ki, mailbox, &rrecord, &rannots);
 	    if (r) goto out;
 
 	    /* same UID - compare the records */
 	    if (rrecord.uid == mrecord.uid) {
-		r = compare_one_record(mailbox,
-				       &mrecord, &rrecord,
-				       mannots, rannots,
-				       kaction);
+		/* anything changed here since will be sent anyway */
+		if (!stub)
+		    r = compare_one_record(mailbox,
+					   &mrecord, &rrecord,
+					   mannots, rannots,
+					   kaction);
 		if (r) goto out;
 		/* increment both */
 		recno++;
@@ -1137,6 +1418,12 @@ static int mailbox_update_loop(struct mailbox *mailbox,
 		/* only increment master */
 		recno++;
 	    }
+	    else if (stub) {
+		r = expunge_stub(mailbox, rrecord.uid, kaction);
+		if (r) goto out;
+		/* only increment replica */
+		ki = ki->next;
+	    }
 	    else {
 		/* record only exists on the replica */
 		if (!(rrecord.system_flags & FLAG_EXPUNGED)) {
@@ -1175,6 +1462,11 @@ static int mailbox_update_loop(struct mailbox *mailbox,
 	}
 
 	/* record only exists on the replica */
+	else if (stub) {
+	    r = expunge_stub(mailbox, dlist_num(ki), kaction);
+	    if (r) goto out;
+	    ki = ki->next;
+	}
 	else {
 	    r = parse_upload(ki, mailbox, &rrecord, &rannots);
 	    if (r) goto out;
@@ -1198,7 +1490,95 @@ out:
     return r;
 }
 
-static int mailbox_full_update(const char *mboxname)
+/* With sync_pipeline set, the APPLY commands for each mailbox are sent
+ * without waiting for the replies.  Up to that many replies can be
+ * outstanding; they are read back in order before anything else which
+ * needs an answer from the replica, including the APPLY MAILBOX after
+ * an upload of messages, and a mailbox whose CRC didn't match is
+ * marked to be retried with a full update afterwards. */
+
+struct pending_reply {
+    struct pending_reply *next;
+    const char *cmd;
+    struct sync_folder *folder;
+    int is_repeat;
+};
+
+/* is_repeat for an update after a full FULLMAILBOX, when a CRC mismatch
+ * is an error, and after a delta one, when it means try a full one */
+#define REPEAT_AFTER_FULL   1
+#define REPEAT_AFTER_DELTA  2
+
+static struct pending_reply *pending_head = NULL;
+static struct pending_reply **pending_tailp = &pending_head;
+static int pending_count = 0;
+
+static int pipeline_read_one(void)
+{
+    struct pending_reply *pending = pending_head;
+    int r;
+
+    assert(pending);
+
+    pending_head = pending->next;
+    if (!pending_head) pending_tailp = &pending_head;
+    pending_count--;
+
+    r = sync_parse_response(pending->cmd, sync_in, NULL);
+
+    if (r == IMAP_SYNC_CHECKSUM && pending->is_repeat != REPEAT_AFTER_FULL) {
+	syslog(LOG_ERR, "CRC failure on sync for %s, trying full update",
+	       pending->folder->name);
+	sync_stats->full_retries++;
+	pending->folder->retry = 1;
+	r = 0;
+    }
+    else if (r) {
+	syslog(LOG_ERR, "pipelined %s for %s failed: %s",
+	       pending->cmd, pending->folder->name, error_message(r));
+    }
+
+    free(pending);
+    return r;
+}
+
+/* read all the outstanding replies, returning the first error */
+static int pipeline_flush(void)
+{
+    int r = 0;
+
+    while (pending_head) {
+	int r2 = pipeline_read_one();
+	if (!r) r = r2;
+    }
+
+    return r;
+}
+
+static int pipeline_expect(const char *cmd, struct sync_folder *folder,
+			   int is_repeat)
+{
+    struct pending_reply *pending = xzmalloc(sizeof(struct pending_reply));
+
+    pending->cmd = cmd;
+    pending->folder = folder;
+    pending->is_repeat = is_repeat;
+    *pending_tailp = pending;
+    pending_tailp = &pending->next;
+    pending_count++;
+
+    /* keep the window bounded, so neither end blocks writing */
+    if (pending_count > sync_pipeline)
+	return pipeline_read_one();
+
+    return 0;
+}
+
+/* With since_modseq set, the replica is only asked for the records
+ * changed since then - it has everything up to since_modseq and
+ * since_uid in common with us apart from the cleaned out expunges. */
+static int mailbox_full_update(const char *mboxname,
+			       modseq_t since_modseq, uint32_t since_uid)
 {
     const char *cmd = "FULLMAILBOX";
     struct mailbox *mailbox = NULL;
@@ -1215,7 +1595,18 @@ static int mailbox_full_update(const char *mboxname)
     uint32_t uidvalidity;
     uint32_t last_uid;
 
-    kl = dlist_setatom(NULL, cmd, mboxname);
+    /* anything still in flight has to be answered first */
+    r = pipeline_flush();
+    if (r) return r;
+
+    if (since_modseq) {
+	kl = dlist_newkvlist(NULL, cmd);
+	dlist_setatom(kl, "MBOXNAME", mboxname);
+	dlist_setnum64(kl, "SINCE_MODSEQ", since_modseq);
+	dlist_setnum32(kl, "SINCE_UID", since_uid);
+    }
+    else
+	kl = dlist_setatom(NULL, cmd, mboxname);
     sync_send_lookup(kl, sync_out);
     dlist_free(&kl);
 
@@ -1408,7 +1799,8 @@ static int update_mailbox_once(struct sync_folder *local,
     r = mailbox_open_irl(local->name, &mailbox);
     if (r == IMAP_MAILBOX_NONEXISTENT) {
 	/* been deleted in the meanwhile... */
-	r = folder_delete(remote->name);
+	r = pipeline_flush();
+	if (!r) r = folder_delete(remote->name);
 	goto done;
     }
     else if (r)
@@ -1462,7 +1854,13 @@ static int update_mailbox_once(struct sync_folder *local,
 	 * files don't get deleted until we're finished with them... */
 	mailbox_unlock_index(mailbox, NULL);
 	sync_send_apply(kupload, sync_out);
-	r = sync_parse_response("MESSAGE", sync_in, NULL);
+	if (sync_pipeline) {
+	    /* the MAILBOX refers to these, so they must have arrived */
+	    r = pipeline_expect("MESSAGE", local, is_repeat);
+	    if (!r) r = pipeline_flush();
+	}
+	else
+	    r = sync_parse_response("MESSAGE", sync_in, NULL);
 	if (r) goto done; /* abort earlier */
     }
 
@@ -1471,7 +1869,10 @@ static int update_mailbox_once(struct sync_folder *local,
 
     /* update the mailbox */
     sync_send_apply(kl, sync_out);
-    r = sync_parse_response("MAILBOX", sync_in, NULL);
+    if (sync_pipeline)
+	r = pipeline_expect("MAILBOX", local, is_repeat);
+    else
+	r = sync_parse_response("MAILBOX", sync_in, NULL);
 
 done:
     annotate_putdb(&user_annot_db);
@@ -1492,14 +1893,33 @@ static int update_mailbox(struct sync_folder *local,
     int r = update_mailbox_once(local, remote, reserve_guids, 0);
 
     if (r == IMAP_AGAIN) {
-	r = mailbox_full_update(local->name);
-	if (!r) r = update_mailbox_once(local, remote, reserve_guids, 1);
+	sync_stats->full_retries++;
+
+	/* if the replica has just missed expunges which have since been
+	 * cleaned out here, the records changed since it was last in
+	 * step are enough to find them */
+	if (remote && remote->highestmodseq &&
+	    remote->uidvalidity == local->uidvalidity &&
+	    CAPA(sync_backend, CAPA_SYNC_FULLMAILBOX_SINCE)) {
+	    r = mailbox_full_update(local->name, remote->highestmodseq,
+				    local->last_uid);
+	    if (!r) r = update_mailbox_once(local, remote, reserve_guids,
+					    REPEAT_AFTER_DELTA);
+	    if (r != IMAP_SYNC_CHECKSUM) return r;
+	    syslog(LOG_ERR, "CRC failure on sync for %s after delta update, "
+		   "trying full update", local->name);
+	}
+	r = mailbox_full_update(local->name, 0, 0);
+	if (!r) r = update_mailbox_once(local, remote, reserve_guids,
+					REPEAT_AFTER_FULL);
     }
     else if (r == IMAP_SYNC_CHECKSUM) {
 	syslog(LOG_ERR, "CRC failure on sync for %s, trying full update",
 	       local->name);
-	r = mailbox_full_update(local->name);
-	if (!r) r = update_mailbox_once(local, remote, reserve_guids, 1);
+	sync_stats->full_retries++;
+	r = mailbox_full_update(local->name, 0, 0);
+	if (!r) r = update_mailbox_once(local, remote, reserve_guids,
+					REPEAT_AFTER_FULL);
     }
 
     return r;
@@ -1708,6 +2128,12 @@ int do_folders(struct sync_name_list *mboxname_list,
 	goto bail;
     }
 
+    r = upload_messages(mboxname_list, reserve_guids);
+    if (r) {
+	syslog(LOG_ERR, "upload messages: failed: %s", error_message(r));
+	goto bail;
+    }
+
     /* Tag folders on server which still exist on the client. Anything
      * on the server which remains untagged can be deleted immediately */
     for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
@@ -1786,7 +2212,31 @@ int do_folders(struct sync_name_list *mboxname_list,
 	}
     }
 
+    if (sync_pipeline) {
+	r = pipeline_flush();
+	if (r) goto bail;
+
+	/* and again, the hard way, for any whose CRC didn't match */
+	for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
+	    if (!mfolder->retry) continue;
+	    mfolder->retry = 0;
+	    rfolder = sync_folder_lookup(replica_folders, mfolder->uniqueid);
+	    r = mailbox_full_update(mfolder->name, 0, 0);
+	    if (!r) r = update_mailbox_once(mfolder, rfolder, reserve_guids,
+					    REPEAT_AFTER_FULL);
+	    if (r) {
+		syslog(LOG_ERR, "do_folders(): update failed: %s '%s'",
+		       mfolder->name, error_message(r));
+		goto bail;
+	    }
+	}
+
+	r = pipeline_flush();
+    }
+
  bail:
+    /* don't leave replies behind for the next command to trip over */
+    pipeline_flush();
     sync_folder_list_free(&master_folders);
     sync_rename_list_free(&rename_folders);
     sync_reserve_list_free(&reserve_guids);
@@ -2232,6 +2682,7 @@ static int do_sync_mailboxes(struct sync_name_list *mboxname_list,
 		    mbox->mark = 1;
 
 		    sync_action_list_add(user_list, NULL, userid);
+		    sync_stats->promotions++;
 		    if (verbose) {
 			printf("  Promoting: MAILBOX %s -> USER %s\n",
 			       mbox->name, userid);
@@ -2251,107 +2702,373 @@ static int do_sync_mailboxes(struct sync_name_list *mboxname_list,
     return r;
 }
 
-static int do_sync(const char *filename)
+/* ====================================================================== */
+
+/* The actions read from a replication log, a list for each kind */
+struct sync_work {
+    struct sync_action_list *user_list;
+    struct sync_action_list *meta_list;
+    struct sync_action_list *mailbox_list;
+    struct sync_action_list *quota_list;
+    struct sync_action_list *annot_list;
+    struct sync_action_list *seen_list;
+    struct sync_action_list *sub_list;
+    hash_table links;		/* users which must share a worker */
+};
+
+static void sync_work_init(struct sync_work *work)
 {
-    struct sync_action_list *user_list = sync_action_list_create();
-    struct sync_action_list *meta_list = sync_action_list_create();
-    struct sync_action_list *mailbox_list = sync_action_list_create();
-    struct sync_action_list *quota_list = sync_action_list_create();
-    struct sync_action_list *annot_list = sync_action_list_create();
-    struct sync_action_list *seen_list = sync_action_list_create();
-    struct sync_action_list *sub_list = sync_action_list_create();
-    struct sync_name_list *mboxname_list = sync_name_list_create();
-    static struct buf type, arg1, arg2;
-    char *arg1s, *arg2s;
-    struct sync_action *action;
-    int c;
-    int fd = -1;
-    int doclose = 0;
-    struct protstream *input;
-    int r = 0;
+    work->user_list = sync_action_list_create();
+    work->meta_list = sync_action_list_create();
+    work->mailbox_list = sync_action_list_create();
+    work->quota_list = sync_action_list_create();
+    work->annot_list = sync_action_list_create();
+    work->seen_list = sync_action_list_create();
+    work->sub_list = sync_action_list_create();
+    construct_hash_table(&work->links, 64, 0);
+}
 
-    if ((filename == NULL) || !strcmp(filename, "-"))
-	fd = 0; /* STDIN */
-    else {
-	fd = open(filename, O_RDWR);
-	if (fd < 0) {
-	    syslog(LOG_ERR, "Failed to open %s: %m", filename);
-	    r = IMAP_IOERROR;
-	    goto cleanup;
-	}
+static void sync_work_free(struct sync_work *work)
+{
+    sync_action_list_free(&work->user_list);
+    sync_action_list_free(&work->meta_list);
+    sync_action_list_free(&work->mailbox_list);
+    sync_action_list_free(&work->quota_list);
+    sync_action_list_free(&work->annot_list);
+    sync_action_list_free(&work->seen_list);
+    sync_action_list_free(&work->sub_list);
+    free_hash_table(&work->links, free);
+}
 
-	doclose = 1;
+static unsigned long sync_work_count(struct sync_work *work)
+{
+    return work->user_list->count + work->meta_list->count +
+	work->mailbox_list->count + work->quota_list->count +
+	work->annot_list->count + work->seen_list->count +
+	work->sub_list->count;
+}
 
-	if (lock_blocking(fd) < 0) {
-	    syslog(LOG_ERR, "Failed to lock %s: %m", filename);
-	    r = IMAP_IOERROR;
-	    goto cleanup;
-	}
+static void sync_work_error(int r)
+{
+    if (verbose)
+	fprintf(stderr, "Error in do_sync(): bailing out! %s\n", error_message(r));
+
+    syslog(LOG_ERR, "Error in do_sync(): bailing out! %s", error_message(r));
+}
+
+/* ====================================================================== */
+
+/* With sync_workers set, do_sync() forks that many processes less one,
+ * each with its own connection to the replica, and keeps them for as
+ * long as sync_client runs.  For each batch the parent shares the work
+ * out by user, so that everything for one user is still done in order
+ * by the one process, and sends each worker its share down a pipe as
+ * replication log lines followed by "RUN".  The worker answers "OK" or
+ * "NO" once it's done; after "NO" it exits, and another is started for
+ * the next batch.  Anything which isn't a user's, or whose worker isn't
+ * running, is left to the parent. */
+
+struct sync_worker {
+    pid_t pid;
+    struct protstream *to;	/* work for the worker */
+    struct protstream *from;	/* and its answers */
+    int busy;			/* an answer is due */
+};
+
+/* [0] is the parent itself, and NULL in the workers */
+static struct sync_worker *workers = NULL;
+
+/* a rename from one user to another has to be done by one worker, so
+ * the users are linked: each one links to another, and the user at the
+ * end of the chain decides the worker for them all.  "" is the parent,
+ * for mailboxes which aren't a user's */
+static const char *sync_link_find(struct sync_work *work, const char *userid)
+{
+    const char *next;
+
+    while ((next = hash_lookup(userid, &work->links)))
+	userid = next;
+
+    return userid;
+}
+
+static void sync_link_mailboxes(struct sync_work *work, const char *name1,
+				const char *name2)
+{
+    const char *userid;
+    char *root1, *root2;
+
+    userid = mboxname_to_userid(name1);
+    root1 = xstrdup(sync_link_find(work, userid ? userid : ""));
+    userid = mboxname_to_userid(name2);
+    root2 = xstrdup(sync_link_find(work, userid ? userid : ""));
+
+    if (strcmp(root1, root2)) {
+	/* keep the parent at the end of any chain it's in */
+	if (!*root2)
+	    hash_insert(root1, xstrdup(root2), &work->links);
+	else
+	    hash_insert(root2, xstrdup(root1), &work->links);
     }
 
-    input = prot_new(fd, 0);
+    free(root1);
+    free(root2);
+}
 
-    while (1) {
-	if ((c = getword(input, &type)) == EOF)
-	    break;
+static int sync_shard(struct sync_work *work, const char *userid,
+		      const char *mboxname)
+{
+    if (!userid && mboxname) userid = mboxname_to_userid(mboxname);
+    userid = sync_link_find(work, userid ? userid : "");
+    if (!*userid) return 0;
+
+    return sync_userhash(userid) % sync_workers;
+}
+
+static int sync_work_parse(struct protstream *input, struct sync_work *work,
+			   int isworker);
+static int sync_work_run(struct sync_work *work);
 
-	/* Ignore blank lines */
-	if (c == '\r') c = prot_getc(input);
-	if (c == '\n')
+/* what a worker does until the parent goes away */
+static void sync_worker_loop(struct protstream *in, struct protstream *out)
+	__attribute__((noreturn));
+static void sync_worker_loop(struct protstream *in, struct protstream *out)
+{
+    struct sync_work work;
+    int c, r = 0;
+
+    sync_work_init(&work);
+
+    while ((c = sync_work_parse(in, &work, 1)) != EOF) {
+	if (c != 1) continue;
+
+	r = sync_work_run(&work);
+	if (r) sync_work_error(r);
+	prot_printf(out, "%s\n", r ? "NO" : "OK");
+	prot_flush(out);
+
+	/* our connection may be no good, let the parent start another */
+	if (r) break;
+
+	sync_work_free(&work);
+	sync_work_init(&work);
+    }
+
+    sync_work_free(&work);
+    replica_disconnect();
+    shut_down(r ? 1 : 0);
+}
+
+/* start any workers which aren't running, before the log is opened so
+ * that they don't keep it open */
+static void sync_start_workers(void)
+{
+    int i, j;
+
+    if (!workers) {
+	workers = xzmalloc(sync_workers * sizeof(struct sync_worker));
+	/* a worker that's gone shouldn't take us with it */
+	signal(SIGPIPE, SIG_IGN);
+    }
+
+    for (i = 1; i < sync_workers; i++) {
+	struct sync_worker *w = &workers[i];
+	int to[2], from[2];
+	pid_t pid;
+
+	if (w->pid) continue;
+
+	if (pipe(to) < 0) {
+	    syslog(LOG_ERR, "sync worker %d: pipe failed: %m", i);
 	    continue;
+	}
+	if (pipe(from) < 0) {
+	    syslog(LOG_ERR, "sync worker %d: pipe failed: %m", i);
+	    close(to[0]);
+	    close(to[1]);
+	    continue;
+	}
+
+	pid = fork();
 
-	if (c != ' ') {
-	    syslog(LOG_ERR, "Invalid input");
-	    eatline(input, c);
+	if (pid == -1) {
+	    syslog(LOG_ERR, "sync worker %d: fork failed: %m", i);
+	    close(to[0]);
+	    close(to[1]);
+	    close(from[0]);
+	    close(from[1]);
 	    continue;
 	}
 
-	if ((c = getastring(input, 0, &arg1)) == EOF) break;
-	arg1s = arg1.s;
+	if (!pid) {
+	    struct protstream *in, *out;
 
-	if (c == ' ') {
-	    if ((c = getastring(input, 0, &arg2)) == EOF) break;
-	    arg2s = arg2.s;
+	    /* only our own pipes and connection are ours to use */
+	    for (j = 1; j < sync_workers; j++) {
+		if (!workers[j].pid) continue;
+		close(workers[j].to->fd);
+		close(workers[j].from->fd);
+		prot_free(workers[j].to);
+		prot_free(workers[j].from);
+	    }
+	    free(workers);
+	    workers = NULL;
+	    close(to[1]);
+	    close(from[0]);
+	    close(sync_backend->sock);
+	    sync_backend = NULL;
+	    sync_stats_worker(i);
+
+	    mboxlist_close();
+	    mboxlist_open(NULL);
+	    quotadb_close();
+	    quotadb_open(NULL);
+	    annotatemore_close();
+	    annotatemore_open();
+
+	    replica_connect(sync_channel);
+
+	    in = prot_new(to[0], 0);
+	    out = prot_new(from[1], 1);
+	    sync_worker_loop(in, out);
+	}
 
-	} else 
-	    arg2s = NULL;
-	
-	if (c == '\r') c = prot_getc(input);
-	if (c != '\n') {
-	    syslog(LOG_ERR, "Garbage at end of input line");
-	    eatline(input, c);
-	    continue;
+	close(to[0]);
+	close(from[1]);
+	w->pid = pid;
+	w->to = prot_new(to[1], 1);
+	/* literals in names go unsynchronised, as in the log */
+	prot_setisclient(w->to, 1);
+	w->from = prot_new(from[0], 0);
+	w->busy = 0;
+    }
+}
+
+static void sync_reap_worker(int i)
+{
+    struct sync_worker *w = &workers[i];
+    int status;
+
+    close(w->to->fd);
+    close(w->from->fd);
+    prot_free(w->to);
+    prot_free(w->from);
+
+    while (waitpid(w->pid, &status, 0) < 0) {
+	if (errno != EINTR) {
+	    status = -1;
+	    break;
 	}
+    }
 
-	ucase(type.s);
-
-	if (!strcmp(type.s, "USER"))
-	    sync_action_list_add(user_list, NULL, arg1s);
-	else if (!strcmp(type.s, "META"))
-	    sync_action_list_add(meta_list, NULL, arg1s);
-	else if (!strcmp(type.s, "SIEVE"))
-	    sync_action_list_add(meta_list, NULL, arg1s);
-	else if (!strcmp(type.s, "MAILBOX"))
-	    sync_action_list_add(mailbox_list, arg1s, NULL);
-	else if (!strcmp(type.s, "QUOTA"))
-	    sync_action_list_add(quota_list, arg1s, NULL);
-	else if (!strcmp(type.s, "ANNOTATION"))
-	    sync_action_list_add(annot_list, arg1s, NULL);
-	else if (!strcmp(type.s, "SEEN"))
-	    sync_action_list_add(seen_list, arg2s, arg1s);
-	else if (!strcmp(type.s, "SUB"))
-	    sync_action_list_add(sub_list, arg2s, arg1s);
-	else if (!strcmp(type.s, "UNSUB"))
-	    sync_action_list_add(sub_list, arg2s, arg1s);
-	else
-	    syslog(LOG_ERR, "Unknown action type: %s", type.s);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+	syslog(LOG_ERR, "sync worker %d (pid %d) failed", i, (int) w->pid);
+
+    memset(w, 0, sizeof(struct sync_worker));
+}
+
+static void sync_stop_workers(void)
+{
+    int i;
+
+    if (!workers) return;
+
+    for (i = 1; i < sync_workers; i++) {
+	if (workers[i].pid) sync_reap_worker(i);
     }
 
-    prot_free(input);
-    if (doclose) {
-	close(fd);
-	doclose = 0;
+    free(workers);
+    workers = NULL;
+}
+
+static void sync_send_list(struct sync_work *work,
+			   struct sync_action_list *list, const char *type)
+{
+    struct sync_action *action;
+
+    for (action = list->head; action; action = action->next) {
+	struct protstream *to;
+	int i;
+
+	if (!action->active) continue;
+
+	i = sync_shard(work, action->user, action->name);
+	if (!i || !workers[i].pid) continue;
+
+	to = workers[i].to;
+	prot_printf(to, "%s", type);
+	if (action->user) {
+	    prot_putc(' ', to);
+	    prot_printastring(to, action->user);
+	}
+	if (action->name) {
+	    prot_putc(' ', to);
+	    prot_printastring(to, action->name);
+	}
+	prot_putc('\n', to);
+
+	workers[i].busy = 1;
+	action->active = 0;
+    }
+}
+
+/* hand each worker its share, leaving the rest for us */
+static void sync_send_work(struct sync_work *work)
+{
+    int i;
+
+    sync_send_list(work, work->user_list, "USER");
+    sync_send_list(work, work->meta_list, "META");
+    sync_send_list(work, work->mailbox_list, "MAILBOX");
+    sync_send_list(work, work->quota_list, "QUOTA");
+    sync_send_list(work, work->annot_list, "ANNOTATION");
+    sync_send_list(work, work->seen_list, "SEEN");
+    sync_send_list(work, work->sub_list, "SUB");
+
+    for (i = 1; i < sync_workers; i++) {
+	if (!workers[i].busy) continue;
+
+	prot_printf(workers[i].to, "RUN\n");
+	prot_flush(workers[i].to);
     }
+}
+
+/* wait for each worker to finish what it was sent */
+static int sync_wait_workers(void)
+{
+    static struct buf answer;
+    int i, c;
+    int r = 0;
+
+    for (i = 1; i < sync_workers; i++) {
+	struct sync_worker *w = &workers[i];
+
+	if (!w->busy) continue;
+	w->busy = 0;
+
+	c = getword(w->from, &answer);
+	if (c == '\n' && !strcmp(answer.s, "OK")) continue;
+
+	/* it's on its way out, or gone already */
+	r = IMAP_AGAIN;
+	sync_reap_worker(i);
+    }
+
+    return r;
+}
+
+static int sync_work_run(struct sync_work *work)
+{
+    struct sync_action_list *user_list = work->user_list;
+    struct sync_action_list *meta_list = work->meta_list;
+    struct sync_action_list *mailbox_list = work->mailbox_list;
+    struct sync_action_list *quota_list = work->quota_list;
+    struct sync_action_list *annot_list = work->annot_list;
+    struct sync_action_list *seen_list = work->seen_list;
+    struct sync_action_list *sub_list = work->sub_list;
+    struct sync_name_list *mboxname_list = sync_name_list_create();
+    struct sync_action *action;
+    int r = 0;
 
     /* Optimise out redundant clauses */
 
@@ -2385,6 +3102,9 @@ static int do_sync(const char *filename)
 	remove_meta(action->user, sub_list);
     }
 
+    /* Share the work out */
+    if (workers) sync_send_work(work);
+
     /* And then run tasks. */
     for (action = quota_list->head; action; action = action->next) {
 	if (!action->active)
@@ -2393,6 +3113,7 @@ static int do_sync(const char *filename)
 	if (do_quota(action->name)) {
 	    /* XXX - bogus handling, should be user */
 	    sync_action_list_add(mailbox_list, action->name, NULL);
+	    sync_stats->promotions++;
 	    if (verbose) {
 		printf("  Promoting: QUOTA %s -> MAILBOX %s\n",
 		       action->name, action->name);
@@ -2414,6 +3135,7 @@ static int do_sync(const char *filename)
 	if (do_annotation(action->name) && *action->name) {
 	    /* XXX - bogus handling, should be ... er, something */
 	    sync_action_list_add(mailbox_list, action->name, NULL);
+	    sync_stats->promotions++;
 	    if (verbose) {
 		printf("  Promoting: ANNOTATION %s -> MAILBOX %s\n",
 		       action->name, action->name);
@@ -2433,6 +3155,7 @@ static int do_sync(const char *filename)
 	    char *userid = mboxname_isusermailbox(action->name, 1);
 	    if (userid && !strcmp(userid, action->user)) {
 		sync_action_list_add(user_list, NULL, action->user);
+		sync_stats->promotions++;
 		if (verbose) {
 		    printf("  Promoting: SEEN %s %s -> USER %s\n",
 			   action->user, action->name, action->user);
@@ -2443,6 +3166,7 @@ static int do_sync(const char *filename)
 		}
 	    } else {
 		sync_action_list_add(meta_list, NULL, action->user);
+		sync_stats->promotions++;
 		if (verbose) {
 		    printf("  Promoting: SEEN %s %s -> META %s\n",
 			   action->user, action->name, action->user);
@@ -2461,6 +3185,7 @@ static int do_sync(const char *filename)
 
         if (user_sub(action->user, action->name)) {
             sync_action_list_add(meta_list, NULL, action->user);
+            sync_stats->promotions++;
             if (verbose) {
                 printf("  Promoting: SUB %s %s -> META %s\n",
                        action->user, action->name, action->user);
@@ -2499,6 +3224,7 @@ static int do_sync(const char *filename)
 	    if (r == IMAP_INVALID_USER) goto cleanup;
 
 	    sync_action_list_add(user_list, NULL, action->user);
+	    sync_stats->promotions++;
 	    if (verbose) {
 		printf("  Promoting: META %s -> USER %s\n",
 		       action->user, action->user);
@@ -2511,34 +3237,489 @@ static int do_sync(const char *filename)
     }
 
     for (action = user_list->head; action; action = action->next) {
+	if (!action->active)
+	    continue;
+
 	r = do_user(action->user);
 	if (r) goto cleanup;
     }
 
   cleanup:
-    if (doclose) close(fd);
+    sync_name_list_free(&mboxname_list);
 
-    if (r) {
-	if (verbose)
-	    fprintf(stderr, "Error in do_sync(): bailing out! %s\n", error_message(r));
+    if (workers) {
+	int r2 = sync_wait_workers();
+	if (!r) r = r2;
+    }
+
+    return r;
+}
 
-	syslog(LOG_ERR, "Error in do_sync(): bailing out! %s", error_message(r));
+/* read one line of a replication log into 'work'.  Returns EOF at the
+ * end of the input, 1 for the "RUN" a worker is sent after its share of
+ * a batch, and 0 for anything else */
+static int sync_work_parse(struct protstream *input, struct sync_work *work,
+			   int isworker)
+{
+    static struct buf type, arg1, arg2;
+    char *arg1s, *arg2s;
+    int c;
+
+    if ((c = getword(input, &type)) == EOF)
+	return EOF;
+
+    if (c == '\r') c = prot_getc(input);
+    if (isworker && c == '\n' && !strcmp(type.s, "RUN"))
+	return 1;
+
+    /* Ignore blank lines */
+    if (c == '\n')
+	return 0;
+
+    if (c != ' ') {
+	syslog(LOG_ERR, "Invalid input");
+	eatline(input, c);
+	return 0;
     }
 
-    sync_action_list_free(&user_list);
-    sync_action_list_free(&meta_list);
-    sync_action_list_free(&mailbox_list);
-    sync_action_list_free(&quota_list);
-    sync_action_list_free(&annot_list);
-    sync_action_list_free(&seen_list);
-    sync_action_list_free(&sub_list);
-    sync_name_list_free(&mboxname_list);
+    if ((c = getastring(input, 0, &arg1)) == EOF) return EOF;
+    arg1s = arg1.s;
+
+    if (c == ' ') {
+	if ((c = getastring(input, 0, &arg2)) == EOF) return EOF;
+	arg2s = arg2.s;
+
+    } else 
+	arg2s = NULL;
+    
+    if (c == '\r') c = prot_getc(input);
+    if (c != '\n') {
+	syslog(LOG_ERR, "Garbage at end of input line");
+	eatline(input, c);
+	return 0;
+    }
+
+    ucase(type.s);
+    /* the parent counted them when it read the log */
+    if (!isworker) sync_stats->events++;
+
+    if (!strcmp(type.s, "USER"))
+	sync_action_list_add(work->user_list, NULL, arg1s);
+    else if (!strcmp(type.s, "META"))
+	sync_action_list_add(work->meta_list, NULL, arg1s);
+    else if (!strcmp(type.s, "SIEVE"))
+	sync_action_list_add(work->meta_list, NULL, arg1s);
+    else if (!strcmp(type.s, "MAILBOX")) {
+	/* a rename names both mailboxes, which must go together */
+	sync_action_list_add(work->mailbox_list, arg1s, NULL);
+	if (arg2s) {
+	    sync_action_list_add(work->mailbox_list, arg2s, NULL);
+	    sync_link_mailboxes(work, arg1s, arg2s);
+	}
+    }
+    else if (!strcmp(type.s, "QUOTA"))
+	sync_action_list_add(work->quota_list, arg1s, NULL);
+    else if (!strcmp(type.s, "ANNOTATION"))
+	sync_action_list_add(work->annot_list, arg1s, NULL);
+    else if (!strcmp(type.s, "SEEN"))
+	sync_action_list_add(work->seen_list, arg2s, arg1s);
+    else if (!strcmp(type.s, "SUB"))
+	sync_action_list_add(work->sub_list, arg2s, arg1s);
+    else if (!strcmp(type.s, "UNSUB"))
+	sync_action_list_add(work->sub_list, arg2s, arg1s);
+    else
+	syslog(LOG_ERR, "Unknown action type: %s", type.s);
+
+    return 0;
+}
+
+static int do_sync(const char *filename)
+{
+    struct sync_work work;
+    int fd = -1;
+    int doclose = 0;
+    struct protstream *input = NULL;
+    int r = 0;
+
+    if (sync_workers > 1) sync_start_workers();
+
+    sync_work_init(&work);
+
+    if ((filename == NULL) || !strcmp(filename, "-"))
+	fd = 0; /* STDIN */
+    else {
+	fd = open(filename, O_RDWR);
+	if (fd < 0) {
+	    syslog(LOG_ERR, "Failed to open %s: %m", filename);
+	    r = IMAP_IOERROR;
+	    goto cleanup;
+	}
+
+	doclose = 1;
+
+	if (lock_blocking(fd) < 0) {
+	    syslog(LOG_ERR, "Failed to lock %s: %m", filename);
+	    r = IMAP_IOERROR;
+	    goto cleanup;
+	}
+    }
+
+    input = prot_new(fd, 0);
+
+    while (sync_work_parse(input, &work, 0) != EOF) {
+	/* replay what we have so far rather than hold all of a huge
+	 * log in memory - every action is safe to repeat, so a later
+	 * batch naming the same things again does no harm */
+	if (sync_log_batch &&
+	    sync_work_count(&work) >= (unsigned long) sync_log_batch) {
+	    r = sync_work_run(&work);
+	    sync_work_free(&work);
+	    sync_work_init(&work);
+	    if (r) goto cleanup;
+	}
+    }
+
+    prot_free(input);
+    input = NULL;
+    if (doclose) {
+	close(fd);
+	doclose = 0;
+    }
+
+    r = sync_work_run(&work);
+
+  cleanup:
+    if (input) prot_free(input);
+    if (doclose) close(fd);
+
+    if (r) sync_work_error(r);
+
+    sync_work_free(&work);
 
     return r;
 }
 
 /* ====================================================================== */
 
+/* The rolling client writes its stats out next to the sync log as it
+ * goes, one "name value" line each, for sync_client -T or anything
+ * else keeping an eye on the replica to read.
+ *
+ * Nothing in the sync log says when it was written, but everything in
+ * it was written since the client last took the log away to work on,
+ * so that's how old the oldest pending event can be at most.  Likewise
+ * the lag of a pass is how long it finished after the pickup before
+ * its own: no event it replicated can have waited longer than that. */
+
+static time_t stats_start = 0;
+static time_t stats_pickup = 0;		/* when we took the log we're on */
+static time_t stats_prev_pickup = 0;	/* and the one before, 0 if unknown */
+static time_t stats_lag = -1;
+
+struct sync_status {
+    pid_t pid;
+    time_t start;
+    time_t updated;
+    time_t pickup;
+    time_t prev_pickup;
+    time_t lag;
+};
+
+/* count the lines in a log, if it's there */
+static void stats_count_log(const char *fname, unsigned long long *eventsp,
+			    unsigned long long *bytesp)
+{
+    const char *base = NULL, *p, *end;
+    size_t len = 0;
+    struct stat sbuf;
+    int fd;
+
+    *eventsp = *bytesp = 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return;
+
+    if (!fstat(fd, &sbuf) && sbuf.st_size) {
+	map_refresh(fd, 1, &base, &len, sbuf.st_size, fname, 0);
+	for (p = base, end = base + len;
+	     (p = memchr(p, '\n', end - p)); p++)
+	    (*eventsp)++;
+	map_free(&base, &len);
+	*bytesp = sbuf.st_size;
+    }
+
+    close(fd);
+}
+
+/* the pending events, those being worked on right now, and how old the
+ * oldest of them all can be: -1 if we can't tell */
+static time_t stats_pending(const char *channel, const struct sync_status *st,
+			    time_t now, unsigned long long *pendingp,
+			    unsigned long long *bytesp,
+			    unsigned long long *workingp)
+{
+    char work_file_name[MAX_MAILBOX_PATH];
+    unsigned long long workbytes;
+
+    stats_count_log(sync_log_fname(channel), pendingp, bytesp);
+
+    *workingp = 0;
+    if (st->pid) {
+	snprintf(work_file_name, sizeof(work_file_name), "%s-%d",
+		 sync_log_fname(channel), (int) st->pid);
+	stats_count_log(work_file_name, workingp, &workbytes);
+    }
+
+    if (*workingp)
+	return st->prev_pickup ? now - st->prev_pickup : -1;
+    if (*pendingp)
+	return st->pickup ? now - st->pickup : -1;
+    return 0;
+}
+
+static void stats_write(const char *channel)
+{
+    struct sync_stats total;
+    struct sync_status st;
+    unsigned long long pending, bytes, working;
+    char *fname, tmpname[MAX_MAILBOX_PATH];
+    time_t oldest;
+    FILE *f;
+    int i, j;
+
+    st.pid = getpid();
+    st.start = stats_start;
+    st.updated = time(NULL);
+    st.pickup = stats_pickup;
+    st.prev_pickup = stats_prev_pickup;
+    st.lag = stats_lag;
+
+    oldest = stats_pending(channel, &st, st.updated,
+			   &pending, &bytes, &working);
+    sync_stats_total(&total);
+
+    fname = sync_stats_fname(channel);
+    snprintf(tmpname, sizeof(tmpname), "%s.NEW", fname);
+
+    f = fopen(tmpname, "w");
+    if (!f) {
+	syslog(LOG_ERR, "IOERROR: failed to write %s: %m", tmpname);
+	return;
+    }
+
+    fprintf(f, "pid %d\n", (int) st.pid);
+    fprintf(f, "start %ld\n", (long) st.start);
+    fprintf(f, "updated %ld\n", (long) st.updated);
+    fprintf(f, "pickup %ld\n", (long) st.pickup);
+    fprintf(f, "prev_pickup %ld\n", (long) st.prev_pickup);
+    fprintf(f, "lag %ld\n", (long) st.lag);
+    fprintf(f, "pending_events %llu\n", pending);
+    fprintf(f, "pending_bytes %llu\n", bytes);
+    fprintf(f, "working_events %llu\n", working);
+    fprintf(f, "oldest_pending %ld\n", (long) oldest);
+    fprintf(f, "events %llu\n", total.events);
+    fprintf(f, "passes %llu\n", total.passes);
+    fprintf(f, "bytes_in %llu\n", total.bytes_in);
+    fprintf(f, "bytes_out %llu\n", total.bytes_out);
+    fprintf(f, "connect_retries %llu\n", total.connect_retries);
+    fprintf(f, "full_retries %llu\n", total.full_retries);
+    fprintf(f, "promotions %llu\n", total.promotions);
+    fprintf(f, "reconnects %llu\n", total.reconnects);
+
+    for (i = 0; i < SYNC_STATS_NUMCMDS; i++) {
+	const char *name = sync_stats_cmdname[i];
+	struct sync_cmd_stats *cs = &total.cmd[i];
+
+	fprintf(f, "%s_count %llu\n", name, cs->count);
+	fprintf(f, "%s_failed %llu\n", name, cs->failed);
+	fprintf(f, "%s_usec %llu\n", name, cs->usec);
+	fprintf(f, "%s_hist", name);
+	for (j = 0; j < SYNC_STATS_BUCKETS; j++)
+	    fprintf(f, " %llu", cs->hist[j]);
+	fprintf(f, "\n");
+    }
+
+    if (fclose(f) == EOF) {
+	syslog(LOG_ERR, "IOERROR: failed to write %s: %m", tmpname);
+	unlink(tmpname);
+	return;
+    }
+
+    if (rename(tmpname, fname) < 0) {
+	syslog(LOG_ERR, "IOERROR: failed to rename %s: %m", tmpname);
+	unlink(tmpname);
+    }
+}
+
+static int stats_read(const char *channel, struct sync_status *st,
+		      struct sync_stats *total)
+{
+    char buf[1024], name[64];
+    FILE *f;
+    int i, j, n;
+
+    memset(st, 0, sizeof(struct sync_status));
+    memset(total, 0, sizeof(struct sync_stats));
+    st->lag = -1;
+
+    f = fopen(sync_stats_fname(channel), "r");
+    if (!f) return IMAP_IOERROR;
+
+    while (fgets(buf, sizeof(buf), f)) {
+	unsigned long long val;
+	long t;
+	char *p;
+
+	if (sscanf(buf, "%63s %n", name, &n) < 1) continue;
+	p = buf + n;
+	val = strtoull(p, NULL, 10);
+	t = strtol(p, NULL, 10);
+
+	if (!strcmp(name, "pid")) st->pid = t;
+	else if (!strcmp(name, "start")) st->start = t;
+	else if (!strcmp(name, "updated")) st->updated = t;
+	else if (!strcmp(name, "pickup")) st->pickup = t;
+	else if (!strcmp(name, "prev_pickup")) st->prev_pickup = t;
+	else if (!strcmp(name, "lag")) st->lag = t;
+	else if (!strcmp(name, "events")) total->events = val;
+	else if (!strcmp(name, "passes")) total->passes = val;
+	else if (!strcmp(name, "bytes_in")) total->bytes_in = val;
+	else if (!strcmp(name, "bytes_out")) total->bytes_out = val;
+	else if (!strcmp(name, "connect_retries")) total->connect_retries = val;
+	else if (!strcmp(name, "full_retries")) total->full_retries = val;
+	else if (!strcmp(name, "promotions")) total->promotions = val;
+	else if (!strcmp(name, "reconnects")) total->reconnects = val;
+	else for (i = 0; i < SYNC_STATS_NUMCMDS; i++) {
+	    struct sync_cmd_stats *cs = &total->cmd[i];
+	    size_t len = strlen(sync_stats_cmdname[i]);
+	    const char *field = name + len;
+
+	    if (strncmp(name, sync_stats_cmdname[i], len) || *field != '_')
+		continue;
+	    field++;
+
+	    if (!strcmp(field, "count")) cs->count = val;
+	    else if (!strcmp(field, "failed")) cs->failed = val;
+	    else if (!strcmp(field, "usec")) cs->usec = val;
+	    else if (!strcmp(field, "hist")) {
+		for (j = 0; j < SYNC_STATS_BUCKETS; j++) {
+		    cs->hist[j] = strtoull(p, &p, 10);
+		}
+	    }
+	    break;
+	}
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+/* the latency in ms under which pct percent of commands came back,
+ * or 0 if it's beyond the last bucket */
+static unsigned long stats_percentile(const struct sync_cmd_stats *cs,
+				      int pct)
+{
+    unsigned long long want = (cs->count * pct + 99) / 100;
+    unsigned long long seen = 0;
+    int j;
+
+    for (j = 0; j < SYNC_STATS_BUCKETS - 1; j++) {
+	seen += cs->hist[j];
+	if (seen >= want) return 1UL << j;
+    }
+
+    return 0;
+}
+
+static void stats_print_percentile(const struct sync_cmd_stats *cs,
+				   const char *label, int pct)
+{
+    unsigned long ms = stats_percentile(cs, pct);
+
+    if (ms)
+	printf(", %s <%lums", label, ms);
+    else
+	printf(", %s >=%lums", label, 1UL << (SYNC_STATS_BUCKETS - 2));
+}
+
+static int do_stats_summary(const char *channel)
+{
+    struct sync_stats total;
+    struct sync_status st;
+    unsigned long long pending, bytes, working, commands = 0;
+    time_t now = time(NULL), oldest, elapsed;
+    int running;
+    int i;
+
+    printf("channel: %s\n", channel ? channel : "(default)");
+
+    if (stats_read(channel, &st, &total)) {
+	printf("no stats in %s\n", sync_stats_fname(channel));
+    }
+    else {
+	running = st.pid && !kill(st.pid, 0);
+	printf("rolling sync_client: pid %d, %s, stats %lds old\n",
+	       (int) st.pid, running ? "running" : "not running",
+	       (long) (now - st.updated));
+    }
+
+    oldest = stats_pending(channel, &st, now, &pending, &bytes, &working);
+    printf("pending: %llu events (%llu bytes), %llu being worked on",
+	   pending, bytes, working);
+    if (oldest < 0)
+	printf(", oldest of unknown age\n");
+    else if (pending || working)
+	printf(", oldest at most %lds old\n", (long) oldest);
+    else
+	printf("\n");
+
+    if (!st.updated) return 0;
+
+    if (st.lag < 0)
+	printf("last pass lag: unknown\n");
+    else
+	printf("last pass lag: at most %lds\n", (long) st.lag);
+
+    elapsed = st.updated - st.start;
+    if (elapsed < 1) elapsed = 1;
+
+    for (i = 0; i < SYNC_STATS_NUMCMDS; i++)
+	commands += total.cmd[i].count;
+
+    printf("since %s", ctime(&st.start));
+    printf("  %llu passes, %llu events (%.1f/s)\n",
+	   total.passes, total.events, (double) total.events / elapsed);
+    printf("  %llu commands (%.1f/s)\n",
+	   commands, (double) commands / elapsed);
+    printf("  %llu bytes out (%.0f/s), %llu bytes in (%.0f/s)\n",
+	   total.bytes_out, (double) total.bytes_out / elapsed,
+	   total.bytes_in, (double) total.bytes_in / elapsed);
+    printf("  retries: %llu connect, %llu full update, "
+	   "%llu promotion, %llu reconnect\n",
+	   total.connect_retries, total.full_retries,
+	   total.promotions, total.reconnects);
+
+    for (i = 0; i < SYNC_STATS_NUMCMDS; i++) {
+	const struct sync_cmd_stats *cs = &total.cmd[i];
+
+	printf("%s: %llu", sync_stats_cmdname[i], cs->count);
+	if (cs->failed)
+	    printf(", %llu failed", cs->failed);
+	if (cs->count) {
+	    printf(", mean %.1fms", (double) cs->usec / cs->count / 1000);
+	    stats_print_percentile(cs, "p50", 50);
+	    stats_print_percentile(cs, "p90", 90);
+	    stats_print_percentile(cs, "p99", 99);
+	}
+	printf("\n");
+    }
+
+    return 0;
+}
+
+/* ====================================================================== */
+
 enum {
     RESTART_NONE = 0,
     RESTART_NORMAL,
@@ -2589,6 +3770,10 @@ int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
 	    /* XXX  Is 60 minutes a resonable timeframe? */
 	    syslog(LOG_NOTICE,
 		   "Reprocessing sync log file %s", work_file_name);
+
+	    /* no telling how long that's been there */
+	    stats_prev_pickup = 0;
+	    stats_pickup = time(NULL);
 	}
 	else {
 	    /* Check for sync_log file */
@@ -2608,7 +3793,11 @@ int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
 		r = IMAP_IOERROR;
 		break;
 	    }
+
+	    stats_prev_pickup = stats_pickup;
+	    stats_pickup = time(NULL);
 	}
+	stats_write(sync_channel);
 
 	/* Process the work log */
         if ((r=do_sync(work_file_name))) {
@@ -2624,6 +3813,10 @@ int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
 	    r = IMAP_IOERROR;
 	    break;
         }
+
+	sync_stats->passes++;
+	stats_lag = stats_prev_pickup ? time(NULL) - stats_prev_pickup : -1;
+	stats_write(sync_channel);
         delta = time(NULL) - single_start;
 
         if (((unsigned) delta < min_delta) && ((min_delta-delta) > 0))
@@ -2664,6 +3857,14 @@ static int get_intconfig(const char *channel, const char *val)
     if (response == -1) {
 	if (!strcmp(val, "sync_repeat_interval"))
 	    response = config_getint(IMAPOPT_SYNC_REPEAT_INTERVAL);
+	else if (!strcmp(val, "sync_workers"))
+	    response = config_getint(IMAPOPT_SYNC_WORKERS);
+	else if (!strcmp(val, "sync_pipeline"))
+	    response = config_getint(IMAPOPT_SYNC_PIPELINE);
+	else if (!strcmp(val, "sync_binary"))
+	    response = config_getswitch(IMAPOPT_SYNC_BINARY);
+	else if (!strcmp(val, "sync_log_batch"))
+	    response = config_getint(IMAPOPT_SYNC_LOG_BATCH);
     }
 
     return response;
@@ -2720,6 +3921,7 @@ void replica_connect(const char *channel)
 
 	if (sync_backend || connect_once || wait > 1000) break;
 
+	sync_stats->connect_retries++;
 	fprintf(stderr,
 		"Can not connect to server '%s', retrying in %d seconds\n",
 		servername, wait);
@@ -2729,6 +3931,8 @@ void replica_connect(const char *channel)
     free_callbacks(cb);
     cb = NULL;
 
+    sync_stats_reset();
+
     if (!sync_backend) {
 	fprintf(stderr, "Can not connect to server '%s'\n",
 		servername);
@@ -2856,6 +4060,25 @@ negfailed:
 	free(covers);
     }
 
+    /* save the replica parsing the messages we upload, if it knows how */
+    sync_set_cache(CAPA(sync_backend, CAPA_SYNC_CACHE));
+
+    /* binary dlists, if the server can read them.  If it won't
+     * switch, we just carry on in text */
+    sync_set_binary(0);
+    if (CAPA(sync_backend, CAPA_SYNC_BINARY) &&
+	get_intconfig(channel, "sync_binary")) {
+	struct dlist *kl = dlist_newkvlist(NULL, "OPTIONS");
+	dlist_setatom(kl, "SYNC_BINARY", "1");
+	sync_send_set(kl, sync_out);
+	dlist_free(&kl);
+
+	if (!sync_parse_response("SET", sync_in, NULL))
+	    sync_set_binary(1);
+	else
+	    syslog(LOG_NOTICE, "Failed to enable binary dlists, continuing in text");
+    }
+
     /* Force use of LITERAL+ so we don't need two way communications */
     prot_setisclient(sync_in, 1);
     prot_setisclient(sync_out, 1);
@@ -2874,6 +4097,9 @@ void do_daemon(const char *sync_log_file, const char *sync_shutdown_file,
 
     signal(SIGPIPE, SIG_IGN); /* don't fail on server disconnects */
 
+    stats_start = time(NULL);
+    stats_write(channel);
+
     while (restart) {
 	replica_connect(channel);
 	r = do_daemon_work(sync_log_file, sync_shutdown_file,
@@ -2883,7 +4109,10 @@ void do_daemon(const char *sync_log_file, const char *sync_shutdown_file,
 	     * If we are, we had some type of error, so we exit.
 	     * Otherwise, try reconnecting.
 	     */
-	    if (!backend_ping(sync_backend)) restart = 1;
+	    if (!backend_ping(sync_backend)) {
+		sync_stats->reconnects++;
+		restart = 1;
+	    }
 	}
 	replica_disconnect();
     }
@@ -2902,7 +4131,8 @@ enum {
     MODE_REPEAT,
     MODE_USER,
     MODE_MAILBOX,
-    MODE_META
+    MODE_META,
+    MODE_STATS
 };
 
 int main(int argc, char **argv)
@@ -2932,7 +4162,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:vlS:F:f:w:t:d:n:rRumsoz")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:vlS:F:f:w:t:d:j:n:rRumsoTz")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -2979,6 +4209,12 @@ int main(int argc, char **argv)
             min_delta = atoi(optarg);
             break;
 
+        case 'j':
+            sync_workers = atoi(optarg);
+            if (sync_workers < 1)
+		fatal("-j needs at least one worker", EC_USAGE);
+            break;
+
         case 'r':
 	    background = 1;
 	    /* fallthrough */
@@ -3007,6 +4243,12 @@ int main(int argc, char **argv)
             mode = MODE_META;
             break;
 
+        case 'T': /* summarise the rolling client's stats */
+	    if (mode != MODE_UNKNOWN)
+		fatal("Mutually exclusive options defined", EC_USAGE);
+            mode = MODE_STATS;
+            break;
+
 	case 'z':
 #ifdef HAVE_ZLIB
 	    do_compress = 1;
@@ -3040,6 +4282,13 @@ int main(int argc, char **argv)
     cyrus_init(alt_config, "sync_client",
 	       (verbose > 1 ? CYRUSINIT_PERROR : 0));
 
+    /* nothing to connect to for this */
+    if (mode == MODE_STATS) {
+	exit_rc = do_stats_summary(channel);
+	cyrus_done();
+	exit(exit_rc);
+    }
+
     /* get the server name if not specified */
     if (!servername)
 	servername = get_config(channel, "sync_host");
@@ -3047,6 +4296,25 @@ int main(int argc, char **argv)
     if (!servername)
         fatal("sync_host not defined", EC_SOFTWARE);
 
+    sync_channel = channel;
+
+    if (!sync_workers)
+	sync_workers = get_intconfig(channel, "sync_workers");
+    if (sync_workers < 1)
+	sync_workers = 1;
+
+    sync_pipeline = get_intconfig(channel, "sync_pipeline");
+    if (sync_pipeline < 0)
+	sync_pipeline = 0;
+
+    sync_log_batch = get_intconfig(channel, "sync_log_batch");
+    if (sync_log_batch < 0)
+	sync_log_batch = 0;
+
+    /* so the workers' stats are seen by the parent */
+    if (sync_workers > 1)
+	sync_stats_share(sync_workers);
+
     /* Just to help with debugging, so we have time to attach debugger */
     if (wait > 0) {
         fprintf(stderr, "Waiting for %d seconds for gdb attach...\n", wait);
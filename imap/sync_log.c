@@ -58,11 +58,13 @@
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
 
 #include "assert.h"
 #include "sync_log.h"
 #include "global.h"
 #include "cyr_lock.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "retry.h"
 #include "util.h"
@@ -71,14 +73,42 @@
 #include "xstrlcat.h"
 
 static int sync_log_enabled = 0;
+static int sync_log_deferred = 0;
 static const char *suppressed_channel = NULL;
 static char *channel_base;
 static char *channel_end;
 
+/* A process that calls sync_log_defer() has its events held back for
+ * a moment and written to each log together, so that a burst naming the
+ * same mailbox over and over costs one line and one open/lock/fsync of
+ * the log rather than one per event.  Anything held back is lost if the
+ * process dies before writing it, so only processes that checkpoint
+ * often, e.g. before each command, should ask for this */
+struct sync_log_pending {
+    char *channel;
+    struct buf lines;
+};
+
+static struct sync_log_pending *pending = NULL;
+static int pending_alloc = 0;
+static int pending_num = 0;
+static hash_table pending_seen;
+static unsigned pending_count = 0;
+static time_t pending_since = 0;
+
+static void sync_log_flush(void);
+
 void sync_log_init(void)
 {
+    static int registered = 0;
     char *p;
 
+    if (!registered) {
+	/* don't lose anything still held when we exit */
+	atexit(sync_log_flush);
+	registered = 1;
+    }
+
     sync_log_enabled = config_getswitch(IMAPOPT_SYNC_LOG);
     channel_base = NULL;
     channel_end = NULL;
@@ -93,6 +123,11 @@ void sync_log_init(void)
     }
 }
 
+void sync_log_defer(void)
+{
+    sync_log_deferred = 1;
+}
+
 void sync_log_suppress(void)
 {
     sync_log_enabled = 0;
@@ -110,8 +145,15 @@ void sync_log_suppress_channel(const char *channelname)
     }
 }
 
+void sync_log_checkpoint(void)
+{
+    sync_log_flush();
+}
+
 void sync_log_done(void)
 {
+    sync_log_flush();
+
     free(channel_base);
     channel_base = NULL;
 }
@@ -130,18 +172,29 @@ char *sync_log_fname(const char *channel)
     return buf;
 }
 
-static void sync_log_base(const char *channel, const char *string)
+/* where sync_client keeps its stats for the channel */
+char *sync_stats_fname(const char *channel)
+{
+    static char buf[MAX_MAILBOX_PATH];
+
+    if (channel)
+	snprintf(buf, MAX_MAILBOX_PATH,
+		 "%s/sync/%s/stats", config_dir, channel);
+    else
+	snprintf(buf, MAX_MAILBOX_PATH,
+		 "%s/sync/stats", config_dir);
+
+    return buf;
+}
+
+static void sync_log_write(const char *channel, const char *string,
+			   size_t len)
 {
     int fd;
     struct stat sbuffile, sbuffd;
     int retries = 0;
     const char *fname;
 
-    /* are we being supressed? */
-    if (!sync_log_enabled) return;
-    if (channel && suppressed_channel && !strcmp(channel, suppressed_channel))
-	return;
-
     fname = sync_log_fname(channel);
 
     while (retries++ < SYNC_LOG_RETRIES) {
@@ -158,8 +211,7 @@ static void sync_log_base(const char *channel, const char *string)
 	}
 
 	if (lock_blocking(fd) == -1) {
-	    syslog(LOG_ERR, "sync_log(): Failed to lock %s for %s: %m",
-		   fname, string);
+	    syslog(LOG_ERR, "sync_log(): Failed to lock %s: %m", fname);
 	    close(fd);
 	    return;
 	}
@@ -175,12 +227,12 @@ static void sync_log_base(const char *channel, const char *string)
     if (retries >= SYNC_LOG_RETRIES) {
 	close(fd);
 	syslog(LOG_ERR,
-	       "sync_log(): Failed to lock %s for %s after %d attempts",
-	       fname, string, retries);
+	       "sync_log(): Failed to lock %s after %d attempts",
+	       fname, retries);
 	return;
     }
 
-    if (retry_write(fd, string, strlen(string)) < 0)
+    if (retry_write(fd, string, len) < 0)
 	syslog(LOG_ERR, "write() to %s failed: %s",
 	       fname, strerror(errno));
 
@@ -188,6 +240,102 @@ static void sync_log_base(const char *channel, const char *string)
     close(fd);
 }
 
+static void sync_log_flush(void)
+{
+    int i;
+
+    if (!pending_count) return;
+
+    if (!config_dir) {
+	/* too late, the configuration has already gone */
+	syslog(LOG_ERR, "sync_log(): dropping %u events at exit",
+	       pending_count);
+	pending_count = 0;
+	return;
+    }
+
+    for (i = 0; i < pending_num; i++) {
+	struct sync_log_pending *p = &pending[i];
+
+	if (!p->lines.len) continue;
+	sync_log_write(p->channel, p->lines.s, p->lines.len);
+	buf_reset(&p->lines);
+    }
+
+    free_hash_table(&pending_seen, NULL);
+    pending_count = 0;
+}
+
+static struct sync_log_pending *sync_log_pending(const char *channel)
+{
+    int i;
+
+    for (i = 0; i < pending_num; i++) {
+	if (!pending[i].channel && !channel) return &pending[i];
+	if (pending[i].channel && channel &&
+	    !strcmp(pending[i].channel, channel))
+	    return &pending[i];
+    }
+
+    if (pending_num == pending_alloc) {
+	pending_alloc += 4;
+	pending = xrealloc(pending,
+			   pending_alloc * sizeof(struct sync_log_pending));
+    }
+
+    pending[pending_num].channel = xstrdupnull(channel);
+    memset(&pending[pending_num].lines, 0, sizeof(struct buf));
+
+    return &pending[pending_num++];
+}
+
+static void sync_log_base(const char *channel, const char *string)
+{
+    struct sync_log_pending *p;
+    struct buf key = BUF_INITIALIZER;
+    const char *line, *end;
+    time_t now = time(NULL);
+
+    /* are we being supressed? */
+    if (!sync_log_enabled) return;
+    if (channel && suppressed_channel && !strcmp(channel, suppressed_channel))
+	return;
+
+    if (!sync_log_deferred) {
+	sync_log_write(channel, string, strlen(string));
+	return;
+    }
+
+    p = sync_log_pending(channel);
+
+    if (!pending_count) {
+	construct_hash_table(&pending_seen, SYNC_LOG_PENDING_MAX, 1);
+	pending_since = now;
+    }
+
+    /* one event may be several lines */
+    for (line = string; *line; line = end) {
+	end = strchr(line, '\n');
+	end = end ? end + 1 : line + strlen(line);
+
+	/* the same event for the same channel is already on its way */
+	buf_reset(&key);
+	buf_printf(&key, "%s %.*s", channel ? channel : "",
+		   (int)(end - line), line);
+	if (hash_lookup(buf_cstring(&key), &pending_seen)) continue;
+	hash_insert(buf_cstring(&key), (void *)1, &pending_seen);
+
+	buf_appendmap(&p->lines, line, end - line);
+	pending_count++;
+    }
+
+    buf_free(&key);
+
+    if (pending_count >= SYNC_LOG_PENDING_MAX ||
+	now - pending_since >= SYNC_LOG_PENDING_DELAY)
+	sync_log_flush();
+}
+
 static const char *sync_quote_name(const char *name)
 {
     static char buf[MAX_MAILBOX_BUFFER+3]; /* "x2 plus \0 */
@@ -50,8 +50,16 @@
 
 #define SYNC_LOG_RETRIES (64)
 
+/* events held back to be written together after sync_log_defer(), at
+ * most this many or for this many seconds, unless sync_log_checkpoint()
+ * comes along first */
+#define SYNC_LOG_PENDING_MAX (1024)
+#define SYNC_LOG_PENDING_DELAY (5)
+
 void sync_log_init(void);
+void sync_log_defer(void);
 void sync_log_suppress(void);
+void sync_log_checkpoint(void);
 void sync_log_done(void);
 
 void sync_log(const char *fmt, ...);
@@ -65,8 +73,9 @@ void sync_log(const char *fmt, ...);
 #define sync_log_mailbox(name) \
     sync_log("MAILBOX %s\n", name)
 
+/* one line, so that sync_client always sees both names together */
 #define sync_log_mailbox_double(name1, name2) \
-    sync_log("MAILBOX %s\nMAILBOX %s\n", name1, name2)
+    sync_log("MAILBOX %s %s\n", name1, name2)
 
 #define sync_log_quota(name) \
     sync_log("QUOTA %s\n", name)
@@ -81,6 +90,7 @@ void sync_log(const char *fmt, ...);
     sync_log("SUB %s %s\n", user, name)
 
 char *sync_log_fname(const char *channel);
+char *sync_stats_fname(const char *channel);
 void sync_log_suppress_channel(const char *channel);
 void sync_log_channel(const char *channel, const char *fmt, ...);
 
@@ -94,7 +104,7 @@ void sync_log_channel(const char *channel, const char *fmt, ...);
     sync_log_channel(channel, "MAILBOX %s\n", name)
 
 #define sync_log_mailbox_double_channel(channel, name1, name2) \
-    sync_log_channel(channel, "MAILBOX %s\nMAILBOX %s\n", name1, name2)
+    sync_log_channel(channel, "MAILBOX %s %s\n", name1, name2)
 
 #define sync_log_quota_channel(channel, name) \
     sync_log_channel(channel, "QUOTA %s\n", name)
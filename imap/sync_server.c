@@ -137,6 +137,27 @@ static int sync_logfd = -1;
 static int sync_starttls_done = 0;
 static int sync_compress_done = 0;
 
+/* APPLY MAILBOX for several users at once, see apply_dispatch() */
+#define APPLY_MAX_PENDING (256)
+
+struct apply_worker {
+    pid_t pid;
+    struct protstream *in;	/* replies from the worker */
+    struct protstream *out;	/* commands to the worker */
+};
+
+struct apply_pending {
+    struct apply_pending *next;
+    int worker;
+};
+
+static int apply_nworkers = 0;
+static struct apply_worker *apply_workers = NULL;
+static struct apply_pending *apply_head = NULL;
+static struct apply_pending **apply_tailp = &apply_head;
+static int apply_count = 0;
+static int apply_worker_child = 0;
+
 /* commands that have specific names */
 static void cmdloop(void);
 static void cmd_authenticate(char *mech, char *resp);
@@ -151,6 +172,11 @@ static void cmd_set(const struct dlist *kl);
 static void cmd_apply(struct dlist *kl,
 		      struct sync_reserve_list *reserve_list);
 
+/* APPLY MAILBOX for several users at once */
+static int apply_dispatch(struct dlist *kl);
+static void apply_wait_input(void);
+static void apply_finish(void);
+
 void usage(void);
 void shut_down(int code) __attribute__ ((noreturn));
 
@@ -328,6 +354,14 @@ static void dobanner(void)
     prot_printf(sync_out, "* SYNC_CRC_COVERS %s\r\n",
 			  sync_crc_list_covers());
 
+    /* and that it can take the binary dlist encoding, RESERVE
+     * by GUID prefix, FULLMAILBOX with just the changes and the
+     * master's cache records with uploaded messages */
+    prot_printf(sync_out, "* SYNC_BINARY\r\n");
+    prot_printf(sync_out, "* SYNC_RESERVE_PREFIX\r\n");
+    prot_printf(sync_out, "* SYNC_FULLMAILBOX_SINCE\r\n");
+    prot_printf(sync_out, "* SYNC_CACHE\r\n");
+
     prot_printf(sync_out,
 		"* OK %s Cyrus sync server %s\r\n",
 		config_servername, cyrus_version());
@@ -413,10 +447,12 @@ int service_main(int argc __attribute__((unused)),
     prot_setflushonread(sync_in, sync_out);
 
     sync_log_init();
+    sync_log_defer();
     if (!config_getswitch(IMAPOPT_SYNC_LOG_CHAIN))
 	sync_log_suppress();
 
     sync_crc_setup(NULL, NULL, /*strict*/1);	/* initialise with defaults */
+    sync_set_binary(0);
 
     dobanner();
 
@@ -450,7 +486,9 @@ void shut_down(int code)
 {
     in_shutdown = 1;
 
-    proc_cleanup();
+    /* an apply worker's proc entry is its parent's */
+    if (!apply_worker_child)
+	proc_cleanup();
 
     if (config_getswitch(IMAPOPT_STATUSCACHE)) {
 	statuscache_close();
@@ -467,6 +505,8 @@ void shut_down(int code)
     annotatemore_close();
     annotatemore_done();
 
+    sync_log_done();
+
     if (sync_in) {
 	prot_NONBLOCK(sync_in);
 	prot_fill(sync_in);
@@ -558,13 +598,21 @@ static void cmdloop(void)
     int c;
     char *p;
     struct dlist *kl;
+    unsigned long ncmds[SYNC_STATS_NUMCMDS] = { 0, 0, 0 };
+    time_t start = time(NULL);
 
     syslog(LOG_DEBUG, "cmdloop(): startup");
 
     reserve_list = sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
 
+    apply_nworkers = config_getint(IMAPOPT_SYNC_APPLY_WORKERS);
+    if (apply_nworkers > 1 && !apply_workers)
+	apply_workers = xzmalloc(apply_nworkers * sizeof(struct apply_worker));
+
     for (;;) {
+	apply_wait_input();
         prot_flush(sync_out);
+	sync_log_checkpoint();
 
 	/* Parse command name */
 	if ((c = getword(sync_in, &cmd)) == EOF)
@@ -582,6 +630,10 @@ static void cmdloop(void)
 	    if (Uisupper(*p)) *p = tolower((unsigned char) *p);
 	}
 
+	/* only APPLY MAILBOX goes alongside the workers */
+	if (strcmp(cmd.s, "Apply"))
+	    apply_finish();
+
 	/* Must be an admin */
 	if (sync_userid && !sync_userisadmin) goto noperm;
 
@@ -613,13 +665,19 @@ static void cmdloop(void)
 	    }
 	    if (!sync_userid) goto nologin;
 	    if (!strcmp(cmd.s, "Apply")) {
+		ncmds[SYNC_STATS_APPLY]++;
 		kl = sync_parseline(sync_in);
 		if (kl) {
-		    cmd_apply(kl, reserve_list);
+		    if (!apply_dispatch(kl)) {
+			apply_finish();
+			cmd_apply(kl, reserve_list);
+		    }
 		    dlist_free(&kl);
 		}
-		else
+		else {
+		    apply_finish();
 		    prot_printf(sync_out, "BAD IMAP_PROTOCOL_ERROR Failed to parse APPLY line\r\n");
+		}
 		continue;
 	    }
 	    break;
@@ -638,6 +696,7 @@ static void cmdloop(void)
 	case 'G':
 	    if (!sync_userid) goto nologin;
 	    if (!strcmp(cmd.s, "Get")) {
+		ncmds[SYNC_STATS_GET]++;
 		kl = sync_parseline(sync_in);
 		if (kl) {
 		    cmd_get(kl);
@@ -704,6 +763,7 @@ static void cmdloop(void)
 		continue;
 	    }
 	    else if (!strcmp(cmd.s, "Set")) {
+		ncmds[SYNC_STATS_SET]++;
 		kl = sync_parseline(sync_in);
 		if (kl) {
 		    cmd_set(kl);
@@ -744,7 +804,16 @@ static void cmdloop(void)
     }
 
  exit:
+    apply_finish();
     cmd_restart(&reserve_list, 0);
+
+    /* the client keeps the detailed stats, but this shows what each
+     * of its connections cost us */
+    syslog(LOG_INFO, "session ended after %lds: %lu APPLY, %lu GET, %lu SET, "
+	   "%u bytes in, %u bytes out", (long) (time(NULL) - start),
+	   ncmds[SYNC_STATS_APPLY], ncmds[SYNC_STATS_GET],
+	   ncmds[SYNC_STATS_SET], (unsigned) prot_bytes_in(sync_in),
+	   (unsigned) prot_bytes_out(sync_out));
 }
 
 static void cmd_authenticate(char *mech, char *resp)
@@ -1037,14 +1106,87 @@ static void cmd_restart(struct sync_reserve_list **reserve_listp, int re_alloc)
 
 /* ====================================================================== */
 
+/* What a RESERVE is looking for: whole GUIDs, marked need_upload in
+ * part_list, or for a PREFIX reserve the sorted GUID prefixes, with
+ * what was found for each */
+struct reserve_want {
+    struct sync_msgid_list *part_list;
+    const char *prefixes;
+    struct message_guid *found;
+    int n;
+    int left;
+};
+
+static int want_prefix(const struct reserve_want *want,
+		       struct message_guid *guid)
+{
+    unsigned char guidbuf[MESSAGE_GUID_SIZE];
+    int lo = 0;
+    int hi = want->n - 1;
+
+    message_guid_export(guid, guidbuf);
+
+    while (lo <= hi) {
+	int mid = (lo + hi) / 2;
+	int cmp = memcmp(guidbuf, want->prefixes + mid * SYNC_GUID_PREFIX,
+			 SYNC_GUID_PREFIX);
+	if (!cmp) return mid;
+	if (cmp < 0) hi = mid - 1;
+	else lo = mid + 1;
+    }
+
+    return -1;
+}
+
+/* is this message still wanted?  Returns which prefix it is for a
+ * PREFIX reserve, 0 for a GUID one, or -1 */
+static int want_lookup(struct reserve_want *want, struct message_guid *guid)
+{
+    struct sync_msgid *item;
+    int i;
+
+    if (want->prefixes) {
+	i = want_prefix(want, guid);
+	if (i < 0 || !message_guid_isnull(&want->found[i]))
+	    return -1;
+	return i;
+    }
+
+    item = sync_msgid_lookup(want->part_list, guid);
+    if (!item || !item->need_upload)
+	return -1;
+    return 0;
+}
+
+/* it's in the reserve directory now */
+static void want_found(struct reserve_want *want, int i,
+		       struct message_guid *guid)
+{
+    struct sync_msgid *item = sync_msgid_insert(want->part_list, guid);
+
+    if (item->need_upload) {
+	item->need_upload = 0;
+	want->part_list->toupload--;
+    }
+
+    if (want->prefixes) {
+	message_guid_copy(&want->found[i], guid);
+	want->left--;
+    }
+}
+
+static int want_left(const struct reserve_want *want)
+{
+    return want->prefixes ? want->left : want->part_list->toupload;
+}
+
 void reserve_folder(const char *part, const char *mboxname,
-		    struct sync_msgid_list *part_list)
+		    struct reserve_want *want)
 {
     struct mailbox *mailbox = NULL;
     struct index_record record;
-    struct index_record record2;
     int r;
-    struct sync_msgid *item;
+    int i;
     const char *mailbox_msg_path, *stage_msg_path;
     uint32_t recno;
 
@@ -1062,13 +1204,9 @@ void reserve_folder(const char *part, const char *mboxname,
 	if (record.system_flags & FLAG_UNLINKED)
 	    continue;
 
-	/* do we need it? */
-	item = sync_msgid_lookup(part_list, &record.guid);
-	if (!item)
-	    continue;
-
-	/* have we already found it? */
-	if (!item->need_upload)
+	/* do we need it, and haven't we already found it? */
+	i = want_lookup(want, &record.guid);
+	if (i < 0)
 	    continue;
 
 	/* Attempt to reserve this message */
@@ -1076,18 +1214,8 @@ void reserve_folder(const char *part, const char *mboxname,
 	stage_msg_path = dlist_reserve_path(part, &record.guid);
 
 	/* check that the sha1 of the file on disk is correct */
-	memset(&record2, 0, sizeof(struct index_record));
-	r = message_parse(mailbox_msg_path, &record2);
-	if (r) {
-	    syslog(LOG_ERR, "IOERROR: Unable to parse %s",
-		   mailbox_msg_path);
+	if (sync_verify_file(mailbox_msg_path, &record.guid, record.size))
 	    continue;
-	}
-	if (!message_guid_equal(&record.guid, &record2.guid)) {
-	    syslog(LOG_ERR, "IOERROR: GUID mismatch on parse for %s",
-		   mailbox_msg_path);
-	    continue;
-	}
 
 	if (mailbox_copyfile(mailbox_msg_path, stage_msg_path, 0) != 0) {
 	    syslog(LOG_ERR, "IOERROR: Unable to link %s -> %s: %m",
@@ -1095,40 +1223,112 @@ void reserve_folder(const char *part, const char *mboxname,
 	    continue;
 	}
 
-	item->need_upload = 0;
-	part_list->toupload--;
+	want_found(want, i, &record.guid);
 
 	/* already found everything, drop out */
-	if (!part_list->toupload) break;
+	if (!want_left(want)) break;
     }
 
     mailbox_close(&mailbox);
 }
 
+/* Messages already reserved or uploaded on this connection are still
+ * in the reserve directories until the next RESTART, so a later user
+ * can have them without searching mailboxes or uploading them again.
+ * Those on other partitions have to be copied across. */
+static void reserve_staged(const char *part,
+			   struct sync_reserve_list *reserve_list,
+			   struct reserve_want *want)
+{
+    struct sync_reserve *res;
+    struct sync_msgid *msgid;
+    char *from;
+    int i;
+
+    for (res = reserve_list->head; res; res = res->next) {
+	int samepart = !strcmp(res->part, part);
+
+	/* in GUID mode our own partition's are already not wanted */
+	if (samepart && !want->prefixes)
+	    continue;
+
+	for (msgid = res->list->head; msgid; msgid = msgid->next) {
+	    if (!want_left(want)) return;
+	    if (msgid->need_upload)
+		continue;
+
+	    i = want_lookup(want, &msgid->guid);
+	    if (i < 0)
+		continue;
+
+	    if (!samepart) {
+		from = xstrdup(dlist_reserve_path(res->part, &msgid->guid));
+		if (mailbox_copyfile(from,
+				     dlist_reserve_path(part, &msgid->guid),
+				     0) != 0) {
+		    syslog(LOG_ERR, "IOERROR: Unable to copy %s -> %s: %m",
+			   from, dlist_reserve_path(part, &msgid->guid));
+		    free(from);
+		    continue;
+		}
+		free(from);
+	    }
+
+	    want_found(want, i, &msgid->guid);
+	}
+    }
+}
+
 static int do_reserve(struct dlist *kl, struct sync_reserve_list *reserve_list)
 {
     struct message_guid *tmpguid;
     struct sync_name_list *folder_names = sync_name_list_create();
-    struct sync_msgid_list *part_list;
     struct sync_msgid *item;
     struct sync_name *folder;
     struct mboxlist_entry *mbentry = NULL;
+    struct reserve_want want;
     const char *partition = NULL;
     struct dlist *ml;
-    struct dlist *gl;
+    struct dlist *gl = NULL;
     struct dlist *i;
     struct dlist *kout;
+    size_t len = 0;
+    int n;
+
+    memset(&want, 0, sizeof(struct reserve_want));
 
     if (!dlist_getatom(kl, "PARTITION", &partition)) goto parse_err;
     if (!dlist_getlist(kl, "MBOXNAME", &ml)) goto parse_err;
-    if (!dlist_getlist(kl, "GUID", &gl)) goto parse_err;
+    if (!dlist_getlist(kl, "GUID", &gl) &&
+	!dlist_getmap(kl, "PREFIX", &want.prefixes, &len))
+	goto parse_err;
 
-    part_list = sync_reserve_partlist(reserve_list, partition);
-    for (i = gl->head; i; i = i->next) {
-	if (!dlist_toguid(i, &tmpguid))
-	    goto parse_err;
-	sync_msgid_insert(part_list, tmpguid);
+    want.part_list = sync_reserve_partlist(reserve_list, partition);
+
+    if (gl) {
+	for (i = gl->head; i; i = i->next) {
+	    if (!dlist_toguid(i, &tmpguid))
+		goto parse_err;
+	    sync_msgid_insert(want.part_list, tmpguid);
+	}
     }
+    else {
+	if (len % SYNC_GUID_PREFIX) goto parse_err;
+	want.n = want.left = len / SYNC_GUID_PREFIX;
+	if (want.n > SYNC_RESERVE_BATCH) goto parse_err;
+	for (n = 1; n < want.n; n++) {
+	    if (memcmp(want.prefixes + (n-1) * SYNC_GUID_PREFIX,
+		       want.prefixes + n * SYNC_GUID_PREFIX,
+		       SYNC_GUID_PREFIX) > 0)
+		goto parse_err; /* not sorted */
+	}
+	want.found = xmalloc(want.n * sizeof(struct message_guid));
+	for (n = 0; n < want.n; n++)
+	    message_guid_set_null(&want.found[n]);
+    }
+
+    /* anything we've already got */
+    reserve_staged(partition, reserve_list, &want);
 
     /* need a list so we can mark items */
     for (i = ml->head; i; i = i->next) {
@@ -1136,7 +1336,7 @@ static int do_reserve(struct dlist *kl, struct sync_reserve_list *reserve_list)
     }
 
     for (folder = folder_names->head; folder; folder = folder->next) {
-	if (!part_list->toupload) break;
+	if (!want_left(&want)) break;
 	if (mboxlist_lookup(folder->name, &mbentry, 0))
 	    continue;
 	if (strcmp(mbentry->partition, partition)) {
@@ -1144,41 +1344,71 @@ static int do_reserve(struct dlist *kl, struct sync_reserve_list *reserve_list)
 	    continue; /* try folders on the same partition first! */
 	}
 	mboxlist_entry_free(&mbentry);
-	reserve_folder(partition, folder->name, part_list);
+	reserve_folder(partition, folder->name, &want);
 	folder->mark = 1;
     }
 
     /* if we have other folders, check them now */
     for (folder = folder_names->head; folder; folder = folder->next) {
-	if (!part_list->toupload) break;
+	if (!want_left(&want)) break;
 	if (folder->mark)
 	    continue;
-	reserve_folder(partition, folder->name, part_list);
+	reserve_folder(partition, folder->name, &want);
 	folder->mark = 1;
     }
 
-    /* check if we missed any */
-    kout = dlist_newlist(NULL, "MISSING");
-    for (i = gl->head; i; i = i->next) {
-	if (!dlist_toguid(i, &tmpguid))
-	    goto parse_err;
-	item = sync_msgid_lookup(part_list, tmpguid);
-	if (item->need_upload)
-	    dlist_setguid(kout, "GUID", tmpguid);
-    }
+    if (want.prefixes) {
+	/* say which we found, and what they were */
+	struct message_guid **found;
+	struct buf bitmap = BUF_INITIALIZER;
+	struct buf digest = BUF_INITIALIZER;
 
-    if (kout->head)
+	found = xzmalloc(want.n * sizeof(struct message_guid *));
+	buf_truncate(&bitmap, (want.n + 7) / 8);
+	for (n = 0; n < want.n; n++) {
+	    if (message_guid_isnull(&want.found[n]))
+		continue;
+	    found[n] = &want.found[n];
+	    bitmap.s[n / 8] |= 1 << (n % 8);
+	}
+	sync_reserve_digest(found, want.n, &digest);
+
+	kout = dlist_newkvlist(NULL, "FOUND");
+	dlist_setmap(kout, "BITMAP", bitmap.s, bitmap.len);
+	dlist_setmap(kout, "DIGEST", digest.s, digest.len);
 	sync_send_response(kout, sync_out);
-    dlist_free(&kout);
+	dlist_free(&kout);
+
+	buf_free(&bitmap);
+	buf_free(&digest);
+	free(found);
+    }
+    else {
+	/* check if we missed any */
+	kout = dlist_newlist(NULL, "MISSING");
+	for (i = gl->head; i; i = i->next) {
+	    if (!dlist_toguid(i, &tmpguid))
+		goto parse_err;
+	    item = sync_msgid_lookup(want.part_list, tmpguid);
+	    if (item->need_upload)
+		dlist_setguid(kout, "GUID", tmpguid);
+	}
+
+	if (kout->head)
+	    sync_send_response(kout, sync_out);
+	dlist_free(&kout);
+    }
 
     sync_name_list_free(&folder_names);
     mboxlist_entry_free(&mbentry);
+    free(want.found);
 
     return 0;
 
  parse_err:
     sync_name_list_free(&folder_names);
     mboxlist_entry_free(&mbentry);
+    free(want.found);
 
     return IMAP_PROTOCOL_BAD_PARAMETERS;
 }
@@ -1644,15 +1874,29 @@ static int do_getfullmailbox(struct dlist *kin)
 {
     struct mailbox *mailbox = NULL;
     struct dlist *kl = dlist_newkvlist(NULL, "MAILBOX");
+    const char *mboxname = kin->sval;
+    modseq_t since_modseq = 0;
+    uint32_t since_uid = 0;
     int r;
 
+    /* %(MBOXNAME name SINCE_MODSEQ n SINCE_UID n) asks for a delta */
+    if (kin->type == DL_KVLIST) {
+	if (!dlist_getatom(kin, "MBOXNAME", &mboxname) ||
+	    !dlist_getnum64(kin, "SINCE_MODSEQ", &since_modseq) ||
+	    !dlist_getnum32(kin, "SINCE_UID", &since_uid))
+	    return IMAP_PROTOCOL_BAD_PARAMETERS;
+    }
+
     r = annotatemore_begin();
     if (r) return r;
 
-    r = mailbox_open_irl(kin->sval, &mailbox);
+    r = mailbox_open_irl(mboxname, &mailbox);
     if (r) return r;
 
-    r = sync_mailbox(mailbox, NULL, NULL, kl, NULL, 1);
+    if (since_modseq)
+	r = sync_mailbox_since(mailbox, since_modseq, since_uid, kl);
+    else
+	r = sync_mailbox(mailbox, NULL, NULL, kl, NULL, 1);
     if (!r) sync_send_response(kl, sync_out);
     dlist_free(&kl);
     mailbox_close(&mailbox);
@@ -2338,6 +2582,284 @@ static void cmd_apply(struct dlist *kin, struct sync_reserve_list *reserve_list)
     print_response(r);
 }
 
+/* ====================================================================== */
+
+/* With sync_apply_workers set, a run of pipelined APPLY MAILBOX commands
+ * is shared out between that many forked processes by user, so that
+ * one user's mailboxes are still updated in order by the one process
+ * while other users' are updated alongside.  The replies are passed
+ * back in the order the commands came in.  Anything else waits for
+ * the workers to finish and stops them first, so each set of workers
+ * sees the messages reserved and uploaded before it was started. */
+
+static void apply_worker_main(void)
+{
+    static struct buf cmd;
+    struct dlist *kl;
+    int c;
+
+    while ((c = getword(sync_in, &cmd)) != EOF) {
+	kl = sync_parseline(sync_in);
+	if (kl) {
+	    print_response(do_mailbox(kl));
+	    dlist_free(&kl);
+	}
+	else
+	    prot_printf(sync_out, "BAD IMAP_PROTOCOL_ERROR Failed to parse APPLY line\r\n");
+	prot_flush(sync_out);
+	sync_log_checkpoint();
+    }
+
+    shut_down(0);
+}
+
+static int apply_start_worker(struct apply_worker *w)
+{
+    int cmdpipe[2], replypipe[2];
+    pid_t parent = getpid();
+    pid_t pid;
+
+    if (pipe(cmdpipe) < 0) return -1;
+    if (pipe(replypipe) < 0) {
+	close(cmdpipe[0]);
+	close(cmdpipe[1]);
+	return -1;
+    }
+
+    /* nothing of ours to be written twice */
+    prot_flush(sync_out);
+    sync_log_checkpoint();
+
+    pid = fork();
+    if (pid < 0) {
+	close(cmdpipe[0]);
+	close(cmdpipe[1]);
+	close(replypipe[0]);
+	close(replypipe[1]);
+	return -1;
+    }
+
+    if (!pid) {
+	int i;
+
+	/* the connection and the other workers aren't ours */
+	for (i = 0; i < apply_nworkers; i++) {
+	    if (!apply_workers[i].pid) continue;
+	    close(apply_workers[i].in->fd);
+	    close(apply_workers[i].out->fd);
+	}
+	close(cmdpipe[1]);
+	close(replypipe[0]);
+
+	/* so that the client sees the connection close when the parent
+	 * closes it, whatever we are doing */
+	close(sync_in->fd);
+	if (sync_out->fd != sync_in->fd) close(sync_out->fd);
+	prot_free(sync_in);
+	prot_free(sync_out);
+
+	apply_worker_child = 1;
+	sync_in = prot_new(cmdpipe[0], 0);
+	sync_out = prot_new(replypipe[1], 1);
+
+	/* the messages were staged by the parent */
+	dlist_reserve_setowner(parent);
+
+	mboxlist_close();
+	mboxlist_open(NULL);
+	quotadb_close();
+	quotadb_open(NULL);
+	annotatemore_close();
+	annotatemore_open();
+	if (config_getswitch(IMAPOPT_STATUSCACHE)) {
+	    statuscache_close();
+	    statuscache_open(NULL);
+	}
+
+	apply_worker_main();
+    }
+
+    close(cmdpipe[0]);
+    close(replypipe[1]);
+
+    w->pid = pid;
+    w->in = prot_new(replypipe[0], 0);
+    w->out = prot_new(cmdpipe[1], 1);
+
+    return 0;
+}
+
+/* close the pipes to a worker and wait for it to go */
+static void apply_stop_worker(struct apply_worker *w)
+{
+    int r, status;
+
+    close(w->out->fd);
+    prot_free(w->out);
+    close(w->in->fd);
+    prot_free(w->in);
+
+    while ((r = waitpid(w->pid, &status, 0)) < 0 && errno == EINTR);
+    if (r < 0)
+	syslog(LOG_ERR, "sync apply worker %d: waitpid: %m", (int) w->pid);
+    else if (!WIFEXITED(status) || WEXITSTATUS(status))
+	syslog(LOG_ERR, "sync apply worker %d failed", (int) w->pid);
+
+    memset(w, 0, sizeof(struct apply_worker));
+}
+
+/* pass the reply to the oldest outstanding command back to the client */
+static void apply_relay_one(void)
+{
+    struct apply_pending *pending = apply_head;
+    struct apply_worker *w;
+    char buf[4096];
+
+    apply_head = pending->next;
+    if (!apply_head) apply_tailp = &apply_head;
+    apply_count--;
+
+    /* its worker died before getting to it */
+    if (pending->worker < 0) {
+	print_response(IMAP_IOERROR);
+	free(pending);
+	return;
+    }
+
+    w = &apply_workers[pending->worker];
+    if (prot_fgets(buf, sizeof(buf), w->in))
+	prot_printf(sync_out, "%s", buf);
+    else {
+	struct apply_pending *p;
+
+	syslog(LOG_ERR, "sync apply worker %d exited early", (int) w->pid);
+	print_response(IMAP_IOERROR);
+
+	/* nothing else it was given will be done either, and the
+	 * next command for its users gets a new worker */
+	for (p = apply_head; p; p = p->next) {
+	    if (p->worker == pending->worker) p->worker = -1;
+	}
+	apply_stop_worker(w);
+    }
+
+    free(pending);
+}
+
+/* is the client pipelining, with another command already on its way? */
+static int apply_more_input(void)
+{
+    struct protgroup *group = protgroup_new(1);
+    struct protgroup *ready = NULL;
+    struct timeval tv = { 0, 0 };
+    int n;
+
+    protgroup_insert(group, sync_in);
+    n = prot_select(group, -1, &ready, NULL, &tv);
+    if (ready) protgroup_free(ready);
+    protgroup_free(group);
+
+    return n > 0;
+}
+
+/* returns 1 if the command has been handed to a worker */
+static int apply_dispatch(struct dlist *kl)
+{
+    struct apply_pending *pending;
+    struct apply_worker *w;
+    const char *mboxname;
+    const char *userid;
+    int i;
+
+    if (apply_nworkers < 2 || strcmp(kl->name, "MAILBOX"))
+	return 0;
+
+    /* nothing more coming straight away, so nothing to do alongside */
+    if (!apply_count && !apply_more_input())
+	return 0;
+
+    if (!dlist_getatom(kl, "MBOXNAME", &mboxname))
+	return 0;
+    userid = mboxname_to_userid(mboxname);
+    i = sync_userhash(userid ? userid : "") % apply_nworkers;
+    w = &apply_workers[i];
+
+    if (!w->pid && apply_start_worker(w)) {
+	syslog(LOG_ERR, "sync apply worker: fork failed: %m");
+	return 0;
+    }
+
+    /* keep the window bounded, so neither end blocks writing */
+    while (apply_count >= APPLY_MAX_PENDING)
+	apply_relay_one();
+
+    sync_send_apply(kl, w->out);
+
+    pending = xzmalloc(sizeof(struct apply_pending));
+    pending->worker = i;
+    *apply_tailp = pending;
+    apply_tailp = &pending->next;
+    apply_count++;
+
+    return 1;
+}
+
+/* pass back replies as they come, until there's another command */
+static void apply_wait_input(void)
+{
+    struct protgroup *group;
+
+    if (!apply_head) return;
+
+    group = protgroup_new(2);
+    while (apply_head) {
+	struct protgroup *ready = NULL;
+	struct apply_worker *w;
+
+	/* failed already, nothing to wait for */
+	if (apply_head->worker < 0) {
+	    apply_relay_one();
+	    continue;
+	}
+	w = &apply_workers[apply_head->worker];
+
+	prot_flush(sync_out);
+	protgroup_reset(group);
+	protgroup_insert(group, sync_in);
+	protgroup_insert(group, w->in);
+
+	if (prot_select(group, -1, &ready, NULL, NULL) < 0) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+
+	if (ready && protgroup_getelement(ready, 0) == sync_in) {
+	    protgroup_free(ready);
+	    break;
+	}
+	if (ready) protgroup_free(ready);
+
+	apply_relay_one();
+    }
+    protgroup_free(group);
+}
+
+/* wait for all the replies and stop the workers */
+static void apply_finish(void)
+{
+    int i;
+
+    while (apply_head)
+	apply_relay_one();
+
+    if (!apply_workers) return;
+
+    for (i = 0; i < apply_nworkers; i++) {
+	if (apply_workers[i].pid)
+	    apply_stop_worker(&apply_workers[i]);
+    }
+}
+
 static void cmd_get(struct dlist *kin)
 {
     int r;
@@ -2370,12 +2892,15 @@ static int do_set_options(const struct dlist *kin)
     struct dlist *child;
     const char *algorithm = NULL;
     const char *covers = NULL;
+    int binary = -1;
 
     for (child = kin->head ; child ; child = child->next) {
 	if (!strcmp(child->name, "SYNC_CRC_ALGORITHM"))
 	    algorithm = child->sval;
 	else if (!strcmp(child->name, "SYNC_CRC_COVERS"))
 	    covers = child->sval;
+	else if (!strcmp(child->name, "SYNC_BINARY"))
+	    binary = dlist_num(child) ? 1 : 0;
 	else {
 	    return IMAP_PROTOCOL_ERROR;
 	}
@@ -2384,6 +2909,10 @@ static int do_set_options(const struct dlist *kin)
     if (algorithm || covers)
 	r = sync_crc_setup(algorithm, covers, /*strict*/1);
 
+    /* replies from here on are binary too */
+    if (!r && binary >= 0)
+	sync_set_binary(binary);
+
     return r;
 }
 
@@ -56,6 +56,8 @@
 #include <syslog.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -86,6 +88,7 @@
 #include "prot.h"
 #include "dlist.h"
 #include "crc32.h"
+#include "strhash.h"
 
 #include "message_guid.h"
 #include "sync_support.h"
@@ -196,25 +199,26 @@ int sync_eatlines_unsolicited(struct protstream *in, int c)
 
 /* ====================================================================== */
 
-void sync_print_flags(struct dlist *kl,
+void sync_print_flags(struct dlist_stream *ds,
 		      struct mailbox *mailbox, 
 		      struct index_record *record)
 {
     int flag;
-    struct dlist *fl = dlist_newlist(kl, "FLAGS");
+
+    dlist_stream_list(ds, "FLAGS");
 
     if (record->system_flags & FLAG_DELETED)
-	dlist_setflag(fl, "FLAG", "\\Deleted");
+	dlist_stream_flag(ds, "FLAG", "\\Deleted");
     if (record->system_flags & FLAG_ANSWERED)
-	dlist_setflag(fl, "FLAG", "\\Answered");
+	dlist_stream_flag(ds, "FLAG", "\\Answered");
     if (record->system_flags & FLAG_FLAGGED)
-	dlist_setflag(fl, "FLAG", "\\Flagged");
+	dlist_stream_flag(ds, "FLAG", "\\Flagged");
     if (record->system_flags & FLAG_DRAFT)
-	dlist_setflag(fl, "FLAG", "\\Draft");
+	dlist_stream_flag(ds, "FLAG", "\\Draft");
     if (record->system_flags & FLAG_EXPUNGED)
-	dlist_setflag(fl, "FLAG", "\\Expunged");
+	dlist_stream_flag(ds, "FLAG", "\\Expunged");
     if (record->system_flags & FLAG_SEEN)
-	dlist_setflag(fl, "FLAG", "\\Seen");
+	dlist_stream_flag(ds, "FLAG", "\\Seen");
         
     /* print user flags in mailbox order */
     for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
@@ -222,8 +226,10 @@ void sync_print_flags(struct dlist *kl,
 	    continue;
 	if (!(record->user_flags[flag/32] & (1<<(flag&31))))
 	    continue;
-	dlist_setflag(fl, "FLAG", mailbox->flagname[flag]);
+	dlist_stream_flag(ds, "FLAG", mailbox->flagname[flag]);
     }
+
+    dlist_stream_end(ds);
 }
 
 int sync_getflags(struct dlist *kl,
@@ -269,6 +275,58 @@ int sync_getflags(struct dlist *kl,
     return 0;
 }
 
+/* The sender may send the cache record it built for a message it's
+ * uploading, along with the fields which parsing the message would
+ * otherwise fill in.  We only take it if it's in the format we'd build
+ * ourselves and matches its CRC - anything else, and we parse the
+ * message as usual.  Like message_parse(), this leaves the record
+ * pointing into a static buffer which is only good until the next
+ * record is parsed. */
+static void parse_upload_cache(struct dlist *kr, struct index_record *record)
+{
+    static struct buf cachebuf;
+    const char *base;
+    size_t len;
+    uint32_t cache_crc;
+
+    if (!dlist_getmap(kr, "CACHE", &base, &len))
+	return;
+
+    if (!dlist_getnum32(kr, "CACHE_VERSION", &record->cache_version) ||
+	!dlist_getnum32(kr, "CACHE_CRC", &cache_crc) ||
+	!dlist_getnum32(kr, "HEADER_SIZE", &record->header_size) ||
+	!dlist_getnum32(kr, "CONTENT_LINES", &record->content_lines) ||
+	!dlist_getdate(kr, "GMTIME", &record->gmtime) ||
+	!dlist_getdate(kr, "SENTDATE", &record->sentdate))
+	goto nocache;
+
+    if (record->cache_version != MAILBOX_CACHE_MINOR_VERSION || !len)
+	goto nocache;
+
+    buf_setmap(&cachebuf, base, len);
+    if (cache_parserecord(&cachebuf, 0, &record->crec) ||
+	record->crec.len != len)
+	goto nocache;
+
+    record->cache_crc = cache_crc;
+    if (crc32_buf(cache_buf(record)) != record->cache_crc) {
+	syslog(LOG_ERR, "SYNCERROR: cache CRC mismatch on upload %s %u",
+	       message_guid_encode(&record->guid), record->uid);
+	goto nocache;
+    }
+
+    return;
+
+nocache:
+    memset(&record->crec, 0, sizeof(struct cacherecord));
+    record->cache_version = 0;
+    record->cache_crc = 0;
+    record->header_size = 0;
+    record->content_lines = 0;
+    record->gmtime = 0;
+    record->sentdate = 0;
+}
+
 int parse_upload(struct dlist *kr, struct mailbox *mailbox,
 		 struct index_record *record,
 		 struct sync_annot_list **salp)
@@ -296,6 +354,9 @@ int parse_upload(struct dlist *kr, struct mailbox *mailbox,
 
     record->guid = *tmpguid;
 
+    /* the cache record is optional */
+    parse_upload_cache(kr, record);
+
     /* parse the flags */
     r = sync_getflags(fl, mailbox, record);
     if (r) return r;
@@ -433,6 +494,31 @@ struct sync_msgid_list *sync_reserve_partlist(struct sync_reserve_list *l,
     return item->list;
 }
 
+void sync_reserve_digest(struct message_guid * const *found, int n,
+			 struct buf *digest)
+{
+    struct buf guids = BUF_INITIALIZER;
+    unsigned char guidbuf[MESSAGE_GUID_SIZE];
+    struct message_guid hash;
+    int i, j;
+
+    buf_reset(digest);
+
+    for (i = 0; i < n; i += SYNC_RESERVE_BUCKET) {
+	buf_setcstr(&guids, "");
+	for (j = i; j < n && j < i + SYNC_RESERVE_BUCKET; j++) {
+	    if (!found[j]) continue;
+	    message_guid_export(found[j], guidbuf);
+	    buf_appendmap(&guids, (char *)guidbuf, MESSAGE_GUID_SIZE);
+	}
+	message_guid_generate(&hash, guids.s, guids.len);
+	message_guid_export(&hash, guidbuf);
+	buf_appendmap(digest, (char *)guidbuf, SYNC_GUID_PREFIX);
+    }
+
+    buf_free(&guids);
+}
+
 void sync_reserve_list_free(struct sync_reserve_list **lp)
 {
     struct sync_reserve_list *l = *lp;
@@ -1207,27 +1293,39 @@ struct sync_action_list *sync_action_list_create(void)
 {
     struct sync_action_list *l = xzmalloc(sizeof (struct sync_action_list));
 
-    l->head   = NULL;
-    l->tail   = NULL;
-    l->count  = 0;
+    l->head      = NULL;
+    l->tail      = NULL;
+    l->hash_size = SYNC_ACTION_HASH_SIZE;
+    l->hash      = xzmalloc(l->hash_size * sizeof(struct sync_action *));
+    l->count     = 0;
 
     return(l);
 }
 
+static int action_strequal(const char *a, const char *b)
+{
+    if (!a || !b) return (a == b);
+    return !strcmp(a, b);
+}
+
 void sync_action_list_add(struct sync_action_list *l,
 			  const char *name, const char *user)
 {
     struct sync_action *current;
+    int offset;
 
     if (!name && !user) return;
 
-    for (current = l->head ; current ; current = current->next) {
-        if ((!name || (current->name && !strcmp(current->name, name))) &&
-	    (!user || (current->user && !strcmp(current->user, user)))) {
+    /* a busy log names the same few objects over and over, so find
+     * the repeats through the hash rather than walking the list */
+    offset = (strhash(name ? name : "") * 31 +
+	      strhash(user ? user : "")) % l->hash_size;
+
+    for (current = l->hash[offset] ; current ; current = current->hash_next) {
+	if (action_strequal(current->name, name) &&
+	    action_strequal(current->user, user)) {
 	    current->active = 1;  /* Make sure active */
 	    return;
-	} else {
-	    /* name and/or user don't match current: no match possible */
 	}
     }
 
@@ -1242,8 +1340,10 @@ void sync_action_list_add(struct sync_action_list *l,
     else
         l->head = l->tail = current;
 
-    l->count++;
+    current->hash_next = l->hash[offset];
+    l->hash[offset]    = current;
 
+    l->count++;
 }
 
 void sync_action_list_free(struct sync_action_list **lp)
@@ -1261,10 +1361,18 @@ void sync_action_list_free(struct sync_action_list **lp)
         free(current);
         current = next;
     }
+    free(l->hash);
     free(l);
     *lp = NULL;
 }
 
+/* strhash() always comes out even, so it needs mixing up before it can
+ * pick one of an even number of workers */
+unsigned sync_userhash(const char *userid)
+{
+    return (strhash(userid) * 2654435761U) >> 16;
+}
+
 /* simple binary search */
 unsigned sync_mailbox_finduid(struct mailbox *mailbox, unsigned uid)
 {
@@ -1320,12 +1428,202 @@ int addmbox_sub(void *rock, const char *key, size_t keylen,
     return 0;
 }
 
+static int sync_binary = 0;
+
+void sync_set_binary(int binary)
+{
+    sync_binary = binary;
+}
+
+int sync_get_binary(void)
+{
+    return sync_binary;
+}
+
+static int sync_cache = 0;
+
+void sync_set_cache(int cache)
+{
+    sync_cache = cache;
+}
+
+static void sync_print(struct dlist *kl, struct protstream *out)
+{
+    if (sync_binary)
+	dlist_printbinary(kl, 1, out);
+    else
+	dlist_print(kl, 1, out);
+}
+
+/* ====================================================================== */
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+const char *sync_stats_cmdname[SYNC_STATS_NUMCMDS] = { "apply", "get", "set" };
+
+static struct sync_stats sync_stats_local;
+struct sync_stats *sync_stats = &sync_stats_local;
+static struct sync_stats *sync_stats_slots = NULL;
+static int sync_stats_nslots = 0;
+
+/* Commands are answered in the order they're sent, even pipelined, so
+ * each response belongs to the oldest one still waiting.  Any more
+ * than fit here at once are still counted, just not timed. */
+#define SYNC_STATS_WAITING (1024)
+
+static struct {
+    unsigned long seq;
+    int cmd;
+    struct timeval start;
+} sync_stats_waiting[SYNC_STATS_WAITING];
+static unsigned long sync_stats_sent = 0;
+static unsigned long sync_stats_answered = 0;
+
+/* prot only keeps an int count of the bytes through a stream, so we
+ * add up the differences as we go */
+static struct protstream *sync_stats_in = NULL;
+static struct protstream *sync_stats_out = NULL;
+static unsigned sync_stats_lastin = 0;
+static unsigned sync_stats_lastout = 0;
+
+void sync_stats_reset(void)
+{
+    sync_stats_answered = sync_stats_sent;
+    sync_stats_in = sync_stats_out = NULL;
+    sync_stats_lastin = sync_stats_lastout = 0;
+}
+
+void sync_stats_share(int nslots)
+{
+    struct sync_stats *slots;
+
+    if (sync_stats_slots || nslots < 2) return;
+
+    slots = (struct sync_stats *)mmap(NULL, nslots * sizeof(struct sync_stats),
+				      PROT_READ|PROT_WRITE,
+				      MAP_SHARED|MAP_ANON, -1, 0);
+    if (slots == (struct sync_stats *)MAP_FAILED) {
+	syslog(LOG_ERR, "sync stats: failed to share with workers: %m");
+	return;
+    }
+
+    memset(slots, 0, nslots * sizeof(struct sync_stats));
+    slots[0] = *sync_stats;
+    sync_stats_slots = slots;
+    sync_stats_nslots = nslots;
+    sync_stats = &slots[0];
+}
+
+void sync_stats_worker(int slot)
+{
+    if (slot < sync_stats_nslots)
+	sync_stats = &sync_stats_slots[slot];
+}
+
+void sync_stats_add(struct sync_stats *total, const struct sync_stats *s)
+{
+    int i, j;
+
+    for (i = 0; i < SYNC_STATS_NUMCMDS; i++) {
+	total->cmd[i].count += s->cmd[i].count;
+	total->cmd[i].failed += s->cmd[i].failed;
+	total->cmd[i].usec += s->cmd[i].usec;
+	for (j = 0; j < SYNC_STATS_BUCKETS; j++)
+	    total->cmd[i].hist[j] += s->cmd[i].hist[j];
+    }
+    total->bytes_in += s->bytes_in;
+    total->bytes_out += s->bytes_out;
+    total->events += s->events;
+    total->passes += s->passes;
+    total->connect_retries += s->connect_retries;
+    total->full_retries += s->full_retries;
+    total->promotions += s->promotions;
+    total->reconnects += s->reconnects;
+}
+
+void sync_stats_total(struct sync_stats *total)
+{
+    int i;
+
+    memset(total, 0, sizeof(struct sync_stats));
+
+    if (!sync_stats_slots) {
+	sync_stats_add(total, sync_stats);
+	return;
+    }
+
+    for (i = 0; i < sync_stats_nslots; i++)
+	sync_stats_add(total, &sync_stats_slots[i]);
+}
+
+static void sync_stats_sending(int cmd, struct protstream *out)
+{
+    unsigned long seq = sync_stats_sent++;
+    unsigned n = prot_bytes_out(out);
+
+    sync_stats->cmd[cmd].count++;
+
+    if (out != sync_stats_out) {
+	sync_stats_out = out;
+	sync_stats_lastout = 0;
+    }
+    sync_stats->bytes_out += n - sync_stats_lastout;
+    sync_stats_lastout = n;
+
+    if (seq - sync_stats_answered < SYNC_STATS_WAITING) {
+	int i = seq % SYNC_STATS_WAITING;
+	sync_stats_waiting[i].seq = seq;
+	sync_stats_waiting[i].cmd = cmd;
+	gettimeofday(&sync_stats_waiting[i].start, NULL);
+    }
+}
+
+static void sync_stats_answer(struct protstream *in, int r)
+{
+    struct sync_cmd_stats *cs;
+    struct timeval now;
+    unsigned long seq, usec, ms;
+    unsigned n = prot_bytes_in(in);
+    int i, bucket;
+
+    if (in != sync_stats_in) {
+	sync_stats_in = in;
+	sync_stats_lastin = 0;
+    }
+    sync_stats->bytes_in += n - sync_stats_lastin;
+    sync_stats_lastin = n;
+
+    /* not a response to anything we sent, like RESTART */
+    if (sync_stats_answered == sync_stats_sent) return;
+
+    seq = sync_stats_answered++;
+    i = seq % SYNC_STATS_WAITING;
+    if (sync_stats_waiting[i].seq != seq) return;
+
+    cs = &sync_stats->cmd[sync_stats_waiting[i].cmd];
+    if (r) cs->failed++;
+
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - sync_stats_waiting[i].start.tv_sec) * 1000000 +
+	   (now.tv_usec - sync_stats_waiting[i].start.tv_usec);
+    cs->usec += usec;
+
+    ms = usec / 1000;
+    for (bucket = 0; bucket < SYNC_STATS_BUCKETS - 1; bucket++)
+	if (ms < (1UL << bucket)) break;
+    cs->hist[bucket]++;
+}
+
+/* ====================================================================== */
+
 /* NOTE - we don't prot_flush here, as we always send an OK at the
  * end of a response anyway */
 void sync_send_response(struct dlist *kl, struct protstream *out)
 {
     prot_printf(out, "* ");
-    dlist_print(kl, 1, out);
+    sync_print(kl, out);
     prot_printf(out, "\r\n");
 }
 
@@ -1334,25 +1632,28 @@ void sync_send_response(struct dlist *kl, struct protstream *out)
 void sync_send_apply(struct dlist *kl, struct protstream *out)
 {
     prot_printf(out, "APPLY ");
-    dlist_print(kl, 1, out);
+    sync_print(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
+    sync_stats_sending(SYNC_STATS_APPLY, out);
 }
 
 void sync_send_lookup(struct dlist *kl, struct protstream *out)
 {
     prot_printf(out, "GET ");
-    dlist_print(kl, 1, out);
+    sync_print(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
+    sync_stats_sending(SYNC_STATS_GET, out);
 }
 
 void sync_send_set(struct dlist *kl, struct protstream *out)
 {
     prot_printf(out, "SET ");
-    dlist_print(kl, 1, out);
+    sync_print(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
+    sync_stats_sending(SYNC_STATS_SET, out);
 }
 
 struct dlist *sync_parseline(struct protstream *in)
@@ -1371,10 +1672,10 @@ struct dlist *sync_parseline(struct protstream *in)
     return NULL;
 }
 
-static int sync_send_file(struct mailbox *mailbox,
-			  struct index_record *record,
-			  struct sync_msgid_list *part_list,
-			  struct dlist *kupload)
+int sync_send_file(struct mailbox *mailbox,
+		   struct index_record *record,
+		   struct sync_msgid_list *part_list,
+		   struct dlist *kupload)
 {
     struct sync_msgid *msgid = sync_msgid_insert(part_list, &record->guid);
     const char *fname;
@@ -1399,6 +1700,59 @@ static int sync_send_file(struct mailbox *mailbox,
     return 0;
 }
 
+static void stream_annotations(struct dlist_stream *ds,
+			       const struct sync_annot_list *sal)
+{
+    const struct sync_annot *sa;
+
+    dlist_stream_list(ds, "ANNOTATIONS");
+    for (sa = sal->head ; sa ; sa = sa->next) {
+	dlist_stream_kvlist(ds, "A");
+	dlist_stream_atom(ds, "ENTRY", sa->entry);
+	dlist_stream_atom(ds, "USERID", sa->userid);
+	dlist_stream_map(ds, "VALUE", sa->value.s, sa->value.len);
+	dlist_stream_end(ds);
+    }
+    dlist_stream_end(ds);
+}
+
+static int stream_record(struct dlist_stream *ds, struct mailbox *mailbox,
+			 struct index_record *record, int withcache)
+{
+    struct sync_annot_list *annots = NULL;
+    int r;
+
+    r = read_annotations(mailbox, record, &annots);
+    if (r) return r;
+
+    dlist_stream_kvlist(ds, "RECORD");
+    dlist_stream_num32(ds, "UID", record->uid);
+    dlist_stream_num64(ds, "MODSEQ", record->modseq);
+    dlist_stream_date(ds, "LAST_UPDATED", record->last_updated);
+    sync_print_flags(ds, mailbox, record);
+    dlist_stream_date(ds, "INTERNALDATE", record->internaldate);
+    dlist_stream_num32(ds, "SIZE", record->size);
+    dlist_stream_atom(ds, "GUID", message_guid_encode(&record->guid));
+    /* if we can't read our own cache record, the replica will just
+     * have to parse the message */
+    if (withcache && !mailbox_cacherecord(mailbox, record)) {
+	dlist_stream_num32(ds, "HEADER_SIZE", record->header_size);
+	dlist_stream_num32(ds, "CONTENT_LINES", record->content_lines);
+	dlist_stream_date(ds, "GMTIME", record->gmtime);
+	dlist_stream_date(ds, "SENTDATE", record->sentdate);
+	dlist_stream_num32(ds, "CACHE_VERSION", record->cache_version);
+	dlist_stream_num32(ds, "CACHE_CRC", record->cache_crc);
+	dlist_stream_map(ds, "CACHE", cache_base(record), cache_size(record));
+    }
+    if (annots) {
+	stream_annotations(ds, annots);
+	sync_annot_list_free(&annots);
+    }
+    dlist_stream_end(ds);
+
+    return 0;
+}
+
 int sync_mailbox(struct mailbox *mailbox,
 		 struct sync_folder *remote,
 		 struct sync_msgid_list *part_list,
@@ -1432,25 +1786,31 @@ int sync_mailbox(struct mailbox *mailbox,
 
     if (printrecords) {
 	struct index_record record;
-	struct dlist *il;
-	struct dlist *rl = dlist_newlist(kl, "RECORD");
+	/* the records go straight into their wire format: as a tree
+	 * they'd cost several allocations per field */
+	struct buf records = BUF_INITIALIZER;
+	struct dlist_stream ds;
 	uint32_t recno;
 	int send_file;
 	uint32_t prevuid = 0;
 	struct sync_annot_list *annots = NULL;
 
+	dlist_stream_init_buf(&ds, 0, sync_binary, &records);
+
 	for (recno = 1; recno <= mailbox->i.num_records; recno++) {
 	    /* we can't send bogus records */
 	    if (mailbox_read_index_record(mailbox, recno, &record)) {
 		syslog(LOG_ERR, "SYNCERROR: corrupt mailbox %s %u, IOERROR",
 		       mailbox->name, recno);
-		return IMAP_IOERROR;
+		r = IMAP_IOERROR;
+		break;
 	    }
 
 	    if  (record.uid <= prevuid) {
 		syslog(LOG_ERR, "SYNCERROR: corrupt mailbox %s %u, ordering",
 		       mailbox->name, recno);
-		return IMAP_IOERROR;
+		r = IMAP_IOERROR;
+		break;
 	    }
 	    prevuid = record.uid;
 
@@ -1475,27 +1835,18 @@ int sync_mailbox(struct mailbox *mailbox,
 
 	    if (send_file) {
 		r = sync_send_file(mailbox, &record, part_list, kupload);
-		if (r) goto done;
+		if (r) break;
 	    }
 
-	    il = dlist_newkvlist(rl, "RECORD");
-	    dlist_setnum32(il, "UID", record.uid);
-	    dlist_setnum64(il, "MODSEQ", record.modseq);
-	    dlist_setdate(il, "LAST_UPDATED", record.last_updated);
-	    sync_print_flags(il, mailbox, &record);
-	    dlist_setdate(il, "INTERNALDATE", record.internaldate);
-	    dlist_setnum32(il, "SIZE", record.size);
-	    dlist_setatom(il, "GUID", message_guid_encode(&record.guid));
-
-	    r = read_annotations(mailbox, &record, &annots);
-	    if (r) goto done;
-
-	    if (annots) {
-		encode_annotations(il, annots);
-		sync_annot_list_free(&annots);
-	    }
+	    r = stream_record(&ds, mailbox, &record, send_file && sync_cache);
+	    if (r) break;
 	}
 
+	dlist_stream_done(&ds);
+	if (!r) dlist_newrawlist(kl, "RECORD", &records, sync_binary);
+	buf_free(&records);
+	if (r) goto done;
+
 	r = read_annotations(mailbox, NULL, &annots);
 	if (r) goto done;
 
@@ -1509,8 +1860,50 @@ done:
     return r;
 }
 
-int sync_parse_response(const char *cmd, struct protstream *in,
-			struct dlist **klp)
+/* The replica's side of a delta FULLMAILBOX: the master already has
+ * every record up to since_modseq and since_uid, so unexpunged ones of
+ * those are sent as just their UID, to tell the master they are still
+ * here.  Anything newer is sent in full. */
+int sync_mailbox_since(struct mailbox *mailbox,
+		       modseq_t since_modseq, uint32_t since_uid,
+		       struct dlist *kl)
+{
+    struct index_record record;
+    struct buf records = BUF_INITIALIZER;
+    struct dlist_stream ds;
+    uint32_t recno;
+    int r;
+
+    r = sync_mailbox(mailbox, NULL, NULL, kl, NULL, 0);
+    if (r) return r;
+
+    dlist_stream_init_buf(&ds, 0, sync_binary, &records);
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	if (mailbox_read_index_record(mailbox, recno, &record)) {
+	    syslog(LOG_ERR, "SYNCERROR: corrupt mailbox %s %u, IOERROR",
+		   mailbox->name, recno);
+	    r = IMAP_IOERROR;
+	    break;
+	}
+
+	if (record.modseq > since_modseq || record.uid > since_uid) {
+	    r = stream_record(&ds, mailbox, &record, 0);
+	    if (r) break;
+	}
+	else if (!(record.system_flags & FLAG_EXPUNGED))
+	    dlist_stream_num32(&ds, "UID", record.uid);
+    }
+
+    dlist_stream_done(&ds);
+    if (!r) dlist_newrawlist(kl, "RECORD", &records, sync_binary);
+    buf_free(&records);
+
+    return r;
+}
+
+static int parse_response(const char *cmd, struct protstream *in,
+			  struct dlist **klp)
 {
     static struct buf response;   /* BSS */
     static struct buf errmsg;
@@ -1572,6 +1965,56 @@ int sync_parse_response(const char *cmd, struct protstream *in,
     return IMAP_PROTOCOL_ERROR;
 }
 
+int sync_parse_response(const char *cmd, struct protstream *in,
+			struct dlist **klp)
+{
+    int r = parse_response(cmd, in, klp);
+
+    sync_stats_answer(in, r);
+
+    return r;
+}
+
+/* check that fname holds the message with the given GUID and size */
+int sync_verify_file(const char *fname, struct message_guid *guid,
+		     uint32_t size)
+{
+    struct stat sbuf;
+    struct message_guid guid2;
+    const char *base = NULL;
+    size_t len = 0;
+    int fd;
+    int r = 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return IMAP_IOERROR;
+
+    if (fstat(fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: Failed to stat file %s", fname);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+    if (sbuf.st_size != (off_t)size) {
+	syslog(LOG_ERR, "IOERROR: Size mismatch %s (%lu != %u)",
+	       fname, (unsigned long)sbuf.st_size, size);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, fname, 0);
+    message_guid_generate(&guid2, base, len);
+    map_free(&base, &len);
+
+    if (!message_guid_equal(&guid2, guid)) {
+	syslog(LOG_ERR, "IOERROR: GUID mismatch %s", fname);
+	r = IMAP_IOERROR;
+    }
+
+done:
+    close(fd);
+    return r;
+}
+
 int sync_append_copyfile(struct mailbox *mailbox,
 			 struct index_record *record,
 			 const struct sync_annot_list *annots)
@@ -1590,11 +2033,17 @@ int sync_append_copyfile(struct mailbox *mailbox,
 	return r;
     }
 
-    r = message_parse(fname, record);
+    /* with the sender's cache record, all a parse would tell us is
+     * that the file is the right one, and that's much cheaper */
+    if (record->crec.len)
+	r = sync_verify_file(fname, &tmp_guid, record->size);
+    else
+	r = message_parse(fname, record);
     if (r) {
 	/* deal with unlinked master records */
 	if (record->system_flags & FLAG_EXPUNGED) {
 	    record->system_flags |= FLAG_UNLINKED;
+	    memset(&record->crec, 0, sizeof(struct cacherecord));
 	    goto just_write;
 	}
 	syslog(LOG_ERR, "IOERROR: failed to parse %s", fname);
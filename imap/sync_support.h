@@ -65,7 +65,7 @@ int sync_getflags(struct dlist *kl,
 		  struct index_record *record);
 unsigned sync_mailbox_finduid(struct mailbox *mailbox, unsigned uid);
 
-void sync_print_flags(struct dlist *kl,
+void sync_print_flags(struct dlist_stream *ds,
 		      struct mailbox *mailbox,
 		      struct index_record *record);
 
@@ -133,6 +133,20 @@ struct sync_msgid_list *sync_reserve_partlist(struct sync_reserve_list *list,
 
 void sync_reserve_list_free(struct sync_reserve_list **list);
 
+/* A PREFIX reserve names the wanted messages by the first
+ * SYNC_GUID_PREFIX bytes of their GUIDs, sorted, at most
+ * SYNC_RESERVE_BATCH at a time.  The reply has a bit for each one
+ * found, and for each SYNC_RESERVE_BUCKET of them a digest of the
+ * whole GUIDs found, so the client can tell if a prefix matched some
+ * other message. */
+#define SYNC_GUID_PREFIX	8
+#define SYNC_RESERVE_BUCKET	64
+#define SYNC_RESERVE_BATCH	16384
+
+/* found[i] is the GUID found for the i'th prefix, or NULL */
+void sync_reserve_digest(struct message_guid * const *found, int n,
+			 struct buf *digest);
+
 /* ====================================================================== */
 
 struct sync_folder {
@@ -154,6 +168,7 @@ struct sync_folder {
     struct quota quota;
     int   mark; 
     int   reserve;  /* Folder has been processed by reserve operation */
+    int   retry;    /* Pipelined update failed, wants a full update */
 };
 
 struct sync_folder_list {
@@ -369,6 +384,7 @@ void sync_annot_list_free(struct sync_annot_list **lp);
 
 struct sync_action {
     struct sync_action *next;
+    struct sync_action *hash_next;
     int active;
     char *name;
     char *user;
@@ -376,9 +392,13 @@ struct sync_action {
 
 struct sync_action_list {
     struct sync_action *head, *tail;
+    struct sync_action **hash;
+    int hash_size;
     unsigned long count;
 };
 
+#define SYNC_ACTION_HASH_SIZE (4096)
+
 struct sync_action_list *sync_action_list_create(void);
 
 void sync_action_list_add(struct sync_action_list *l,
@@ -386,6 +406,9 @@ void sync_action_list_add(struct sync_action_list *l,
 
 void sync_action_list_free(struct sync_action_list **lp);
 
+/* for sharing work out by user */
+unsigned sync_userhash(const char *userid);
+
 /* ====================================================================== */
 
 void sync_send_response(struct dlist *kl, struct protstream *out);
@@ -393,6 +416,15 @@ void sync_send_apply(struct dlist *kl, struct protstream *out);
 void sync_send_lookup(struct dlist *kl, struct protstream *out);
 void sync_send_set(struct dlist *kl, struct protstream *out);
 
+/* send dlists in the binary encoding from now on, once it's been
+ * negotiated with SET OPTIONS.  Either encoding is always accepted */
+void sync_set_binary(int binary);
+int sync_get_binary(void);
+
+/* send the cache record with each message being uploaded, once the
+ * replica has said it can use it instead of parsing the message */
+void sync_set_cache(int cache);
+
 struct dlist *sync_parseline(struct protstream *in);
 
 /* ====================================================================== */
@@ -407,10 +439,20 @@ int sync_mailbox(struct mailbox *mailbox,
 		 struct sync_msgid_list *part_list,
 		 struct dlist *kl, struct dlist *kupload,
 		 int printrecords);
+int sync_mailbox_since(struct mailbox *mailbox,
+		       modseq_t since_modseq, uint32_t since_uid,
+		       struct dlist *kl);
+/* add the record's message to kupload if part_list says it's needed */
+int sync_send_file(struct mailbox *mailbox,
+		   struct index_record *record,
+		   struct sync_msgid_list *part_list,
+		   struct dlist *kupload);
 
 int parse_upload(struct dlist *kr, struct mailbox *mailbox,
 		 struct index_record *record,
 		 struct sync_annot_list **annotsp);
+int sync_verify_file(const char *fname, struct message_guid *guid,
+		     uint32_t size);
 int sync_append_copyfile(struct mailbox *mailbox,
 			 struct index_record *record,
 			 const struct sync_annot_list *sal);
@@ -443,4 +485,51 @@ int sync_crc_calc(struct mailbox *, char *, int);
 
 /* ====================================================================== */
 
+/* Replication statistics.  The client counts the commands it sends,
+ * timing each one until its response arrives, and the bytes it moves;
+ * everything else is counted by whoever knows about it */
+
+enum {
+    SYNC_STATS_APPLY = 0,
+    SYNC_STATS_GET,
+    SYNC_STATS_SET,
+    SYNC_STATS_NUMCMDS
+};
+
+/* latencies under 1ms, under 2ms, under 4ms... and the rest */
+#define SYNC_STATS_BUCKETS (16)
+
+struct sync_cmd_stats {
+    unsigned long long count;
+    unsigned long long failed;
+    unsigned long long usec;
+    unsigned long long hist[SYNC_STATS_BUCKETS];
+};
+
+struct sync_stats {
+    struct sync_cmd_stats cmd[SYNC_STATS_NUMCMDS];
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long events;
+    unsigned long long passes;
+    unsigned long long connect_retries;
+    unsigned long long full_retries;
+    unsigned long long promotions;
+    unsigned long long reconnects;
+};
+
+extern const char *sync_stats_cmdname[SYNC_STATS_NUMCMDS];
+extern struct sync_stats *sync_stats;
+
+/* forget any commands still waiting for responses, for a new connection */
+void sync_stats_reset(void);
+/* give the parent and each of nslots-1 forked workers somewhere to
+ * count which the parent can still see, and switch to one of them */
+void sync_stats_share(int nslots);
+void sync_stats_worker(int slot);
+void sync_stats_total(struct sync_stats *total);
+void sync_stats_add(struct sync_stats *total, const struct sync_stats *s);
+
+/* ====================================================================== */
+
 #endif /* INCLUDED_SYNC_SUPPORT_H */
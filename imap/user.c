@@ -82,6 +82,7 @@
 #include "seen.h"
 #include "sync_log.h"
 #include "user.h"
+#include "usercache.h"
 #include "util.h"
 #include "xmalloc.h"
 
@@ -189,6 +190,9 @@ int user_deletedata(const char *userid, int wipe_user)
 {
     char *fname;
 
+    /* don't keep the files open once they are gone */
+    usercache_drop(userid);
+
     /* delete seen state and mbox keys */
     if(wipe_user) {
 	seen_delete_user(userid);
@@ -339,6 +343,7 @@ int user_renamedata(char *olduser, char *newuser,
 
     if (!r) {
 	/* copy seen db */
+	usercache_drop(olduser);
 	seen_rename_user(olduser, newuser);
     }
 
@@ -0,0 +1,210 @@
+/* usercache.c -- user level state kept open between sessions
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A process which serves one session after another (imapd, with the
+ * master's max_use) would otherwise open and close the same user's
+ * seen state and subscriptions databases for each one.  Mobile clients
+ * in particular reconnect as the same user every few minutes.
+ *
+ * The cyrusdb backends share one handle per file within a process, so
+ * simply holding a reference here makes every later open of the same
+ * file find it mapped already.  The backends notice by inode when a
+ * file is replaced under them; what they can't cope with is the file
+ * going away, so each login checks that the files we hold still are
+ * the ones on disk, and reopens them if not.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cyrusdb.h"
+#include "mboxlist.h"
+#include "seen.h"
+#include "user.h"
+#include "usercache.h"
+#include "util.h"
+#include "xmalloc.h"
+
+struct usercache {
+    char *userid;
+    struct seen *seendb;
+    ino_t seen_ino;
+    struct db *subs;
+    ino_t subs_ino;
+    struct usercache *next;
+};
+
+/* most recently used first */
+static struct usercache *cache = NULL;
+static struct usercache_stats stats;
+
+static ino_t file_ino(const char *fname)
+{
+    struct stat sbuf;
+
+    if (stat(fname, &sbuf) < 0)
+	return 0;
+    return sbuf.st_ino;
+}
+
+static void entry_free(struct usercache *e)
+{
+    if (e->seendb) seen_close(&e->seendb);
+    if (e->subs) mboxlist_closesubs(e->subs);
+    free(e->userid);
+    free(e);
+}
+
+/* are the files we hold still the ones on disk? */
+static int entry_isfresh(struct usercache *e)
+{
+    char *fname;
+    int fresh;
+
+    /* a seen file created since is as good as a changed one */
+    fname = seen_getpath(e->userid);
+    fresh = (file_ino(fname) == e->seen_ino);
+    free(fname);
+
+    if (fresh) {
+	fname = user_hash_subs(e->userid);
+	fresh = (file_ino(fname) == e->subs_ino);
+	free(fname);
+    }
+
+    return fresh;
+}
+
+static struct usercache *entry_open(const char *userid)
+{
+    struct usercache *e = xzmalloc(sizeof(struct usercache));
+    char *fname;
+
+    e->userid = xstrdup(userid);
+
+    /* the user may not have any seen state yet, that's fine */
+    if (!seen_open(userid, SEEN_SILENT, &e->seendb)) {
+	fname = seen_getpath(userid);
+	e->seen_ino = file_ino(fname);
+	free(fname);
+    }
+    /* nor any subscriptions, and holding them mustn't create any */
+    if (!mboxlist_opensubs_existing(userid, &e->subs)) {
+	fname = user_hash_subs(userid);
+	e->subs_ino = file_ino(fname);
+	free(fname);
+    }
+
+    return e;
+}
+
+void usercache_hold(const char *userid, int max)
+{
+    struct usercache **prevp, *e;
+    int n;
+
+    if (max <= 0 || !userid)
+	return;
+
+    for (prevp = &cache; *prevp; prevp = &(*prevp)->next) {
+	if (!strcmp((*prevp)->userid, userid))
+	    break;
+    }
+
+    e = *prevp;
+    if (e) {
+	/* take it out, it goes back at the front */
+	*prevp = e->next;
+	if (entry_isfresh(e)) {
+	    stats.hits++;
+	}
+	else {
+	    syslog(LOG_DEBUG, "usercache: state of %s changed on disk",
+		   userid);
+	    stats.stale++;
+	    entry_free(e);
+	    e = NULL;
+	}
+    }
+    if (!e) {
+	stats.misses++;
+	e = entry_open(userid);
+    }
+    e->next = cache;
+    cache = e;
+
+    /* and forget whoever hasn't been around for longest */
+    for (n = 1, prevp = &cache->next; *prevp; n++) {
+	if (n < max) {
+	    prevp = &(*prevp)->next;
+	    continue;
+	}
+	e = *prevp;
+	*prevp = e->next;
+	entry_free(e);
+    }
+}
+
+void usercache_drop(const char *userid)
+{
+    struct usercache **prevp = &cache, *e;
+
+    while ((e = *prevp)) {
+	if (userid && strcmp(e->userid, userid)) {
+	    prevp = &e->next;
+	    continue;
+	}
+	*prevp = e->next;
+	entry_free(e);
+    }
+}
+
+void usercache_getstats(struct usercache_stats *s)
+{
+    *s = stats;
+}
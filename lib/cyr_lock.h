@@ -54,9 +54,24 @@
 #endif
 
 #include <sys/stat.h>
+#include <time.h>
 
 extern const char *lock_method_desc;
 
+/* whether lock_range() works here; only fcntl() locks can do it */
+extern const int lock_can_range;
+
+/* total seconds spent waiting for locks which someone else held */
+extern double lock_wait_time;
+
+/* and for the one taken by the most recent lock_* call */
+extern double lock_last_wait;
+
+/* if set, called when a lock can't be had straight away, before
+ * waiting for it, with the pid of a process which has it (0 if we
+ * can't tell) */
+extern void (*lock_contended_hook) P((int pid));
+
 extern int lock_reopen P((int fd, const char *filename,
 			   struct stat *sbuf, const char **failaction));
 
@@ -65,4 +80,44 @@ extern int lock_shared P((int fd));
 extern int lock_nonblocking P((int fd));
 extern int lock_unlock P((int fd));
 
+/* lock, or unlock, just 'len' bytes from 'offset'; see lock_can_range */
+extern int lock_range P((int fd, off_t offset, off_t len, int exclusive));
+extern int lock_range_unlock P((int fd, off_t offset, off_t len));
+
+/*
+ * Lock profiling, in lock_profile.c.
+ *
+ * Callers which know what a lock protects report it with lock_held()
+ * straight after the lock_* call which took it, and lock_released()
+ * when they let it go.  Once lock_profile_init() has been called, a
+ * wait of 'warn_ms' milliseconds or more is logged, along with who
+ * held the lock if we can tell; and if 'registry' is set, each process
+ * lists the locks it holds in <configdir>/locks/<pid> for lock_foreach().
+ */
+struct lock_holder {
+    int pid;
+    const char *kind;		/* "mailbox", "index", "db", ... */
+    const char *name;		/* what of that kind */
+    time_t since;
+    const char *ident;		/* the service */
+    const char *command;	/* what it was doing when it took the lock */
+};
+
+typedef int lockholder_t(const struct lock_holder *holder, void *rock);
+
+/* what this process is doing now, as far as anyone waiting cares */
+extern void lock_setcommand P((const char *command));
+
+extern void lock_held P((const char *kind, const char *name));
+extern void lock_released P((const char *kind, const char *name));
+
+/* call 'func' for each lock held by a live process, until it returns
+ * non-zero; returns that */
+extern int lock_foreach P((lockholder_t *func, void *rock));
+
+/* start and stop profiling, as by cyrus_init() and cyrus_done() */
+extern void lock_profile_init P((const char *ident, const char *configdir,
+				 int warn_ms, int registry));
+extern void lock_profile_done P((void));
+
 #endif /* INCLUDED_LOCK_H */
@@ -60,6 +60,7 @@
 #include "util.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
+#include "map.h"
 #include "retry.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -232,6 +233,60 @@ int cyrusdb_foreach(struct db *db,
 				p, cb, rock, tid);
 }
 
+int cyrusdb_fetchmulti(struct db *db,
+		       const char * const *keys,
+		       const size_t *keylens, int nkeys,
+		       foreach_cb *cb, void *rock,
+		       struct txn **tid)
+{
+    size_t *lens = NULL;
+    const char *data;
+    size_t datalen;
+    int i, r = 0;
+
+    if (!nkeys) return 0;
+
+    if (!keylens) {
+	lens = xmalloc(nkeys * sizeof(size_t));
+	for (i = 0; i < nkeys; i++)
+	    lens[i] = strlen(keys[i]);
+	keylens = lens;
+    }
+
+    if (db->backend->fetchmulti) {
+	r = db->backend->fetchmulti(db->engine, keys, keylens, nkeys,
+				    cb, rock, tid);
+	goto done;
+    }
+
+    /* no native support, one fetch at a time */
+    for (i = 0; i < nkeys; i++) {
+	r = db->backend->fetch(db->engine, keys[i], keylens[i],
+			       &data, &datalen, tid);
+	if (r == CYRUSDB_NOTFOUND) {
+	    data = NULL;
+	    datalen = 0;
+	}
+	else if (r) break;
+	else if (!data) data = "";
+
+	r = cb(rock, keys[i], keylens[i], data, datalen);
+	if (r) break;
+    }
+
+ done:
+    free(lens);
+    return r;
+}
+
+int cyrusdb_generation(struct db *db, uint64_t *genp)
+{
+    if (!db->backend->generation)
+	return CYRUSDB_INTERNAL;
+
+    return db->backend->generation(db->engine, genp);
+}
+
 int cyrusdb_create(struct db *db,
 	      const char *key, size_t keylen,
 	      const char *data, size_t datalen,
@@ -282,6 +337,153 @@ int cyrusdb_compar(struct db *db,
     return db->backend->compar(db->engine, a, alen, b, blen);
 }
 
+/* generic snapshots: copy every matching record into a private
+ * buffer, as [keylen][datalen][key][data] with the lengths in host
+ * order, under a transaction so that the copy is consistent */
+
+static int snapshot_copy_decode(const char *base, size_t offset,
+				const char **key, size_t *keylen,
+				const char **data, size_t *datalen)
+{
+    const char *ptr = base + offset;
+    size_t klen, dlen;
+
+    memcpy(&klen, ptr, sizeof(size_t));
+    memcpy(&dlen, ptr + sizeof(size_t), sizeof(size_t));
+    ptr += 2 * sizeof(size_t);
+
+    if (key) *key = ptr;
+    if (keylen) *keylen = klen;
+    if (data) *data = ptr + klen;
+    if (datalen) *datalen = dlen;
+
+    return 0;
+}
+
+static int snapshot_copy_cb(void *rock,
+			    const char *key, size_t keylen,
+			    const char *data, size_t datalen)
+{
+    struct dbsnapshot *snap = (struct dbsnapshot *)rock;
+
+    cyrusdb_snapshot_copy(snap, key, keylen, data, datalen);
+
+    return 0;
+}
+
+static int snapshot_copy(struct db *db,
+			 const char *prefix, size_t prefixlen,
+			 struct dbsnapshot *snap)
+{
+    struct txn *tid = NULL;
+    int r;
+
+    r = cyrusdb_foreach(db, prefix, prefixlen, NULL,
+			snapshot_copy_cb, snap, &tid);
+    if (tid) cyrusdb_abort(db, tid);
+
+    return r;
+}
+
+void cyrusdb_snapshot_copy(struct dbsnapshot *snap,
+			   const char *key, size_t keylen,
+			   const char *data, size_t datalen)
+{
+    cyrusdb_snapshot_add(snap, snap->copy.len);
+    buf_appendmap(&snap->copy, (const char *)&keylen, sizeof(size_t));
+    buf_appendmap(&snap->copy, (const char *)&datalen, sizeof(size_t));
+    buf_appendmap(&snap->copy, key, keylen);
+    buf_appendmap(&snap->copy, data, datalen);
+
+    /* the buffer may have moved */
+    snap->base = snap->copy.s;
+    snap->len = snap->copy.len;
+    snap->end = snap->copy.len;
+    snap->decode = snapshot_copy_decode;
+}
+
+void cyrusdb_snapshot_add(struct dbsnapshot *snap, size_t offset)
+{
+    if (snap->count == snap->alloc) {
+	snap->alloc = snap->alloc ? snap->alloc * 2 : 256;
+	snap->offsets = xrealloc(snap->offsets,
+				 snap->alloc * sizeof(size_t));
+    }
+    snap->offsets[snap->count++] = offset;
+}
+
+int cyrusdb_snapshot(struct db *db,
+		     const char *prefix, size_t prefixlen,
+		     struct dbsnapshot **snapp)
+{
+    struct dbsnapshot *snap = xzmalloc(sizeof(struct dbsnapshot));
+    int r;
+
+    if (db->backend->snapshot)
+	r = db->backend->snapshot(db->engine, prefix, prefixlen, snap);
+    else
+	r = snapshot_copy(db, prefix, prefixlen, snap);
+
+    if (r) cyrusdb_snapshot_free(&snap);
+    *snapp = snap;
+
+    return r;
+}
+
+int cyrusdb_snapshot_next(struct dbsnapshot *snap,
+			  const char **key, size_t *keylen,
+			  const char **data, size_t *datalen)
+{
+    if (snap->pos >= snap->count)
+	return CYRUSDB_DONE;
+
+    return snap->decode(snap->base, snap->offsets[snap->pos++],
+			key, keylen, data, datalen);
+}
+
+void cyrusdb_snapshot_free(struct dbsnapshot **snapp)
+{
+    struct dbsnapshot *snap = *snapp;
+
+    if (!snap) return;
+
+    if (snap->is_mapped)
+	map_free(&snap->base, &snap->len);
+    buf_free(&snap->copy);
+    free(snap->offsets);
+    free(snap);
+
+    *snapp = NULL;
+}
+
+int cyrusdb_snapshot_foreach(struct db *db,
+			     const char *prefix, size_t prefixlen,
+			     foreach_p *p,
+			     foreach_cb *cb, void *rock)
+{
+    struct dbsnapshot *snap = NULL;
+    const char *key, *data;
+    size_t keylen, datalen;
+    int r, cb_r = 0;
+
+    r = cyrusdb_snapshot(db, prefix, prefixlen, &snap);
+    if (r) return r;
+
+    while (!(r = cyrusdb_snapshot_next(snap, &key, &keylen,
+				       &data, &datalen))) {
+	if (p && !p(rock, key, keylen, data, datalen))
+	    continue;
+	cb_r = cb(rock, key, keylen, data, datalen);
+	if (cb_r) break;
+    }
+
+    cyrusdb_snapshot_free(&snap);
+
+    if (r == CYRUSDB_DONE) r = 0;
+
+    return r ? r : cb_r;
+}
+
 /**********************************************/
 
 void cyrusdb_init(void)
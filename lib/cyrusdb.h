@@ -45,10 +45,17 @@
 #define INCLUDED_CYRUSDB_H
 
 #include <stdio.h>
+#ifdef HAVE_INTTYPES_H
+# include <inttypes.h>
+#elif defined(HAVE_STDINT_H)
+# include <stdint.h>
+#endif
 #include "strarray.h"
+#include "util.h"
 
 struct db;
 struct txn;
+struct dbsnapshot;
 
 enum cyrusdb_ret {
     CYRUSDB_OK = 0,
@@ -84,6 +91,38 @@ typedef int foreach_cb(void *rock,
 		       const char *key, size_t keylen,
 		       const char *data, size_t datalen);
 
+/* decodes the record at 'offset' within a snapshot image */
+typedef int snapshot_decoder(const char *base, size_t offset,
+			     const char **key, size_t *keylen,
+			     const char **data, size_t *datalen);
+
+/* A read-only view of a database, taken with a single short lock.
+ *
+ * 'base' and 'len' are the pinned image: a private map of the file
+ * up to its committed end offset for twoskip, or a private copy of
+ * the matching records for everything else.  Since twoskip never
+ * rewrites keys or values in place, and a checkpoint renames a new
+ * file over the old one rather than changing it, the image stays
+ * valid without holding any lock while other processes (or this one)
+ * carry on writing.
+ *
+ * 'offsets' lists the matching records in key order. */
+struct dbsnapshot {
+    const char *base;
+    size_t len;
+    int is_mapped;
+    struct buf copy;
+
+    size_t end;
+
+    size_t *offsets;
+    size_t count;
+    size_t alloc;
+    size_t pos;
+
+    snapshot_decoder *decode;
+};
+
 typedef int cyrusdb_archiver(const strarray_t *fnames,
 			     const char *dirname);
 
@@ -211,6 +250,43 @@ struct cyrusdb_backend {
     int (*consistent)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
 		  const char *s2, int l2);
+
+    /* snapshot: fill in 'snap' with every record that starts with
+       'prefix', pinned at the current committed end of the database.
+       The backend should hold its lock only while collecting the
+       record offsets.  If the caller has a transaction open on the
+       database, the snapshot sees the uncommitted changes too, and
+       must be freed before that transaction is aborted.
+
+       May be NULL, in which case cyrusdb_snapshot() falls back to
+       copying the records out under a transaction. */
+    int (*snapshot)(struct dbengine *db,
+		    const char *prefix, size_t prefixlen,
+		    struct dbsnapshot *snap);
+
+    /* fetchmulti: look up 'nkeys' keys, which should be sorted in
+       the database's order, in a single locked pass.  'cb' is called
+       once per key, in order, with data=NULL if the key was not found.
+       Each lookup starts from where the previous one ended rather
+       than from the head.  'cb' must not change the database.
+
+       May be NULL, in which case cyrusdb_fetchmulti() calls fetch()
+       for each key. */
+    int (*fetchmulti)(struct dbengine *db,
+		      const char * const *keys, const size_t *keylens,
+		      int nkeys,
+		      foreach_cb *cb, void *rock,
+		      struct txn **tid);
+
+    /* generation: set '*genp' to a value which changes whenever
+       anything is committed to the database, by this or any other
+       process.  Callers may use it to tell whether data they cached
+       from the database is still current.  Inside a transaction it
+       returns CYRUSDB_AGAIN, as nothing read there may be cached.
+
+       May be NULL, in which case cyrusdb_generation() returns
+       CYRUSDB_INTERNAL and nothing can be cached. */
+    int (*generation)(struct dbengine *db, uint64_t *genp);
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -257,6 +333,15 @@ extern int cyrusdb_foreach(struct db *db,
 			   foreach_p *p,
 			   foreach_cb *cb, void *rock,
 			   struct txn **tid);
+/* fetch many keys in one pass, see fetchmulti above.  If 'keylens'
+ * is NULL the keys are NUL terminated strings */
+extern int cyrusdb_fetchmulti(struct db *db,
+			      const char * const *keys,
+			      const size_t *keylens, int nkeys,
+			      foreach_cb *cb, void *rock,
+			      struct txn **tid);
+/* see generation above */
+extern int cyrusdb_generation(struct db *db, uint64_t *genp);
 extern int cyrusdb_create(struct db *db,
 			  const char *key, size_t keylen,
 			  const char *data, size_t datalen,
@@ -276,6 +361,25 @@ extern int cyrusdb_compar(struct db *db,
 			  const char *a, int alen,
 			  const char *b, int blen);
 
+/* snapshot interface: take a consistent view of all records starting
+ * with 'prefix', then walk it with cyrusdb_snapshot_next() without
+ * holding any lock on the database.  cyrusdb_snapshot_next() returns
+ * CYRUSDB_DONE after the last record.  Keys and data are valid until
+ * cyrusdb_snapshot_free() */
+extern int cyrusdb_snapshot(struct db *db,
+			    const char *prefix, size_t prefixlen,
+			    struct dbsnapshot **snapp);
+extern int cyrusdb_snapshot_next(struct dbsnapshot *snap,
+				 const char **key, size_t *keylen,
+				 const char **data, size_t *datalen);
+extern void cyrusdb_snapshot_free(struct dbsnapshot **snapp);
+/* like cyrusdb_foreach(), but 'cb' is called with no lock held and
+ * sees the database as it was when the walk started */
+extern int cyrusdb_snapshot_foreach(struct db *db,
+				    const char *prefix, size_t prefixlen,
+				    foreach_p *p,
+				    foreach_cb *cb, void *rock);
+
 /* somewhat special case, because they don't take a DB */
 
 extern int cyrusdb_sync(const char *backend);
@@ -292,4 +396,11 @@ int cyrusdb_generic_sync(void);
 int cyrusdb_generic_archive(const strarray_t *fnames, const char *dirname);
 int cyrusdb_generic_noarchive(const strarray_t *fnames, const char *dirname);
 
+/* helpers for backend snapshot implementations: either add the offset
+ * of a record within a pinned image, or copy the record out */
+void cyrusdb_snapshot_add(struct dbsnapshot *snap, size_t offset);
+void cyrusdb_snapshot_copy(struct dbsnapshot *snap,
+			   const char *key, size_t keylen,
+			   const char *data, size_t datalen);
+
 #endif /* INCLUDED_CYRUSDB_H */
@@ -1043,7 +1043,10 @@ struct cyrusdb_backend cyrusdb_berkeley =
     
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
 
 struct cyrusdb_backend cyrusdb_berkeley_nosync = 
@@ -1072,7 +1075,10 @@ struct cyrusdb_backend cyrusdb_berkeley_nosync =
 
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
 
 struct cyrusdb_backend cyrusdb_berkeley_hash = 
@@ -1101,7 +1107,10 @@ struct cyrusdb_backend cyrusdb_berkeley_hash =
     
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
 
 struct cyrusdb_backend cyrusdb_berkeley_hash_nosync = 
@@ -1130,5 +1139,8 @@ struct cyrusdb_backend cyrusdb_berkeley_hash_nosync =
 
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
@@ -848,5 +848,8 @@ struct cyrusdb_backend cyrusdb_flat =
 
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
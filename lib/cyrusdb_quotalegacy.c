@@ -894,5 +894,8 @@ struct cyrusdb_backend cyrusdb_quotalegacy =
 
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
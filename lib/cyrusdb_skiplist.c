@@ -667,6 +667,7 @@ static int write_lock(struct dbengine *db, const char *altname)
     db->map_ino = sbuf.st_ino;
     db->lock_status = WRITELOCKED;
     gettimeofday(&db->starttime, 0);
+    lock_held("db", db->fname);
     
     map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
 		fname, 0);
@@ -724,6 +725,7 @@ static int read_lock(struct dbengine *db)
     db->map_ino = sbuf.st_ino;
     db->lock_status = READLOCKED;
     gettimeofday(&db->starttime, 0);
+    lock_held("db", db->fname);
     
     /* printf("%d: read lock: %d\n", getpid(), db->map_ino); */
 
@@ -751,6 +753,7 @@ static int unlock(struct dbengine *db)
 	return CYRUSDB_IOERROR;
     }
     db->lock_status = UNLOCKED;
+    lock_released("db", db->fname);
 
     gettimeofday(&endtime, 0);
     timediff = timesub(&db->starttime, &endtime);
@@ -1047,6 +1050,120 @@ static const char *find_node(struct dbengine *db,
     return ptr;
 }
 
+/* like find_node(), but 'fingers' holds the update offsets left by a
+ * search for an earlier key.  Climb only as far as it takes to get
+ * past 'key', then descend from there (a finger search) */
+static const char *find_node_finger(struct dbengine *db,
+				    const char *key, size_t keylen,
+				    unsigned *fingers)
+{
+    const char *ptr;
+    int i, level;
+    unsigned offset;
+
+    for (level = 0; level < (int) db->curlevel - 1; level++) {
+	offset = FORWARD(db->map_base + fingers[level], level);
+	if (!offset ||
+	    db->compar(KEY(db->map_base + offset),
+		       KEYLEN(db->map_base + offset), key, keylen) >= 0)
+	    break;
+    }
+
+    ptr = db->map_base + fingers[level];
+    for (i = level; i >= 0; i--) {
+	while ((offset = FORWARD(ptr, i)) &&
+	       db->compar(KEY(db->map_base + offset),
+			  KEYLEN(db->map_base + offset), key, keylen) < 0) {
+	    ptr = db->map_base + offset;
+	}
+	fingers[i] = ptr - db->map_base;
+    }
+
+    return db->map_base + FORWARD(ptr, 0);
+}
+
+static int myfetchmulti(struct dbengine *db,
+			const char * const *keys, const size_t *keylens,
+			int nkeys,
+			foreach_cb *cb, void *rock,
+			struct txn **tidptr)
+{
+    unsigned fingers[SKIPLIST_MAXLEVEL+1];
+    const char *ptr;
+    int i, r = 0, cb_r = 0;
+
+    assert(db != NULL);
+
+    if (!tidptr && db->current_txn != NULL) {
+	tidptr = &(db->current_txn);
+    }
+
+    if (tidptr) {
+	if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	    return r;
+	}
+    } else {
+	if ((r = read_lock(db)) < 0) {
+	    return r;
+	}
+    }
+
+    for (i = 0; i < nkeys; i++) {
+	/* only a later key can start from the fingers */
+	if (i && db->compar(keys[i], keylens[i],
+			    keys[i-1], keylens[i-1]) > 0)
+	    ptr = find_node_finger(db, keys[i], keylens[i], fingers);
+	else
+	    ptr = find_node(db, keys[i], keylens[i], fingers);
+
+	if (ptr == db->map_base ||
+	    db->compar(KEY(ptr), KEYLEN(ptr), keys[i], keylens[i]))
+	    cb_r = cb(rock, keys[i], keylens[i], NULL, 0);
+	else
+	    cb_r = cb(rock, keys[i], keylens[i], DATA(ptr), DATALEN(ptr));
+	if (cb_r) break;
+    }
+
+    if (!tidptr) {
+	int r1;
+	if ((r1 = unlock(db)) < 0) {
+	    return r1;
+	}
+    }
+
+    return cb_r;
+}
+
+/* commits only ever append to the log and a checkpoint writes a new
+ * file, so under the read lock (with no transaction half written) the
+ * inode and size change whenever the committed contents do.  The
+ * mtime is there in case a later checkpoint gets the old inode number
+ * back at the same size.  Nothing read inside a transaction may be
+ * cached, since an abort takes it all back */
+static int mygeneration(struct dbengine *db, uint64_t *genp)
+{
+    struct stat sbuf;
+    int r;
+
+    assert(db != NULL);
+
+    if (db->current_txn != NULL) return CYRUSDB_AGAIN;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    if (fstat(db->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", db->fname);
+	unlock(db);
+	return CYRUSDB_IOERROR;
+    }
+
+    *genp = ((uint64_t)sbuf.st_ino << 32) ^ sbuf.st_size;
+    *genp = *genp * 1000003 + sbuf.st_mtime;
+
+    return unlock(db);
+}
+
 static int myfetch(struct dbengine *db,
 		   const char *key, size_t keylen,
 		   const char **data, size_t *datalen,
@@ -1238,6 +1355,60 @@ static int myforeach(struct dbengine *db,
     return r ? r : cb_r;
 }
 
+/* skiplist checkpoints truncate the old file away to free the space,
+   so we can't keep a map of it around.  Copy the records out instead,
+   but still only hold the read lock for as long as that takes.
+*/
+static int mysnapshot(struct dbengine *db,
+		      const char *prefix, size_t prefixlen,
+		      struct dbsnapshot *snap)
+{
+    const char *ptr;
+    struct txn **tidptr = NULL;
+    int r = 0;
+
+    assert(db != NULL);
+
+    /* inside a transaction, just use it */
+    if (db->current_txn != NULL) {
+	tidptr = &(db->current_txn);
+    }
+
+    if (tidptr) {
+	/* make sure we're up to date */
+	if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	    return r;
+	}
+    } else {
+	/* grab a r lock */
+	if ((r = read_lock(db)) < 0) {
+	    return r;
+	}
+    }
+
+    ptr = find_node(db, prefix, prefixlen, 0);
+
+    while (ptr != db->map_base) {
+	/* does it match prefix? */
+	if (KEYLEN(ptr) < (uint32_t) prefixlen) break;
+	if (prefixlen && db->compar(KEY(ptr), prefixlen, prefix, prefixlen)) break;
+
+	cyrusdb_snapshot_copy(snap, KEY(ptr), KEYLEN(ptr),
+			      DATA(ptr), DATALEN(ptr));
+
+	ptr = db->map_base + FORWARD(ptr, 0);
+    }
+
+    if (!tidptr) {
+	/* release read lock */
+	if ((r = unlock(db)) < 0) {
+	    return r;
+	}
+    }
+
+    return 0;
+}
+
 static unsigned int randlvl(struct dbengine *db)
 {
     unsigned int lvl = 1;
@@ -2489,5 +2660,8 @@ struct cyrusdb_backend cyrusdb_skiplist =
 
     &dump,
     &consistent,
-    &mycompar
+    &mycompar,
+    &mysnapshot,
+    &myfetchmulti,
+    &mygeneration
 };
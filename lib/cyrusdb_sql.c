@@ -920,5 +920,8 @@ struct cyrusdb_backend cyrusdb_sql =
 
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+    NULL,
+    NULL,
+    NULL
 };
@@ -1001,6 +1001,96 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
     return relocate(db);
 }
 
+/* helper function for fetchmulti: move the location on to 'key',
+ * which sorts after the key of the last search.  Rather than starting
+ * again at the dummy, climb only as many levels as it takes to get
+ * past 'key' and descend from there (a finger search) */
+static int finger_loc(struct dbengine *db, const char *key, size_t keylen)
+{
+    struct skiprecord newrecord;
+    struct skiploc *loc = &db->loc;
+    uint8_t level, i;
+    int cmp = -1;
+    int r;
+
+    /* nothing to start from, or going backwards */
+    if (!keylen || !loc->keybuf.len
+	|| loc->end != db->end
+	|| loc->generation != db->header.generation
+	|| db->compar(key, keylen, loc->keybuf.s, loc->keybuf.len) <= 0)
+	return find_loc(db, key, keylen);
+
+    /* an exact match is itself the last record before 'key' on
+     * each of its levels */
+    if (loc->is_exactmatch) {
+	for (i = 0; i < loc->record.level; i++)
+	    loc->backloc[i] = loc->record.offset;
+    }
+
+    buf_setmap(&loc->keybuf, key, keylen);
+    loc->is_exactmatch = 0;
+
+    /* climb until the next record is at or past the key.  Above
+     * that level the pointers are already right for the new key */
+    for (level = 0; level < MAXLEVEL; level++) {
+	if (!loc->forwardloc[level]) break;
+
+	r = read_skipdelete(db, loc->forwardloc[level], &newrecord);
+	if (r) return r;
+	if (!newrecord.offset) break;
+
+	cmp = db->compar(_key(db, &newrecord), newrecord.keylen,
+			 loc->keybuf.s, loc->keybuf.len);
+	if (cmp >= 0) break;
+    }
+
+    /* never got past it, so search from the top */
+    if (level == MAXLEVEL) return relocate(db);
+
+    r = read_onerecord(db, loc->backloc[level], &loc->record);
+    if (r) return r;
+
+    /* and descend, just like relocate() */
+    level++;
+    cmp = -1;
+    newrecord.offset = 0;
+
+    while (level) {
+	size_t offset = _getloc(db, &loc->record, level-1);
+
+	loc->backloc[level-1] = loc->record.offset;
+	loc->forwardloc[level-1] = offset;
+
+	r = read_skipdelete(db, offset, &newrecord);
+	if (r) return r;
+
+	if (newrecord.offset) {
+	    cmp = db->compar(_key(db, &newrecord), newrecord.keylen,
+			     loc->keybuf.s, loc->keybuf.len);
+
+	    if (cmp < 0) {
+		loc->record = newrecord;
+		continue;
+	    }
+	}
+
+	level--;
+    }
+
+    if (cmp == 0) {
+	loc->is_exactmatch = 1;
+	loc->record = newrecord;
+
+	for (i = 0; i < loc->record.level; i++)
+	    loc->forwardloc[i] = _getloc(db, &loc->record, i);
+
+	r = check_tailcrc(db, &loc->record);
+	if (r) return r;
+    }
+
+    return 0;
+}
+
 /* helper function to advance to the "next" record.  Used by foreach,
  * fetchnext, and internal functions */
 static int advance_loc(struct dbengine *db)
@@ -1495,6 +1585,71 @@ done:
     return r;
 }
 
+static int myfetchmulti(struct dbengine *db,
+			const char * const *keys, const size_t *keylens,
+			int nkeys,
+			foreach_cb *cb, void *rock,
+			struct txn **tidptr)
+{
+    int i, r = 0, cb_r = 0;
+
+    assert(db);
+
+    if (!tidptr && db->current_txn)
+	tidptr = &db->current_txn;
+
+    if (tidptr) {
+	if (!*tidptr) {
+	    r = newtxn(db, tidptr);
+	    if (r) return r;
+	}
+    } else {
+	r = read_lock(db);
+	if (r) return r;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+	assert(keylens[i]);
+
+	r = finger_loc(db, keys[i], keylens[i]);
+	if (r) break;
+
+	if (db->loc.is_exactmatch)
+	    cb_r = cb(rock, keys[i], keylens[i],
+		      _val(db, &db->loc.record), db->loc.record.vallen);
+	else
+	    cb_r = cb(rock, keys[i], keylens[i], NULL, 0);
+	if (cb_r) break;
+    }
+
+    if (!tidptr) {
+	int r1 = unlock(db);
+	if (r1 < 0) return r1;
+    }
+
+    return r ? r : cb_r;
+}
+
+/* every commit moves current_size on, and a checkpoint bumps the
+ * generation and may well shrink the file, so together they change
+ * whenever the contents do.  Nothing read inside a transaction may be
+ * cached, since an abort takes it all back */
+static int mygeneration(struct dbengine *db, uint64_t *genp)
+{
+    int r;
+
+    assert(db);
+
+    if (db->current_txn) return CYRUSDB_AGAIN;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    *genp = (db->header.generation << 40) ^ db->header.current_size;
+
+    return unlock(db);
+}
+
 /* foreach allows for subsidary mailbox operations in 'cb'.
    if there is a txn, 'cb' must make use of it.
 */
@@ -1589,6 +1744,101 @@ static int myforeach(struct dbengine *db,
     return r ? r : cb_r;
 }
 
+/* find the key and value of the record at 'offset' in a pinned image
+ * of the file.  Only the parts of the record that are never rewritten
+ * in place are looked at, so this is safe without a lock */
+static int snapshot_decode(const char *base, size_t offset,
+			   const char **key, size_t *keylen,
+			   const char **data, size_t *datalen)
+{
+    const char *ptr = base + offset;
+    uint8_t level = ptr[1];
+    size_t klen = ntohs(*((uint16_t *)(ptr + 2)));
+    size_t vlen = ntohl(*((uint32_t *)(ptr + 4)));
+
+    ptr += 8;
+
+    /* long key */
+    if (klen == UINT16_MAX) {
+	klen = ntohll(*((uint64_t *)ptr));
+	ptr += 8;
+    }
+
+    /* long value */
+    if (vlen == UINT32_MAX) {
+	vlen = ntohll(*((uint64_t *)ptr));
+	ptr += 8;
+    }
+
+    /* skip the pointers and the crc32s */
+    ptr += 8 * (1 + level) + 8;
+
+    if (key) *key = ptr;
+    if (keylen) *keylen = klen;
+    if (data) *data = ptr + klen;
+    if (datalen) *datalen = vlen;
+
+    return 0;
+}
+
+/* records are only ever appended, and a checkpoint writes a whole new
+ * file, so a private map of everything up to the current end together
+ * with the offsets of the live records is a consistent view for as
+ * long as we like - the lock is only needed while finding them */
+static int mysnapshot(struct dbengine *db,
+		      const char *prefix, size_t prefixlen,
+		      struct dbsnapshot *snap)
+{
+    int r = 0, r1;
+
+    assert(db);
+    assert(snap);
+    if (prefixlen) assert(prefix);
+
+    /* inside a transaction we already hold the write lock */
+    if (!db->current_txn) {
+	r = read_lock(db);
+	if (r) return r;
+    }
+
+    snap->end = db->end;
+    mappedfile_pin(db->mf, snap->end, &snap->base, &snap->len);
+    snap->is_mapped = 1;
+    snap->decode = snapshot_decode;
+
+    r = find_loc(db, prefix, prefixlen);
+    if (r) goto done;
+
+    if (!db->loc.is_exactmatch) {
+	/* advance to the first match */
+	r = advance_loc(db);
+	if (r) goto done;
+    }
+
+    while (db->loc.is_exactmatch) {
+	/* does it match prefix? */
+	if (prefixlen) {
+	    if (db->loc.record.keylen < prefixlen) break;
+	    if (db->compar(_key(db, &db->loc.record), prefixlen, prefix, prefixlen)) break;
+	}
+
+	cyrusdb_snapshot_add(snap, db->loc.record.offset);
+
+	/* move to the next one */
+	r = advance_loc(db);
+	if (r) goto done;
+    }
+
+ done:
+    if (!db->current_txn) {
+	/* release read lock */
+	r1 = unlock(db);
+	if (!r) r = r1;
+    }
+
+    return r;
+}
+
 /* helper function for all writes - wraps create and delete and the FORCE
  * logic for each */
 static int skipwrite(struct dbengine *db,
@@ -2355,5 +2605,8 @@ struct cyrusdb_backend cyrusdb_twoskip =
 
     &dump,
     &consistent,
-    &mycompar
+    &mycompar,
+    &mysnapshot,
+    &myfetchmulti,
+    &mygeneration
 };
@@ -0,0 +1,173 @@
+/* histogram.c -- log-linear histograms of counts and latencies
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+int histogram_bucket(bit64 value)
+{
+    int bits = 0, shift;
+
+    if (value < 2 * HISTOGRAM_SUBBUCKETS)
+	return value;
+    if (value >> HISTOGRAM_MAXBITS)
+	return HISTOGRAM_BUCKETS - 1;
+
+    /* the position of the top bit, less the bits kept below it */
+    while (value >> (bits + 1))
+	bits++;
+    shift = bits - HISTOGRAM_SUBBITS;
+
+    return HISTOGRAM_SUBBUCKETS * (shift + 1) +
+	   (int) (value >> shift) - HISTOGRAM_SUBBUCKETS;
+}
+
+bit64 histogram_bucket_top(int bucket)
+{
+    int shift;
+    bit64 base;
+
+    if (bucket < 2 * HISTOGRAM_SUBBUCKETS)
+	return bucket;
+
+    shift = bucket / HISTOGRAM_SUBBUCKETS - 1;
+    base = bucket % HISTOGRAM_SUBBUCKETS + HISTOGRAM_SUBBUCKETS;
+
+    return ((base + 1) << shift) - 1;
+}
+
+void histogram_add(struct histogram *h, bit64 value)
+{
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+	h->max = value;
+    h->buckets[histogram_bucket(value)]++;
+}
+
+void histogram_merge(struct histogram *h, const struct histogram *from)
+{
+    int i;
+
+    h->count += from->count;
+    h->sum += from->sum;
+    if (from->max > h->max)
+	h->max = from->max;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	h->buckets[i] += from->buckets[i];
+}
+
+bit64 histogram_percentile(const struct histogram *h, double p)
+{
+    bit64 want, seen = 0;
+    int i;
+
+    if (!h->count)
+	return 0;
+
+    if (p <= 0.0)
+	want = 1;
+    else if (p >= 1.0)
+	want = h->count;
+    else
+	want = (bit64) (p * h->count + 0.999999);
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+	seen += h->buckets[i];
+	if (seen >= want)
+	    break;
+    }
+    if (i == HISTOGRAM_BUCKETS)
+	return h->max;
+
+    /* no point claiming more than we've ever seen */
+    return histogram_bucket_top(i) < h->max ? histogram_bucket_top(i) : h->max;
+}
+
+void histogram_format(const struct histogram *h, struct buf *buf)
+{
+    int i;
+
+    buf_printf(buf, "%llu %llu %llu", h->count, h->sum, h->max);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+	if (h->buckets[i])
+	    buf_printf(buf, " %d:%llu", i, h->buckets[i]);
+    }
+}
+
+int histogram_parse(struct histogram *h, const char *p)
+{
+    struct histogram tmp;
+    char *end;
+    int i;
+
+    memset(&tmp, 0, sizeof(tmp));
+
+    tmp.count = strtoull(p, &end, 10);
+    if (end == p || *end != ' ') return -1;
+    p = end + 1;
+    tmp.sum = strtoull(p, &end, 10);
+    if (end == p || *end != ' ') return -1;
+    p = end + 1;
+    tmp.max = strtoull(p, &end, 10);
+    if (end == p) return -1;
+    p = end;
+
+    while (*p == ' ') {
+	p++;
+	i = strtol(p, &end, 10);
+	if (end == p || *end != ':' || i < 0 || i >= HISTOGRAM_BUCKETS)
+	    return -1;
+	p = end + 1;
+	tmp.buckets[i] = strtoull(p, &end, 10);
+	if (end == p) return -1;
+	p = end;
+    }
+    if (*p && *p != '\n') return -1;
+
+    histogram_merge(h, &tmp);
+    return 0;
+}
@@ -0,0 +1,97 @@
+/* histogram.h -- log-linear histograms of counts and latencies
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_HISTOGRAM_H__
+#define __CYRUS_HISTOGRAM_H__
+
+#include <config.h>
+
+#include "util.h"
+
+/*
+ * Values are counted in buckets whose width grows with the value, in
+ * the manner of HdrHistogram: each power of two is split into
+ * HISTOGRAM_SUBBUCKETS equal buckets, so any value is known to within
+ * 1/8th of itself whatever its size.  Values below 16 get a bucket
+ * each, and anything from 2^40 up shares the last one.
+ */
+#define HISTOGRAM_SUBBITS	3
+#define HISTOGRAM_SUBBUCKETS	(1 << HISTOGRAM_SUBBITS)
+#define HISTOGRAM_MAXBITS	40
+#define HISTOGRAM_BUCKETS	\
+    (HISTOGRAM_SUBBUCKETS * (HISTOGRAM_MAXBITS - HISTOGRAM_SUBBITS + 1))
+
+struct histogram {
+    bit64 count;
+    bit64 sum;
+    bit64 max;
+    bit64 buckets[HISTOGRAM_BUCKETS];
+};
+
+#define HISTOGRAM_INITIALIZER { 0, 0, 0, { 0 } }
+
+extern void histogram_add(struct histogram *h, bit64 value);
+
+/* add everything counted in 'from' to 'h' */
+extern void histogram_merge(struct histogram *h, const struct histogram *from);
+
+/* the bucket 'value' is counted in, and the largest value it holds */
+extern int histogram_bucket(bit64 value);
+extern bit64 histogram_bucket_top(int bucket);
+
+/*
+ * The value at or below which a fraction 'p' (0.0 to 1.0) of values
+ * fall, to within the width of its bucket.  0 if there are none.
+ */
+extern bit64 histogram_percentile(const struct histogram *h, double p);
+
+/*
+ * As text, "count sum max" followed by "bucket:count" for each bucket
+ * which is not empty, all separated by single spaces.
+ */
+extern void histogram_format(const struct histogram *h, struct buf *buf);
+
+/* add the counts in 'p' (as made by histogram_format()) to 'h'.
+ * Returns 0, or -1 if 'p' isn't in that format. */
+extern int histogram_parse(struct histogram *h, const char *p);
+
+#endif /* __CYRUS_HISTOGRAM_H__ */
@@ -45,6 +45,7 @@
 #include <config.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -52,6 +53,53 @@
 #include "cyr_lock.h"
 
 const char *lock_method_desc = "fcntl";
+const int lock_can_range = 1;
+
+double lock_wait_time = 0.0;
+double lock_last_wait = 0.0;
+void (*lock_contended_hook)(int pid) = NULL;
+
+/*
+ * Set a lock of 'type' on 'len' bytes of 'fd' from 'offset' (0 for all
+ * of it), waiting if need be, and add any time spent waiting to
+ * lock_wait_time and lock_last_wait.
+ * Returns as fcntl().
+ */
+static int lock_wait(int fd, int type, off_t offset, off_t len)
+{
+    struct flock fl, holder;
+    struct timeval start, end;
+    double waited;
+    int r;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = len;
+
+    /* nearly always uncontended, so don't look at the clock then */
+    r = fcntl(fd, F_SETLK, &fl);
+    if (r != -1 || (errno != EACCES && errno != EAGAIN))
+	return r;
+
+    /* see who has it while they still do */
+    if (lock_contended_hook) {
+	holder = fl;
+	if (fcntl(fd, F_GETLK, &holder) == -1 || holder.l_type == F_UNLCK)
+	    holder.l_pid = 0;
+	lock_contended_hook(holder.l_pid);
+    }
+
+    gettimeofday(&start, 0);
+    r = fcntl(fd, F_SETLKW, &fl);
+    gettimeofday(&end, 0);
+    waited = (end.tv_sec - start.tv_sec) +
+	     (end.tv_usec - start.tv_usec) / 1000000.0;
+    lock_wait_time += waited;
+    lock_last_wait += waited;
+
+    return r;
+}
 
 /*
  * Block until we obtain an exclusive lock on the file descriptor 'fd',
@@ -76,13 +124,10 @@ int lock_reopen(int fd, const char *filename,
     int newfd;
 
     if (!sbuf) sbuf = &sbufspare;
+    lock_last_wait = 0.0;
 
     for (;;) {
-	fl.l_type= F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = 0;
-	fl.l_len = 0;
-	r = fcntl(fd, F_SETLKW, &fl);
+	r = lock_wait(fd, F_WRLCK, 0, 0);
 	if (r == -1) {
 	    if (errno == EINTR) continue;
 	    if (failaction) *failaction = "locking";
@@ -126,14 +171,10 @@ int lock_reopen(int fd, const char *filename,
 int lock_blocking(int fd)
 {
     int r;
-    struct flock fl;
 
+    lock_last_wait = 0.0;
     for (;;) {
-	fl.l_type= F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = 0;
-	fl.l_len = 0;
-	r = fcntl(fd, F_SETLKW, &fl);
+	r = lock_wait(fd, F_WRLCK, 0, 0);
 	if (r != -1) return 0;
 	if (errno == EINTR) continue;
 	return -1;
@@ -148,14 +189,10 @@ int lock_blocking(int fd)
 int lock_shared(int fd)
 {
     int r;
-    struct flock fl;
 
+    lock_last_wait = 0.0;
     for (;;) {
-	fl.l_type= F_RDLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = 0;
-	fl.l_len = 0;
-	r = fcntl(fd, F_SETLKW, &fl);
+	r = lock_wait(fd, F_RDLCK, 0, 0);
 	if (r != -1) return 0;
 	if (errno == EINTR) continue;
 	return -1;
@@ -172,6 +209,7 @@ int lock_nonblocking(int fd)
     int r;
     struct flock fl;
 
+    lock_last_wait = 0.0;
     for (;;) {
 	fl.l_type= F_WRLCK;
 	fl.l_whence = SEEK_SET;
@@ -184,6 +222,47 @@ int lock_nonblocking(int fd)
     }
 }
 
+/*
+ * Obtain a lock on just 'len' bytes of 'fd' from 'offset', shared or
+ * exclusive.  It only conflicts with locks which overlap it, which
+ * includes any lock on the whole file.  The bytes need not exist.
+ * Returns 0 for success, -1 for failure, with errno set to an
+ * appropriate error code.
+ */
+int lock_range(int fd, off_t offset, off_t len, int exclusive)
+{
+    int r;
+
+    lock_last_wait = 0.0;
+    for (;;) {
+	r = lock_wait(fd, exclusive ? F_WRLCK : F_RDLCK, offset, len);
+	if (r != -1) return 0;
+	if (errno == EINTR) continue;
+	return -1;
+    }
+}
+
+/*
+ * Release a lock taken by lock_range(), leaving any others.
+ */
+int lock_range_unlock(int fd, off_t offset, off_t len)
+{
+    struct flock fl;
+    int r;
+
+    fl.l_type= F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = len;
+
+    for (;;) {
+        r = fcntl(fd, F_SETLKW, &fl);
+        if (r != -1) return 0;
+        if (errno == EINTR) continue;
+        return -1;
+    }
+}
+
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
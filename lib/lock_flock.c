@@ -45,6 +45,7 @@
 #include <config.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <errno.h>
 #ifdef HAVE_UNISTD_H
@@ -54,6 +55,41 @@
 #include "cyr_lock.h"
 
 const char *lock_method_desc = "flock";
+const int lock_can_range = 0;
+
+double lock_wait_time = 0.0;
+double lock_last_wait = 0.0;
+void (*lock_contended_hook)(int pid) = NULL;
+
+/*
+ * Lock 'fd' as 'op' (LOCK_EX or LOCK_SH), waiting if need be, and add
+ * any time spent waiting to lock_wait_time and lock_last_wait.
+ * Returns as flock().
+ */
+static int lock_wait(int fd, int op)
+{
+    struct timeval start, end;
+    double waited;
+    int r;
+
+    /* nearly always uncontended, so don't look at the clock then */
+    r = flock(fd, op|LOCK_NB);
+    if (r != -1 || errno != EWOULDBLOCK)
+	return r;
+
+    /* flock() won't tell us who has it */
+    if (lock_contended_hook) lock_contended_hook(0);
+
+    gettimeofday(&start, 0);
+    r = flock(fd, op);
+    gettimeofday(&end, 0);
+    waited = (end.tv_sec - start.tv_sec) +
+	     (end.tv_usec - start.tv_usec) / 1000000.0;
+    lock_wait_time += waited;
+    lock_last_wait += waited;
+
+    return r;
+}
 
 /*
  * Block until we obtain an exclusive lock on the file descriptor 'fd',
@@ -80,9 +116,10 @@ const char **failaction;
     int newfd;
 
     if (!sbuf) sbuf = &sbufspare;
+    lock_last_wait = 0.0;
 
     for (;;) {
-	r = flock(fd, LOCK_EX);
+	r = lock_wait(fd, LOCK_EX);
 	if (r == -1) {
 	    if (errno == EINTR) continue;
 	    if (failaction) *failaction = "locking";
@@ -120,8 +157,9 @@ int fd;
 {
     int r;
 
+    lock_last_wait = 0.0;
     for (;;) {
-	r = flock(fd, LOCK_EX);
+	r = lock_wait(fd, LOCK_EX);
 	if (r != -1) return 0;
 	if (errno == EINTR) continue;
 	return -1;
@@ -138,8 +176,9 @@ int fd;
 {
     int r;
 
+    lock_last_wait = 0.0;
     for (;;) {
-	r = flock(fd, LOCK_SH);
+	r = lock_wait(fd, LOCK_SH);
 	if (r != -1) return 0;
 	if (errno == EINTR) continue;
 	return -1;
@@ -156,6 +195,7 @@ int fd;
 {
     int r;
 
+    lock_last_wait = 0.0;
     for (;;) {
 	r = flock(fd, LOCK_EX|LOCK_NB);
 	if (r != -1) return 0;
@@ -164,6 +204,27 @@ int fd;
     }
 }
 
+/*
+ * flock() can only lock whole files, so there are no byte range
+ * locks; callers check lock_can_range and lock the whole file instead.
+ */
+int lock_range(int fd __attribute__((unused)),
+	       off_t offset __attribute__((unused)),
+	       off_t len __attribute__((unused)),
+	       int exclusive __attribute__((unused)))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int lock_range_unlock(int fd __attribute__((unused)),
+		      off_t offset __attribute__((unused)),
+		      off_t len __attribute__((unused)))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
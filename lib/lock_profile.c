@@ -0,0 +1,430 @@
+/* lock_profile.c -- who is waiting for which locks, and who has them
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#else
+# define dirent direct
+# if HAVE_SYS_NDIR_H
+#  include <sys/ndir.h>
+# endif
+# if HAVE_SYS_DIR_H
+#  include <sys/dir.h>
+# endif
+# if HAVE_NDIR_H
+#  include <ndir.h>
+# endif
+#endif
+
+#include "cyr_lock.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "xstrlcpy.h"
+
+#define FNAME_LOCKDIR "/locks/"
+
+/* the locks we hold, newest first */
+struct held {
+    char *kind;
+    char *name;
+    time_t since;
+    char command[64];
+    struct held *next;
+};
+
+static struct held *held = NULL;
+static char command[64] = "";
+
+/* as given to lock_profile_init() */
+static char *ident = NULL;
+static char *configdir = NULL;
+static int warn_ms = 0;
+static int registry = 0;
+
+/* our entry in the registry, if we have one */
+static int regfd = -1;
+static pid_t regpid = 0;
+static char *regfname = NULL;
+
+/* what the holder of a lock we had to wait for was doing */
+static int wait_holder = 0;
+static struct buf holder_locks = BUF_INITIALIZER;
+
+static char *registry_path(int pid)
+{
+    char pidbuf[32];
+
+    snprintf(pidbuf, sizeof(pidbuf), "%d", pid);
+    return strconcat(configdir, FNAME_LOCKDIR, pidbuf, (char *)NULL);
+}
+
+static int registry_read(int pid, struct buf *buf)
+{
+    char *fname = registry_path(pid);
+    struct stat sbuf;
+    int fd, n = -1;
+
+    buf_reset(buf);
+
+    fd = open(fname, O_RDONLY, 0);
+    free(fname);
+    if (fd == -1)
+	return -1;
+
+    if (!fstat(fd, &sbuf)) {
+	buf_ensure(buf, sbuf.st_size + 1);
+	n = retry_read(fd, buf->s, sbuf.st_size);
+	if (n >= 0)
+	    buf->len = n;
+    }
+    close(fd);
+
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * Call 'func' for each line of 'data', the registry of 'pid', until it
+ * returns non-zero.  Lines which don't parse are skipped, as they may
+ * just have been caught half written.
+ */
+static int registry_parse(int pid, struct buf *data,
+			  lockholder_t *func, void *rock)
+{
+    struct lock_holder holder;
+    char *line, *next, *p[4];
+    int i, r = 0;
+
+    buf_cstring(data);
+    for (line = data->s; line && *line && !r; line = next) {
+	next = strchr(line, '\n');
+	if (!next)
+	    break;
+	*next++ = '\0';
+
+	for (i = 0; i < 4; i++) {
+	    p[i] = strchr(i ? p[i-1] : line, '\t');
+	    if (!p[i])
+		break;
+	    *p[i]++ = '\0';
+	}
+	if (i < 4)
+	    continue;
+
+	holder.pid = pid;
+	holder.kind = line;
+	holder.name = p[0];
+	holder.since = strtoul(p[1], NULL, 10);
+	holder.ident = p[2];
+	holder.command = p[3];
+	r = func(&holder, rock);
+    }
+
+    return r;
+}
+
+/* write out what we hold now */
+static void registry_write(void)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct held *h;
+
+    if (regfd == -1) {
+	regpid = getpid();
+	regfname = registry_path(regpid);
+	regfd = open(regfname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (regfd == -1 && errno == ENOENT) {
+	    cyrus_mkdir(regfname, 0755);
+	    regfd = open(regfname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	}
+	if (regfd == -1) {
+	    syslog(LOG_ERR, "IOERROR: creating %s: %m", regfname);
+	    free(regfname);
+	    regfname = NULL;
+	    return;
+	}
+    }
+
+    for (h = held; h; h = h->next) {
+	buf_printf(&buf, "%s\t%s\t%lu\t%s\t%s\n", h->kind, h->name,
+		   (unsigned long) h->since,
+		   ident, h->command);
+    }
+
+    /* readers put up with a line or two which is out of date, but not
+     * with an empty file while someone still holds a lock */
+    if (lseek(regfd, 0, SEEK_SET) == -1 ||
+	(buf.len && retry_write(regfd, buf.s, buf.len) != (int) buf.len) ||
+	ftruncate(regfd, buf.len) == -1) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", regfname);
+    }
+
+    buf_free(&buf);
+}
+
+/* the registry and the list belong to whoever started them */
+static void check_forked(void)
+{
+    struct held *h;
+
+    if (!regpid || regpid == getpid())
+	return;
+
+    /* fcntl locks aren't inherited, and flock locks are still our
+     * parent's to give up */
+    while ((h = held)) {
+	held = h->next;
+	free(h->kind);
+	free(h->name);
+	free(h);
+    }
+    if (regfd != -1)
+	close(regfd);
+    regfd = -1;
+    regpid = 0;
+    free(regfname);
+    regfname = NULL;
+}
+
+void lock_setcommand(const char *cmd)
+{
+    strlcpy(command, cmd ? cmd : "", sizeof(command));
+}
+
+static void lock_contended(int pid)
+{
+    wait_holder = pid;
+    buf_reset(&holder_locks);
+
+    if (pid && registry)
+	registry_read(pid, &holder_locks);
+}
+
+struct findholder {
+    const char *kind;
+    const char *name;
+    struct buf *desc;
+};
+
+static int find_holder(const struct lock_holder *holder, void *rock)
+{
+    struct findholder *fh = (struct findholder *) rock;
+
+    if (strcmp(holder->kind, fh->kind) || strcmp(holder->name, fh->name))
+	return 0;
+
+    buf_printf(fh->desc, " (%s %s, for %lus)", holder->ident,
+	       holder->command, (unsigned long) (time(NULL) - holder->since));
+    return 1;
+}
+
+static void report_wait(const char *kind, const char *name)
+{
+    struct buf desc = BUF_INITIALIZER;
+    struct findholder fh;
+
+    if (wait_holder) {
+	buf_printf(&desc, "pid %d", wait_holder);
+	fh.kind = kind;
+	fh.name = name;
+	fh.desc = &desc;
+	if (holder_locks.len)
+	    registry_parse(wait_holder, &holder_locks, find_holder, &fh);
+    }
+    else {
+	buf_setcstr(&desc, "unknown");
+    }
+
+    syslog(LOG_WARNING, "lockwait: %s %s waited %.3f seconds for %s %s, "
+	   "held by %s", ident, command,
+	   lock_last_wait, kind, name, buf_cstring(&desc));
+
+    buf_free(&desc);
+}
+
+void lock_held(const char *kind, const char *name)
+{
+    struct held *h;
+
+    if (warn_ms > 0 && lock_last_wait * 1000.0 >= warn_ms)
+	report_wait(kind, name);
+    wait_holder = 0;
+    buf_reset(&holder_locks);
+
+    if (!registry)
+	return;
+
+    check_forked();
+
+    h = xmalloc(sizeof(struct held));
+    h->kind = xstrdup(kind);
+    h->name = xstrdup(name);
+    h->since = time(NULL);
+    strlcpy(h->command, command, sizeof(h->command));
+    h->next = held;
+    held = h;
+
+    registry_write();
+}
+
+void lock_released(const char *kind, const char *name)
+{
+    struct held **hp, *h;
+
+    if (!held)
+	return;
+
+    check_forked();
+
+    for (hp = &held; (h = *hp); hp = &h->next) {
+	if (!strcmp(h->kind, kind) && !strcmp(h->name, name)) {
+	    *hp = h->next;
+	    free(h->kind);
+	    free(h->name);
+	    free(h);
+	    registry_write();
+	    return;
+	}
+    }
+}
+
+int lock_foreach(lockholder_t *func, void *rock)
+{
+    struct buf data = BUF_INITIALIZER;
+    struct dirent *dirent;
+    char *dirname;
+    DIR *dirp;
+    int pid, r = 0;
+
+    if (!configdir)
+	return 0;
+
+    dirname = strconcat(configdir, FNAME_LOCKDIR, (char *)NULL);
+    dirp = opendir(dirname);
+    free(dirname);
+    if (!dirp)
+	return 0;
+
+    while (!r && (dirent = readdir(dirp)) != NULL) {
+	if (dirent->d_name[0] == '.')
+	    continue;
+	pid = atoi(dirent->d_name);
+	if (pid <= 0)
+	    continue;
+
+	/* left behind by a process which didn't exit cleanly */
+	if (kill(pid, 0) == -1 && errno == ESRCH) {
+	    char *fname = registry_path(pid);
+	    unlink(fname);
+	    free(fname);
+	    continue;
+	}
+
+	if (!registry_read(pid, &data))
+	    r = registry_parse(pid, &data, func, rock);
+    }
+    closedir(dirp);
+    buf_free(&data);
+
+    return r;
+}
+
+void lock_profile_init(const char *id, const char *dir, int warn, int reg)
+{
+    free(ident);
+    ident = xstrdup(id ? id : "-");
+    free(configdir);
+    configdir = dir ? xstrdup(dir) : NULL;
+    warn_ms = warn;
+    registry = reg && configdir;
+
+    lock_contended_hook = (warn_ms > 0) ? lock_contended : NULL;
+}
+
+void lock_profile_done(void)
+{
+    struct held *h;
+
+    lock_contended_hook = NULL;
+
+    while ((h = held)) {
+	held = h->next;
+	free(h->kind);
+	free(h->name);
+	free(h);
+    }
+
+    if (regfd != -1 && regpid == getpid()) {
+	close(regfd);
+	unlink(regfname);
+    }
+    else if (regfd != -1) {
+	close(regfd);
+    }
+    regfd = -1;
+    regpid = 0;
+    free(regfname);
+    regfname = NULL;
+    buf_free(&holder_locks);
+
+    warn_ms = 0;
+    registry = 0;
+    free(ident);
+    ident = NULL;
+    free(configdir);
+    configdir = NULL;
+}
@@ -233,6 +233,7 @@ int mappedfile_readlock(struct mappedfile *mf)
     }
 
     mf->lock_status = MF_READLOCKED;
+    lock_held("db", mf->fname);
 
     /* XXX - can we guarantee the fd isn't reused? */
     if (mf->map_ino != sbuf.st_ino) {
@@ -263,6 +264,7 @@ int mappedfile_writelock(struct mappedfile *mf)
 	return r;
     }
     mf->lock_status = MF_WRITELOCKED;
+    lock_held("db", mf->fname);
 
     /* XXX - can we guarantee the fd isn't reused? */
     if (mf->map_ino != sbuf.st_ino) {
@@ -295,6 +297,7 @@ int mappedfile_unlock(struct mappedfile *mf)
     }
 
     mf->lock_status = MF_UNLOCKED;
+    lock_released("db", mf->fname);
 
     return 0;
 }
@@ -494,3 +497,15 @@ const char *mappedfile_fname(const struct mappedfile *mf)
 
     return mf->fname;
 }
+
+void mappedfile_pin(const struct mappedfile *mf, size_t size,
+		    const char **base, size_t *len)
+{
+    assert(mf);
+    assert(mf->fd != -1);
+    assert(size <= mf->map_size);
+
+    *base = NULL;
+    *len = 0;
+    map_refresh(mf->fd, 1, base, len, size, mf->fname, 0);
+}
@@ -76,4 +76,10 @@ extern const char *mappedfile_base(const struct mappedfile *mf);
 extern size_t mappedfile_size(const struct mappedfile *mf);
 extern const char *mappedfile_fname(const struct mappedfile *mf);
 
+/* map the first 'size' bytes of the file separately from the main
+ * map, so that they stay readable after the mappedfile is unlocked,
+ * refreshed or even closed.  Release with map_free() */
+extern void mappedfile_pin(const struct mappedfile *mf, size_t size,
+			   const char **base, size_t *len);
+
 #endif /* _MAPPEDFILE_H */
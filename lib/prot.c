@@ -779,6 +779,10 @@ int prot_fill(struct protstream *s)
 	} while (left);
     }
 
+    /* first input from our client, for the connection statistics */
+    if (!s->bytes_in && !s->isclient)
+	conntime_input();
+
     s->cnt--;		/* we return the first char */
     s->can_unget = 1;
     s->bytes_in++;
@@ -0,0 +1,294 @@
+/* timerwheel.c -- hierarchical timing wheel
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK	(TIMERWHEEL_SLOTS - 1)
+/* the number of ticks covered by a level */
+#define LEVEL_SPAN(l)	((bit64) 1 << (TIMERWHEEL_BITS * ((l) + 1)))
+#define MAX_SPAN	LEVEL_SPAN(TIMERWHEEL_LEVELS - 1)
+
+static bit64 timeval_ms(const struct timeval *tv)
+{
+    return (bit64) tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+static void slot_init(struct timer *head)
+{
+    head->prev = head->next = head;
+}
+
+static int slot_empty(const struct timer *head)
+{
+    return head->next == head;
+}
+
+static void slot_append(struct timer *head, struct timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void slot_unlink(struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/* take over all the timers of a slot, leaving it empty */
+static void slot_move(struct timer *from, struct timer *to)
+{
+    slot_init(to);
+    if (slot_empty(from))
+	return;
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    slot_init(from);
+}
+
+/* put a timer in the right slot for its expiry, relative to base */
+static void place(struct timerwheel *tw, struct timer *t)
+{
+    bit64 expires = t->expires;
+    bit64 idx;
+    int level;
+
+    /* overdue timers fire on the next tick */
+    if (expires < tw->base)
+	expires = tw->base;
+
+    /* timers beyond the top level wait in its furthest slot, and are
+     * placed again when that comes round */
+    idx = expires - tw->base;
+    if (idx >= MAX_SPAN) {
+	idx = MAX_SPAN - 1;
+	expires = tw->base + idx;
+    }
+
+    for (level = 0; idx >= LEVEL_SPAN(level); level++)
+	;
+
+    slot_append(&tw->slots[level][(expires >> (TIMERWHEEL_BITS * level))
+				  & SLOT_MASK], t);
+}
+
+/* move the timers in a slot of a higher level down to where they belong */
+static void cascade(struct timerwheel *tw, int level, unsigned idx)
+{
+    struct timer list, *t;
+
+    slot_move(&tw->slots[level][idx], &list);
+    while (!slot_empty(&list)) {
+	t = list.next;
+	slot_unlink(t);
+	place(tw, t);
+    }
+}
+
+/*
+ * The number of ticks from base until the first one with anything to
+ * do: either timers falling due, or timers to be moved down a level.
+ */
+static bit64 next_work(struct timerwheel *tw)
+{
+    bit64 best = MAX_SPAN;
+    unsigned k;
+    int level;
+
+    for (k = 0; k < TIMERWHEEL_SLOTS; k++) {
+	if (!slot_empty(&tw->slots[0][(tw->base + k) & SLOT_MASK])) {
+	    best = k;
+	    break;
+	}
+    }
+
+    for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+	int shift = TIMERWHEEL_BITS * level;
+	bit64 block = tw->base >> shift;
+	int aligned = !(tw->base & (((bit64) 1 << shift) - 1));
+
+	/* a slot is moved down when base reaches the start of its block;
+	 * if we are past the start of the current block, its slot next
+	 * comes round a whole level later */
+	for (k = aligned ? 0 : 1; k <= TIMERWHEEL_SLOTS; k++) {
+	    if (k == TIMERWHEEL_SLOTS && aligned)
+		break;
+	    if (!slot_empty(&tw->slots[level][(block + k) & SLOT_MASK])) {
+		bit64 when = ((block + k) << shift) - tw->base;
+		if (when < best) best = when;
+		break;
+	    }
+	}
+    }
+
+    return best;
+}
+
+/* process the tick at base, and move on to the next one */
+static int run_tick(struct timerwheel *tw)
+{
+    struct timer list, *t;
+    int level, fired = 0;
+
+    for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+	int shift = TIMERWHEEL_BITS * level;
+
+	if (tw->base & (((bit64) 1 << shift) - 1))
+	    break;
+	cascade(tw, level, (tw->base >> shift) & SLOT_MASK);
+    }
+
+    slot_move(&tw->slots[0][tw->base & SLOT_MASK], &list);
+    tw->base++;
+
+    /* callbacks may add and cancel timers, including ones in our list */
+    while (!slot_empty(&list)) {
+	t = list.next;
+	slot_unlink(t);
+	tw->count--;
+	t->cb(t);
+	fired++;
+    }
+
+    return fired;
+}
+
+void timerwheel_init(struct timerwheel *tw, unsigned resolution,
+		     const struct timeval *now)
+{
+    int level, i;
+
+    memset(tw, 0, sizeof(*tw));
+    tw->resolution = resolution ? resolution : 1;
+    tw->base = timeval_ms(now) / tw->resolution;
+
+    for (level = 0; level < TIMERWHEEL_LEVELS; level++)
+	for (i = 0; i < TIMERWHEEL_SLOTS; i++)
+	    slot_init(&tw->slots[level][i]);
+}
+
+void timer_init(struct timer *t, timer_cb *cb, void *rock)
+{
+    memset(t, 0, sizeof(*t));
+    t->cb = cb;
+    t->rock = rock;
+}
+
+void timerwheel_add(struct timerwheel *tw, struct timer *t,
+		    const struct timeval *when)
+{
+    bit64 ms;
+
+    timerwheel_cancel(tw, t);
+
+    /* round up, so timers never fire early */
+    ms = (bit64) when->tv_sec * 1000 + (when->tv_usec + 999) / 1000;
+    t->expires = (ms + tw->resolution - 1) / tw->resolution;
+    place(tw, t);
+    tw->count++;
+}
+
+void timerwheel_cancel(struct timerwheel *tw, struct timer *t)
+{
+    if (!timer_pending(t))
+	return;
+
+    slot_unlink(t);
+    tw->count--;
+}
+
+int timerwheel_run(struct timerwheel *tw, const struct timeval *now)
+{
+    bit64 tick = timeval_ms(now) / tw->resolution;
+    int fired = 0;
+
+    while (tw->base <= tick) {
+	bit64 skip;
+
+	if (!tw->count) {
+	    tw->base = tick + 1;
+	    break;
+	}
+
+	/* jump straight to the next tick with anything to do */
+	skip = next_work(tw);
+	if (tw->base + skip > tick) {
+	    tw->base = tick + 1;
+	    break;
+	}
+	tw->base += skip;
+
+	fired += run_tick(tw);
+    }
+
+    return fired;
+}
+
+int timerwheel_next(struct timerwheel *tw, const struct timeval *now,
+		    struct timeval *delay)
+{
+    bit64 due, ms;
+
+    if (!tw->count)
+	return -1;
+
+    due = (tw->base + next_work(tw)) * tw->resolution;
+    ms = timeval_ms(now);
+    if (due < ms)
+	due = ms;
+
+    delay->tv_sec = (due - ms) / 1000;
+    delay->tv_usec = ((due - ms) % 1000) * 1000;
+
+    return 0;
+}
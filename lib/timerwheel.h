@@ -0,0 +1,106 @@
+/* timerwheel.h -- hierarchical timing wheel
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_TIMERWHEEL_H__
+#define __CYRUS_TIMERWHEEL_H__
+
+#include <config.h>
+#include <sys/time.h>
+
+#include "util.h"
+
+/*
+ * Timers are kept in four levels of 64 slots each.  The first level
+ * holds timers due within 64 ticks, one slot per tick; each level
+ * above covers 64 times the span of the one below, and its timers are
+ * moved down a level as their time comes closer.  Adding, cancelling
+ * and expiring a timer is O(1), whatever the number of timers.
+ */
+#define TIMERWHEEL_BITS		6
+#define TIMERWHEEL_SLOTS	(1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS	4
+
+struct timer;
+typedef void timer_cb(struct timer *t);
+
+struct timer {
+    struct timer *prev, *next;	/* in its slot, NULL when not pending */
+    bit64 expires;		/* in ticks */
+    timer_cb *cb;
+    void *rock;
+};
+
+struct timerwheel {
+    bit64 base;			/* the next tick to be processed */
+    unsigned resolution;	/* milliseconds per tick */
+    unsigned count;		/* pending timers */
+    struct timer slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+};
+
+/* set up a wheel with ticks of 'resolution' milliseconds, starting at 'now' */
+extern void timerwheel_init(struct timerwheel *tw, unsigned resolution,
+			    const struct timeval *now);
+
+extern void timer_init(struct timer *t, timer_cb *cb, void *rock);
+
+/* (re)schedule 't' to fire at the first tick at or after 'when' */
+extern void timerwheel_add(struct timerwheel *tw, struct timer *t,
+			   const struct timeval *when);
+
+/* stop 't' from firing; harmless if it is not pending */
+extern void timerwheel_cancel(struct timerwheel *tw, struct timer *t);
+
+#define timer_pending(t) ((t)->next != NULL)
+
+/* fire every timer due at or before 'now', returns how many fired */
+extern int timerwheel_run(struct timerwheel *tw, const struct timeval *now);
+
+/*
+ * How long until timerwheel_run() next has something to do, given the
+ * time is 'now'.  Returns 0 and sets 'delay' if there are timers,
+ * otherwise returns -1.  This may be earlier than the next timer is
+ * due, when timers need moving between levels.
+ */
+extern int timerwheel_next(struct timerwheel *tw, const struct timeval *now,
+			   struct timeval *delay);
+
+#endif /* __CYRUS_TIMERWHEEL_H__ */
@@ -328,6 +328,15 @@ int cyrus_close_sock(int fd)
 }
 
 void cyrus_reset_stdio(void)
+{
+    shutdown(0, SHUT_RD);
+    shutdown(1, SHUT_RD);
+    shutdown(2, SHUT_RD);
+
+    cyrus_release_stdio();
+}
+
+void cyrus_release_stdio(void)
 {
     int devnull = open("/dev/null", O_RDWR, 0);
     
@@ -335,16 +344,8 @@ void cyrus_reset_stdio(void)
         fatal("open() on /dev/null failed", EC_TEMPFAIL);
     }
     
-    /* stdin */
-    shutdown(0, SHUT_RD);
     dup2(devnull, 0);
-    
-    /* stdout */
-    shutdown(1, SHUT_RD);
     dup2(devnull, 1);
-    
-    /* stderr */
-    shutdown(2, SHUT_RD);
     dup2(devnull, 2);
 
     if (devnull > 2) close(devnull);
@@ -541,6 +542,7 @@ int become_cyrus(void)
 static int cmdtime_enabled = 0;
 static struct timeval cmdtime_start, cmdtime_end, nettime_start, nettime_end;
 static double totaltime, cmdtime, nettime;
+static struct timeval conntime_accept, conntime_firstbyte;
 
 double timeval_get_double(const struct timeval *tv)
 {
@@ -606,6 +608,35 @@ void cmdtime_netend(void)
     nettime += timesub(&nettime_start, &nettime_end);
 }
 
+/*
+ * Timing of a whole client connection, for the master's statistics.
+ * service.c starts it at accept(), prot notes the first input from
+ * the client, and service.c collects both once the session is over.
+ */
+void conntime_start(void)
+{
+    gettimeofday(&conntime_accept, 0);
+    timerclear(&conntime_firstbyte);
+}
+
+void conntime_input(void)
+{
+    if (timerisset(&conntime_accept) && !timerisset(&conntime_firstbyte))
+	gettimeofday(&conntime_firstbyte, 0);
+}
+
+/* both in seconds; 'firstbyte' is negative if the client never sent any */
+void conntime_end(double *firstbyte, double *session)
+{
+    struct timeval now;
+
+    gettimeofday(&now, 0);
+    *session = timesub(&conntime_accept, &now);
+    *firstbyte = timerisset(&conntime_firstbyte) ?
+		 timesub(&conntime_accept, &conntime_firstbyte) : -1.0;
+    timerclear(&conntime_accept);
+}
+
 /*
  * Like the system clock() but works in system time
  * rather than process virtual time.  Would be more
@@ -896,8 +927,9 @@ void buf_printf(struct buf *buf, const char *fmt, ...)
     va_end(args);
 
     if (n > room) {
-	/* woops, we guessed wrong...retry */
-	buf_ensure(buf, n-room);
+	/* woops, we guessed wrong...retry with room for n bytes
+	 * and the trailing NUL */
+	buf_ensure(buf, n+1);
 	va_start(args, fmt);
 	n = vsnprintf(buf->s + buf->len, n+1, fmt, args);
 	va_end(args);
@@ -156,6 +156,10 @@ extern int cyrus_close_sock(int fd);
 /* Reset stdin/stdout/stderr */
 extern void cyrus_reset_stdio(void);
 
+/* Point stdin/stdout/stderr at /dev/null, without shutting down the
+ * socket they were, which some other process may still be using */
+extern void cyrus_release_stdio(void);
+
 /* Create all parent directories for the given path,
  * up to but not including the basename.
  */
@@ -187,6 +191,9 @@ extern void cmdtime_starttimer(void);
 extern void cmdtime_endtimer(double * cmdtime, double * nettime);
 extern void cmdtime_netstart(void);
 extern void cmdtime_netend(void);
+extern void conntime_start(void);
+extern void conntime_input(void);
+extern void conntime_end(double *firstbyte, double *session);
 extern double timeval_get_double(const struct timeval *tv);
 extern void timeval_set_double(struct timeval *tv, double d);
 extern void timeval_add_double(struct timeval *tv, double delta);
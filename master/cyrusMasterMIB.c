@@ -88,6 +88,20 @@ struct variable4 cyrusMasterMIB_variables[] = {
   { SERVICEID           , ASN_INTEGER   , NOACCESS , var_serviceTable, 3, { 2,1,4 } },
 #define   SERVICECONNS          9
   { SERVICECONNS        , ASN_COUNTER   , NOACCESS , var_serviceTable, 3, { 2,1,5 } },
+#define   SERVICEREADY          10
+  { SERVICEREADY        , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,6 } },
+#define   SERVICEDESIRED        11
+  { SERVICEDESIRED      , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,7 } },
+#define   SERVICEARRIVALRATE    12
+  { SERVICEARRIVALRATE  , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,8 } },
+#define   SERVICESERVICETIME    13
+  { SERVICESERVICETIME  , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,9 } },
+#define   SERVICERETIRED        14
+  { SERVICERETIRED      , ASN_COUNTER   , RONLY , var_serviceTable, 3, { 2,1,10 } },
+#define   SERVICESESSIONS       15
+  { SERVICESESSIONS     , ASN_COUNTER   , RONLY , var_serviceTable, 3, { 2,1,11 } },
+#define   SERVICEFIRSTBYTE      16
+  { SERVICEFIRSTBYTE    , ASN_GAUGE     , RONLY , var_serviceTable, 3, { 2,1,12 } },
 };
 /*    (L = length of the oidsuffix) */
 
@@ -237,6 +251,36 @@ var_serviceTable(struct variable *vp,
 	long_ret = Services[index - 1].nconnections;
 	return (unsigned char *) &long_ret;
 
+    case SERVICEREADY:
+	long_ret = Services[index - 1].ready_workers;
+	return (unsigned char *) &long_ret;
+
+    case SERVICEDESIRED:
+	long_ret = Services[index - 1].desired_workers;
+	return (unsigned char *) &long_ret;
+
+    case SERVICEARRIVALRATE:
+	/* per minute, so that quiet services don't round to zero */
+	long_ret = (long) (Services[index - 1].arrivalrate * 60.0 + 0.5);
+	return (unsigned char *) &long_ret;
+
+    case SERVICESERVICETIME:
+	long_ret = (long) (Services[index - 1].servicetime * 1000.0 + 0.5);
+	return (unsigned char *) &long_ret;
+
+    case SERVICERETIRED:
+	long_ret = Services[index - 1].nretired;
+	return (unsigned char *) &long_ret;
+
+    case SERVICESESSIONS:
+	long_ret = Services[index - 1].nsessions;
+	return (unsigned char *) &long_ret;
+
+    case SERVICEFIRSTBYTE:
+	/* in microseconds, most clients are quick */
+	long_ret = (long) (Services[index - 1].firstbyte * 1000000.0 + 0.5);
+	return (unsigned char *) &long_ret;
+
     default:
 	ERROR_MSG("");
     }
@@ -72,6 +72,9 @@
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #ifndef INADDR_NONE
 #define INADDR_NONE 0xffffffff
@@ -120,6 +123,7 @@
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
+#include "timerwheel.h"
 
 enum {
     become_cyrus_early = 1,
@@ -148,6 +152,13 @@ int nservices = 0;
 /* make libcyrus_min happy */
 int config_need_data = 0;
 
+/* Everything that happens at a given time: EVENTS, cleaning up the
+ * child table, and waking up to spawn or resize pools */
+#define TIMER_RESOLUTION	10	/* ms */
+static struct timerwheel timers;
+static struct timer wakeup;
+static struct timeval wakeup_mark;
+
 struct event {
     char *name;
     struct timeval mark;
@@ -156,9 +167,10 @@ struct event {
     int min;
     int periodic;
     strarray_t *exec;
+    struct timer timer;
     struct event *next;
 };
-static struct event *schedule = NULL;
+static struct event *schedule = NULL;	/* all events, in no order */
 
 enum sstate {
     SERVICE_STATE_UNKNOWN = 0,  /* duh */
@@ -173,15 +185,29 @@ enum sstate {
 struct centry {
     pid_t pid;
     enum sstate service_state;	/* SERVICE_STATE_* */
-    time_t janitor_deadline;	/* cleanup deadline */
+    struct timer janitor;	/* cleanup, once DEAD */
     int si;			/* Services[] index */
+    struct timeval conn_start;	/* when the current connection began */
     struct centry *next;
 };
 static struct centry *ctable[child_table_size];
 
-static int janitor_frequency = 1;	/* Janitor sweeps per second */
-static int janitor_position;		/* Entry to begin at in next sweep */
-static struct timeval janitor_mark;	/* Last time janitor did a sweep */
+/* What the main loop waits on for each service */
+struct watch {
+    int statfd;			/* status pipe, if registered */
+    int listenfd;		/* listener, if registered */
+    int listening;		/* do we want connections on it? */
+    int ready;			/* WATCH_* found ready */
+};
+#define WATCH_STATUS	1
+#define WATCH_LISTEN	2
+#define WATCH_EVENTS	64	/* most fds reported per wakeup */
+#define NOTIFY_BATCH	64	/* most child messages read at once */
+static struct watch *watches = NULL;
+static int nwatches = 0;
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1;
+#endif
 
 static void limit_fds(rlim_t);
 static void schedule_event(struct event *a);
@@ -191,6 +217,8 @@ static void child_sighandler_setup(void);
 static sigset_t pselect_sigmask;
 #endif
 
+#if !defined(HAVE_SYS_EPOLL_H) || \
+    defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
 static int myselect(int nfds, fd_set *rfds, fd_set *wfds,
 		    fd_set *efds, struct timeval *tout)
 {
@@ -209,6 +237,7 @@ static int myselect(int nfds, fd_set *rfds, fd_set *wfds,
     return select(nfds, rfds, wfds, efds, tout);
 #endif
 }
+#endif
 
 void fatal(const char *msg, int code)
 {
@@ -219,6 +248,7 @@ void fatal(const char *msg, int code)
 
 static void event_free(struct event *a)
 {
+    timerwheel_cancel(&timers, &a->timer);
     if (a->exec) {
 	strarray_free(a->exec);
 	a->exec = NULL;
@@ -258,6 +288,8 @@ static void get_statsock(int filedes[2])
 	fatalf(1, "unable to set close-on-exec: %m");
 }
 
+static void centry_janitor(struct timer *t);
+
 /* return a new 'centry', by malloc'ing it */
 static struct centry *centry_alloc(void)
 {
@@ -265,6 +297,7 @@ static struct centry *centry_alloc(void)
 
     t = xzmalloc(sizeof(*t));
     t->si = SERVICE_NONE;
+    timer_init(&t->janitor, centry_janitor, t);
 
     return t;
 }
@@ -297,11 +330,269 @@ static struct centry *centry_find(pid_t p)
     return c;
 }
 
+/* remove a dead centry from the global table and free it */
+static void centry_janitor(struct timer *t)
+{
+    struct centry *c = (struct centry *) t->rock;
+    struct centry **p = &ctable[c->pid % child_table_size];
+
+    while (*p && *p != c)
+	p = &(*p)->next;
+    if (*p)
+	*p = c->next;
+    centry_free(c);
+}
+
 static void centry_set_state(struct centry *c, enum sstate state)
 {
     c->service_state = state;
-    if (state == SERVICE_STATE_DEAD)
-	c->janitor_deadline = time(NULL) + 2;
+    if (state == SERVICE_STATE_DEAD) {
+	/* keep it around a little for any late messages */
+	struct timeval deadline;
+
+	gettimeofday(&deadline, 0);
+	deadline.tv_sec += 2;
+	timerwheel_add(&timers, &c->janitor, &deadline);
+    }
+    else
+	timerwheel_cancel(&timers, &c->janitor);
+}
+
+/* make sure the main loop wakes up within 'delay' seconds */
+static void schedule_wakeup(double delay)
+{
+    struct timeval when;
+
+    gettimeofday(&when, 0);
+    timeval_add_double(&when, delay);
+    if (!timer_pending(&wakeup) || timesub(&when, &wakeup_mark) > 0.0) {
+	wakeup_mark = when;
+	timerwheel_add(&timers, &wakeup, &when);
+    }
+}
+
+static void wakeup_call(struct timer *t __attribute__((unused)))
+{
+    /* nothing to do, the main loop runs again */
+}
+
+static struct watch *watch_get(int si)
+{
+    if (si >= nwatches) {
+	int n = si + 5;
+
+	watches = xrealloc(watches, n * sizeof(struct watch));
+	memset(watches + nwatches, 0, (n - nwatches) * sizeof(struct watch));
+	nwatches = n;
+    }
+    return &watches[si];
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void watch_ctl(int op, int fd, int si, int what, int events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = (si << 1) | (what == WATCH_LISTEN);
+    if (epoll_ctl(epfd, op, fd, &ev) < 0)
+	syslog(LOG_ERR, "epoll_ctl(%d, %d) for service %s: %m",
+	       op, fd, SERVICENAME(Services[si].name));
+}
+#endif
+
+/*
+ * Make sure the main loop waits on the status pipe of a service, and on
+ * its listener only if 'listening'.  Anything registered here must be
+ * removed with unwatch_service() before the fd is closed.
+ */
+static void watch_service(int si, int listening)
+{
+    struct service *s = &Services[si];
+    struct watch *w = watch_get(si);
+
+    /* a service re-enabled on SIGHUP comes back with a new status pipe
+     * and listener, so stop watching the ones it had before */
+    if (w->statfd && w->statfd != s->stat[0]) {
+#ifdef HAVE_SYS_EPOLL_H
+	watch_ctl(EPOLL_CTL_DEL, w->statfd, si, WATCH_STATUS, 0);
+#endif
+	w->statfd = 0;
+    }
+    if (w->listenfd && w->listenfd != s->socket) {
+#ifdef HAVE_SYS_EPOLL_H
+	watch_ctl(EPOLL_CTL_DEL, w->listenfd, si, WATCH_LISTEN, 0);
+#endif
+	w->listenfd = 0;
+	w->listening = 0;
+    }
+
+    if (!w->statfd && s->stat[0] > 0) {
+	w->statfd = s->stat[0];
+#ifdef HAVE_SYS_EPOLL_H
+	watch_ctl(EPOLL_CTL_ADD, w->statfd, si, WATCH_STATUS, EPOLLIN);
+#endif
+    }
+
+    if (!w->listenfd && s->socket > 0) {
+	w->listenfd = s->socket;
+	w->listening = listening;
+#ifdef HAVE_SYS_EPOLL_H
+	watch_ctl(EPOLL_CTL_ADD, w->listenfd, si, WATCH_LISTEN,
+		  listening ? EPOLLIN : 0);
+#endif
+    }
+    else if (w->listenfd && w->listening != listening) {
+	w->listening = listening;
+#ifdef HAVE_SYS_EPOLL_H
+	watch_ctl(EPOLL_CTL_MOD, w->listenfd, si, WATCH_LISTEN,
+		  listening ? EPOLLIN : 0);
+#endif
+    }
+}
+
+static void unwatch_service(int si)
+{
+    struct watch *w = watch_get(si);
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (w->statfd)
+	watch_ctl(EPOLL_CTL_DEL, w->statfd, si, WATCH_STATUS, 0);
+    if (w->listenfd)
+	watch_ctl(EPOLL_CTL_DEL, w->listenfd, si, WATCH_LISTEN, 0);
+#endif
+    memset(w, 0, sizeof(*w));
+}
+
+/*
+ * Close the status pipe of a service that is going away.  Its children
+ * write to the pipe until they exit, so a disabled service only stops
+ * being watched, and keeps the pipe until it has no children left.
+ */
+static void service_close_stat(struct service *s)
+{
+    if (s->stat[0] > 0) close(s->stat[0]);
+    if (s->stat[1] > 0) close(s->stat[1]);
+    memset(s->stat, 0, sizeof(s->stat));
+}
+
+/*
+ * Wait until 'tout' (or forever, if NULL) for something to happen on
+ * the watched fds, and note which are ready.  Returns as select() does.
+ */
+#ifdef HAVE_SYS_EPOLL_H
+static int watch_wait(struct timeval *tout)
+{
+    struct epoll_event events[WATCH_EVENTS];
+    int i, r;
+#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
+    /* the SNMP library wants select(), so wait for epoll there too */
+    fd_set rfds;
+    int maxfd = epfd + 1, blockp = 0;
+#endif
+
+    for (i = 0; i < nwatches; i++)
+	watches[i].ready = 0;
+
+#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
+    FD_ZERO(&rfds);
+    FD_SET(epfd, &rfds);
+    if (tout == NULL) blockp = 1;
+    snmp_select_info(&maxfd, &rfds, tout, &blockp);
+    r = myselect(maxfd, &rfds, NULL, NULL, tout);
+    if (r < 0)
+	return r;
+
+    /* check for SNMP queries */
+    snmp_read(&rfds);
+    snmp_timeout();
+
+    if (!FD_ISSET(epfd, &rfds))
+	return 0;
+    r = epoll_wait(epfd, events, WATCH_EVENTS, 0);
+#else
+    int ms = -1;
+
+    if (tout)
+	ms = tout->tv_sec * 1000 + (tout->tv_usec + 999) / 1000;
+#if HAVE_PSELECT
+    r = epoll_pwait(epfd, events, WATCH_EVENTS, ms, &pselect_sigmask);
+#else
+    r = epoll_wait(epfd, events, WATCH_EVENTS, ms);
+#endif
+#endif
+
+    for (i = 0; i < r; i++) {
+	int si = events[i].data.u32 >> 1;
+
+	if (si < nwatches)
+	    watches[si].ready |= (events[i].data.u32 & 1) ?
+				 WATCH_LISTEN : WATCH_STATUS;
+    }
+
+    return r;
+}
+#else
+static int watch_wait(struct timeval *tout)
+{
+    fd_set rfds;
+    int i, r, maxfd = 0;
+#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
+    int blockp = 0;
+#endif
+
+    FD_ZERO(&rfds);
+    for (i = 0; i < nwatches; i++) {
+	struct watch *w = &watches[i];
+
+	if (w->statfd) {
+	    FD_SET(w->statfd, &rfds);
+	    if (w->statfd > maxfd) maxfd = w->statfd;
+	}
+	if (w->listenfd && w->listening) {
+	    FD_SET(w->listenfd, &rfds);
+	    if (w->listenfd > maxfd) maxfd = w->listenfd;
+	}
+    }
+    maxfd++;		/* need 1 greater than maxfd */
+
+#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
+    if (tout == NULL) blockp = 1;
+    snmp_select_info(&maxfd, &rfds, tout, &blockp);
+#endif
+    r = myselect(maxfd, &rfds, NULL, NULL, tout);
+    if (r < 0)
+	return r;
+
+#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
+    /* check for SNMP queries */
+    snmp_read(&rfds);
+    snmp_timeout();
+#endif
+
+    for (i = 0; i < nwatches; i++) {
+	struct watch *w = &watches[i];
+
+	w->ready = 0;
+	if (w->statfd && FD_ISSET(w->statfd, &rfds))
+	    w->ready |= WATCH_STATUS;
+	if (w->listenfd && w->listening && FD_ISSET(w->listenfd, &rfds))
+	    w->ready |= WATCH_LISTEN;
+    }
+
+    return r;
+}
+#endif
+
+static void watch_init(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    epfd = epoll_create(1024);
+    if (epfd < 0)
+	fatalf(1, "epoll_create failed: %m");
+    fcntl(epfd, F_SETFD, FD_CLOEXEC);
+#endif
 }
 
 /* see if 'listen' parameter has both hostname and port, or just port */
@@ -687,17 +978,134 @@ static int service_is_fork_limited(struct service *s)
     /* (We schedule a wakeup call for sometime soon though to be
      * sure that we don't wait to do the fork that is required forever! */
     if ((unsigned int)s->forkrate >= s->maxforkrate) {
-	struct event *evt = (struct event *) xzmalloc(sizeof(struct event));
+	schedule_wakeup(FORKRATE_INTERVAL);
+	return 1;
+    }
+    return 0;
+}
 
-	evt->name = xstrdup("forkrate wakeup call");
-	evt->mark = now;
-	timeval_add_double(&evt->mark, FORKRATE_INTERVAL);
+/* Fold the service time of a finished connection into the average */
+static void service_account_conn(struct service *s, struct centry *c)
+{
+/* How much each finished connection counts towards the average */
+#define SERVICETIME_WEIGHT	0.05
+    struct timeval now;
+    double t;
+
+    if (!timerisset(&c->conn_start))
+	return;
 
-	schedule_event(evt);
+    gettimeofday(&now, 0);
+    t = timesub(&c->conn_start, &now);
+    timerclear(&c->conn_start);
+    if (t < 0.0)
+	return;
 
-	return 1;
+    if (s->servicetime == 0.0)
+	s->servicetime = t;
+    else
+	s->servicetime = (1.0-SERVICETIME_WEIGHT) * s->servicetime +
+			 SERVICETIME_WEIGHT * t;
+}
+
+/*
+ * Ask up to 'n' ready children of a service to exit.  Children only
+ * honour this while they are waiting for a connection, so one which
+ * has just accepted carries on regardless.
+ */
+static void service_retire(int si, int n)
+{
+    struct centry *c;
+    int i;
+
+    for (i = 0; n > 0 && i < child_table_size; i++) {
+	for (c = ctable[i]; n > 0 && c; c = c->next) {
+	    if (c->si != si || c->service_state != SERVICE_STATE_READY)
+		continue;
+	    if (kill(c->pid, SERVICE_RETIRE_SIGNAL) < 0)
+		continue;
+	    Services[si].nretired++;
+	    n--;
+	}
     }
-    return 0;
+}
+
+/* is the ready pool larger than we are prepared to tolerate? */
+static int service_prefork_surplus(struct service *s)
+{
+    return s->ready_workers - s->desired_workers - s->desired_workers / 4;
+}
+
+/* does the ready pool of this service still need adjusting over time? */
+static int service_is_adapting(struct service *s)
+{
+    return s->maxprefork && s->exec &&
+	   (s->desired_workers > s->prefork || service_prefork_surplus(s) > 0);
+}
+
+/*
+ * Resize the ready pool of a service between prefork and maxprefork.
+ *
+ * We keep a decaying average of the connection arrival rate, which
+ * rises quickly and falls slowly, and aim to have enough children
+ * ready to take every connection arriving within PREFORK_HORIZON
+ * (or within the average service time, if that is shorter, since
+ * children then come back to the pool before a new one could start).
+ * Growing is left to the main loop and maxforkrate; shrinking is done
+ * a few children at a time.
+ */
+static void service_adapt_prefork(int si, struct timeval now)
+{
+/* How often we resize the pool */
+#define PREFORK_INTERVAL	1.0	/* seconds */
+/* How much the arrival rate estimator decays, per second, when the
+ * observed rate is above and below the estimate */
+#define PREFORK_RISE_ALPHA	0.1	/* per second */
+#define PREFORK_FALL_ALPHA	0.99	/* per second */
+/* How far ahead the ready pool should cover arrivals */
+#define PREFORK_HORIZON		1.0	/* seconds */
+    struct service *s = &Services[si];
+    double interval, rate, horizon, f;
+    int target, surplus;
+
+    if (!s->maxprefork || !s->exec)
+	return;
+
+    interval = timesub(&s->last_adapt_start, &now);
+    if (interval < 0.0) {
+	/* clock went backwards, start over */
+	s->interval_conns = 0;
+	s->last_adapt_start = now;
+	return;
+    }
+    if (interval < PREFORK_INTERVAL)
+	return;
+
+    rate = s->interval_conns / interval;
+    f = pow(rate > s->arrivalrate ? PREFORK_RISE_ALPHA : PREFORK_FALL_ALPHA,
+	    interval);
+    s->arrivalrate = f * s->arrivalrate + (1.0-f) * rate;
+    s->interval_conns = 0;
+    s->last_adapt_start = now;
+
+    horizon = PREFORK_HORIZON;
+    if (s->servicetime > 0.0 && s->servicetime < horizon)
+	horizon = s->servicetime;
+
+    target = (int) ceil(s->arrivalrate * horizon);
+    if (target < s->prefork) target = s->prefork;
+    if (target > s->maxprefork) target = s->maxprefork;
+
+    if (target != s->desired_workers && verbose)
+	syslog(LOG_DEBUG, "service %s: %d ready workers wanted, was %d "
+	       "(%.2f connections/s, %.3fs per connection)",
+	       SERVICENAME(s->name), target, s->desired_workers,
+	       s->arrivalrate, s->servicetime);
+    s->desired_workers = target;
+
+    surplus = service_prefork_surplus(s);
+    if (surplus > 0)
+	service_retire(si, (s->ready_workers - target + 7) / 8);
 }
 
 static void spawn_service(int si)
@@ -761,6 +1169,8 @@ static void spawn_service(int si)
 	putenv(name_env);
 	snprintf(name_env2, sizeof(name_env2), "CYRUS_ID=%d", s->associate);
 	putenv(name_env2);
+	if (s->acceptmode == SERVICE_ACCEPT_EPOLL)
+	    putenv("CYRUS_ACCEPT=epoll");
 
 	execv(path, s->exec->data);
 	syslog(LOG_ERR, "couldn't exec %s: %m", path);
@@ -784,130 +1194,103 @@ static void spawn_service(int si)
 
 static void schedule_event(struct event *a)
 {
-    struct event *ptr;
-
     if (! a->name)
 	fatal("Serious software bug found: schedule_event() called on unnamed event!",
 		EX_SOFTWARE);
 
-    if (!schedule || timesub(&schedule->mark, &a->mark) < 0.0) {
-	a->next = schedule;
-	schedule = a;
-
-	return;
-    }
-    for (ptr = schedule;
-	 ptr->next && timesub(&a->mark, &ptr->next->mark) <= 0.0;
-	 ptr = ptr->next) ;
-
-    /* insert a */
-    a->next = ptr->next;
-    ptr->next = a;
+    timerwheel_add(&timers, &a->timer, &a->mark);
 }
 
-static void spawn_schedule(struct timeval now)
+/* run an event which has come due, and schedule its next run */
+static void spawn_event(struct timer *t)
 {
-    struct event *a, *b;
+    struct event *a = (struct event *) t->rock;
+    struct event **ptr;
+    struct timeval now;
     int i;
     char path[PATH_MAX];
     pid_t p;
     struct centry *c;
 
-    a = NULL;
-    /* update schedule accordingly */
-    while (schedule && timesub(&now, &schedule->mark) <= 0.0) {
-	/* delete from schedule, insert into a */
-	struct event *ptr = schedule;
-
-	/* delete */
-	schedule = schedule->next;
+    if (in_shutdown)
+	return;
 
-	/* insert */
-	ptr->next = a;
-	a = ptr;
-    }
+    gettimeofday(&now, 0);
 
-    /* run all events */
-    while (a && a != schedule) {
-	/* if a->exec is NULL, we just used the event to wake up,
-	 * so we actually don't need to exec anything at the moment */
-	if(a->exec) {
-	    switch (p = fork()) {
-	    case -1:
-		syslog(LOG_CRIT,
-		       "can't fork process to run event %s", a->name);
-		break;
+    switch (p = fork()) {
+    case -1:
+	syslog(LOG_CRIT,
+	       "can't fork process to run event %s", a->name);
+	break;
 
-	    case 0:
-		/* Child - Release our pidfile lock. */
-		if(pidfd != -1) close(pidfd);
+    case 0:
+	/* Child - Release our pidfile lock. */
+	if(pidfd != -1) close(pidfd);
 
-		if (become_cyrus() != 0) {
-		    syslog(LOG_ERR, "can't change to the cyrus user");
-		    exit(1);
-		}
+	if (become_cyrus() != 0) {
+	    syslog(LOG_ERR, "can't change to the cyrus user");
+	    exit(1);
+	}
 
-		/* close all listeners */
-		for (i = 0; i < nservices; i++) {
-		    if (Services[i].socket > 0) close(Services[i].socket);
-		    if (Services[i].stat[0] > 0) close(Services[i].stat[0]);
-		    if (Services[i].stat[1] > 0) close(Services[i].stat[1]);
-		}
-		limit_fds(256);
+	/* close all listeners */
+	for (i = 0; i < nservices; i++) {
+	    if (Services[i].socket > 0) close(Services[i].socket);
+	    if (Services[i].stat[0] > 0) close(Services[i].stat[0]);
+	    if (Services[i].stat[1] > 0) close(Services[i].stat[1]);
+	}
+	limit_fds(256);
 
-		get_prog(path, sizeof(path), a->exec);
-		syslog(LOG_DEBUG, "about to exec %s", path);
-		execv(path, a->exec->data);
-		syslog(LOG_ERR, "can't exec %s on schedule: %m", path);
-		exit(EX_OSERR);
-		break;
+	get_prog(path, sizeof(path), a->exec);
+	syslog(LOG_DEBUG, "about to exec %s", path);
+	execv(path, a->exec->data);
+	syslog(LOG_ERR, "can't exec %s on schedule: %m", path);
+	exit(EX_OSERR);
+	break;
 
-	    default:
-		/* we don't wait for it to complete */
+    default:
+	/* we don't wait for it to complete */
 
-		/* add to child table */
-		c = centry_alloc();
-		centry_set_state(c, SERVICE_STATE_READY);
-		centry_add(c, p);
-		break;
-	    }
-	} /* a->exec */
+	/* add to child table */
+	c = centry_alloc();
+	centry_set_state(c, SERVICE_STATE_READY);
+	centry_add(c, p);
+	break;
+    }
 
-	/* reschedule as needed */
-	b = a->next;
-	if (a->period) {
-	    if(a->periodic) {
-		a->mark = now;
+    /* reschedule as needed */
+    if (a->period) {
+	if(a->periodic) {
+	    a->mark = now;
+	    a->mark.tv_sec += a->period;
+	} else {
+	    struct tm *tm;
+	    int delta;
+	    /* Daily Event */
+	    while (timesub(&now, &a->mark) <= 0.0)
 		a->mark.tv_sec += a->period;
-	    } else {
-		struct tm *tm;
-		int delta;
-		/* Daily Event */
-		while (timesub(&now, &a->mark) <= 0.0)
-		    a->mark.tv_sec += a->period;
-		/* check for daylight savings fuzz... */
-		tm = localtime(&a->mark.tv_sec);
-		if (tm->tm_hour != a->hour || tm->tm_min != a->min) {
-		    /* calculate the same time on the new day */
-		    tm->tm_hour = a->hour;
-		    tm->tm_min = a->min;
-		    delta = mktime(tm) - a->mark.tv_sec;
-		    /* bring it within half a period either way */
-		    while (delta > (a->period/2)) delta -= a->period;
-		    while (delta < -(a->period/2)) delta += a->period;
-		    /* update the time */
-		    a->mark.tv_sec += delta;
-		    /* and let us know about the change */
-		    syslog(LOG_NOTICE, "timezone shift for %s - altering schedule by %d seconds", a->name, delta);
-		}
+	    /* check for daylight savings fuzz... */
+	    tm = localtime(&a->mark.tv_sec);
+	    if (tm->tm_hour != a->hour || tm->tm_min != a->min) {
+		/* calculate the same time on the new day */
+		tm->tm_hour = a->hour;
+		tm->tm_min = a->min;
+		delta = mktime(tm) - a->mark.tv_sec;
+		/* bring it within half a period either way */
+		while (delta > (a->period/2)) delta -= a->period;
+		while (delta < -(a->period/2)) delta += a->period;
+		/* update the time */
+		a->mark.tv_sec += delta;
+		/* and let us know about the change */
+		syslog(LOG_NOTICE, "timezone shift for %s - altering schedule by %d seconds", a->name, delta);
 	    }
-	    /* reschedule a */
-	    schedule_event(a);
-	} else {
-	    event_free(a);
 	}
-	/* examine next event */
-	a = b;
+	/* reschedule a */
+	schedule_event(a);
+    } else {
+	for (ptr = &schedule; *ptr && *ptr != a; ptr = &(*ptr)->next)
+	    ;
+	if (*ptr) *ptr = a->next;
+	event_free(a);
     }
 }
 
@@ -958,6 +1341,7 @@ static void reap_child(void)
 				   "service %s, disabling until next SIGHUP",
 				   SERVICENAME(s->name));
 			    service_forget_exec(s);
+			    unwatch_service(c->si);
 			    close(s->socket);
 			    s->socket = 0;
 			}
@@ -974,6 +1358,7 @@ static void reap_child(void)
 
 		case SERVICE_STATE_BUSY:
 		    s->nactive--;
+		    service_account_conn(s, c);
 		    if (!in_shutdown && failed) {
 			syslog(LOG_DEBUG,
 			       "service %s pid %d in BUSY state: "
@@ -1018,61 +1403,6 @@ static void reap_child(void)
     }
 }
 
-static void init_janitor(void)
-{
-    struct event *evt = (struct event *) xzmalloc(sizeof(struct event));
-
-    gettimeofday(&janitor_mark, NULL);
-    janitor_position = 0;
-
-    evt->name = xstrdup("janitor periodic wakeup call");
-    evt->period = 10;
-    evt->periodic = 1;
-    evt->mark = janitor_mark;
-    evt->mark.tv_sec += 2;
-    schedule_event(evt);
-}
-
-static void child_janitor(struct timeval now)
-{
-    int i;
-    struct centry **p;
-    struct centry *c;
-
-    /* Estimate the number of entries to clean up in this sweep */
-    if (now.tv_sec > janitor_mark.tv_sec + 1) {
-	/* overflow protection */
-	i = child_table_size;
-    } else {
-	double n;
-
-	n = child_table_size * janitor_frequency * timesub(&janitor_mark, &now);
-	if (n < child_table_size) {
-	    i = n;
-	} else {
-	    i = child_table_size;
-	}
-    }
-
-    while (i-- > 0) {
-	p = &ctable[janitor_position++];
-	janitor_position = janitor_position % child_table_size;
-	while (*p) {
-	    c = *p;
-	    if (c->service_state == SERVICE_STATE_DEAD) {
-		if (c->janitor_deadline < now.tv_sec) {
-		    *p = c->next;
-		    centry_free(c);
-		} else {
-		    p = &((*p)->next);
-		}
-	    } else {
-		p = &((*p)->next);
-	    }
-	}
-    }
-}
-
 /* Allow a clean shutdown on SIGQUIT, SIGTERM or SIGINT */
 static volatile sig_atomic_t gotsigquit = 0;
 
@@ -1207,45 +1537,92 @@ static void child_sighandler_setup(void)
     /* Unblock SIGCHLD et al in the child */
     sigprocmask(SIG_SETMASK, &pselect_sigmask, NULL);
 #endif
+
+    /* only services which handle it get asked to retire, see service.c */
+    signal(SERVICE_RETIRE_SIGNAL, SIG_IGN);
 }
 
 /*
- * Receives a message from a service.
+ * Receives up to 'max' messages from the children of a service.
  *
- * Returns zero if all goes well
- * 1 if no msg available
- * 2 if bad message received (incorrectly sized)
+ * Children write whole messages to the pipe, so a read of several
+ * message sizes only comes up short at a message boundary.
+ *
+ * Returns the number of messages read, zero if none were available,
+ * -2 if bad message received (incorrectly sized)
  * -1 on error (errno set)
  */
-static int read_msg(int fd, struct notify_message *msg)
+static int read_msgs(int fd, struct notify_message *msgs, int max)
 {
     ssize_t r;
     size_t off = 0;
-    int s = sizeof(struct notify_message);
+    size_t s = max * sizeof(struct notify_message);
 
-    while (s > 0) {
-        do
-            r = read(fd, msg + off, s);
-        while ((r == -1) && (errno == EINTR));
-        if (r <= 0) break;
-        s -= r;
-        off += r;
-    }
-    if ( ((r == 0) && (off == 0)) ||
-         ((r == -1) && (errno == EAGAIN)) )
-        return 1;
+    do
+	r = read(fd, msgs, s);
+    while ((r == -1) && (errno == EINTR));
+    if ((r == 0) || ((r == -1) && (errno == EAGAIN)))
+	return 0;
     if (r == -1) return -1;
-    if (s != 0) return 2;
-    return 0;
+
+    /* paranoia: finish off a partial message */
+    off = r;
+    s = off % sizeof(struct notify_message);
+    if (s) s = sizeof(struct notify_message) - s;
+    while (s > 0) {
+	do
+	    r = read(fd, (char *) msgs + off, s);
+	while ((r == -1) && (errno == EINTR));
+	if (r <= 0) return -2;
+	s -= r;
+	off += r;
+    }
+
+    return off / sizeof(struct notify_message);
 }
 
-static void process_msg(int si, struct notify_message *msg)
+/* account for a connection the child has told us about */
+static void service_account_done(struct service *s, struct centry *c,
+				 struct notify_message *msg)
+{
+/* How much each connection counts towards the first byte average */
+#define FIRSTBYTE_WEIGHT	0.05
+    double t;
+
+    s->nsessions++;
+
+    /* the child knows better than we do how long it took */
+    timerclear(&c->conn_start);
+    t = msg->session / 1000.0;
+    if (s->servicetime == 0.0)
+	s->servicetime = t;
+    else
+	s->servicetime = (1.0-SERVICETIME_WEIGHT) * s->servicetime +
+			 SERVICETIME_WEIGHT * t;
+
+    if (msg->firstbyte == UINT_MAX)
+	return;
+    t = msg->firstbyte / 1000000.0;
+    if (s->firstbyte == 0.0)
+	s->firstbyte = t;
+    else
+	s->firstbyte = (1.0-FIRSTBYTE_WEIGHT) * s->firstbyte +
+		       FIRSTBYTE_WEIGHT * t;
+}
+
+/*
+ * Process one message from a child of service 'si'.  'c' is the child
+ * which sent the previous message, if it is likely to be the same
+ * again; returns the child which sent this one.
+ */
+static struct centry *process_msg(int si, struct notify_message *msg,
+				  struct centry *c)
 {
-    struct centry *c;
     /* si must NOT point to an invalid service */
     struct service *s = &Services[si];
 
-    c = centry_find(msg->service_pid);
+    if (!c || c->pid != msg->service_pid)
+	c = centry_find(msg->service_pid);
 
     /* Did we find it? */
     if (!c) {
@@ -1316,6 +1693,7 @@ static void process_msg(int si, struct notify_message *msg)
 		syslog(LOG_DEBUG,
 		       "service %s pid %d in BUSY state: now available and in READY state",
 		       SERVICENAME(s->name), c->pid);
+	    service_account_conn(s, c);
 	    centry_set_state(c, SERVICE_STATE_READY);
 	    s->ready_workers++;
 	    break;
@@ -1366,6 +1744,8 @@ static void process_msg(int si, struct notify_message *msg)
 	break;
 
     case MASTER_SERVICE_CONNECTION:
+	s->interval_conns++;
+	gettimeofday(&c->conn_start, 0);
 	switch (c->service_state) {
 	case SERVICE_STATE_BUSY:
 	    s->nconnections++;
@@ -1406,6 +1786,7 @@ static void process_msg(int si, struct notify_message *msg)
 	break;
 
     case MASTER_SERVICE_CONNECTION_MULTI:
+	s->interval_conns++;
 	switch (c->service_state) {
 	case SERVICE_STATE_READY:
 	    s->nconnections++;
@@ -1445,6 +1826,11 @@ static void process_msg(int si, struct notify_message *msg)
 	}
 	break;
 
+    case MASTER_SERVICE_CONNECTION_DONE:
+	/* only statistics, the state changes with the next message */
+	service_account_done(s, c, msg);
+	break;
+
     default:
 	syslog(LOG_CRIT, "service %s pid %d: Software bug: unrecognized message 0x%x",
 	       SERVICENAME(s->name), c->pid, msg->message);
@@ -1454,6 +1840,8 @@ static void process_msg(int si, struct notify_message *msg)
     if (verbose)
 	syslog(LOG_DEBUG, "service %s now has %d ready workers\n",
 	       SERVICENAME(s->name), s->ready_workers);
+
+    return c;
 }
 
 static void add_start(const char *name, struct entry *e,
@@ -1475,17 +1863,27 @@ static void add_service(const char *name, struct entry *e, void *rock)
     int ignore_err = rock ? 1 : 0;
     char *cmd = xstrdup(masterconf_getstring(e, "cmd", ""));
     int prefork = masterconf_getint(e, "prefork", 0);
+    int maxprefork = masterconf_getint(e, "maxprefork", 0);
     int babysit = masterconf_getswitch(e, "babysit", 0);
     int maxforkrate = masterconf_getint(e, "maxforkrate", 0);
     char *listen = xstrdup(masterconf_getstring(e, "listen", ""));
     char *proto = xstrdup(masterconf_getstring(e, "proto", "tcp"));
     char *max = xstrdup(masterconf_getstring(e, "maxchild", "-1"));
+    char *acceptmethod = xstrdup(masterconf_getstring(e, "accept", "lock"));
+    int acceptmode = SERVICE_ACCEPT_LOCK;
     rlim_t maxfds = (rlim_t) masterconf_getint(e, "maxfds", 256);
     int reconfig = 0;
     int i, j;
 
     if(babysit && prefork == 0) prefork = 1;
     if(babysit && maxforkrate == 0) maxforkrate = 10; /* reasonable safety */
+    if(maxprefork <= prefork) maxprefork = 0; /* fixed size pool */
+
+    if (!strcmp(acceptmethod, "epoll"))
+	acceptmode = SERVICE_ACCEPT_EPOLL;
+    else if (strcmp(acceptmethod, "lock"))
+	syslog(LOG_WARNING, "WARNING: unknown accept method '%s' "
+	       "for service '%s' -- using lock", acceptmethod, name);
 
     if (!strcmp(cmd,"") || !strcmp(listen,"")) {
 	char buf[256];
@@ -1531,6 +1929,7 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	 */
 	struct service *s = service_add(NULL);
 	gettimeofday(&s->last_interval_start, 0);
+	s->last_adapt_start = s->last_interval_start;
     }
     else if (Services[i].listen) reconfig = 1;
 
@@ -1558,6 +1957,9 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	!strcmp(Services[i].proto, "tcp4") ||
 	!strcmp(Services[i].proto, "tcp6")) {
 	Services[i].desired_workers = prefork;
+	Services[i].prefork = prefork;
+	Services[i].maxprefork = maxprefork;
+	Services[i].acceptmode = acceptmode;
 	Services[i].babysit = babysit;
 	Services[i].max_workers = atoi(max);
 	if (Services[i].max_workers < 0) {
@@ -1567,6 +1969,9 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	/* udp */
 	if (prefork > 1) prefork = 1;
 	Services[i].desired_workers = prefork;
+	Services[i].prefork = prefork;
+	Services[i].maxprefork = 0;
+	Services[i].acceptmode = SERVICE_ACCEPT_LOCK;
 	Services[i].max_workers = 1;
     }
 
@@ -1578,6 +1983,9 @@ static void add_service(const char *name, struct entry *e, void *rock)
 		Services[j].maxforkrate = Services[i].maxforkrate;
 		Services[j].exec = Services[i].exec;
 		Services[j].desired_workers = Services[i].desired_workers;
+		Services[j].prefork = Services[i].prefork;
+		Services[j].maxprefork = Services[i].maxprefork;
+		Services[j].acceptmode = Services[i].acceptmode;
 		Services[j].babysit = Services[i].babysit;
 		Services[j].max_workers = Services[i].max_workers;
 	    }
@@ -1598,6 +2006,7 @@ done:
     free(listen);
     free(proto);
     free(max);
+    free(acceptmethod);
     return;
 }
 
@@ -1654,7 +2063,10 @@ static void add_event(const char *name, struct entry *e, void *rock)
     evt->period = period;
 
     evt->exec = strarray_splitm(cmd, NULL);
+    timer_init(&evt->timer, spawn_event, evt);
 
+    evt->next = schedule;
+    schedule = evt;
     schedule_event(evt);
 }
 
@@ -1733,6 +2145,7 @@ static void reread_conf(void)
 	    Services[i].listen = NULL;
 	    Services[i].proto = NULL;
 	    Services[i].desired_workers = 0;
+	    unwatch_service(i);
 
 	    /* send SIGHUP to all children */
 	    for (j = 0 ; j < child_table_size ; j++ ) {
@@ -1775,9 +2188,6 @@ static void reread_conf(void)
     /* read events */
     masterconf_getsection("EVENTS", &add_event, (void*) 1);
 
-    /* reinit child janitor */
-    init_janitor();
-
     /* send some feedback to admin */
     syslog(LOG_NOTICE,
 	    "Services reconfigured. %d out of %d (max %d) services structures are now in use",
@@ -1801,7 +2211,6 @@ int main(int argc, char **argv)
     char *alt_config = NULL;
 
     int fd;
-    fd_set rfds;
     char *p = NULL;
     int r;
 
@@ -1847,10 +2256,8 @@ int main(int argc, char **argv)
 	    error_log = optarg;
 	    break;
 	case 'j':
-	    /* Janitor frequency */
-	    janitor_frequency = atoi(optarg);
-	    if(janitor_frequency < 1)
-		fatal("The janitor period must be at least 1 second", EX_CONFIG);
+	    /* Janitor frequency: dead children are now cleaned up by
+	     * timer, accept the option for old init scripts */
 	    break;
 #ifdef HAVE_NETSNMP
 	case 'P': /* snmp AgentXPingInterval */
@@ -2067,6 +2474,11 @@ int main(int argc, char **argv)
     init_snmp("cyrusMaster");
 #endif
 
+    gettimeofday(&now, 0);
+    timerwheel_init(&timers, TIMER_RESOLUTION, &now);
+    timer_init(&wakeup, wakeup_call, NULL);
+    watch_init();
+
     masterconf_getsection("START", &add_start, NULL);
     masterconf_getsection("SERVICES", &add_service, NULL);
     masterconf_getsection("EVENTS", &add_event, NULL);
@@ -2090,29 +2502,20 @@ int main(int argc, char **argv)
 	}
     }
 
-    /* init ctable janitor */
-    init_janitor();
-
     /* ok, we're going to start spawning like mad now */
     syslog(LOG_DEBUG, "ready for work");
 
     gettimeofday(&now, 0);
     for (;;) {
-	int r, i, maxfd, total_children = 0;
+	int r, i, total_children = 0;
 	struct timeval tv, *tvptr;
-	struct notify_message msg;
-#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
-	int blockp = 0;
-#endif
+	struct notify_message msgs[NOTIFY_BATCH];
+
 	if (gotsigquit) {
 	    gotsigquit = 0;
 	    begin_shutdown();
 	}
 
-	/* run any scheduled processes */
-	if (!in_shutdown)
-	    spawn_schedule(now);
-
 	/* reap first, that way if we need to babysit we will */
 	if (gotsigchld) {
 	    /* order matters here */
@@ -2124,6 +2527,8 @@ int main(int argc, char **argv)
 	for (i = 0; i < nservices; i++) {
 	    total_children += Services[i].nactive;
 	    if (!in_shutdown) {
+		service_adapt_prefork(i, now);
+
 		if (Services[i].exec /* enabled */ &&
 		    (Services[i].nactive < Services[i].max_workers) &&
 		    (Services[i].ready_workers < Services[i].desired_workers)) {
@@ -2152,11 +2557,11 @@ int main(int argc, char **argv)
 		    Services[i].nforks = 0;
 		    Services[i].nactive = 0;
 		    Services[i].nconnections = 0;
+		    Services[i].nretired = 0;
 		    Services[i].associate = 0;
 
-		    if (Services[i].stat[0] > 0) close(Services[i].stat[0]);
-		    if (Services[i].stat[1] > 0) close(Services[i].stat[1]);
-		    memset(Services[i].stat, 0, sizeof(Services[i].stat));
+		    unwatch_service(i);
+		    service_close_stat(&Services[i]);
 		}
 	    }
 	}
@@ -2172,62 +2577,42 @@ int main(int argc, char **argv)
 	    reread_conf();
 	}
 
-	FD_ZERO(&rfds);
-	maxfd = 0;
 	for (i = 0; i < nservices; i++) {
-	    int x = Services[i].stat[0];
-
-	    int y = Services[i].socket;
-
-	    /* messages */
-	    if (x > 0) {
-		if (verbose > 2)
-		    syslog(LOG_DEBUG, "listening for messages from %s",
-			   Services[i].name);
-		FD_SET(x, &rfds);
-	    }
-	    if (x > maxfd) maxfd = x;
+	    int listening = 0;
 
 	    /* connections */
-	    if (y > 0 && Services[i].ready_workers == 0 &&
+	    if (Services[i].socket > 0 && Services[i].ready_workers == 0 &&
 		Services[i].nactive < Services[i].max_workers &&
 		!service_is_fork_limited(&Services[i])) {
 		if (verbose > 2)
 		    syslog(LOG_DEBUG, "listening for connections for %s",
 			   Services[i].name);
-		FD_SET(y, &rfds);
-		if (y > maxfd) maxfd = y;
+		listening = 1;
 	    }
 
+	    /* messages, and connections if wanted */
+	    watch_service(i, listening);
+
+	    /* wake up to keep resizing any adaptive ready pools */
+	    if (!in_shutdown && service_is_adapting(&Services[i]))
+		schedule_wakeup(PREFORK_INTERVAL);
+
 	    /* paranoia */
 	    if (Services[i].ready_workers < 0) {
 		syslog(LOG_ERR, "%s has %d workers?!?", Services[i].name,
 		       Services[i].ready_workers);
 	    }
 	}
-	maxfd++;		/* need 1 greater than maxfd */
 
 	/* how long to wait? - do now so that any scheduled wakeup
 	 * calls get accounted for*/
+	gettimeofday(&now, 0);
 	tvptr = NULL;
-	if (schedule && !in_shutdown) {
-	    double delay = timesub(&now, &schedule->mark);
-	    if (delay > 0.0) {
-		timeval_set_double(&tv, delay);
-	    }
-	    else {
-		tv.tv_sec = 0;
-		tv.tv_usec = 0;
-	    }
+	if (timerwheel_next(&timers, &now, &tv) == 0)
 	    tvptr = &tv;
-	}
 
-#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
-	if (tvptr == NULL) blockp = 1;
-	snmp_select_info(&maxfd, &rfds, tvptr, &blockp);
-#endif
 	errno = 0;
-	r = myselect(maxfd, &rfds, NULL, NULL, tvptr);
+	r = watch_wait(tvptr);
 	if (r == -1 && errno == EAGAIN) continue;
 	if (r == -1 && errno == EINTR) continue;
 	if (r == -1) {
@@ -2235,21 +2620,23 @@ int main(int argc, char **argv)
 	    fatalf(1, "select failed: %m");
 	}
 
-#if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
-	/* check for SNMP queries */
-	snmp_read(&rfds);
-	snmp_timeout();
-#endif
 	for (i = 0; i < nservices; i++) {
 	    int x = Services[i].stat[0];
-	    int y = Services[i].socket;
+	    int ready = watches[i].ready;
 	    int j;
 
-	    if (FD_ISSET(x, &rfds)) {
-		while ((r = read_msg(x, &msg)) == 0)
-		    process_msg(i, &msg);
+	    if (ready & WATCH_STATUS) {
+		struct centry *c = NULL;
+		int n;
+
+		/* a short batch means the pipe is empty */
+		do {
+		    r = read_msgs(x, msgs, NOTIFY_BATCH);
+		    for (n = 0; n < r; n++)
+			c = process_msg(i, &msgs[n], c);
+		} while (r == NOTIFY_BATCH);
 
-		if (r == 2) {
+		if (r == -2) {
 		    syslog(LOG_ERR,
 			"got incorrectly sized response from child: %x", i);
 		    continue;
@@ -2272,14 +2659,15 @@ int main(int argc, char **argv)
 		}
 
 		if (Services[i].ready_workers == 0 &&
-		    FD_ISSET(y, &rfds)) {
+		    (ready & WATCH_LISTEN)) {
 		    /* huh, someone wants to talk to us */
 		    spawn_service(i);
 		}
 	    }
 	}
+	/* run any scheduled processes, and clean up after dead children */
 	gettimeofday(&now, 0);
-	child_janitor(now);
+	timerwheel_run(&timers, &now);
 
 #ifdef HAVE_NETSNMP
 	run_alarms();
@@ -27,9 +27,13 @@ struct service {
 
     /* limits */
     int desired_workers;	/* num child processes to have ready */
+    int prefork;		/* least num child processes to have ready */
+    int maxprefork;		/* most num child processes to have ready,
+				   0 unless the ready pool is adaptive */
     int max_workers;		/* max num child processes to spawn */
     rlim_t maxfds;		/* max num file descriptors to use */
     unsigned int maxforkrate;	/* max rate to spawn children */
+    int acceptmode;		/* SERVICE_ACCEPT_* */
 
     /* stats */
     int ready_workers;		/* num child processes ready for service */
@@ -38,10 +42,20 @@ struct service {
     int nconnections;		/* num connections made to children */
     double forkrate;		/* rate at which we're spawning children */
     int nreadyfails;		/* number of failures in READY state */
+    double arrivalrate;		/* connections per second, decaying average */
+    double servicetime;		/* seconds per connection, decaying average */
+    int nretired;		/* surplus ready children asked to exit */
+    int nsessions;		/* connections reported finished by children */
+    double firstbyte;		/* seconds from accept to first client input,
+				   decaying average */
 
     /* fork rate computation */
     struct timeval last_interval_start;
     unsigned int interval_forks;
+
+    /* arrival rate computation */
+    struct timeval last_adapt_start;
+    unsigned int interval_conns;
 };
 
 extern struct service *Services;
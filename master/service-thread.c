@@ -84,6 +84,7 @@ void notify_master(int fd, int msg)
 {
     struct notify_message notifymsg;
     if (verbose) syslog(LOG_DEBUG, "telling master %x", msg);
+    memset(&notifymsg, 0, sizeof(notifymsg));
     notifymsg.message = msg;
     notifymsg.service_pid = getpid();
     if (write(fd, &notifymsg, sizeof(notifymsg)) != sizeof(notifymsg)) {
@@ -53,8 +53,14 @@
 #endif
 #include <fcntl.h>
 #include <signal.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <sys/time.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <syslog.h>
@@ -76,6 +82,7 @@
 #include "xstrlcat.h"
 #include "strarray.h"
 #include "signals.h"
+#include "util.h"
 
 extern int optind, opterr;
 extern char *optarg;
@@ -84,12 +91,15 @@ extern char *optarg;
 static int use_count = 0;
 static int verbose = 0;
 static int lockfd = -1;
+static int acceptfd = -1;
 static int newfile = 0;
+static volatile sig_atomic_t gotretire = 0;
 
 void notify_master(int fd, int msg)
 {
     struct notify_message notifymsg;
     if (verbose) syslog(LOG_DEBUG, "telling master %x", msg);
+    memset(&notifymsg, 0, sizeof(notifymsg));
     notifymsg.message = msg;
     notifymsg.service_pid = getpid();
     if (write(fd, &notifymsg, sizeof(notifymsg)) != sizeof(notifymsg)) {
@@ -97,6 +107,64 @@ void notify_master(int fd, int msg)
     }
 }
 
+/*
+ * Tell master how the connection we just finished went, and whether we
+ * are available for another one, with a single write.
+ */
+static void notify_master_done(int fd, int available)
+{
+    struct notify_message notifymsg[2];
+    double firstbyte, session;
+    size_t len = sizeof(notifymsg[0]);
+
+    conntime_end(&firstbyte, &session);
+
+    memset(notifymsg, 0, sizeof(notifymsg));
+    notifymsg[0].message = MASTER_SERVICE_CONNECTION_DONE;
+    notifymsg[0].service_pid = getpid();
+    if (firstbyte < 0.0 || firstbyte >= UINT_MAX / 1000000.0)
+	notifymsg[0].firstbyte = UINT_MAX;
+    else
+	notifymsg[0].firstbyte = firstbyte * 1000000.0;
+    if (session >= UINT_MAX / 1000.0)
+	notifymsg[0].session = UINT_MAX;
+    else if (session > 0.0)
+	notifymsg[0].session = session * 1000.0;
+
+    if (available) {
+	notifymsg[1].message = MASTER_SERVICE_AVAILABLE;
+	notifymsg[1].service_pid = notifymsg[0].service_pid;
+	len += sizeof(notifymsg[1]);
+    }
+
+    if (verbose) syslog(LOG_DEBUG, "telling master connection done");
+    if (write(fd, notifymsg, len) != (ssize_t) len) {
+	syslog(LOG_ERR, "unable to tell master connection done: %m");
+    }
+}
+
+static void retire_handler(int sig __attribute__((unused)))
+{
+    gotretire = 1;
+}
+
+/*
+ * Master asks ready children to exit when it shrinks an adaptive pool.
+ * We only listen while waiting for a connection; once we have one,
+ * the request is ignored.
+ */
+static void retire_signal(int listen)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    /* no SA_RESTART, so that accept() is interrupted */
+    action.sa_handler = listen ? retire_handler : SIG_IGN;
+    if (sigaction(SERVICE_RETIRE_SIGNAL, &action, NULL) < 0)
+	syslog(LOG_ERR, "unable to set handler for retire signal: %m");
+}
+
 #ifdef HAVE_LIBWRAP
 #include <tcpd.h>
 
@@ -176,6 +244,76 @@ static int getlockfd(char *service, int id)
     return 0;
 }
 
+/*
+ * Rather than taking turns at the accept lock, each child can wait on
+ * the listener in its own epoll set with EPOLLEXCLUSIVE.  The kernel
+ * then wakes one (or at most a few) of them for each connection, and
+ * any child which loses the race gets EAGAIN from the non-blocking
+ * accept() and goes back to waiting.
+ */
+static int getacceptfd(void)
+{
+#if defined(HAVE_SYS_EPOLL_H) && defined(EPOLLEXCLUSIVE)
+    struct epoll_event ev;
+    int fd, fdflags;
+
+    fd = epoll_create(1);
+    if (fd < 0) {
+	syslog(LOG_ERR, "epoll_create: %m");
+	return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, LISTEN_FD, &ev) < 0) {
+	syslog(LOG_ERR, "epoll_ctl: %m");
+	close(fd);
+	return -1;
+    }
+
+    fdflags = fcntl(LISTEN_FD, F_GETFL, 0);
+    if (fdflags == -1 ||
+	fcntl(LISTEN_FD, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+	syslog(LOG_ERR, "unable to make listener non-blocking: %m");
+	close(fd);
+	return -1;
+    }
+
+    acceptfd = fd;
+    return 0;
+#else
+    syslog(LOG_WARNING, "epoll accept not available, using accept lock");
+    return -1;
+#endif
+}
+
+/*
+ * Wait until the listener looks readable.  Returns -1 if a signal
+ * arrived first.  With the accept lock the listener may still be
+ * non-blocking, as it is shared with children started before a SIGHUP
+ * which use epoll, so we can't leave the waiting to accept().
+ */
+static int waitaccept(void)
+{
+    fd_set rfds;
+    int r;
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(EPOLLEXCLUSIVE)
+    struct epoll_event ev;
+
+    if (acceptfd != -1) {
+	r = epoll_wait(acceptfd, &ev, 1, -1);
+	return (r < 0 && errno == EINTR) ? -1 : 0;
+    }
+#endif
+
+    FD_ZERO(&rfds);
+    FD_SET(LISTEN_FD, &rfds);
+    r = select(LISTEN_FD + 1, &rfds, NULL, NULL, NULL);
+    return (r < 0 && errno == EINTR) ? -1 : 0;
+}
+
 static int lockaccept(void)
 {
     struct flock alockinfo;
@@ -190,10 +328,10 @@ static int lockaccept(void)
 	alockinfo.l_type = F_WRLCK;
 	while ((rc = fcntl(lockfd, F_SETLKW, &alockinfo)) < 0 && 
 	       errno == EINTR &&
-	       !signals_poll())
+	       !signals_poll() && !gotretire)
 	    /* noop */;
 	
-	if (rc < 0 && signals_poll()) {
+	if (rc < 0 && (signals_poll() || gotretire)) {
 	    if (MESSAGE_MASTER_ON_EXIT) 
 		notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
 	    service_abort(0);
@@ -396,12 +534,18 @@ int main(int argc, char **argv, char **envp)
     start_size = sbuf.st_size;
     start_mtime = sbuf.st_mtime;
 
-    getlockfd(service, id);
+    p = getenv("CYRUS_ACCEPT");
+    if (soctype != SOCK_STREAM || !p || strcmp(p, "epoll") ||
+	getacceptfd() != 0) {
+	getlockfd(service, id);
+    }
+
     for (;;) {
 	/* ok, listen to this socket until someone talks to us */
 
 	/* (re)set signal handlers, including SIGALRM */
 	signals_add_handlers(SIGALRM);
+	retire_signal(1);
 
 	if (use_count > 0) {
 	    /* we want to time out after 60 seconds, set an alarm */
@@ -412,7 +556,7 @@ int main(int argc, char **argv, char **envp)
 	lockaccept();
 
 	fd = -1;
-	while (fd < 0 && !signals_poll()) { /* loop until we succeed */
+	while (fd < 0 && !signals_poll() && !gotretire) { /* loop until we succeed */
 	    /* check current process file inode, size and mtime */
 	    stat(path, &sbuf);
 	    if (sbuf.st_ino != start_ino || sbuf.st_size != start_size ||
@@ -423,6 +567,8 @@ int main(int argc, char **argv, char **envp)
 	    }
 
 	    if (soctype == SOCK_STREAM) {
+		/* interrupted, so see why before blocking in accept() */
+		if (waitaccept() < 0) continue;
 		fd = accept(LISTEN_FD, NULL, NULL);
 		if (fd < 0) {
 		    switch (errno) {
@@ -476,8 +622,8 @@ int main(int argc, char **argv, char **envp)
 	/* unlock */
 	unlockaccept();
 
-	if (fd < 0 && (signals_poll() || newfile)) {
-	    /* timed out (SIGALRM), SIGHUP, or new process file */
+	if (fd < 0 && (signals_poll() || newfile || gotretire)) {
+	    /* timed out (SIGALRM), SIGHUP, retired, or new process file */
 	    if (MESSAGE_MASTER_ON_EXIT) 
 		notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
 	    service_abort(0);
@@ -492,6 +638,10 @@ int main(int argc, char **argv, char **envp)
 
 	/* cancel the alarm */
 	alarm(0);
+	retire_signal(0);
+	gotretire = 0;
+
+	conntime_start();
 
 	/* tcp only */
 	if(soctype == SOCK_STREAM) {
@@ -573,10 +723,11 @@ int main(int argc, char **argv, char **envp)
 
 	if (signals_poll() || use_count >= max_use) {
 	    /* caught SIGHUP or exceeded max use count */
+	    notify_master_done(STATUS_FD, 0);
 	    break;
 	}
 
-	notify_master(STATUS_FD, MASTER_SERVICE_AVAILABLE);
+	notify_master_done(STATUS_FD, 1);
     }
 
     service_abort(0);
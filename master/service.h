@@ -53,7 +53,8 @@ enum {
     MASTER_SERVICE_AVAILABLE = 0x01,
     MASTER_SERVICE_UNAVAILABLE = 0x02,
     MASTER_SERVICE_CONNECTION = 0x03,
-    MASTER_SERVICE_CONNECTION_MULTI = 0x04
+    MASTER_SERVICE_CONNECTION_MULTI = 0x04,
+    MASTER_SERVICE_CONNECTION_DONE = 0x05
 };
 
 extern int service_init(int argc, char **argv, char **envp);
@@ -66,9 +67,26 @@ enum {
     REUSE_TIMEOUT = 60
 };
 
+/* how ready children of a service take turns at accept() */
+enum {
+    SERVICE_ACCEPT_LOCK = 0,	/* fcntl() lock around accept() */
+    SERVICE_ACCEPT_EPOLL = 1	/* epoll wait with EPOLLEXCLUSIVE */
+};
+
+/* sent by master to a ready child which is no longer needed */
+#define SERVICE_RETIRE_SIGNAL SIGUSR2
+
+/*
+ * All messages have the same size, so the master can read a whole
+ * batch of them at once.  Only MASTER_SERVICE_CONNECTION_DONE uses
+ * the timing fields; the others leave them zero.
+ */
 struct notify_message {
     int message;
     pid_t service_pid;
+    unsigned int firstbyte;	/* usec from accept to first client input,
+				   ~0 if there was none */
+    unsigned int session;	/* msec from accept to end of connection */
 };
 
 #endif
@@ -199,6 +199,7 @@ static void cmdloop(void)
 	    return;
 	}
 
+	sync_log_checkpoint();
 	ret = parser(sieved_out, sieved_in);
     }
 
@@ -260,6 +261,7 @@ int service_main(int argc __attribute__((unused)),
     sasl_security_properties_t *secprops = NULL;
 
     sync_log_init();
+    sync_log_defer();
 
     /* set up the prot streams */
     sieved_in = prot_new(0, 0);
@@ -0,0 +1,61 @@
+#!/usr/bin/perl -w
+#
+# acceptbench.pl -- measure how fast a service accepts connections
+#
+# usage: acceptbench.pl [-c clients] [-t seconds] host:port
+#
+# Each client repeatedly connects, waits for the greeting and
+# disconnects again, so the rate reported is bounded by how quickly
+# the ready children of the service get to accept().  Run it against
+# the same service with accept=lock and accept=epoll in cyrus.conf
+# (and a prefork= large enough that forking is not measured) to
+# compare the two.
+
+use strict;
+use Getopt::Std;
+use IO::Socket::INET;
+use Time::HiRes qw(time);
+
+my %opts;
+getopts('c:t:', \%opts) && @ARGV == 1
+    or die "usage: $0 [-c clients] [-t seconds] host:port\n";
+
+my $server = $ARGV[0];
+my $clients = $opts{c} || 16;
+my $seconds = $opts{t} || 10;
+
+pipe(my $rd, my $wr) or die "pipe: $!\n";
+
+for (1 .. $clients) {
+    my $pid = fork();
+    die "fork: $!\n" unless defined $pid;
+    next if $pid;
+
+    close($rd);
+    my ($n, $failed) = (0, 0);
+    my $end = time() + $seconds;
+    while (time() < $end) {
+	my $s = IO::Socket::INET->new(PeerAddr => $server);
+	if ($s && defined <$s>) {
+	    $n++;
+	}
+	else {
+	    $failed++;
+	}
+	close($s) if $s;
+    }
+    syswrite($wr, "$n $failed\n");
+    exit(0);
+}
+
+close($wr);
+my ($total, $failed) = (0, 0);
+while (<$rd>) {
+    my ($n, $f) = split;
+    $total += $n;
+    $failed += $f;
+}
+1 while wait() != -1;
+
+printf("%d connections in %ds from %d clients: %.1f/s (%d failed)\n",
+       $total, $seconds, $clients, $total / $seconds, $failed);
@@ -0,0 +1,59 @@
+#!/usr/bin/perl -w
+#
+# syncbench.pl -- measure how fast sync_client catches a replica up
+#
+# usage: syncbench.pl [-C config] [-S server] [-b sync_client]
+#                     [-j workers,...] [-R reset-command] user...
+#
+# Writes a replication log with a USER line for each user given (or
+# read one per line from stdin if there are none) and times
+# "sync_client -r -f" over it once for each number of workers.  Unless
+# the replica is put back the way it was between passes, every pass
+# after the first has nothing to do, so -R names a command to run
+# before each pass which does that - typically one which stops the
+# replica, removes its spool and mailboxes database and starts it again.
+#
+# Set sync_pipeline in the config to compare with and without
+# pipelining the mailbox updates, and sync_apply_workers in the
+# replica's config to compare applying them serially or in parallel.
+
+use strict;
+use Getopt::Std;
+use File::Temp qw(tempfile);
+use Time::HiRes qw(time);
+
+my %opts;
+getopts('C:S:b:j:R:', \%opts)
+    or die "usage: $0 [-C config] [-S server] [-b sync_client] " .
+	   "[-j workers,...] [-R reset-command] user...\n";
+
+my @users = @ARGV;
+if (!@users) {
+    while (<STDIN>) {
+	chomp;
+	push(@users, $_) if length($_);
+    }
+}
+die "no users to replicate\n" unless @users;
+
+my ($fh, $log) = tempfile("syncbench-XXXXXX", TMPDIR => 1, UNLINK => 1);
+print $fh "USER $_\n" for @users;
+close($fh);
+
+my @cmd = ($opts{b} || "sync_client", "-o", "-r", "-f", $log);
+push(@cmd, "-C", $opts{C}) if $opts{C};
+push(@cmd, "-S", $opts{S}) if $opts{S};
+
+for my $workers (split(/,/, $opts{j} || "1,2,4,8")) {
+    if ($opts{R}) {
+	system($opts{R}) == 0 or die "$opts{R} failed\n";
+    }
+
+    my $start = time();
+    my $rc = system(@cmd, "-j", $workers);
+    my $elapsed = time() - $start;
+
+    printf("%2d worker%s: %d users in %.2fs: %.1f/s%s\n",
+	   $workers, $workers == 1 ? " " : "s", scalar(@users), $elapsed,
+	   @users / $elapsed, $rc ? " (sync_client failed)" : "");
+}